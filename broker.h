@@ -0,0 +1,85 @@
+#ifndef _BROKER_H_
+#define _BROKER_H_
+
+#include <stdint.h>
+#include "mqtt.h"
+#include "topictrie.h"
+#include "mempipe.h"
+
+#define BROKER_MAX_CONNS   256   /* connections per broker - sizes the subscriber bitsets */
+#define BROKER_MAX_LISTEN  4     /* listening sockets */
+#define BROKER_EVENTS_MAX  64    /* epoll events handled per broker_poll() */
+#define BROKER_QOS2_MAX    16    /* inbound QoS 2 PUBLISHes per connection awaiting PUBREL */
+
+
+/* One client connection */
+typedef struct
+{
+  int        fd;              /* socket, or the pipe's eventfd, -1 = free slot */
+  mempipe_t* psPipe;          /* in-process connection, 0 for a socket */
+  uint32_t   u32gen;          /* bumped on close, stops processing packets of a connection just closed */
+  uint8_t    u8connected;     /* CONNECT accepted */
+  uint8_t    u8closing;       /* pipe closed by us, waiting for the client to let go */
+  uint8_t    u8want_out;      /* EPOLLOUT registered */
+  uint64_t   u64keepalive_us; /* close after 1.5 times this without a packet, 0 = never */
+  uint64_t   u64last_rx_us;
+  uint8_t*   pu8rx;
+  uint32_t   u32rxlen;
+  uint8_t*   pu8tx;           /* what the socket didn't take yet */
+  uint32_t   u32txlen;
+  uint64_t   u64dropped;      /* deliveries dropped, backlog full */
+  uint16_t   au16rx_pending[BROKER_QOS2_MAX]; /* QoS 2 ids routed, PUBREL not seen yet */
+  uint32_t   u32rx_pending;
+} broker_conn_t;
+
+/* A subscription filter bound in the trie, and the connections subscribed to it */
+typedef struct
+{
+  void*    psBroker;
+  uint32_t u32nmembers;       /* 0 = free */
+  uint32_t au32members[BROKER_MAX_CONNS / 32];
+} broker_filter_t;
+
+/*
+   Embedded MQTT 3.1.1 broker for a handful of local clients, on TCP, Unix domain
+   sockets and in-process pipes. Subscriptions go into a topic trie, and each
+   PUBLISH is encoded once - header, then topic and payload straight out of the
+   publisher's receive buffer - and written to every matching connection from
+   that same iov. Subscriptions are granted QoS 0: inbound QoS 1/2 is acknowledged
+   to the publisher, delivery is at most once - a QoS 2 PUBLISH sent again before
+   its PUBREL is only acknowledged again. No retained messages, wills or
+   persistent sessions. All memory is supplied by the caller.
+*/
+typedef struct
+{
+  int              epfd;
+  int              alistenfd[BROKER_MAX_LISTEN];
+  uint32_t         u32nlisten;
+  broker_conn_t*   asConn;
+  uint32_t         u32nconns;
+  uint32_t         u32bufsz;       /* per connection receive and backlog buffer, caps the packet size */
+  broker_filter_t* asFilter;
+  uint32_t         u32nfilters;
+  trie_t           sTrie;
+  uint32_t         au32fanout[BROKER_MAX_CONNS / 32]; /* subscribers of the PUBLISH being routed */
+
+  uint64_t         u64published;   /* PUBLISHes routed */
+  uint64_t         u64delivered;   /* copies written to subscribers */
+  uint64_t         u64dropped;     /* copies dropped, subscriber backlog full */
+} broker_t;
+
+
+/* pu8bufs holds 2 * u32bufsz bytes per connection. Returns 0 if epoll can't be set up */
+int  broker_init(broker_t* psBroker, broker_conn_t* asConn, uint32_t u32nconns, uint8_t* pu8bufs, uint32_t u32bufsz,
+                 broker_filter_t* asFilter, uint32_t u32nfilters, trie_node_t* asNodes, uint32_t u32nnodes, char* pcnames, uint32_t u32names_size);
+void broker_close(broker_t* psBroker);
+/* Accept connections on a TCP port, addr 0 = all interfaces. Returns 1 on success */
+int  broker_listen_tcp(broker_t* psBroker, const char* addr, uint16_t port);
+/* Accept connections on a Unix domain socket, an old one at path is removed. Returns 1 on success */
+int  broker_listen_unix(broker_t* psBroker, const char* path);
+/* Serve the server end of a pipe (mempipe_init()'ed) - it takes a connection slot for good */
+int  broker_attach_pipe(broker_t* psBroker, mempipe_t* psPipe);
+/* Wait up to timeout_us for I/O and handle it. Returns the number of events handled */
+int  broker_poll(broker_t* psBroker, uint32_t timeout_us);
+
+#endif /* _BROKER_H_ */
@@ -0,0 +1,112 @@
+/*
+   Standalone broker on top of broker.c: listens on a TCP port and optionally a Unix
+   domain socket, prints routing counters every few seconds.
+
+   Compile and run, then point client_loadgen at it:
+
+     gcc -O2 client.c mqtt.c wheel.c ring.c topictrie.c mempipe.c broker.c broker_main.c -o broker
+     ./broker -p 1883 -U /tmp/mqtt.sock
+*/
+#include "broker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define NCONNS      BROKER_MAX_CONNS
+#define NFILTERS    1024
+#define NNODES      4096
+#define NAMES_SIZE  (64 * 1024)
+
+/* Configuration */
+static char*    bind_addr = 0;          /* 0 = all interfaces */
+static char*    unix_path = 0;
+static uint16_t port = 1883;
+static uint32_t bufsz = 64 * 1024;      /* per connection, caps the packet size */
+static uint32_t report_s = 5;
+
+static volatile int stop;
+
+/* State */
+static broker_t        sBroker;
+static broker_conn_t   asConn[NCONNS];
+static broker_filter_t asFilter[NFILTERS];
+static trie_node_t     asNodes[NNODES];
+static char            acnames[NAMES_SIZE];
+
+
+static void usage(const char* prog)
+{
+  fprintf(stderr, "usage: %s [-a bind address] [-p port] [-U unix socket path] [-b buffer bytes/connection] [-i report interval s]\n", prog);
+  exit(1);
+}
+
+static void inthandler(int dummy)
+{
+  (void)dummy;
+  stop = 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "a:p:U:b:i:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'a': bind_addr = optarg;             break;
+      case 'p': port = atoi(optarg);            break;
+      case 'U': unix_path = optarg;             break;
+      case 'b': bufsz = atoi(optarg);           break;
+      case 'i': report_s = atoi(optarg);        break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (bufsz < 256)
+  {
+    usage(argv[0]);
+  }
+
+  uint8_t* pu8bufs = malloc((size_t)NCONNS * 2 * bufsz);
+  if (    (pu8bufs == 0)
+       || (!broker_init(&sBroker, asConn, NCONNS, pu8bufs, bufsz, asFilter, NFILTERS, asNodes, NNODES, acnames, sizeof(acnames))))
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  if (    (!broker_listen_tcp(&sBroker, bind_addr, port))
+       || (    (unix_path != 0)
+            && (!broker_listen_unix(&sBroker, unix_path))))
+  {
+    return 1;
+  }
+
+  signal(SIGINT, inthandler);
+  signal(SIGTERM, inthandler);
+
+  uint64_t u64next_report_us = client_time_us() + (report_s * 1000000ULL);
+  while (!stop)
+  {
+    broker_poll(&sBroker, 100000);
+
+    uint64_t u64now = client_time_us();
+    if (    (report_s != 0)
+         && (u64now >= u64next_report_us))
+    {
+      printf("published=%llu delivered=%llu dropped=%llu\n", (unsigned long long)sBroker.u64published,
+             (unsigned long long)sBroker.u64delivered, (unsigned long long)sBroker.u64dropped);
+      fflush(stdout);
+      u64next_report_us = u64now + (report_s * 1000000ULL);
+    }
+  }
+
+  broker_close(&sBroker);
+  if (unix_path != 0)
+  {
+    unlink(unix_path);
+  }
+  free(pu8bufs);
+  return 0;
+}
@@ -3,27 +3,769 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 
+#if (CLIENT_LOG == 1)
+client_log_fn client_log_hook = client_log_stderr;
+int           client_log_level = CLIENT_LOG_INFO;
+#endif
+
+
 /* Helper functions: */
 static void _dummy_connect  (client_t* s, int f, const char* b)  { (void) s; (void) f; (void) b; }
 static void _dummy_recv_data(client_t* s, int f, char* d, int l) { (void) s; (void) f; (void) d; (void) l; }
+static void _dummy_pub_begin(client_t* s, mqtt_publish_view_t* p, uint32_t l) { (void) s; (void) p; (void) l; }
+static void _dummy_pub_end  (client_t* s, int c)                      { (void) s; (void) c; }
+static void _dummy_timer    (wheel_timer_t* t, uint64_t n)            { (void) t; (void) n; }
+static void _dummy_qdone    (client_t* s, void* p, int f)             { (void) s; (void) p; (void) f; }
+static void _dummy_batch    (client_t* s, char* d, mqtt_batch_t* b)   { (void) s; (void) d; (void) b; }
+
+#if (CLIENT_STATS == 1)
+static uint64_t _now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void _stat_packet_in(client_t* psClnt, uint8_t* pu8pkt, uint32_t u32len)
+{
+  uint8_t u8type = pu8pkt[0] >> 4;
+  CLIENT_STAT_ADD(psClnt, au64pkts_in[u8type], 1);
+  CLIENT_STAT_ADD(psClnt, au64bytes_in[u8type], u32len);
+  if (u8type == CTRL_PINGRESP)
+  {
+    CLIENT_STAT_SET(psClnt, u64ping_pending, 0);
+  }
+}
+
+static void _stat_packet_out(client_t* psClnt, mqtt_iov_t* asIov, uint32_t u32niov, uint32_t u32len)
+{
+  if (    (u32niov > 0)
+       && (asIov[0].u32len > 0))
+  {
+    uint8_t u8type = asIov[0].pu8data[0] >> 4;
+    CLIENT_STAT_ADD(psClnt, au64pkts_out[u8type], 1);
+    CLIENT_STAT_ADD(psClnt, au64bytes_out[u8type], u32len);
+    if (    (u8type == CTRL_PINGREQ)
+         && (__atomic_exchange_n(&psClnt->sStats.u64ping_pending, 1, __ATOMIC_RELAXED) != 0))
+    {
+      CLIENT_STAT_ADD(psClnt, u64keepalive_misses, 1);
+    }
+  }
+}
+#else
+ #define _stat_packet_in(psClnt, pu8pkt, u32len)            do { } while (0)
+ #define _stat_packet_out(psClnt, asIov, u32niov, u32len)   do { } while (0)
+#endif
+
+/* Have the client's timer run no later than u64deadline - it works out the real next deadline itself */
+static void _schedule(client_t* psClnt, uint64_t u64deadline)
+{
+  if (    (psClnt->psWheel != 0)
+       && (    (!wheel_pending(&psClnt->sTimer))
+            || (psClnt->sTimer.u64deadline_us > u64deadline)))
+  {
+    wheel_add(psClnt->psWheel, &psClnt->sTimer, u64deadline);
+  }
+}
 
 static void _change_state(client_t* psClnt, conn_state_t new_state)
 {
   require(psClnt != 0);
 
   psClnt->state = new_state;
-  psClnt->last_active = time(0);
+  psClnt->state_since_us = client_time_us();
+  psClnt->last_active_us = psClnt->state_since_us;
+  psClnt->last_tx_us = psClnt->state_since_us;
+  _schedule(psClnt, psClnt->state_since_us);
+}
+
+static void _touch(client_t* psClnt)
+{
+  psClnt->last_active_us = client_time_us();
+}
+
+/* Wait until the socket can take more data - blocking clients only, an event loop must never sit here.
+   Other transports' descriptors are always writable and turn readable when there's room again. */
+static void _wait_writable(client_t* psClnt)
+{
+  struct pollfd sPfd;
+  sPfd.fd = psClnt->sockfd;
+  sPfd.events = ((psClnt->psTransport->flags & CLIENT_TRANSPORT_SOCKET) ? POLLOUT : POLLIN);
+  poll(&sPfd, 1, -1);
+}
+
+
+/*
+   Start streaming the PUBLISH at pu8pkt, which is too large for the rx buffer:
+   parse topic and packet id and call client_publish_begin. Returns the number of
+   header bytes consumed, 0 if the header isn't complete yet, -1 if it can't be streamed.
+*/
+static int _stream_begin(client_t* psClnt, uint8_t* pu8pkt, uint32_t u32avail, int hdr_len, uint32_t u32remaining_len)
+{
+  mqtt_view_t sView;
+  mqtt_publish_view_t sPub;
+  uint32_t u32need = hdr_len + sizeof(uint16_t);
+  if (u32avail < u32need)
+  {
+    return 0;
+  }
+  u32need += (pu8pkt[hdr_len] << 8) | pu8pkt[hdr_len + 1];  /* topic */
+  u32need += ((((pu8pkt[0] >> 1) & 3) > QOS_AT_MOST_ONCE) ? sizeof(uint16_t) : 0);
+  if (u32need > psClnt->rxbufsz)
+  {
+    return -1; /* not even the header fits */
+  }
+  if (u32avail < u32need)
+  {
+    return 0;
+  }
+
+  sView.u8type = pu8pkt[0] >> 4;
+  sView.u8flags = pu8pkt[0] & 0x0F;
+  sView.u8hdr_len = hdr_len;
+  sView.u32remaining_len = u32remaining_len;
+  sView.pu8pkt = pu8pkt;
+  sView.pu8body = &pu8pkt[hdr_len];
+  if (!mqtt_view_publish(&sView, &sPub))
+  {
+    return -1;
+  }
+
+  /* the payload is not in memory yet */
+  uint32_t u32payload_len = sPub.u32payload_len;
+  sPub.pu8payload = 0;
+  _stat_packet_in(psClnt, pu8pkt, hdr_len + u32remaining_len);
+  psClnt->rx_stream_left = u32payload_len;
+  psClnt->client_publish_begin(psClnt, &sPub, u32payload_len);
+  return u32need;
+}
+
+/*
+   Walk every complete MQTT packet in pu8buf and hand each one to the
+   client_new_data callback in place. Returns the number of bytes consumed,
+   or -1 if the connection was closed.
+*/
+static int _frame(client_t* psClnt, uint8_t* pu8buf, uint32_t u32len)
+{
+  require(psClnt != 0);
+
+  uint32_t u32offset = 0;
+  while (    (psClnt->state == CONNECTED)
+          && (u32offset < u32len))
+  {
+    uint8_t* pu8pkt = &pu8buf[u32offset];
+    uint32_t u32avail = u32len - u32offset;
+
+    if (psClnt->rx_stream_left != 0)
+    {
+      /* inside a streamed PUBLISH: hand over as much of the payload as we have */
+      uint32_t u32chunk = ((u32avail < psClnt->rx_stream_left) ? u32avail : psClnt->rx_stream_left);
+      psClnt->rx_stream_left -= u32chunk;
+      u32offset += u32chunk;
+      psClnt->client_publish_chunk(psClnt, (char*)pu8pkt, u32chunk);
+      if (    (psClnt->rx_stream_left == 0)
+           && (psClnt->state == CONNECTED))
+      {
+        psClnt->client_publish_end(psClnt, 1);
+      }
+      continue;
+    }
+
+    if (psClnt->psBatch != 0)
+    {
+      /* describe every complete packet in one pass - a partial or oversized first packet is handled below */
+      int consumed = mqtt_decode_batch(pu8pkt, u32avail, psClnt->psBatch);
+      if (consumed > 0)
+      {
+#if (CLIENT_STATS == 1)
+        uint32_t i;
+        for (i = 0; i < psClnt->psBatch->u32count; ++i)
+        {
+          _stat_packet_in(psClnt, &pu8pkt[psClnt->psBatch->au32offset[i]], psClnt->psBatch->au32length[i]);
+        }
+#endif
+        u32offset += consumed;
+        psClnt->client_new_batch(psClnt, (char*)pu8pkt, psClnt->psBatch);
+        continue;
+      }
+      if (consumed < 0)
+      {
+        client_log(CLIENT_LOG_ERROR, "CLNT%d: malformed packet, dropping connection.\n", psClnt->sockfd);
+        client_disconnect(psClnt);
+        return -1;
+      }
+    }
+
+    uint32_t u32remaining_len;
+    int hdr_len = mqtt_decode_fixed_header(pu8pkt, u32avail, &u32remaining_len);
+    if (    (hdr_len > 0)
+         && ((hdr_len + u32remaining_len) > psClnt->rxbufsz)
+         && ((pu8pkt[0] >> 4) == CTRL_PUBLISH)
+         && (psClnt->client_publish_chunk != 0))
+    {
+      int consumed = _stream_begin(psClnt, pu8pkt, u32avail, hdr_len, u32remaining_len);
+      if (consumed > 0)
+      {
+        u32offset += consumed;
+        continue;
+      }
+      if (consumed == 0)
+      {
+        break; /* wait for the rest of the header */
+      }
+    }
+    if (    (hdr_len < 0)
+         || (    (hdr_len > 0)
+              && ((hdr_len + u32remaining_len) > psClnt->rxbufsz)))
+    {
+      /* malformed packet, or a packet that can never fit in the rx buffer */
+      client_log(CLIENT_LOG_ERROR, "CLNT%d: cannot frame packet, dropping connection.\n", psClnt->sockfd);
+      client_disconnect(psClnt);
+      return -1;
+    }
+    if (    (hdr_len == 0)
+         || ((hdr_len + u32remaining_len) > u32avail))
+    {
+      break; /* wait for the rest of the packet */
+    }
+
+    uint32_t u32pkt_len = hdr_len + u32remaining_len;
+    _stat_packet_in(psClnt, pu8pkt, u32pkt_len);
+    psClnt->client_new_data(psClnt, (char*)pu8pkt, u32pkt_len);
+    u32offset += u32pkt_len;
+  }
+
+  /* client_disconnect() (possibly from a callback) resets the rx buffer */
+  return ((psClnt->state == CONNECTED) ? (int)u32offset : -1);
+}
+
+/* Deliver what is complete in the rx buffer, move a trailing partial packet to the front for the next recv() */
+static void _deliver_packets(client_t* psClnt)
+{
+  int consumed = _frame(psClnt, (uint8_t*)psClnt->rxbuf, psClnt->rxbuflen);
+  if (consumed > 0)
+  {
+    psClnt->rxbuflen -= consumed;
+    memmove(psClnt->rxbuf, &psClnt->rxbuf[consumed], psClnt->rxbuflen);
+  }
+}
+
+
+static void _set_cork(client_t* psClnt, int enable)
+{
+  require(psClnt != 0);
+
+  if (psClnt->psTransport->cork != 0)
+  {
+    psClnt->psTransport->cork(psClnt, psClnt->sockfd, enable);
+  }
+}
+
+/*
+   Write a list of buffers to the socket, resuming after partial writes.
+   On a non-blocking socket that is full, returns the bytes written so far.
+   A blocking client waits for the socket to drain unless partial_ok is set.
+*/
+static int _sendv_now(client_t* psClnt, mqtt_iov_t* asIov, uint32_t u32niov, uint32_t u32total, int flags, int partial_ok)
+{
+  require(psClnt != 0);
+
+  struct iovec aIov[CLIENT_IOV_MAX];
+  struct iovec* psIov = aIov;
+  int niov = (int)u32niov;
+  uint32_t i;
+  for (i = 0; i < u32niov; ++i)
+  {
+    aIov[i].iov_base = asIov[i].pu8data;
+    aIov[i].iov_len  = asIov[i].u32len;
+  }
+
+  client_log(CLIENT_LOG_DEBUG, "CLNT%d: sending %u bytes in %u segments.\n", psClnt->sockfd, u32total, u32niov);
+
+  uint32_t u32sent = 0;
+  while (u32sent < u32total)
+  {
+#if (CLIENT_STATS == 1)
+    uint64_t u64start_ns = _now_ns();
+#endif
+    ssize_t nbytes = psClnt->psTransport->writev(psClnt, psClnt->sockfd, psIov, niov, flags);
+    CLIENT_STAT_ADD(psClnt, u64syscalls, 1);
+    CLIENT_STAT_HIST(psClnt, sSendLat, _now_ns() - u64start_ns);
+    if (nbytes < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (    (errno == EAGAIN)
+           || (errno == EWOULDBLOCK))
+      {
+        if (    (partial_ok)
+             || (psClnt->nonblocking))
+        {
+          break;
+        }
+        _wait_writable(psClnt);
+        continue;
+      }
+      client_log(CLIENT_LOG_ERROR, "CLNT%d: send: %s\n", psClnt->sockfd, strerror(errno));
+      client_disconnect(psClnt);
+      return -1;
+    }
+    u32sent += nbytes;
+    if (u32sent < u32total)
+    {
+      CLIENT_STAT_ADD(psClnt, u64partial_writes, 1);
+    }
+
+    /* partial write: skip the iov entries already sent and trim the first unsent one */
+    while (    (niov > 0)
+            && ((size_t)nbytes >= psIov[0].iov_len))
+    {
+      nbytes -= psIov[0].iov_len;
+      psIov += 1;
+      niov -= 1;
+    }
+    if (niov > 0)
+    {
+      psIov[0].iov_base = (char*)psIov[0].iov_base + nbytes;
+      psIov[0].iov_len -= nbytes;
+    }
+  }
+
+  return u32sent;
+}
+
+/* Send what is queued in the tx buffer. A non-blocking socket may leave a remainder queued. */
+static int _flush(client_t* psClnt, int flags)
+{
+  require(psClnt != 0);
+
+  int nbytes = 0;
+  if (    (psClnt->txbuflen != 0)
+       && (psClnt->txinflight == 0)) /* otherwise an async driver is sending it */
+  {
+    mqtt_iov_t sIov;
+    sIov.pu8data = (uint8_t*)psClnt->txbuf;
+    sIov.u32len = psClnt->txbuflen;
+    nbytes = _sendv_now(psClnt, &sIov, 1, sIov.u32len, flags, 1);
+    if (nbytes >= 0)
+    {
+      psClnt->txbuflen -= nbytes;
+      memmove(psClnt->txbuf, &psClnt->txbuf[nbytes], psClnt->txbuflen);
+      psClnt->txpkts = ((psClnt->txbuflen != 0) ? 1 : 0);
+    }
+  }
+  return nbytes;
+}
+
+/*
+   A non-blocking send stopped after u32sent of u32total bytes. The rest goes into the tx
+   buffer for the driver to send on EPOLLOUT - the client timer makes it look. Without room
+   for it the packet is refused if nothing went out yet, otherwise the stream is broken.
+*/
+static int _send_short(client_t* psClnt, mqtt_iov_t* asIov, uint32_t u32niov, uint32_t u32total, uint32_t u32sent)
+{
+  if (    (psClnt->txbuf != 0)
+       && ((u32total - u32sent) <= (psClnt->txbufsz - psClnt->txbuflen)))
+  {
+    uint32_t u32skip = u32sent;
+    uint32_t i;
+    if (psClnt->txbuflen == 0)
+    {
+      psClnt->tx_first_us = client_time_us();
+    }
+    for (i = 0; i < u32niov; ++i)
+    {
+      if (u32skip >= asIov[i].u32len)
+      {
+        u32skip -= asIov[i].u32len;
+        continue;
+      }
+      memcpy(&psClnt->txbuf[psClnt->txbuflen], asIov[i].pu8data + u32skip, asIov[i].u32len - u32skip);
+      psClnt->txbuflen += asIov[i].u32len - u32skip;
+      u32skip = 0;
+    }
+    psClnt->txpkts += 1;
+    _schedule(psClnt, client_time_us());
+    return u32total;
+  }
+
+  if (u32sent == 0)
+  {
+    CLIENT_STAT_ADD(psClnt, u64tx_refused, 1);
+    client_log(CLIENT_LOG_DEBUG, "CLNT%d: socket full.\n", psClnt->sockfd);
+    return -1;
+  }
+  client_log(CLIENT_LOG_ERROR, "CLNT%d: socket full in the middle of a packet, no room in the tx buffer for the rest.\n", psClnt->sockfd);
+  client_disconnect(psClnt);
+  return -1;
+}
+
+static void _connected(client_t* psClnt)
+{
+#if (CLIENT_STATS == 1)
+  if (CLIENT_STAT_ADD(psClnt, u64connects, 1) > 0)
+  {
+    CLIENT_STAT_ADD(psClnt, u64reconnects, 1);
+  }
+  CLIENT_STAT_SET(psClnt, u64ping_pending, 0);
+#endif
+  psClnt->rxbuflen = 0;
+  if (psClnt->tx_cork)
+  {
+    _set_cork(psClnt, 1);
+  }
+  _change_state(psClnt, CONNECTED);
+  psClnt->client_connected(psClnt);
+}
+
+
+/* Address cache shared by all clients (and threads), guarded by a spinlock */
+typedef struct
+{
+  char          host[32];
+  uint16_t      port;
+  uint32_t      naddrs;
+  uint64_t      expires_us;
+  client_addr_t asAddr[CLIENT_MAX_ADDRS];
+} dns_entry_t;
+
+static dns_entry_t asDnsCache[CLIENT_DNS_CACHE];
+static uint32_t    u32dns_next;   /* round-robin replacement */
+static char        dns_lock;
+
+static void _dns_lock(void)
+{
+  while (__atomic_test_and_set(&dns_lock, __ATOMIC_ACQUIRE))
+  {
+  }
+}
+
+static void _dns_unlock(void)
+{
+  __atomic_clear(&dns_lock, __ATOMIC_RELEASE);
+}
+
+static socklen_t _addr_len(client_addr_t* psAddr)
+{
+  return ((psAddr->sa.sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+}
+
+/* Fill psClnt->asAddr from the cache, or from getaddrinfo() on a miss. Returns number of addresses. */
+static uint32_t _resolve(client_t* psClnt)
+{
+  uint64_t u64now = client_time_us();
+  uint32_t i;
+
+  _dns_lock();
+  for (i = 0; i < CLIENT_DNS_CACHE; ++i)
+  {
+    dns_entry_t* psEnt = &asDnsCache[i];
+    if (    (psEnt->naddrs != 0)
+         && (psEnt->port == psClnt->port)
+         && (u64now < psEnt->expires_us)
+         && (strcmp(psEnt->host, psClnt->addr) == 0))
+    {
+      memcpy(psClnt->asAddr, psEnt->asAddr, psEnt->naddrs * sizeof(client_addr_t));
+      psClnt->naddrs = psEnt->naddrs;
+      _dns_unlock();
+      return psClnt->naddrs;
+    }
+  }
+  _dns_unlock();
+
+  /* a miss blocks this thread once per TTL - numeric addresses return right away */
+  struct addrinfo sHints;
+  struct addrinfo* psRes = 0;
+  memset(&sHints, 0, sizeof(sHints));
+  sHints.ai_family = AF_UNSPEC;
+  sHints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(psClnt->addr, 0, &sHints, &psRes);
+  if (rc != 0)
+  {
+    client_log(CLIENT_LOG_ERROR, "ERROR, no such host '%s': %s\n", psClnt->addr, gai_strerror(rc));
+    psClnt->naddrs = 0;
+    return 0;
+  }
+
+  /* interleave the address families, starting with the resolver's first choice (RFC 8305 section 4) */
+  int family = psRes->ai_family;
+  uint32_t n = 0;
+  while (n < CLIENT_MAX_ADDRS)
+  {
+    struct addrinfo* psAi;
+    for (psAi = psRes; psAi != 0; psAi = psAi->ai_next)
+    {
+      if (    (psAi->ai_family == family)
+           && (psAi->ai_addrlen <= sizeof(client_addr_t)))
+      {
+        break;
+      }
+    }
+    if (psAi == 0)
+    {
+      /* this family is used up - continue with the other one */
+      family = ((family == AF_INET6) ? AF_INET : AF_INET6);
+      for (psAi = psRes; psAi != 0; psAi = psAi->ai_next)
+      {
+        if (    (psAi->ai_family == family)
+             && (psAi->ai_addrlen <= sizeof(client_addr_t)))
+        {
+          break;
+        }
+      }
+      if (psAi == 0)
+      {
+        break;
+      }
+    }
+    memcpy(&psClnt->asAddr[n], psAi->ai_addr, psAi->ai_addrlen);
+    if (family == AF_INET6)
+    {
+      psClnt->asAddr[n].sin6.sin6_port = htons(psClnt->port);
+    }
+    else
+    {
+      psClnt->asAddr[n].sin.sin_port = htons(psClnt->port);
+    }
+    n += 1;
+    psAi->ai_family = AF_UNSPEC; /* taken */
+    family = ((family == AF_INET6) ? AF_INET : AF_INET6);
+  }
+  freeaddrinfo(psRes);
+  psClnt->naddrs = n;
+
+  if (n != 0)
+  {
+    _dns_lock();
+    dns_entry_t* psEnt = &asDnsCache[u32dns_next++ % CLIENT_DNS_CACHE];
+    strcpy(psEnt->host, psClnt->addr);
+    psEnt->port = psClnt->port;
+    psEnt->naddrs = n;
+    psEnt->expires_us = u64now + CLIENT_DNS_TTL_US;
+    memcpy(psEnt->asAddr, psClnt->asAddr, n * sizeof(client_addr_t));
+    _dns_unlock();
+  }
+  return n;
+}
+
+/* Socket transports: */
+
+/* Connect a new stream socket. Returns it or -1, *pconnected = 1 if already done */
+static int _sock_connect(client_t* psClnt, struct sockaddr* psAddr, socklen_t len, int* pconnected)
+{
+  int fd = socket(psAddr->sa_family, SOCK_STREAM | (psClnt->nonblocking ? SOCK_NONBLOCK : 0), 0);
+  if (fd < 0)
+  {
+    client_log(CLIENT_LOG_ERROR, "socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if (connect(fd, psAddr, len) == 0)
+  {
+    *pconnected = 1;
+    return fd;
+  }
+  if (    (psClnt->nonblocking)
+       && (errno == EINPROGRESS))
+  {
+    /* completes when the socket turns writable, see client_finish_connect() */
+    return fd;
+  }
+  client_log(CLIENT_LOG_ERROR, "CLNT%d: connect: %s\n", fd, strerror(errno));
+  close(fd);
+  return -1;
+}
+
+static int _sock_connect_error(void* pvClnt, int fd)
+{
+  (void) pvClnt;
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+  {
+    err = errno;
+  }
+  return err;
+}
+
+static ssize_t _sock_read(void* pvClnt, int fd, void* pvbuf, size_t nbytes)
+{
+  (void) pvClnt;
+  return recv(fd, pvbuf, nbytes, 0);
+}
+
+static ssize_t _sock_writev(void* pvClnt, int fd, struct iovec* asIov, int niov, int flags)
+{
+  (void) pvClnt;
+  struct msghdr sMsg;
+  memset(&sMsg, 0, sizeof(sMsg));
+  sMsg.msg_iov = asIov;
+  sMsg.msg_iovlen = niov;
+  return sendmsg(fd, &sMsg, flags | MSG_NOSIGNAL);
+}
+
+static void _sock_close(void* pvClnt, int fd)
+{
+  (void) pvClnt;
+  shutdown(fd, 2);
+  close(fd);
+}
+
+static uint32_t _tcp_resolve(void* pvClnt)
+{
+  return _resolve(pvClnt);
+}
+
+static int _tcp_connect(void* pvClnt, uint32_t u32idx, int* pconnected)
+{
+  client_t* psClnt = pvClnt;
+  client_addr_t* psAddr = &psClnt->asAddr[u32idx];
+  return _sock_connect(psClnt, &psAddr->sa, _addr_len(psAddr), pconnected);
+}
+
+static void _tcp_cork(void* pvClnt, int fd, int enable)
+{
+  (void) pvClnt;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &enable, sizeof(enable));
+}
+
+static uint32_t _unix_resolve(void* pvClnt)
+{
+  client_t* psClnt = pvClnt;
+  return ((psClnt->pvtransport != 0) ? 1 : 0);
+}
+
+static int _unix_connect(void* pvClnt, uint32_t u32idx, int* pconnected)
+{
+  (void) u32idx;
+  client_t* psClnt = pvClnt;
+  const char* path = psClnt->pvtransport;
+  struct sockaddr_un sAddr;
+  if (strlen(path) >= sizeof(sAddr.sun_path))
+  {
+    client_log(CLIENT_LOG_ERROR, "ERROR, socket path too long: '%s'\n", path);
+    return -1;
+  }
+  memset(&sAddr, 0, sizeof(sAddr));
+  sAddr.sun_family = AF_UNIX;
+  strcpy(sAddr.sun_path, path);
+  return _sock_connect(psClnt, (struct sockaddr*)&sAddr, sizeof(sAddr), pconnected);
+}
+
+const client_transport_t client_transport_tcp =
+{
+  "tcp", CLIENT_TRANSPORT_SOCKET,
+  _tcp_resolve, _tcp_connect, _sock_connect_error, _sock_read, _sock_writev, _sock_close, _tcp_cork
+};
+
+/* no cork: a local socket has no segments to hold back */
+const client_transport_t client_transport_unix =
+{
+  "unix", CLIENT_TRANSPORT_SOCKET,
+  _unix_resolve, _unix_connect, _sock_connect_error, _sock_read, _sock_writev, _sock_close, 0
+};
+
+/* Connect to the next candidate that doesn't fail right away. Returns the descriptor or -1, *pconnected = 1 if already done */
+static int _attempt(client_t* psClnt, int* pconnected)
+{
+  *pconnected = 0;
+  while (psClnt->nextaddr < psClnt->naddrs)
+  {
+    psClnt->attempt_us = client_time_us();
+    int fd = psClnt->psTransport->connect(psClnt, psClnt->nextaddr++, pconnected);
+    if (fd >= 0)
+    {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+/* Replace sockfd by another connecting socket - I/O drivers see it like a disconnect */
+static void _switch_socket(client_t* psClnt, int fd)
+{
+  psClnt->psTransport->close(psClnt, psClnt->sockfd);
+  psClnt->sockfd = fd;
+  psClnt->evmask = 0;   /* close() removed the old socket from any epoll set */
+  psClnt->ioflags = 0;
+  psClnt->iogen += 1;
+}
+
+static void _close_alt(client_t* psClnt)
+{
+  if (psClnt->altfd >= 0)
+  {
+    psClnt->psTransport->close(psClnt, psClnt->altfd);
+    psClnt->altfd = -1;
+  }
+}
+
+/* Decorrelated jitter: next = random(min, 3 * previous) capped at max, so a fleet dropped at once doesn't come back at once */
+static void _next_backoff(client_t* psClnt)
+{
+  uint32_t u32prev = ((psClnt->reconnect_delay_us > psClnt->backoff_min_us) ? psClnt->reconnect_delay_us : psClnt->backoff_min_us);
+  uint64_t u64hi = (uint64_t)u32prev * 3;
+  uint64_t u64span = u64hi - psClnt->backoff_min_us;
+
+  uint32_t x = psClnt->u32rand;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  psClnt->u32rand = x;
+
+  uint64_t u64delay = psClnt->backoff_min_us + ((u64span != 0) ? (x % (u64span + 1)) : 0);
+  psClnt->reconnect_delay_us = ((u64delay < psClnt->backoff_max_us) ? (uint32_t)u64delay : psClnt->backoff_max_us);
+}
+
+/* Interrupt the reactor driving the client, if there is one - client_poll() users see the queue on their next call */
+static void _queue_wake(client_t* psClnt)
+{
+  int fd = __atomic_load_n(&psClnt->queue_wakefd, __ATOMIC_ACQUIRE);
+  if (fd >= 0)
+  {
+    /* push the client on the reactor's ready list, so a wake-up only drains clients that have something queued */
+    void** ppvhead = __atomic_load_n(&psClnt->ppvqueue_ready, __ATOMIC_RELAXED);
+    int pushed = 0;
+    if (    (ppvhead != 0)
+         && (__atomic_exchange_n(&psClnt->queue_ready, 1, __ATOMIC_ACQ_REL) == 0))
+    {
+      void* pvhead = __atomic_load_n(ppvhead, __ATOMIC_RELAXED);
+      do
+      {
+        psClnt->pvqueue_next = pvhead;
+      } while (!__atomic_compare_exchange_n(ppvhead, &pvhead, psClnt, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+      pushed = 1;
+    }
+
+    /* already on the list: whoever pushed it writes the eventfd */
+    if (    (pushed)
+         || (ppvhead == 0))
+    {
+      uint64_t u64one = 1;
+      if (write(fd, &u64one, sizeof(u64one)) < 0)
+      {
+        require(errno == EAGAIN);
+      }
+    }
+  }
 }
 
 
@@ -41,11 +783,59 @@ void client_init(client_t* psClnt, char* dst_addr, uint16_t dst_port, char* rxbu
   strcpy(psClnt->addr, dst_addr);
   psClnt->port = dst_port;
   psClnt->sockfd = 0;
+  psClnt->psTransport = &client_transport_tcp;
+  psClnt->pvtransport = 0;
   psClnt->rxbuf   = rxbuf;
   psClnt->rxbufsz = rxbufsize;
+  psClnt->rxbuflen = 0;
+  psClnt->txbuf   = 0;
+  psClnt->txbufsz = 0;
+  psClnt->txbuflen = 0;
+  psClnt->txpkts  = 0;
+  psClnt->tx_cork = 0;
+  psClnt->tx_async = 0;
+  psClnt->txinflight = 0;
+  psClnt->iogen = 0;
+  psClnt->ioflags = 0;
+  psClnt->nonblocking = 0;
+  psClnt->evmask  = 0;
+  psClnt->naddrs = 0;
+  psClnt->nextaddr = 0;
+  psClnt->altfd = -1;
+  psClnt->attempt_us = 0;
+  psClnt->backoff_min_us = CLIENT_BACKOFF_MIN_US;
+  psClnt->backoff_max_us = CLIENT_BACKOFF_MAX_US;
+  psClnt->reconnect_delay_us = 0;
+  psClnt->u32rand = (uint32_t)((uintptr_t)psClnt ^ client_time_us()) | 1;
+  psClnt->idle_timeout_us = 0;
+  psClnt->keepalive_us = 0;
+  psClnt->last_tx_us = 0;
+  psClnt->psWheel = 0;
+  wheel_timer_init(&psClnt->sTimer, _dummy_timer, psClnt);
+  psClnt->last_timeout_us = 0;
+  psClnt->client_timeout      = (void*)_dummy_connect;
+#if (CLIENT_STATS == 1)
+  client_stats_reset(psClnt);
+#endif
   psClnt->client_connected    = (void*)_dummy_connect;
   psClnt->client_disconnected = (void*)_dummy_connect;
   psClnt->client_new_data     = (void*)_dummy_recv_data;
+  psClnt->client_publish_begin = (void*)_dummy_pub_begin;
+  psClnt->client_publish_chunk = 0;
+  psClnt->client_publish_end   = (void*)_dummy_pub_end;
+  psClnt->rx_stream_left = 0;
+  psClnt->psQueue = 0;
+  psClnt->queue_policy = QUEUE_FULL_ERROR;
+  psClnt->queue_idle = 1;
+  psClnt->queue_wakefd = -1;
+  psClnt->ppvqueue_ready = 0;
+  psClnt->pvqueue_next = 0;
+  psClnt->queue_ready = 0;
+  psClnt->u64queue_full = 0;
+  psClnt->u64queue_dropped = 0;
+  psClnt->client_queue_done = (void*)_dummy_qdone;
+  psClnt->psBatch = 0;
+  psClnt->client_new_batch = (void*)_dummy_batch;
 
   /*
      Set the socket I/O mode: In this case FIONBIO  
@@ -57,92 +847,429 @@ void client_init(client_t* psClnt, char* dst_addr, uint16_t dst_port, char* rxbu
   int iMode = 0;
   ioctl(psClnt->sockfd, FIONBIO, &iMode);
 
-  /*
-  // WINDOWS
-  DWORD timeout = SOCKET_READ_TIMEOUT_SEC * 1000;
-  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-  */
+  /*
+  // WINDOWS
+  DWORD timeout = SOCKET_READ_TIMEOUT_SEC * 1000;
+  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+  */
+
+  _change_state(psClnt, CREATED);
+
+  /* Ignore SIGPIPE - "broken pipe" / disconnected socket */
+  signal(SIGPIPE, SIG_IGN);
+}
+
+int client_set_callback(client_t* psClnt, cb_type eTyp, void* funcptr)
+{
+  require(psClnt != 0);
+  require(funcptr != 0);
+
+  int success = 1;
+
+  switch(eTyp)
+  {
+    case CB_ON_CONNECTION:    psClnt->client_connected    = funcptr;    break;
+    case CB_ON_DISCONNECT:    psClnt->client_disconnected = funcptr;    break;
+    case CB_RECEIVED_DATA:    psClnt->client_new_data     = funcptr;    break;
+    case CB_ON_TIMEOUT:       psClnt->client_timeout      = funcptr;    break;
+    case CB_PUBLISH_BEGIN:    psClnt->client_publish_begin = funcptr;   break;
+    case CB_PUBLISH_CHUNK:    psClnt->client_publish_chunk = funcptr;   break;
+    case CB_PUBLISH_END:      psClnt->client_publish_end  = funcptr;    break;
+    case CB_QUEUE_DONE:       psClnt->client_queue_done   = funcptr;    break;
+    case CB_RECEIVED_BATCH:   psClnt->client_new_batch    = funcptr;    break;
+    default:                  success = 0; /* unknown callback-type */  break;
+  }
+
+  return success;
+}
+
+int client_send(client_t* psClnt, char* data, uint32_t nbytes)
+{
+  require(psClnt != 0);
+  require(data != 0);
+
+  mqtt_iov_t sIov;
+  sIov.pu8data = (uint8_t*)data;
+  sIov.u32len = nbytes;
+
+  return client_sendv(psClnt, &sIov, 1);
+}
+
+int client_sendv(client_t* psClnt, mqtt_iov_t* asIov, uint32_t u32niov)
+{
+  require(psClnt != 0);
+  require(asIov != 0);
+  require(u32niov <= CLIENT_IOV_MAX);
+
+  uint32_t u32total = 0;
+  uint32_t i;
+  for (i = 0; i < u32niov; ++i)
+  {
+    u32total += asIov[i].u32len;
+  }
+
+  _touch(psClnt);
+  psClnt->last_tx_us = psClnt->last_active_us;
+  _stat_packet_out(psClnt, asIov, u32niov, u32total);
+
+  int nbytes;
+  if (psClnt->txbuf == 0)
+  {
+    /* batching disabled: one syscall per packet */
+    nbytes = _sendv_now(psClnt, asIov, u32niov, u32total, 0, 0);
+    return (((nbytes >= 0) && ((uint32_t)nbytes < u32total)) ? _send_short(psClnt, asIov, u32niov, u32total, nbytes) : nbytes);
+  }
+
+  while (    (psClnt->txbuflen != 0)
+          && (u32total > (psClnt->txbufsz - psClnt->txbuflen)))
+  {
+    if (psClnt->txinflight != 0)
+    {
+      /* an async driver owns the head of the queue - the caller has to try again later */
+      client_log(CLIENT_LOG_DEBUG, "CLNT%d: tx buffer full.\n", psClnt->sockfd);
+      return -1;
+    }
+    /* does not fit: push out what is queued, hinting that more data follows */
+    uint32_t u32queued = psClnt->txbuflen;
+    if (_flush(psClnt, MSG_MORE) < 0)
+    {
+      return -1;
+    }
+    if (psClnt->txbuflen == u32queued)
+    {
+      if (psClnt->nonblocking)
+      {
+        /* socket and tx buffer full: the driver flushes on EPOLLOUT, the caller tries again later */
+        CLIENT_STAT_ADD(psClnt, u64tx_refused, 1);
+        client_log(CLIENT_LOG_DEBUG, "CLNT%d: tx buffer full.\n", psClnt->sockfd);
+        return -1;
+      }
+      _wait_writable(psClnt);
+    }
+  }
+
+  if (u32total > psClnt->txbufsz)
+  {
+    /* larger than the whole tx buffer: send in place, don't copy */
+    nbytes = _sendv_now(psClnt, asIov, u32niov, u32total, 0, 0);
+    return (((nbytes >= 0) && ((uint32_t)nbytes < u32total)) ? _send_short(psClnt, asIov, u32niov, u32total, nbytes) : nbytes);
+  }
+
+  if (psClnt->txbuflen == 0)
+  {
+    psClnt->tx_first_us = client_time_us();
+    _schedule(psClnt, psClnt->tx_first_us + psClnt->tx_flush_delay_us);
+  }
+  for (i = 0; i < u32niov; ++i)
+  {
+    memcpy(&psClnt->txbuf[psClnt->txbuflen], asIov[i].pu8data, asIov[i].u32len);
+    psClnt->txbuflen += asIov[i].u32len;
+  }
+  psClnt->txpkts += 1;
+
+  if (    (!psClnt->tx_async)
+       && (    (psClnt->txbuflen >= psClnt->tx_flush_bytes)
+            || (psClnt->txpkts >= psClnt->tx_flush_pkts)))
+  {
+    if (_flush(psClnt, 0) < 0)
+    {
+      return -1;
+    }
+  }
+
+  return u32total;
+}
+
+void client_set_batching(client_t* psClnt, char* txbuf, uint32_t txbufsize, uint32_t flush_bytes, uint32_t flush_pkts, uint32_t flush_delay_us, int use_cork)
+{
+  require(psClnt != 0);
+  require(    (txbuf == 0)
+           || (txbufsize > 0));
+
+  /* don't lose anything queued under the old settings */
+  if (psClnt->txbuflen != 0)
+  {
+    client_flush(psClnt);
+  }
+
+  psClnt->txbuf = txbuf;
+  psClnt->txbufsz = txbufsize;
+  psClnt->txbuflen = 0;
+  psClnt->txpkts = 0;
+  psClnt->tx_flush_bytes = (((flush_bytes == 0) || (flush_bytes > txbufsize)) ? txbufsize : flush_bytes);
+  psClnt->tx_flush_pkts = ((flush_pkts == 0) ? 0xFFFFFFFF : flush_pkts);
+  psClnt->tx_flush_delay_us = flush_delay_us;
+  psClnt->tx_cork = ((txbuf != 0) && use_cork);
+
+  if (psClnt->state == CONNECTED)
+  {
+    _set_cork(psClnt, psClnt->tx_cork);
+  }
+}
+
+int client_flush(client_t* psClnt)
+{
+  require(psClnt != 0);
+
+  int nbytes = _flush(psClnt, 0);
+  if (    (nbytes > 0)
+       && (psClnt->tx_cork))
+  {
+    /* uncork + recork pushes out a partial segment right away */
+    _set_cork(psClnt, 0);
+    _set_cork(psClnt, 1);
+  }
+  return nbytes;
+}
+
+int client_recv(client_t* psClnt, uint32_t timeout_us)
+{
+  require(psClnt != 0);
+
+  struct timeval tv;
+  tv.tv_sec = 0;
+  while (timeout_us >= 1000000)
+  {
+    timeout_us -= 1000000;
+    tv.tv_sec += 1;
+  }
+  tv.tv_usec = timeout_us; /* Not init'ing this can cause strange errors */
+  if (!psClnt->nonblocking)
+  {
+    if (psClnt->psTransport->flags & CLIENT_TRANSPORT_SOCKET)
+    {
+      setsockopt(psClnt->sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
+    }
+    else
+    {
+      /* no receive timeout to set - wait for the descriptor, 0 waits forever like SO_RCVTIMEO */
+      struct pollfd sPfd;
+      sPfd.fd = psClnt->sockfd;
+      sPfd.events = POLLIN;
+      int timeout_ms = (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+      poll(&sPfd, 1, ((timeout_ms != 0) ? timeout_ms : -1));
+    }
+  }
+
+  int nbytes = psClnt->psTransport->read(psClnt, psClnt->sockfd, &psClnt->rxbuf[psClnt->rxbuflen], psClnt->rxbufsz - psClnt->rxbuflen);
+  CLIENT_STAT_ADD(psClnt, u64syscalls, 1);
+  if (nbytes <= 0)
+  {
+    /* got error or connection closed by server? */
+    if (    (nbytes == -1)
+         && (    (errno == EAGAIN)        /* nothing for us  */
+              || (errno == EWOULDBLOCK)   /* same as above   */
+              || (errno == EINTR)))       /* try again later */
+    {
+      /* do nothing */
+    }
+    else
+    {
+      /* connection lost / reset by peer */
+      client_log(CLIENT_LOG_ERROR, "CLNT%d: recv: %s\n", psClnt->sockfd, ((nbytes == 0) ? "connection closed" : strerror(errno)));
+      client_disconnect(psClnt);
+    }
+  }
+  else
+  {
+    _touch(psClnt);
+    psClnt->rxbuflen += nbytes;
+    _deliver_packets(psClnt);
+  }
+  return nbytes;
+}
+
+int client_feed(client_t* psClnt, char* data, uint32_t nbytes)
+{
+  require(psClnt != 0);
+  require(    (data != 0)
+           || (nbytes == 0));
+
+  _touch(psClnt);
+  while (    (nbytes > 0)
+          && (psClnt->state == CONNECTED))
+  {
+    if (psClnt->rxbuflen == 0)
+    {
+      /* nothing buffered: deliver complete packets straight from the caller's memory */
+      int consumed = _frame(psClnt, (uint8_t*)data, nbytes);
+      if (consumed < 0)
+      {
+        return -1;
+      }
+      data += consumed;
+      nbytes -= consumed;
+      if (nbytes == 0)
+      {
+        break;
+      }
+    }
 
-  _change_state(psClnt, CREATED);
+    /* buffer the partial packet (_frame() made sure it fits) and complete it from there */
+    uint32_t u32room = psClnt->rxbufsz - psClnt->rxbuflen;
+    uint32_t u32copy = ((nbytes < u32room) ? nbytes : u32room);
+    memcpy(&psClnt->rxbuf[psClnt->rxbuflen], data, u32copy);
+    psClnt->rxbuflen += u32copy;
+    data += u32copy;
+    nbytes -= u32copy;
+    _deliver_packets(psClnt);
+  }
+  return ((psClnt->state == CONNECTED) ? 0 : -1);
+}
 
-  /* Ignore SIGPIPE - "broken pipe" / disconnected socket */
-  signal(SIGPIPE, SIG_IGN);
+void client_sent(client_t* psClnt, uint32_t nbytes)
+{
+  require(psClnt != 0);
+  require(nbytes <= psClnt->txbuflen);
+
+  psClnt->txinflight = 0;
+  psClnt->txbuflen -= nbytes;
+  memmove(psClnt->txbuf, &psClnt->txbuf[nbytes], psClnt->txbuflen);
+  psClnt->txpkts = ((psClnt->txbuflen != 0) ? 1 : 0);
+  _touch(psClnt);
 }
 
-int client_set_callback(client_t* psClnt, cb_type eTyp, void* funcptr)
+void client_set_batch(client_t* psClnt, mqtt_batch_t* psBatch)
 {
   require(psClnt != 0);
-  require(funcptr != 0);
+  require((psBatch == 0) || (psBatch->u32cap != 0));
 
-  int success = 1;
+  psClnt->psBatch = psBatch;
+}
 
-  switch(eTyp)
-  {
-    case CB_ON_CONNECTION:    psClnt->client_connected    = funcptr;    break;
-    case CB_ON_DISCONNECT:    psClnt->client_disconnected = funcptr;    break;
-    case CB_RECEIVED_DATA:    psClnt->client_new_data     = funcptr;    break;
-    default:                  success = 0; /* unknown callback-type */  break;
-  }
+void client_set_queue(client_t* psClnt, ring_t* psRing, queue_policy_t ePolicy)
+{
+  require(psClnt != 0);
+  require((psRing == 0) || (psRing->u32elem_size == sizeof(client_qentry_t)));
 
-  return success;
+  psClnt->psQueue = psRing;
+  psClnt->queue_policy = ePolicy;
+  psClnt->queue_idle = 1;
 }
 
-int client_send(client_t* psClnt, char* data, uint32_t nbytes)
+int client_enqueue(client_t* psClnt, char* data, uint32_t nbytes, void* pvctx)
 {
   require(psClnt != 0);
+  require(psClnt->psQueue != 0);
   require(data != 0);
 
-  psClnt->last_active = time(0);
-  printf("CLNT%u: sending %u bytes.\n", psClnt->sockfd, nbytes);
+  client_qentry_t sEntry;
+  sEntry.data = data;
+  sEntry.nbytes = nbytes;
+  sEntry.pvctx = pvctx;
 
-  int success = send(psClnt->sockfd, data, nbytes, 0);
-
-  if (success < 0)
+  if (!ring_push(psClnt->psQueue, &sEntry))
   {
-    perror("send");
-    client_disconnect(psClnt);
+    __atomic_fetch_add(&psClnt->u64queue_full, 1, __ATOMIC_RELAXED);
+    switch (psClnt->queue_policy)
+    {
+      case QUEUE_FULL_ERROR:
+      {
+        return 0;
+      }
+
+      case QUEUE_FULL_DROP:
+      {
+        __atomic_fetch_add(&psClnt->u64queue_dropped, 1, __ATOMIC_RELAXED);
+        psClnt->client_queue_done(psClnt, pvctx, 0);
+        return 1;
+      }
+
+      case QUEUE_FULL_BLOCK:
+      {
+        /* make sure the driver is running, then yield - and back off to short sleeps if it stays full */
+        _queue_wake(psClnt);
+        uint32_t u32spins = 0;
+        while (!ring_push(psClnt->psQueue, &sEntry))
+        {
+          if (u32spins++ < 64)
+          {
+            sched_yield();
+          }
+          else
+          {
+            struct timespec sTs = { 0, 50000 };
+            nanosleep(&sTs, 0);
+          }
+        }
+      } break;
+    }
   }
 
-  return success;
+  /* pairs with the fence in client_drain_queue(): either we see queue_idle or the driver sees our packet */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (    (__atomic_load_n(&psClnt->queue_idle, __ATOMIC_RELAXED) != 0)
+       && (__atomic_exchange_n(&psClnt->queue_idle, 0, __ATOMIC_ACQ_REL) != 0))
+  {
+    _queue_wake(psClnt);
+  }
+  return 1;
 }
 
-int client_recv(client_t* psClnt, uint32_t timeout_us)
+uint32_t client_drain_queue(client_t* psClnt)
 {
   require(psClnt != 0);
 
-  struct timeval tv;
-  tv.tv_sec = 0;
-  while (timeout_us >= 1000000)
+  uint32_t u32count = 0;
+  if (psClnt->psQueue == 0)
   {
-    timeout_us -= 1000000;
-    tv.tv_sec += 1;
+    return 0;
   }
-  tv.tv_usec = timeout_us; /* Not init'ing this can cause strange errors */
-  setsockopt(psClnt->sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
 
-  int nbytes = recv(psClnt->sockfd, psClnt->rxbuf, psClnt->rxbufsz, 0);
-  if (nbytes <= 0)
+  while (    (psClnt->state == CONNECTED)
+          && (u32count < CLIENT_QUEUE_BATCH))
   {
-    /* got error or connection closed by server? */
-    if (    (nbytes == -1)           /* nothing for us  */
-         || (nbytes == EAGAIN)       /* try again later */
-         || (nbytes == EWOULDBLOCK)) /* same as above   */
+    client_qentry_t* psEntry = ring_peek(psClnt->psQueue);
+    if (psEntry == 0)
     {
-      /* do nothing */
+      /* announce we're done, then look once more for an enqueue that raced with us */
+      __atomic_store_n(&psClnt->queue_idle, 1, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (ring_peek(psClnt->psQueue) == 0)
+      {
+        break;
+      }
+      __atomic_store_n(&psClnt->queue_idle, 0, __ATOMIC_RELAXED);
+      continue;
     }
-    else
+
+    int ret = client_send(psClnt, psEntry->data, psEntry->nbytes);
+    if (    (ret < 0)
+         && (psClnt->state == CONNECTED))
     {
-      /* connection lost / reset by peer */
-      perror("recv");
-      client_disconnect(psClnt);
+      break; /* tx buffer of an async driver is full - try again on its next poll */
     }
+    client_qentry_t sEntry = *psEntry;
+    ring_release(psClnt->psQueue);
+    u32count += 1;
+    psClnt->client_queue_done(psClnt, sEntry.pvctx, (ret > 0));
   }
-  else
-  {
-    psClnt->client_new_data(psClnt, psClnt->rxbuf, nbytes);
-    psClnt->last_active = time(0);
-  }
-  return nbytes;
+  return u32count;
+}
+
+void client_queue_wake(client_t* psClnt)
+{
+  require(psClnt != 0);
+
+  _queue_wake(psClnt);
+}
+
+uint32_t client_queue_level(client_t* psClnt)
+{
+  require(psClnt != 0);
+
+  return ((psClnt->psQueue != 0) ? ring_count(psClnt->psQueue) : 0);
+}
+
+void client_set_transport(client_t* psClnt, const client_transport_t* psTransport, void* pvctx)
+{
+  require(psClnt != 0);
+  require(psTransport != 0);
+  require(psClnt->state != CONNECTING);
+  require(psClnt->state != CONNECTED);
+
+  psClnt->psTransport = psTransport;
+  psClnt->pvtransport = pvctx;
 }
 
 int client_state(client_t* psClnt)
@@ -166,7 +1293,26 @@ void client_poll(client_t* psClnt, uint32_t timeout_us)
 
     case CONNECTED:
     {
+      client_drain_queue(psClnt);
+      /* don't sleep in recv() past the next PINGREQ or the flush deadline of queued packets */
+      uint64_t u64now = client_time_us();
+      uint64_t u64deadline = client_keepalive_poll(psClnt, u64now);
+      if (    (psClnt->txbuflen != 0)
+           && ((psClnt->tx_first_us + psClnt->tx_flush_delay_us) < u64deadline))
+      {
+        u64deadline = psClnt->tx_first_us + psClnt->tx_flush_delay_us;
+      }
+      if (    (u64now < u64deadline)
+           && ((u64deadline - u64now) < timeout_us))
+      {
+        timeout_us = (uint32_t)(u64deadline - u64now);
+      }
       client_recv(psClnt, timeout_us);
+      if (    (psClnt->txbuflen != 0)
+           && ((client_time_us() - psClnt->tx_first_us) >= psClnt->tx_flush_delay_us))
+      {
+        client_flush(psClnt);
+      }
 /*
       static time_t timeLastMsg = 0;
       if ((time(0) - timeLastMsg) > 0)
@@ -177,10 +1323,37 @@ void client_poll(client_t* psClnt, uint32_t timeout_us)
 */
     } break;
 
+    case CONNECTING:
+    {
+      /* wake up in time to start the next candidate or check the racing one */
+      uint64_t u64now = client_time_us();
+      uint64_t u64next = client_connect_poll(psClnt, u64now);
+      if (    (psClnt->state == CONNECTING)
+           && (u64next > u64now)
+           && ((u64next - u64now) < timeout_us))
+      {
+        timeout_us = (uint32_t)(u64next - u64now);
+      }
+
+      struct pollfd sPfd;
+      sPfd.fd = psClnt->sockfd;
+      sPfd.events = POLLOUT;
+      if (    (psClnt->state == CONNECTING)
+           && (poll(&sPfd, 1, (timeout_us + 999) / 1000) > 0))
+      {
+        client_finish_connect(psClnt);
+      }
+      if (    (psClnt->state == CONNECTING)
+           && ((client_time_us() - psClnt->state_since_us) >= CLIENT_CONNECT_TIMEOUT_US))
+      {
+        client_log(CLIENT_LOG_ERROR, "CLNT%d: connect timed out.\n", psClnt->sockfd);
+        client_disconnect(psClnt);
+      }
+    } break;
+
     case DISCONNECTED:
     {
-      /* ~1 second cooldown */
-      if (time(0) > psClnt->last_active)
+      if ((client_time_us() - psClnt->state_since_us) >= psClnt->reconnect_delay_us)
       {
         client_connect(psClnt);
       }
@@ -194,56 +1367,421 @@ void client_disconnect(client_t* psClnt)
 {
   require(psClnt != 0);
 
-  shutdown(psClnt->sockfd, 2);
-  close(psClnt->sockfd);
+  psClnt->psTransport->close(psClnt, psClnt->sockfd);
+  _close_alt(psClnt);
 
+  psClnt->rxbuflen = 0;
+  psClnt->txbuflen = 0; /* queued packets are lost with the connection */
+  psClnt->txpkts = 0;
+  psClnt->evmask = 0;   /* close() removed the socket from any epoll set */
+  psClnt->txinflight = 0;
+  psClnt->ioflags = 0;
+  psClnt->iogen += 1;   /* async requests still in flight now complete as stale */
+  _next_backoff(psClnt);
   _change_state(psClnt, DISCONNECTED);
+  if (psClnt->rx_stream_left != 0)
+  {
+    psClnt->rx_stream_left = 0;
+    psClnt->client_publish_end(psClnt, 0);
+  }
   psClnt->client_disconnected(psClnt);
 }
 
+void client_set_backoff(client_t* psClnt, uint32_t min_us, uint32_t max_us)
+{
+  require(psClnt != 0);
+  require(min_us <= max_us);
+
+  psClnt->backoff_min_us = min_us;
+  psClnt->backoff_max_us = max_us;
+}
+
+void client_reset_backoff(client_t* psClnt)
+{
+  require(psClnt != 0);
+
+  psClnt->reconnect_delay_us = 0;
+}
+
+void client_set_keepalive(client_t* psClnt, uint32_t keepalive_us)
+{
+  require(psClnt != 0);
+
+  psClnt->keepalive_us = keepalive_us;
+  _schedule(psClnt, client_time_us());
+}
+
+uint64_t client_keepalive_poll(client_t* psClnt, uint64_t u64now)
+{
+  require(psClnt != 0);
+
+  if (    (psClnt->keepalive_us == 0)
+       || (psClnt->state != CONNECTED))
+  {
+    return UINT64_MAX;
+  }
+
+  if (u64now >= (psClnt->last_tx_us + psClnt->keepalive_us))
+  {
+    uint8_t au8ping[2];
+    int nbytes = mqtt_encode_ping_msg(au8ping);
+    client_log(CLIENT_LOG_DEBUG, "CLNT%d: keepalive PINGREQ.\n", psClnt->sockfd);
+    client_send(psClnt, (char*)au8ping, nbytes);
+    if (psClnt->state != CONNECTED)
+    {
+      return UINT64_MAX;
+    }
+    psClnt->last_tx_us = u64now; /* even if it only got queued */
+  }
+  return psClnt->last_tx_us + psClnt->keepalive_us;
+}
+
 int client_connect(client_t* psClnt)
 {
   require(psClnt != 0);
 
   int success = 0;
+  int connected;
 
-  struct sockaddr_in serv_addr;
-  struct hostent* server;
+  psClnt->sockfd = -1;
+  psClnt->altfd = -1;
+  psClnt->nextaddr = 0;
+  psClnt->naddrs = psClnt->psTransport->resolve(psClnt);
+  if (psClnt->naddrs != 0)
+  {
+    psClnt->sockfd = _attempt(psClnt, &connected);
+  }
 
-  psClnt->sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (psClnt->sockfd < 0)
   {
-    perror("socket");
+    client_disconnect(psClnt);
+  }
+  else if (connected)
+  {
+    _connected(psClnt);
+    success = 1;
+  }
+  else
+  {
+    _change_state(psClnt, CONNECTING);
+    success = 1;
+  }
+
+  return success;
+}
+
+int client_finish_connect(client_t* psClnt)
+{
+  require(psClnt != 0);
+  require(psClnt->state == CONNECTING);
+
+  int success = 0;
+  int err = psClnt->psTransport->connect_error(psClnt, psClnt->sockfd);
+  if (err == 0)
+  {
+    _close_alt(psClnt);
+    _connected(psClnt);
+    success = 1;
   }
   else
   {
-    server = gethostbyname(psClnt->addr);
-    if (server == NULL)
+    client_log(CLIENT_LOG_ERROR, "CLNT%d: connect: %s\n", psClnt->sockfd, strerror(err));
+
+    /* fall back to the racing attempt, or the next candidate */
+    int connected = 0;
+    int fd = psClnt->altfd;
+    psClnt->altfd = -1;
+    if (fd < 0)
+    {
+      fd = _attempt(psClnt, &connected);
+    }
+    if (fd < 0)
     {
-      fprintf(stderr,"ERROR, no such host\n");
+      client_disconnect(psClnt);
     }
     else
     {
-      memset(&serv_addr, 0, sizeof(serv_addr));
-      serv_addr.sin_family = AF_INET;
-      memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-      serv_addr.sin_port = htons(psClnt->port);
+      _switch_socket(psClnt, fd);
+      if (connected)
+      {
+        _connected(psClnt);
+        success = 1;
+      }
+    }
+  }
+
+  return success;
+}
+
+uint64_t client_connect_poll(client_t* psClnt, uint64_t u64now)
+{
+  require(psClnt != 0);
+  require(psClnt->state == CONNECTING);
 
-      if (connect(psClnt->sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+  if (psClnt->altfd >= 0)
+  {
+    struct pollfd sPfd;
+    sPfd.fd = psClnt->altfd;
+    sPfd.events = POLLOUT;
+    if (poll(&sPfd, 1, 0) > 0)
+    {
+      int err = psClnt->psTransport->connect_error(psClnt, psClnt->altfd);
+      if (err == 0)
       {
-        perror("connect");
-        /* Clean up by calling close() on socket before allocating a new socket. */
-        client_disconnect(psClnt);
+        /* the racing attempt won */
+        int fd = psClnt->altfd;
+        psClnt->altfd = -1;
+        _switch_socket(psClnt, fd);
+        _connected(psClnt);
+        return u64now;
       }
-      else
+      client_log(CLIENT_LOG_ERROR, "CLNT%d: connect: %s\n", psClnt->altfd, strerror(err));
+      _close_alt(psClnt);
+      psClnt->attempt_us = 0; /* start the next one right away */
+    }
+  }
+
+  if (    (psClnt->altfd < 0)
+       && (psClnt->nextaddr < psClnt->naddrs)
+       && (u64now >= (psClnt->attempt_us + CLIENT_CONNECT_DELAY_US)))
+  {
+    int connected;
+    int fd = _attempt(psClnt, &connected);
+    if (    (fd >= 0)
+         && (connected))
+    {
+      _switch_socket(psClnt, fd);
+      _connected(psClnt);
+      return u64now;
+    }
+    psClnt->altfd = fd;
+  }
+
+  /* the racing socket isn't registered with the I/O driver - look at it again soon */
+  if (psClnt->altfd >= 0)
+  {
+    return u64now + (CLIENT_CONNECT_DELAY_US / 25);
+  }
+  if (psClnt->nextaddr < psClnt->naddrs)
+  {
+    return psClnt->attempt_us + CLIENT_CONNECT_DELAY_US;
+  }
+  return UINT64_MAX;
+}
+
+void client_set_nonblocking(client_t* psClnt, int enable)
+{
+  require(psClnt != 0);
+
+  psClnt->nonblocking = enable;
+  if (    (    (psClnt->state == CONNECTING)
+            || (psClnt->state == CONNECTED))
+       && (psClnt->psTransport->flags & CLIENT_TRANSPORT_SOCKET))
+  {
+    int iMode = enable;
+    ioctl(psClnt->sockfd, FIONBIO, &iMode);
+  }
+}
+
+void client_log_stderr(int level, const char* fmt, ...)
+{
+  (void) level;
+
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+}
+
+#if (CLIENT_STATS == 1)
+void client_stats_snapshot(client_t* psClnt, client_stats_t* psOut)
+{
+  require(psClnt != 0);
+  require(psOut != 0);
+
+  /* client_stats_t is nothing but uint64_t's - copy word by word with atomic loads */
+  uint64_t* pu64src = (uint64_t*)&psClnt->sStats;
+  uint64_t* pu64dst = (uint64_t*)psOut;
+  uint32_t i;
+  for (i = 0; i < (sizeof(client_stats_t) / sizeof(uint64_t)); ++i)
+  {
+    pu64dst[i] = __atomic_load_n(&pu64src[i], __ATOMIC_RELAXED);
+  }
+}
+
+void client_stats_reset(client_t* psClnt)
+{
+  require(psClnt != 0);
+
+  uint64_t* pu64dst = (uint64_t*)&psClnt->sStats;
+  uint32_t i;
+  for (i = 0; i < (sizeof(client_stats_t) / sizeof(uint64_t)); ++i)
+  {
+    __atomic_store_n(&pu64dst[i], 0, __ATOMIC_RELAXED);
+  }
+  psClnt->sStats.sSendLat.u64min = UINT64_MAX;
+  psClnt->sStats.sAckRtt.u64min = UINT64_MAX;
+}
+#endif
+
+uint64_t client_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c client.c && gcc client.o mqtt.c wheel.c ring.c -o client_selftest && ./client_selftest */
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+static uint8_t  au8types[8];
+static uint32_t au32lens[8];
+static uint32_t u32npkts;
+
+static void _test_new_data(client_t* psClnt, char* data, int nbytes)
+{
+  (void)psClnt;
+  if (u32npkts < 8)
+  {
+    au8types[u32npkts] = ((uint8_t)data[0]) >> 4;
+    au32lens[u32npkts] = nbytes;
+  }
+  u32npkts += 1;
+}
+
+/* A connected client with no socket behind it, fed through client_feed() */
+static void _test_client(client_t* psClnt, char* rxbuf, uint32_t rxbufsize)
+{
+  client_init(psClnt, "127.0.0.1", 1883, rxbuf, rxbufsize);
+  client_set_callback(psClnt, CB_RECEIVED_DATA, _test_new_data);
+  psClnt->sockfd = -1;
+  psClnt->state = CONNECTED;
+  u32npkts = 0;
+}
+
+static void test_framing(void)
+{
+  static uint8_t au8payload[300];
+  uint8_t au8stream[512];
+  uint32_t u32len = 0;
+  char acrxbuf[400];
+  client_t sClnt;
+
+  /* a PUBLISH with a two byte length field, a PUBACK, a PINGRESP and a small PUBLISH */
+  u32len += mqtt_encode_publish_msg(&au8stream[u32len], (uint8_t*)"a/b", 3, QOS_AT_LEAST_ONCE, 7, au8payload, sizeof(au8payload));
+  u32len += mqtt_encode_puback_msg(&au8stream[u32len], 7);
+  au8stream[u32len++] = CTRL_PINGRESP << 4;
+  au8stream[u32len++] = 0x00;
+  u32len += mqtt_encode_publish_msg(&au8stream[u32len], (uint8_t*)"c", 1, QOS_AT_MOST_ONCE, 0, (uint8_t*)"x", 1);
+
+  /* however the stream is cut into reads, the same four packets come out whole */
+  uint32_t u32chunk;
+  for (u32chunk = 1; u32chunk <= u32len; ++u32chunk)
+  {
+    _test_client(&sClnt, acrxbuf, sizeof(acrxbuf));
+    uint32_t u32ofs;
+    for (u32ofs = 0; u32ofs < u32len; u32ofs += u32chunk)
+    {
+      uint32_t u32n = (((u32len - u32ofs) < u32chunk) ? (u32len - u32ofs) : u32chunk);
+      client_feed(&sClnt, (char*)&au8stream[u32ofs], u32n);
+    }
+    check(u32npkts == 4);
+    check(au8types[0] == CTRL_PUBLISH);
+    check(au32lens[0] == (3 + 2 + 3 + 2 + sizeof(au8payload)));
+    check((au8types[1] == CTRL_PUBACK) && (au32lens[1] == MQTT_ACK_MSG_LEN));
+    check((au8types[2] == CTRL_PINGRESP) && (au32lens[2] == 2));
+    check((au8types[3] == CTRL_PUBLISH) && (au32lens[3] == 6));
+    check(sClnt.rxbuflen == 0);
+    check(sClnt.state == CONNECTED);
+  }
+
+  /* a packet that can never fit in the rx buffer drops the connection instead of stalling it */
+  _test_client(&sClnt, acrxbuf, 100);
+  client_feed(&sClnt, (char*)au8stream, 3);
+  check(u32npkts == 0);
+  check(sClnt.state == DISCONNECTED);
+
+  /* so does a malformed length field */
+  uint8_t au8bad[] = { 0x30, 0xff, 0xff, 0xff, 0xff, 0x01 };
+  _test_client(&sClnt, acrxbuf, sizeof(acrxbuf));
+  client_feed(&sClnt, (char*)au8bad, sizeof(au8bad));
+  check(sClnt.state == DISCONNECTED);
+}
+
+static void test_resolve(void)
+{
+  char acrxbuf[64];
+  client_t sClnt;
+  uint32_t i, j;
+
+  /* numeric addresses, port filled in */
+  client_init(&sClnt, "127.0.0.1", 1883, acrxbuf, sizeof(acrxbuf));
+  check(_resolve(&sClnt) == 1);
+  check((sClnt.asAddr[0].sa.sa_family == AF_INET) && (sClnt.asAddr[0].sin.sin_port == htons(1883)));
+  client_init(&sClnt, "::1", 1884, acrxbuf, sizeof(acrxbuf));
+  check(_resolve(&sClnt) == 1);
+  check((sClnt.asAddr[0].sa.sa_family == AF_INET6) && (sClnt.asAddr[0].sin6.sin6_port == htons(1884)));
+
+  /* the families alternate for as long as both have addresses left */
+  client_init(&sClnt, "localhost", 1883, acrxbuf, sizeof(acrxbuf));
+  uint32_t n = _resolve(&sClnt);
+  check(n >= 1);
+  for (i = 0; (i + 1) < n; ++i)
+  {
+    if (sClnt.asAddr[i].sa.sa_family == sClnt.asAddr[i + 1].sa.sa_family)
+    {
+      for (j = i + 2; j < n; ++j)
       {
-        _change_state(psClnt, CONNECTED);
-        psClnt->client_connected(psClnt);
-        success = 1;
+        check(sClnt.asAddr[j].sa.sa_family == sClnt.asAddr[i].sa.sa_family);
       }
     }
   }
 
-  return success;
+  /* a second lookup of the same host and port comes from the cache until it expires */
+  client_init(&sClnt, "127.0.0.1", 1883, acrxbuf, sizeof(acrxbuf));
+  dns_entry_t* psEnt = 0;
+  for (i = 0; i < CLIENT_DNS_CACHE; ++i)
+  {
+    if (    (strcmp(asDnsCache[i].host, "127.0.0.1") == 0)
+         && (asDnsCache[i].port == 1883))
+    {
+      psEnt = &asDnsCache[i];
+    }
+  }
+  check(psEnt != 0);
+  if (psEnt != 0)
+  {
+    psEnt->asAddr[0].sin.sin_addr.s_addr = htonl(0x0a010203);
+    check((_resolve(&sClnt) == 1) && (sClnt.asAddr[0].sin.sin_addr.s_addr == htonl(0x0a010203)));
+    psEnt->expires_us = 0;
+    check((_resolve(&sClnt) == 1) && (sClnt.asAddr[0].sin.sin_addr.s_addr == htonl(INADDR_LOOPBACK)));
+  }
+  client_init(&sClnt, "127.0.0.1", 1885, acrxbuf, sizeof(acrxbuf));
+  check((_resolve(&sClnt) == 1) && (sClnt.asAddr[0].sin.sin_port == htons(1885)));
+}
+
+
+int main(void)
+{
+#if (CLIENT_LOG == 1)
+  client_log_hook = 0; /* the malformed input below is logged as an error */
+#endif
+
+  test_framing();
+  test_resolve();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
 }
 
+#endif
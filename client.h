@@ -1,54 +1,313 @@
+#ifndef _CLIENT_H_
+#define _CLIENT_H_
+
 #include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "mqtt.h"
+#include "wheel.h"
+#include "ring.h"
 
 #define NCONNECTIONS               1
 #define BUFFER_SIZE_BYTES          1024
+#define CLIENT_IOV_MAX             16   /* max scatter/gather elements per client_sendv() call */
+#define CLIENT_MAX_ADDRS           8    /* broker addresses tried per connect */
+#define CLIENT_DNS_CACHE           16   /* host names remembered by client_connect() */
+#define CLIENT_DNS_TTL_US          60000000 /* re-resolve a host name after 60 sec */
+#define CLIENT_CONNECT_DELAY_US    250000   /* start the next address if the current attempt hasn't finished (RFC 8305) */
+#define CLIENT_CONNECT_TIMEOUT_US  5000000  /* client_poll() gives up a connect after 5 sec */
+#define CLIENT_BACKOFF_MIN_US      1000000  /* default: first reconnect after 1-3 sec ... */
+#define CLIENT_BACKOFF_MAX_US      60000000 /* ... growing to at most 60 sec, see client_set_backoff() */
+#define CLIENT_QUEUE_BATCH         64   /* packets taken off the publish queue per client_drain_queue() */
 
 /* Assertion macro */
 #define require(predicate)         assert((predicate))
 
+/* Compile-time switches (set with -D) */
+#ifndef CLIENT_LOG
+ #define CLIENT_LOG                1    /* 0 compiles all logging out */
+#endif
+#ifndef CLIENT_STATS
+ #define CLIENT_STATS              0    /* 1 adds a client_stats_t block to client_t */
+#endif
+
+
+/* Logging goes through a replaceable hook, filtered by client_log_level */
+enum
+{
+  CLIENT_LOG_ERROR,
+  CLIENT_LOG_INFO,
+  CLIENT_LOG_DEBUG,
+};
+
+typedef void (*client_log_fn)(int level, const char* fmt, ...);
+
+#if (CLIENT_LOG == 1)
+ extern client_log_fn client_log_hook;  /* defaults to client_log_stderr, 0 silences everything */
+ extern int           client_log_level; /* defaults to CLIENT_LOG_INFO */
+ #define client_log(level, ...)                                          \
+   do {                                                                  \
+     if (((level) <= client_log_level) && (client_log_hook != 0))        \
+       client_log_hook((level), __VA_ARGS__);                            \
+   } while (0)
+#else
+ #define client_log(level, ...)    do { } while (0)
+#endif
+
+void client_log_stderr(int level, const char* fmt, ...);
+
+
+#if (CLIENT_STATS == 1)
+#include "histogram.h"
+
+/* Per-connection counters - all fields are uint64_t, updated with relaxed atomics */
+typedef struct
+{
+  uint64_t    au64pkts_in[16];      /* indexed by control type */
+  uint64_t    au64bytes_in[16];
+  uint64_t    au64pkts_out[16];
+  uint64_t    au64bytes_out[16];
+  uint64_t    u64syscalls;          /* send/recv system calls */
+  uint64_t    u64partial_writes;
+  uint64_t    u64tx_refused;        /* non-blocking sends refused, socket and tx buffer full */
+  uint64_t    u64connects;
+  uint64_t    u64reconnects;
+  uint64_t    u64keepalive_misses;  /* PINGREQ sent while the previous one is unanswered */
+  uint64_t    u64ping_pending;
+  histogram_t sSendLat;             /* nsec spent in send system calls */
+  histogram_t sAckRtt;              /* usec from PUBLISH to PUBACK/PUBCOMP, see session.c */
+} client_stats_t;
+
+ #define CLIENT_STAT_ADD(psClnt, field, n)    __atomic_fetch_add(&(psClnt)->sStats.field, (n), __ATOMIC_RELAXED)
+ #define CLIENT_STAT_SET(psClnt, field, v)    __atomic_store_n(&(psClnt)->sStats.field, (v), __ATOMIC_RELAXED)
+ #define CLIENT_STAT_HIST(psClnt, hist, v)    histogram_record_atomic(&(psClnt)->sStats.hist, (v))
+#else
+ #define CLIENT_STAT_ADD(psClnt, field, n)    do { } while (0)
+ #define CLIENT_STAT_SET(psClnt, field, v)    do { } while (0)
+ #define CLIENT_STAT_HIST(psClnt, hist, v)    do { } while (0)
+#endif
+
 
 /* Socket connection state */
 typedef enum
 {
   CREATED,
+  CONNECTING,   /* non-blocking connect() in progress */
   CONNECTED,
   DISCONNECTED,
 } conn_state_t;
 
 /* Type definitions */
+typedef union
+{
+  struct sockaddr     sa;
+  struct sockaddr_in  sin;
+  struct sockaddr_in6 sin6;
+} client_addr_t;
+
 typedef enum
 {
   CB_ON_CONNECTION,
   CB_ON_DISCONNECT,
   CB_RECEIVED_DATA,
+  CB_ON_TIMEOUT,
+  CB_PUBLISH_BEGIN,   /* streamed PUBLISH: header parsed */
+  CB_PUBLISH_CHUNK,   /* streamed PUBLISH: next part of the payload - setting this enables streaming */
+  CB_PUBLISH_END,     /* streamed PUBLISH: payload complete, or connection lost */
+  CB_QUEUE_DONE,      /* publish queue: a packet was sent, or dropped */
+  CB_RECEIVED_BATCH,  /* all complete packets of one receive at once, see client_set_batch() */
 } cb_type;
 
+/* What client_enqueue() does when the publish queue is full */
+typedef enum
+{
+  QUEUE_FULL_ERROR,   /* return 0, the caller keeps the packet */
+  QUEUE_FULL_DROP,    /* drop the packet and report it through client_queue_done */
+  QUEUE_FULL_BLOCK,   /* wait for the network thread to make room */
+} queue_policy_t;
+
+/* Transport flags */
+#define CLIENT_TRANSPORT_SOCKET  0x01   /* descriptors are stream sockets, drivers may send() / recv() on them directly */
+
+/*
+   How the client reaches the broker. Every connection is a descriptor the I/O
+   drivers can poll: readable while there is data (or EOF) to read. read and writev
+   follow read(2) / sendmsg(2): -1 with errno EAGAIN when they would block.
+*/
+typedef struct
+{
+  const char* name;
+  uint32_t    flags;
+  /* Fill in the candidates to try, returns how many */
+  uint32_t (*resolve)      (void* psClnt);
+  /* Start connecting to candidate u32idx: returns the descriptor or -1, *pconnected = 1 if already done */
+  int      (*connect)      (void* psClnt, uint32_t u32idx, int* pconnected);
+  /* Result of a connect that was still in progress: 0 = connected, else the error */
+  int      (*connect_error)(void* psClnt, int fd);
+  ssize_t  (*read)         (void* psClnt, int fd, void* pvbuf, size_t nbytes);
+  ssize_t  (*writev)       (void* psClnt, int fd, struct iovec* asIov, int niov, int flags);
+  void     (*close)        (void* psClnt, int fd);
+  /* Hold back partial segments between flushes, 0 if the transport has no such thing */
+  void     (*cork)         (void* psClnt, int fd, int enable);
+} client_transport_t;
+
+extern const client_transport_t client_transport_tcp;   /* the default: dst_addr / dst_port from client_init() */
+extern const client_transport_t client_transport_unix;  /* AF_UNIX stream socket, pvctx is the socket's path */
+
+/* A pre-encoded packet on the publish queue - the data is not copied */
 typedef struct
 {
-  int          sockfd;
+  char*    data;
+  uint32_t nbytes;
+  void*    pvctx;
+} client_qentry_t;
+
+typedef struct
+{
+  int          sockfd;         /* descriptor of the connection, see client_transport_t */
+  const client_transport_t* psTransport;
+  void*        pvtransport;    /* transport specific, see client_set_transport() */
   char*        rxbuf;
   uint32_t     rxbufsz;
+  uint32_t     rxbuflen;     /* bytes of a partially received packet kept in rxbuf */
   conn_state_t state;
   uint16_t     port;
   char         addr[32];
-  time_t       last_active;
+  int          nonblocking;    /* socket is in non-blocking mode, see client_set_nonblocking() */
+  uint32_t     evmask;         /* events registered with a reactor, 0 = not registered */
+  uint64_t     state_since_us; /* monotonic timestamp of last state change */
+  uint64_t     last_active_us; /* monotonic timestamp of last send/recv */
+  uint64_t     last_timeout_us;/* monotonic timestamp of last idle-timeout callback */
+  uint32_t     idle_timeout_us;/* call client_timeout after this long without activity, 0 = never */
+  uint32_t     keepalive_us;   /* send PINGREQ after this long without sending, 0 = never */
+  uint64_t     last_tx_us;     /* monotonic timestamp of last packet sent */
+
+  /* Timers, when driven by a reactor or uring: sTimer runs reactor_service_timers() for this client */
+  wheel_t*     psWheel;        /* 0 = not attached */
+  wheel_timer_t sTimer;
+
+  /* Connection setup, see client_connect() */
+  client_addr_t asAddr[CLIENT_MAX_ADDRS]; /* candidates, alternating address families */
+  uint32_t     naddrs;
+  uint32_t     nextaddr;          /* next candidate to try */
+  int          altfd;             /* attempt racing sockfd (Happy Eyeballs), -1 = none */
+  uint64_t     attempt_us;        /* monotonic timestamp of the last attempt started */
+
+  /* Reconnect backoff with decorrelated jitter, see client_set_backoff() */
+  uint32_t     backoff_min_us;
+  uint32_t     backoff_max_us;
+  uint32_t     reconnect_delay_us; /* stay DISCONNECTED this long, 0 = reconnect right away */
+  uint32_t     u32rand;            /* xorshift state for the jitter */
+
+  /* Outbound batching, see client_set_batching() -- disabled while txbuf == 0 */
+  char*        txbuf;
+  uint32_t     txbufsz;
+  uint32_t     txbuflen;          /* bytes queued, not yet handed to the kernel */
+  uint32_t     txpkts;            /* packets queued */
+  uint32_t     tx_flush_bytes;    /* flush once this many bytes are queued */
+  uint32_t     tx_flush_pkts;     /* flush once this many packets are queued */
+  uint32_t     tx_flush_delay_us; /* flush from client_poll() when oldest queued packet is this old */
+  uint64_t     tx_first_us;       /* monotonic timestamp of oldest queued packet */
+  int          tx_cork;           /* keep TCP_CORK set on the socket between flushes */
+
+  /* Asynchronous I/O drivers (uring.c) */
+  int          tx_async;          /* the driver sends txbuf, client_sendv() only queues */
+  uint32_t     txinflight;        /* head of txbuf handed to the driver, not yet completed */
+  uint32_t     iogen;             /* bumped on disconnect, tags outstanding async requests */
+  uint32_t     ioflags;           /* async requests outstanding, driver specific */
+
+  /* Streaming receive: a PUBLISH that doesn't fit in rxbuf is delivered in chunks as it arrives */
+  uint32_t     rx_stream_left;    /* payload bytes of the streamed PUBLISH still to come, 0 = not streaming */
+
+  /* Batch receive, see client_set_batch() -- packets go to client_new_data one by one while psBatch == 0 */
+  mqtt_batch_t* psBatch;
+
+  /* Publish queue, see client_set_queue(): any thread enqueues, the thread driving the client sends */
+  ring_t*      psQueue;           /* ring of client_qentry_t, 0 = no queue */
+  queue_policy_t queue_policy;
+  uint32_t     queue_idle;        /* drained empty - the next enqueue has to wake the driver */
+  int          queue_wakefd;      /* eventfd of the reactor driving the client, -1 = none */
+  void**       ppvqueue_ready;    /* that reactor's ready list, 0 = none */
+  void*        pvqueue_next;      /* next client on the ready list */
+  uint32_t     queue_ready;       /* on the ready list - pushed once until the driver takes it off */
+  uint64_t     u64queue_full;     /* enqueues that found the queue full */
+  uint64_t     u64queue_dropped;  /* ... and dropped the packet (QUEUE_FULL_DROP) */
+
+#if (CLIENT_STATS == 1)
+  client_stats_t sStats;
+#endif
 
   /* Callbacks */
   void (*client_connected)   (void* psClnt);    /* new connection established */
   void (*client_disconnected)(void* psClnt);    /* a connection was closed */
-  void (*client_new_data)    (void* psClnt, char* data, int nbytes); /* data has been received */
+  void (*client_new_data)    (void* psClnt, char* data, int nbytes); /* one complete MQTT packet has been received */
+  void (*client_timeout)     (void* psClnt);    /* no activity for idle_timeout_us (reactor only) */
+  /* Streaming: psPub->pu8topic is only valid during the call and psPub->pu8payload is 0. With MQTT 5 the
+     chunks start with the property block. While publish_chunk == 0 a packet larger than rxbuf closes the connection. */
+  void (*client_publish_begin)(void* psClnt, mqtt_publish_view_t* psPub, uint32_t u32payload_len);
+  void (*client_publish_chunk)(void* psClnt, char* data, uint32_t nbytes);
+  void (*client_publish_end)  (void* psClnt, int complete); /* complete == 0: connection lost mid-payload */
+  /* Publish queue: the packet's data may be reused. Runs on the driving thread, or on the enqueuing one when dropped. */
+  void (*client_queue_done)  (void* psClnt, void* pvctx, int sent);
+  /* Batch receive: psBatch describes the complete packets starting at data, offsets are relative to it */
+  void (*client_new_batch)   (void* psClnt, char* data, mqtt_batch_t* psBatch);
 } client_t;
 
 
 
 void client_init(client_t* psClnt, char* dst_addr, uint16_t dst_port, char* rxbuf, uint32_t rxbufsize);
 int  client_set_callback(client_t* psClnt, cb_type eTyp, void* funcptr);
+/* Returns the bytes sent or queued. A non-blocking client never waits: what the socket doesn't take goes into
+   the tx buffer, and if that is full too the packet is refused with -1 - try again after the driver flushed */
 int  client_send(client_t* psClnt, char* data, uint32_t nbytes);
+int  client_sendv(client_t* psClnt, mqtt_iov_t* asIov, uint32_t u32niov);
+int  client_flush(client_t* psClnt);
+/* Queue outbound packets in txbuf; 0 for flush_bytes/flush_pkts means "when full". txbuf == 0 disables batching. */
+void client_set_batching(client_t* psClnt, char* txbuf, uint32_t txbufsize, uint32_t flush_bytes, uint32_t flush_pkts, uint32_t flush_delay_us, int use_cork);
 int  client_recv(client_t* psClnt, uint32_t timeout_us);
+/* For I/O drivers that do their own socket I/O: hand over received bytes / report bytes of txbuf sent */
+int  client_feed(client_t* psClnt, char* data, uint32_t nbytes);
+void client_sent(client_t* psClnt, uint32_t nbytes);
 void client_poll(client_t* psClnt, uint32_t timeout_us);
 void client_disconnect(client_t* psClnt);
+/* Each disconnect waits random(min, 3 * previous wait) capped at max before reconnecting, min == max gives a fixed delay */
+void client_set_backoff(client_t* psClnt, uint32_t min_us, uint32_t max_us);
+/* Start over from min - call once the broker has accepted the connection (CONNACK) */
+void client_reset_backoff(client_t* psClnt);
+/* Send PINGREQ whenever nothing was sent for keepalive_us - a bit less than the keep alive in CONNECT. 0 disables. */
+void client_set_keepalive(client_t* psClnt, uint32_t keepalive_us);
+/* Send a PINGREQ if one is due, returns when to call again (UINT64_MAX: not needed) */
+uint64_t client_keepalive_poll(client_t* psClnt, uint64_t u64now);
 int  client_connect(client_t* psClnt);
+int  client_finish_connect(client_t* psClnt);
+/* While CONNECTING: start the next candidate address every CLIENT_CONNECT_DELAY_US and check the racing
+   attempt. Called from the I/O driver's timers, returns the time it wants to be called again. */
+uint64_t client_connect_poll(client_t* psClnt, uint64_t u64now);
+/* Deliver received packets in batches to the CB_RECEIVED_BATCH callback, described in psBatch's caller-supplied
+   arrays. Streamed PUBLISHes still go through the CB_PUBLISH_xxx callbacks. Pass 0 to go back to client_new_data. */
+void client_set_batch(client_t* psClnt, mqtt_batch_t* psBatch);
+/* Attach a publish queue: psRing is ring_init()'ed with client_qentry_t elements. Call before the client is driven. */
+void client_set_queue(client_t* psClnt, ring_t* psRing, queue_policy_t ePolicy);
+/* Any thread: queue a pre-encoded packet. Returns 1 if it was queued (or dropped, with QUEUE_FULL_DROP),
+   0 if the queue is full with QUEUE_FULL_ERROR. Never call with QUEUE_FULL_BLOCK from the driving thread. */
+int  client_enqueue(client_t* psClnt, char* data, uint32_t nbytes, void* pvctx);
+/* Driving thread: send up to CLIENT_QUEUE_BATCH queued packets while connected. Returns how many were taken. */
+uint32_t client_drain_queue(client_t* psClnt);
+/* Any thread: put the client on its reactor's ready list and wake the reactor, e.g. after a full client_drain_queue() */
+void client_queue_wake(client_t* psClnt);
+/* Any thread: packets waiting in the publish queue */
+uint32_t client_queue_level(client_t* psClnt);
+/* Connect through another transport from the next client_connect() on. pvctx is passed on to it. */
+void client_set_transport(client_t* psClnt, const client_transport_t* psTransport, void* pvctx);
 int  client_state(client_t* psClnt);
+void client_set_nonblocking(client_t* psClnt, int enable);
+uint64_t client_time_us(void); /* monotonic clock */
+#if (CLIENT_STATS == 1)
+/* Consistent-per-field copy of the counters, safe to call from any thread */
+void client_stats_snapshot(client_t* psClnt, client_stats_t* psOut);
+void client_stats_reset(client_t* psClnt);
+#endif
 
-
+#endif /* _CLIENT_H_ */
@@ -0,0 +1,482 @@
+/*
+   Latency probe: one connection publishes sequence-numbered, timestamped payloads at a
+   fixed rate, a second one subscribed to the same topic receives them. Prints
+   publish->delivery and publish->PUBACK (PUBCOMP for QoS 2) latency percentiles, plus
+   lost, reordered and duplicate deliveries. Timestamps come from the monotonic clock, so
+   both connections run in this process - the broker can be anything on the same host.
+
+   Compile and run against a local broker:
+
+     gcc -O2 client.c mqtt.c wheel.c ring.c reactor.c histogram.c client_latency.c -o latency
+     ./latency -h 127.0.0.1 -p 1883 -r 1000 -b 64 -q 1 -d 30
+*/
+#include "client.h"
+#include "reactor.h"
+#include "histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#define PROBE_HDR_SIZE  (2 * sizeof(uint64_t))   /* payload starts with sequence number and send timestamp */
+
+enum { PUB, SUB, NCLIENTS };
+
+/* Configuration */
+static char*    host = "127.0.0.1";
+static char*    unix_path = 0;          /* connect over AF_UNIX instead of TCP */
+static uint16_t port = 1883;
+static char*    topic = 0;              /* default "probe/<pid>" */
+static uint32_t rate = 100;             /* publishes per second */
+static uint32_t payload_size = 64;
+static uint8_t  qos = QOS_AT_MOST_ONCE;
+static uint32_t duration_s = 10;
+static uint32_t drain_ms = 1000;        /* wait for stragglers after the last publish */
+static int      print_distribution = 0;
+static int      spin = 0;               /* busy-poll for waits under a millisecond, for exact pacing at the cost of a core */
+
+/* State */
+static client_t  asClnt[NCLIENTS];
+static client_t* apsSlots[NCLIENTS];
+static char      acrxbuf[NCLIENTS][BUFFER_SIZE_BYTES + 1024];
+static reactor_t sReactor;
+static int       aready[NCLIENTS];      /* CONNACK received (and SUBACK for the subscriber) */
+static uint16_t  u16topic_len;
+static char      actopic[64];
+static uint8_t*  pu8payload;
+static uint8_t*  pu8pkt;
+static uint64_t  au64inflight_us[65536]; /* send timestamp by packet id, 0 = not in flight */
+static uint16_t  u16next_id;
+static uint8_t*  pu8seen;               /* bitmap of delivered sequence numbers */
+static uint64_t  u64nseq;               /* bitmap size in bits */
+static volatile int stop;
+static int      finished;
+
+/* Results */
+static uint64_t u64published, u64acked, u64unacked, u64delivered, u64unique, u64reordered, u64duplicates, u64highest_seq;
+static histogram_t sAckLat, sDeliverLat;
+
+
+static void on_connect(client_t* psClnt)
+{
+  uint8_t au8buf[64];
+  char acid[32];
+  int n = snprintf(acid, sizeof(acid), "probe-%s-%u", ((psClnt == &asClnt[PUB]) ? "pub" : "sub"), (unsigned)getpid());
+  int nbytes = mqtt_encode_connect_msg2(au8buf, MQTT_CONNECT_CLEAN_SESSION, 60, (uint8_t*)acid, n);
+  client_send(psClnt, (char*)au8buf, nbytes);
+}
+
+static void on_disconnect(client_t* psClnt)
+{
+  aready[(psClnt == &asClnt[PUB]) ? PUB : SUB] = 0;
+  if (!finished)
+  {
+    fprintf(stderr, "%s: disconnected\n", ((psClnt == &asClnt[PUB]) ? "publisher" : "subscriber"));
+  }
+}
+
+static void send_ack(client_t* psClnt, int (*pfEncode)(uint8_t*, uint16_t), uint16_t u16msg_id)
+{
+  uint8_t au8buf[8];
+  int nbytes = pfEncode(au8buf, u16msg_id);
+  client_send(psClnt, (char*)au8buf, nbytes);
+}
+
+static void on_delivery(mqtt_publish_view_t* psPub, uint64_t u64now)
+{
+  uint64_t u64seq, u64sent_us;
+  if (psPub->u32payload_len < PROBE_HDR_SIZE)
+  {
+    return;
+  }
+  memcpy(&u64seq, psPub->pu8payload, sizeof(u64seq));
+  memcpy(&u64sent_us, psPub->pu8payload + sizeof(u64seq), sizeof(u64sent_us));
+
+  u64delivered += 1;
+  if (u64seq >= u64nseq)
+  {
+    return; /* not ours */
+  }
+  if (pu8seen[u64seq / 8] & (1 << (u64seq % 8)))
+  {
+    u64duplicates += 1; /* QoS 1 redelivery */
+    return;
+  }
+  pu8seen[u64seq / 8] |= (1 << (u64seq % 8));
+  u64unique += 1;
+  if (u64seq < u64highest_seq)
+  {
+    u64reordered += 1;
+  }
+  else
+  {
+    u64highest_seq = u64seq;
+  }
+  histogram_record(&sDeliverLat, u64now - u64sent_us);
+}
+
+static void on_data(client_t* psClnt, char* data, int nbytes)
+{
+  uint64_t u64now = client_time_us();
+  int i = ((psClnt == &asClnt[PUB]) ? PUB : SUB);
+  uint16_t u16msg_id;
+  mqtt_view_t sView;
+
+  if (mqtt_decode_view((uint8_t*)data, nbytes, &sView) <= 0)
+  {
+    return;
+  }
+
+  switch (sView.u8type)
+  {
+    case CTRL_CONNACK:
+    {
+      mqtt_connack_view_t sConnack;
+      if (    (!mqtt_view_connack(&sView, &sConnack))
+           || (sConnack.u8return_code != 0))
+      {
+        fprintf(stderr, "%s: connection refused\n", ((i == PUB) ? "publisher" : "subscriber"));
+        stop = 1;
+      }
+      else if (i == PUB)
+      {
+        client_reset_backoff(psClnt);
+        aready[PUB] = 1;
+      }
+      else
+      {
+        uint8_t au8buf[96];
+        int n = mqtt_encode_subscribe_msg(au8buf, (uint8_t*)actopic, u16topic_len, qos, 1);
+        client_reset_backoff(psClnt);
+        client_send(psClnt, (char*)au8buf, n);
+      }
+    } break;
+
+    case CTRL_SUBACK:
+    {
+      mqtt_suback_view_t sSuback;
+      if (    (mqtt_view_suback(&sView, &sSuback))
+           && (sSuback.u32ncodes > 0)
+           && (sSuback.pu8codes[0] < 0x80))
+      {
+        aready[SUB] = 1;
+      }
+      else
+      {
+        fprintf(stderr, "subscriber: subscription refused\n");
+        stop = 1;
+      }
+    } break;
+
+    case CTRL_PUBLISH:
+    {
+      mqtt_publish_view_t sPub;
+      if (mqtt_view_publish(&sView, &sPub))
+      {
+        on_delivery(&sPub, u64now);
+        if (sPub.u8qos == QOS_AT_LEAST_ONCE)
+        {
+          send_ack(psClnt, mqtt_encode_puback_msg, sPub.u16msg_id);
+        }
+        else if (sPub.u8qos == QOS_EXACTLY_ONCE)
+        {
+          send_ack(psClnt, mqtt_encode_pubrec_msg, sPub.u16msg_id);
+        }
+      }
+    } break;
+
+    case CTRL_PUBREL:
+    {
+      if (mqtt_view_ack(&sView, &u16msg_id))
+      {
+        send_ack(psClnt, mqtt_encode_pubcomp_msg, u16msg_id);
+      }
+    } break;
+
+    case CTRL_PUBREC:
+    {
+      if (mqtt_view_ack(&sView, &u16msg_id))
+      {
+        send_ack(psClnt, mqtt_encode_pubrel_msg, u16msg_id);
+      }
+    } break;
+
+    case CTRL_PUBACK:
+    case CTRL_PUBCOMP:
+    {
+      if (    (mqtt_view_ack(&sView, &u16msg_id))
+           && (au64inflight_us[u16msg_id] != 0))
+      {
+        histogram_record(&sAckLat, u64now - au64inflight_us[u16msg_id]);
+        au64inflight_us[u16msg_id] = 0;
+        u64acked += 1;
+      }
+    } break;
+  }
+}
+
+static void publish(uint64_t u64seq, uint64_t u64now)
+{
+  uint16_t u16msg_id = 0;
+  if (qos != QOS_AT_MOST_ONCE)
+  {
+    u16next_id = ((u16next_id == 0xFFFF) ? 1 : (u16next_id + 1));
+    u16msg_id = u16next_id;
+    if (au64inflight_us[u16msg_id] != 0)
+    {
+      u64unacked += 1; /* id came around again without an ack */
+    }
+  }
+
+  memcpy(pu8payload, &u64seq, sizeof(u64seq));
+  memcpy(pu8payload + sizeof(u64seq), &u64now, sizeof(u64now));
+  int nbytes = mqtt_encode_publish_msg(pu8pkt, (uint8_t*)actopic, u16topic_len, qos, u16msg_id, pu8payload, payload_size);
+  if (client_send(&asClnt[PUB], (char*)pu8pkt, nbytes) > 0)
+  {
+    u64published += 1;
+    if (qos != QOS_AT_MOST_ONCE)
+    {
+      au64inflight_us[u16msg_id] = u64now;
+    }
+  }
+}
+
+static void print_latency(const char* name, histogram_t* psHist)
+{
+  printf("%-18s n=%llu min=%llu p50=%llu p90=%llu p99=%llu p999=%llu p9999=%llu max=%llu mean=%llu (usec)\n", name,
+         (unsigned long long)psHist->u64total,
+         (unsigned long long)((psHist->u64total != 0) ? psHist->u64min : 0),
+         (unsigned long long)histogram_percentile(psHist, 50.0),
+         (unsigned long long)histogram_percentile(psHist, 90.0),
+         (unsigned long long)histogram_percentile(psHist, 99.0),
+         (unsigned long long)histogram_percentile(psHist, 99.9),
+         (unsigned long long)histogram_percentile(psHist, 99.99),
+         (unsigned long long)psHist->u64max,
+         (unsigned long long)histogram_mean(psHist));
+}
+
+/* Percentile ladder in the layout of HdrHistogram's text output, halving the distance to 100% at each step */
+static void print_percentiles(const char* name, histogram_t* psHist)
+{
+  double pct = 0.0;
+  printf("\n%s\n%12s %14s %10s %14s\n", name, "Value(usec)", "Percentile", "TotalCount", "1/(1-Percentile)");
+  while (psHist->u64total != 0)
+  {
+    uint64_t u64rank = (uint64_t)((pct / 100.0) * psHist->u64total + 0.5);
+    printf("%12llu %14.12f %10llu", (unsigned long long)histogram_percentile(psHist, pct), pct / 100.0,
+           (unsigned long long)((u64rank == 0) ? 1 : u64rank));
+    if (pct < 100.0)
+    {
+      printf(" %14.2f\n", 1.0 / (1.0 - (pct / 100.0)));
+    }
+    else
+    {
+      printf("\n");
+      break;
+    }
+    pct = ((u64rank >= psHist->u64total) ? 100.0 : (pct + ((100.0 - pct) / 2)));
+  }
+}
+
+static void usage(const char* prog)
+{
+  fprintf(stderr, "usage: %s [-h host] [-p port] [-U unix socket path] [-t topic] [-r rate/s]\n"
+                  "          [-b payload bytes] [-q qos] [-d seconds] [-D drain msec] [-H] [-S]\n", prog);
+  exit(1);
+}
+
+static void inthandler(int dummy)
+{
+  (void)dummy;
+  stop = 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "h:p:U:t:r:b:q:d:D:HS")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h': host = optarg;                  break;
+      case 'p': port = atoi(optarg);            break;
+      case 'U': unix_path = optarg;             break;
+      case 't': topic = optarg;                 break;
+      case 'r': rate = atoi(optarg);            break;
+      case 'b': payload_size = atoi(optarg);    break;
+      case 'q': qos = atoi(optarg);             break;
+      case 'd': duration_s = atoi(optarg);      break;
+      case 'D': drain_ms = atoi(optarg);        break;
+      case 'H': print_distribution = 1;         break;
+      case 'S': spin = 1;                       break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (    (rate == 0)
+       || (rate > 1000000)
+       || (qos > QOS_EXACTLY_ONCE)
+       || (payload_size < PROBE_HDR_SIZE)
+       || (payload_size > BUFFER_SIZE_BYTES))
+  {
+    usage(argv[0]);
+  }
+
+  if (topic != 0)
+  {
+    u16topic_len = snprintf(actopic, sizeof(actopic), "%s", topic);
+  }
+  else
+  {
+    u16topic_len = snprintf(actopic, sizeof(actopic), "probe/%u", (unsigned)getpid());
+  }
+
+  /* publish k is due at start + k / rate, and the last one due before the end is k = rate * duration - 1 */
+  u64nseq = (uint64_t)rate * duration_s;
+  pu8seen = calloc((u64nseq / 8) + 1, 1);
+  pu8payload = calloc(1, payload_size);
+  pu8pkt = calloc(1, payload_size + 128);
+  if (    (pu8seen == 0)
+       || (pu8payload == 0)
+       || (pu8pkt == 0))
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  memset(pu8payload, 'x', payload_size);
+
+  histogram_init(&sAckLat);
+  histogram_init(&sDeliverLat);
+  reactor_init(&sReactor, apsSlots, NCLIENTS);
+  for (i = 0; i < NCLIENTS; ++i)
+  {
+    client_init(&asClnt[i], host, port, acrxbuf[i], sizeof(acrxbuf[i]));
+    if (unix_path != 0)
+    {
+      client_set_transport(&asClnt[i], &client_transport_unix, unix_path);
+    }
+    client_set_callback(&asClnt[i], CB_ON_CONNECTION, on_connect);
+    client_set_callback(&asClnt[i], CB_ON_DISCONNECT, on_disconnect);
+    client_set_callback(&asClnt[i], CB_RECEIVED_DATA, on_data);
+    client_set_keepalive(&asClnt[i], 30 * 1000000); /* PINGREQ well within the 60 sec keepalive */
+    reactor_add(&sReactor, &asClnt[i]);
+  }
+
+  signal(SIGINT, inthandler);
+
+  /* connect and subscribe before the clock starts */
+  uint64_t u64deadline = client_time_us() + 5000000;
+  while (    (!stop)
+          && (!(aready[PUB] && aready[SUB])))
+  {
+    if (client_time_us() > u64deadline)
+    {
+      fprintf(stderr, "no broker at %s\n", ((unix_path != 0) ? unix_path : host));
+      return 1;
+    }
+    reactor_poll(&sReactor, 10000);
+  }
+
+  uint64_t u64start = client_time_us();
+  uint64_t u64end = u64start + ((uint64_t)duration_s * 1000000);
+  uint64_t u64sched_us = u64start;       /* publish u64seq is due at u64sched_us + (u64seq - u64sched_seq) / rate */
+  uint64_t u64sched_seq = 0;
+  uint64_t u64next_pub = u64start;
+  uint64_t u64next_report = u64start + 1000000;
+  uint64_t u64last_published = 0, u64last_delivered = 0;
+  uint64_t u64seq = 0;
+
+  while (!stop)
+  {
+    uint64_t u64now = client_time_us();
+    if (u64now >= u64end)
+    {
+      break;
+    }
+    if (    (u64next_pub + 1000000) < u64now)
+    {
+      /* fell more than a second behind - skip those sequence numbers rather than burst */
+      u64sched_us = u64now;
+      u64sched_seq = u64seq;
+      u64next_pub = u64now;
+    }
+    while (    (u64next_pub <= u64now)
+            && (u64seq < u64nseq))
+    {
+      if (aready[PUB])
+      {
+        publish(u64seq, u64now);
+      }
+      u64seq += 1;
+      u64next_pub = u64sched_us + (((u64seq - u64sched_seq) * 1000000) / rate);
+    }
+
+    /*
+       The reactor sleeps in whole milliseconds, rounding shorter waits up: at rates above
+       1000/s publishes go out in small bursts of whatever has come due, the loop above
+       catches up. Deliveries still wake the reactor at once. Spinning paces exactly.
+    */
+    uint64_t u64wait = u64next_pub - u64now;
+    reactor_poll(&sReactor, ((spin && (u64wait < 1000)) ? 0 : (uint32_t)u64wait));
+
+    if (u64now >= u64next_report)
+    {
+      fprintf(stderr, "t=%llus pub/s=%llu recv/s=%llu\n",
+              (unsigned long long)((u64now - u64start) / 1000000),
+              (unsigned long long)(u64published - u64last_published),
+              (unsigned long long)(u64delivered - u64last_delivered));
+      u64last_published = u64published;
+      u64last_delivered = u64delivered;
+      u64next_report += 1000000;
+    }
+  }
+  double elapsed_s = (client_time_us() - u64start) / 1e6;
+
+  /* let the last deliveries and acks come in */
+  u64deadline = client_time_us() + ((uint64_t)drain_ms * 1000);
+  while (    (!stop)
+          && (    (u64unique < u64published)
+               || ((u64acked + u64unacked) < u64published && (qos != QOS_AT_MOST_ONCE)))
+          && (client_time_us() < u64deadline))
+  {
+    reactor_poll(&sReactor, 1000);
+  }
+  if (qos != QOS_AT_MOST_ONCE)
+  {
+    u64unacked = u64published - u64acked;
+  }
+
+  printf("topic=%s rate=%u/s payload=%u qos=%u duration=%.1fs\n", actopic, rate, payload_size, qos, elapsed_s);
+  printf("published=%llu delivered=%llu lost=%llu reordered=%llu duplicates=%llu unacked=%llu\n",
+         (unsigned long long)u64published, (unsigned long long)u64delivered,
+         (unsigned long long)((u64published > u64unique) ? (u64published - u64unique) : 0),
+         (unsigned long long)u64reordered, (unsigned long long)u64duplicates, (unsigned long long)u64unacked);
+  if (qos != QOS_AT_MOST_ONCE)
+  {
+    print_latency(((qos == QOS_AT_LEAST_ONCE) ? "publish->puback" : "publish->pubcomp"), &sAckLat);
+  }
+  print_latency("publish->deliver", &sDeliverLat);
+  if (print_distribution)
+  {
+    if (qos != QOS_AT_MOST_ONCE)
+    {
+      print_percentiles(((qos == QOS_AT_LEAST_ONCE) ? "publish->puback" : "publish->pubcomp"), &sAckLat);
+    }
+    print_percentiles("publish->deliver", &sDeliverLat);
+  }
+
+  finished = 1;
+  for (i = 0; i < NCLIENTS; ++i)
+  {
+    reactor_remove(&sReactor, &asClnt[i]);
+    client_disconnect(&asClnt[i]);
+  }
+  reactor_close(&sReactor);
+  free(pu8pkt);
+  free(pu8payload);
+  free(pu8seen);
+  return 0;
+}
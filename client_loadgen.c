@@ -0,0 +1,464 @@
+/*
+   Load generator: N simulated MQTT clients on one thread, driven by the epoll reactor
+   (or by io_uring with -u).
+
+   Publishers send timestamped payloads to "load/<n>" at a fixed rate, subscribers
+   subscribe to "load/#". At the end, throughput, connect rate and latency percentiles
+   (publish->PUBACK/PUBCOMP for QoS 1/2, publish->delivery for subscribers) are printed.
+
+   Compile and run against a local broker:
+
+     gcc -O2 client.c mqtt.c wheel.c ring.c reactor.c uring.c session.c histogram.c client_loadgen.c -o loadgen
+     ./loadgen -h 127.0.0.1 -p 1883 -n 1000 -s 10 -r 10 -b 64 -q 1 -d 30
+*/
+#include "client.h"
+#include "reactor.h"
+#include "uring.h"
+#include "session.h"
+#include "histogram.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+
+/* Per simulated client */
+typedef struct
+{
+  int      ready;          /* CONNACK received */
+  int      subscriber;
+  uint64_t u64next_pub_us;
+  uint64_t u64connect_start_us;
+  uint16_t u16topic_len;
+  char     actopic[24];
+  mqtt_publish_tmpl_t sTmpl; /* QoS 0 publishes go out through a prepared template */
+} sim_t;
+
+/* Configuration */
+static char*    host = "127.0.0.1";
+static char*    unix_path = 0;          /* connect over AF_UNIX instead of TCP */
+static uint16_t port = 1883;
+static uint32_t nclients = 100;
+static uint32_t nsubscribers = 1;
+static uint32_t rate = 1;               /* publishes per second per publisher */
+static uint32_t payload_size = 64;
+static uint8_t  qos = QOS_AT_MOST_ONCE;
+static uint32_t duration_s = 10;
+static uint32_t connect_rate = 0;       /* new connections per second, 0 = all at once */
+static uint32_t flush_delay_us = 0;     /* tx coalescing delay, 0 = flush every packet */
+static uint32_t window = 16;            /* QoS 1/2 in-flight window per client */
+static uint8_t  conn_flags = MQTT_CONNECT_CLEAN_SESSION;
+
+/* State, allocated once at startup */
+static client_t*  asClnt;
+static client_t** apsSlots;
+static sim_t*     asSim;
+static session_t* asSess;
+static char*      pcrxbufs;
+static char*      pctxbufs;
+static uint32_t   rxbufsz;
+static uint32_t   txbufsz;
+static uint8_t*   pu8payload;
+static reactor_t  sReactor;
+static uring_t    sUring;
+static int        use_uring = 0;
+static volatile int stop;
+
+/* Results */
+static uint64_t u64published, u64acked, u64delivered, u64window_full;
+static uint64_t u64connects, u64disconnects, u64connected_now;
+static uint64_t u64first_connect_us, u64all_connected_us;
+static histogram_t sAckLat, sDeliverLat, sConnectLat;
+
+
+static uint32_t idx_of(client_t* psClnt)
+{
+  return (uint32_t)(psClnt - asClnt);
+}
+
+static void on_connect(client_t* psClnt)
+{
+  uint32_t i = idx_of(psClnt);
+  uint8_t au8buf[64];
+  char acid[24];
+  int n = snprintf(acid, sizeof(acid), "lg%u-%u", (unsigned)getpid(), i);
+  int nbytes = mqtt_encode_connect_msg2(au8buf, conn_flags, 60, (uint8_t*)acid, n);
+  client_send(psClnt, (char*)au8buf, nbytes);
+}
+
+static void on_disconnect(client_t* psClnt)
+{
+  uint32_t i = idx_of(psClnt);
+  if (asSim[i].ready)
+  {
+    asSim[i].ready = 0;
+    u64disconnects += 1;
+    u64connected_now -= 1;
+  }
+  asSim[i].u64connect_start_us = client_time_us();
+}
+
+static void on_complete(session_t* psSess, uint16_t u16msg_id, void* pvctx, uint8_t u8reason)
+{
+  (void) psSess;
+  (void) u16msg_id;
+  (void) u8reason; /* MQTT 3.1.1: always acknowledged */
+  u64acked += 1;
+  histogram_record(&sAckLat, client_time_us() - (uint64_t)(uintptr_t)pvctx);
+}
+
+static void on_data(client_t* psClnt, char* data, int nbytes)
+{
+  uint32_t i = idx_of(psClnt);
+  uint8_t* pu8pkt = (uint8_t*)data;
+
+  if (session_handle_packet(&asSess[i], pu8pkt, nbytes))
+  {
+    return;
+  }
+
+  switch (pu8pkt[0] >> 4)
+  {
+    case CTRL_CONNACK:
+    {
+      uint8_t u8session_present;
+      if (mqtt_decode_connack_msg2(pu8pkt, nbytes, &u8session_present))
+      {
+        uint64_t u64now = client_time_us();
+        client_reset_backoff(psClnt);
+        asSim[i].ready = 1;
+        asSim[i].u64next_pub_us = u64now + (rand() % (1000000 / rate)); /* spread publishers out */
+        histogram_record(&sConnectLat, u64now - asSim[i].u64connect_start_us);
+        u64connects += 1;
+        u64connected_now += 1;
+        if (u64connected_now == nclients)
+        {
+          u64all_connected_us = u64now;
+        }
+        /* a resumed session still has its subscription */
+        if (    (session_connack(&asSess[i], u8session_present))
+             && (asSim[i].subscriber))
+        {
+          uint8_t au8buf[32];
+          int n = mqtt_encode_subscribe_msg(au8buf, (uint8_t*)"load/#", 6, qos, 1);
+          client_send(psClnt, (char*)au8buf, n);
+        }
+      }
+      else
+      {
+        fprintf(stderr, "client %u: connection refused\n", i);
+        client_disconnect(psClnt);
+      }
+    } break;
+
+    case CTRL_PUBLISH:
+    {
+      uint8_t u8qos;
+      uint16_t u16msg_id, u16topic_len;
+      uint8_t* pu8topic;
+      uint8_t* pu8data;
+      if (    (mqtt_decode_publish_msg(pu8pkt, nbytes, &u8qos, &u16msg_id, &u16topic_len, &pu8topic, &pu8data))
+           && ((&pu8pkt[nbytes] - pu8data) >= (int)sizeof(uint64_t)))
+      {
+        uint64_t u64sent_us;
+        memcpy(&u64sent_us, pu8data, sizeof(u64sent_us));
+        histogram_record(&sDeliverLat, client_time_us() - u64sent_us);
+        u64delivered += 1;
+      }
+    } break;
+  }
+}
+
+static void publish(uint32_t i, uint64_t u64now)
+{
+  /* payload starts with the monotonic send timestamp, same host so same clock */
+  memcpy(pu8payload, &u64now, sizeof(u64now));
+
+  if (qos == QOS_AT_MOST_ONCE)
+  {
+    mqtt_iov_t asIov[2];
+    uint32_t u32niov;
+    mqtt_encode_prepared_publish_iov(&asSim[i].sTmpl, asIov, &u32niov, 0, pu8payload, payload_size);
+    if (client_sendv(&asClnt[i], asIov, u32niov) > 0)
+    {
+      u64published += 1;
+    }
+  }
+  else
+  {
+    /* The session keeps a pointer to the payload for retransmits. The buffer is shared, so a
+       retransmitted message carries a later timestamp - ack latency is taken from pvctx instead */
+    if (session_publish(&asSess[i], (uint8_t*)asSim[i].actopic, asSim[i].u16topic_len, qos, pu8payload, payload_size, (void*)(uintptr_t)u64now) != 0)
+    {
+      u64published += 1;
+    }
+    else
+    {
+      u64window_full += 1;
+    }
+  }
+}
+
+static void print_latency(const char* name, histogram_t* psHist)
+{
+  printf("%-18s n=%llu min=%llu p50=%llu p99=%llu p999=%llu max=%llu mean=%llu (usec)\n", name,
+         (unsigned long long)psHist->u64total,
+         (unsigned long long)((psHist->u64total != 0) ? psHist->u64min : 0),
+         (unsigned long long)histogram_percentile(psHist, 50.0),
+         (unsigned long long)histogram_percentile(psHist, 99.0),
+         (unsigned long long)histogram_percentile(psHist, 99.9),
+         (unsigned long long)psHist->u64max,
+         (unsigned long long)histogram_mean(psHist));
+}
+
+/* Event loop: epoll reactor or io_uring */
+static void driver_init(void)
+{
+  if (use_uring)
+  {
+    uring_init(&sUring, apsSlots, nclients);
+  }
+  else
+  {
+    reactor_init(&sReactor, apsSlots, nclients);
+  }
+}
+
+static void driver_add(client_t* psClnt)
+{
+  if (use_uring)
+  {
+    uring_add(&sUring, psClnt);
+  }
+  else
+  {
+    reactor_add(&sReactor, psClnt);
+  }
+}
+
+static void driver_poll(uint32_t timeout_us)
+{
+  if (use_uring)
+  {
+    uring_poll(&sUring, timeout_us);
+  }
+  else
+  {
+    reactor_poll(&sReactor, timeout_us);
+  }
+}
+
+static void driver_close(void)
+{
+  if (use_uring)
+  {
+    printf("io_uring: %s, io_uring_enter=%llu completions=%llu\n", ((sUring.fd >= 0) ? "active" : "fell back to epoll"),
+           (unsigned long long)sUring.u64enters, (unsigned long long)sUring.u64completions);
+    uring_close(&sUring);
+  }
+  else
+  {
+    reactor_close(&sReactor);
+  }
+}
+
+static void usage(const char* prog)
+{
+  fprintf(stderr, "usage: %s [-h host] [-p port] [-n clients] [-s subscribers] [-r rate/s/client]\n"
+                  "          [-b payload bytes] [-q qos] [-d seconds] [-c connects/s] [-w flush delay usec] [-W window] [-u] [-k]\n"
+                  "          [-U unix socket path]\n", prog);
+  exit(1);
+}
+
+static void inthandler(int dummy)
+{
+  (void)dummy;
+  stop = 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+  int opt;
+  uint32_t i;
+
+  while ((opt = getopt(argc, argv, "h:p:n:s:r:b:q:d:c:w:W:ukU:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h': host = optarg;                  break;
+      case 'p': port = atoi(optarg);            break;
+      case 'n': nclients = atoi(optarg);        break;
+      case 's': nsubscribers = atoi(optarg);    break;
+      case 'r': rate = atoi(optarg);            break;
+      case 'b': payload_size = atoi(optarg);    break;
+      case 'q': qos = atoi(optarg);             break;
+      case 'd': duration_s = atoi(optarg);      break;
+      case 'c': connect_rate = atoi(optarg);    break;
+      case 'w': flush_delay_us = atoi(optarg);  break;
+      case 'W': window = atoi(optarg);          break;
+      case 'u': use_uring = 1;                  break;
+      case 'k': conn_flags = 0;                 break;
+      case 'U': unix_path = optarg;             break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (    (nclients == 0)
+       || (rate == 0)
+       || (rate > 1000000)
+       || (qos > QOS_EXACTLY_ONCE)
+       || (nsubscribers > nclients)
+       || (payload_size < sizeof(uint64_t)))
+  {
+    usage(argv[0]);
+  }
+
+  rxbufsz = ((payload_size + 256) > BUFFER_SIZE_BYTES) ? (payload_size + 256) : BUFFER_SIZE_BYTES;
+  txbufsz = rxbufsz * 4;
+  asClnt     = calloc(nclients, sizeof(client_t));
+  apsSlots   = calloc(nclients, sizeof(client_t*));
+  asSim      = calloc(nclients, sizeof(sim_t));
+  asSess     = calloc(nclients, sizeof(session_t));
+  pcrxbufs   = calloc(nclients, rxbufsz);
+  pctxbufs   = calloc(nclients, txbufsz);
+  pu8payload = calloc(1, payload_size);
+  if (    (asClnt == 0) || (apsSlots == 0) || (asSim == 0) || (asSess == 0)
+       || (pcrxbufs == 0) || (pctxbufs == 0) || (pu8payload == 0))
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  memset(pu8payload, 'x', payload_size);
+
+  histogram_init(&sAckLat);
+  histogram_init(&sDeliverLat);
+  histogram_init(&sConnectLat);
+  driver_init();
+
+  for (i = 0; i < nclients; ++i)
+  {
+    client_init(&asClnt[i], host, port, &pcrxbufs[i * rxbufsz], rxbufsz);
+    if (unix_path != 0)
+    {
+      client_set_transport(&asClnt[i], &client_transport_unix, unix_path);
+    }
+    client_set_callback(&asClnt[i], CB_ON_CONNECTION, on_connect);
+    client_set_callback(&asClnt[i], CB_ON_DISCONNECT, on_disconnect);
+    client_set_callback(&asClnt[i], CB_RECEIVED_DATA, on_data);
+    client_set_batching(&asClnt[i], &pctxbufs[i * txbufsz], txbufsz, 0, ((flush_delay_us == 0) ? 1 : 0), flush_delay_us, 0);
+    client_set_keepalive(&asClnt[i], 30 * 1000000); /* PINGREQ well within the 60 sec keepalive */
+    session_init(&asSess[i], &asClnt[i], window);
+    session_set_callback(&asSess[i], on_complete);
+    asSim[i].subscriber = (i < nsubscribers);
+    asSim[i].u16topic_len = snprintf(asSim[i].actopic, sizeof(asSim[i].actopic), "load/%u", i);
+    mqtt_prepare_publish(&asSim[i].sTmpl, (uint8_t*)asSim[i].actopic, asSim[i].u16topic_len, qos);
+  }
+
+  signal(SIGINT, inthandler);
+
+  uint64_t u64start = client_time_us();
+  uint64_t u64end = u64start + ((uint64_t)duration_s * 1000000);
+  uint64_t u64next_report = u64start + 1000000;
+  uint64_t u64interval = 1000000 / rate;
+  uint64_t u64last_published = 0, u64last_delivered = 0;
+  uint32_t nadded = 0;
+  u64first_connect_us = u64start;
+
+  while (    (!stop)
+          && (client_time_us() < u64end))
+  {
+    uint64_t u64now = client_time_us();
+
+    /* ramp up connections */
+    uint32_t u32target = ((connect_rate == 0) ? nclients : (uint32_t)(((u64now - u64start) * connect_rate) / 1000000) + 1);
+    while (    (nadded < nclients)
+            && (nadded < u32target))
+    {
+      asSim[nadded].u64connect_start_us = u64now;
+      driver_add(&asClnt[nadded++]);
+    }
+
+    driver_poll(1000);
+
+    u64now = client_time_us();
+    for (i = nsubscribers; i < nadded; ++i)
+    {
+      if (    (asSim[i].ready)
+           && (asSim[i].u64next_pub_us <= u64now))
+      {
+        publish(i, u64now);
+        asSim[i].u64next_pub_us += u64interval;
+        if (asSim[i].u64next_pub_us + 1000000 < u64now)
+        {
+          asSim[i].u64next_pub_us = u64now + u64interval; /* fell more than a second behind, don't burst */
+        }
+      }
+      session_poll(&asSess[i]);
+    }
+
+    if (u64now >= u64next_report)
+    {
+      fprintf(stderr, "t=%llus connected=%llu pub/s=%llu recv/s=%llu\n",
+              (unsigned long long)((u64now - u64start) / 1000000),
+              (unsigned long long)u64connected_now,
+              (unsigned long long)(u64published - u64last_published),
+              (unsigned long long)(u64delivered - u64last_delivered));
+      u64last_published = u64published;
+      u64last_delivered = u64delivered;
+      u64next_report += 1000000;
+    }
+  }
+
+  double elapsed_s = (client_time_us() - u64start) / 1e6;
+  printf("clients=%u subscribers=%u rate=%u/s payload=%u qos=%u duration=%.1fs\n", nclients, nsubscribers, rate, payload_size, qos, elapsed_s);
+  printf("connects=%llu disconnects=%llu", (unsigned long long)u64connects, (unsigned long long)u64disconnects);
+  if (u64all_connected_us != 0)
+  {
+    double ramp_s = (u64all_connected_us - u64first_connect_us) / 1e6;
+    printf(" all-connected-after=%.3fs connect-rate=%.0f/s", ramp_s, nclients / ((ramp_s > 0) ? ramp_s : 1e-6));
+  }
+  printf("\n");
+  printf("published=%llu (%.0f/s) acked=%llu delivered=%llu (%.0f/s) window-full=%llu\n",
+         (unsigned long long)u64published, u64published / elapsed_s,
+         (unsigned long long)u64acked,
+         (unsigned long long)u64delivered, u64delivered / elapsed_s,
+         (unsigned long long)u64window_full);
+  print_latency("connect", &sConnectLat);
+  print_latency("publish->ack", &sAckLat);
+  print_latency("publish->deliver", &sDeliverLat);
+#if (CLIENT_STATS == 1)
+  {
+    client_stats_t sStats;
+    uint64_t u64syscalls = 0, u64partial = 0, u64reconnects = 0;
+    histogram_t sSendLat;
+    histogram_init(&sSendLat);
+    for (i = 0; i < nadded; ++i)
+    {
+      client_stats_snapshot(&asClnt[i], &sStats);
+      u64syscalls += sStats.u64syscalls;
+      u64partial += sStats.u64partial_writes;
+      u64reconnects += sStats.u64reconnects;
+      histogram_merge(&sSendLat, &sStats.sSendLat);
+    }
+    printf("syscalls=%llu partial-writes=%llu reconnects=%llu\n", (unsigned long long)u64syscalls, (unsigned long long)u64partial, (unsigned long long)u64reconnects);
+    printf("send syscall (nsec) p50=%llu p99=%llu p999=%llu\n", (unsigned long long)histogram_percentile(&sSendLat, 50.0),
+           (unsigned long long)histogram_percentile(&sSendLat, 99.0), (unsigned long long)histogram_percentile(&sSendLat, 99.9));
+  }
+#endif
+
+  driver_close();
+  for (i = 0; i < nadded; ++i)
+  {
+    if (client_state(&asClnt[i]) == CONNECTED)
+    {
+      uint8_t au8buf[4];
+      int nbytes = mqtt_encode_disconnect_msg(au8buf);
+      client_send(&asClnt[i], (char*)au8buf, nbytes);
+      client_flush(&asClnt[i]);
+    }
+  }
+
+  return 0;
+}
@@ -1,13 +1,16 @@
 #include "client.h"
+#include "reactor.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
-#include "mqtt.h"
 
 int keepalive_sec = 4;
 client_t c;
+reactor_t r;
+client_t* slots[1];
+wheel_timer_t pub_timer;
 char buffer[BUFFER_SIZE_BYTES];
 uint8_t buf[128];
 int nbytes;
@@ -40,25 +43,37 @@ static void got_data(client_t* psClnt, unsigned char* data, int nbytes)
 
   printf("CLNT%d: got %d bytes (", psClnt->sockfd, nbytes);
 
-  uint8_t ctrl = data[0] >> 4;
-  if (ctrl == CTRL_CONNACK)  { printf("CONNACK"); }
-  if (ctrl == CTRL_PINGRESP) { printf("PINGRESP"); }
-  if (ctrl == CTRL_PUBACK)   { printf("PUBACK"); }
-  if (ctrl == CTRL_SUBACK)   { printf("SUBACK"); }
-  if (ctrl == CTRL_PUBLISH)
+  mqtt_view_t view;
+  if (mqtt_decode_view(data, nbytes, &view) > 0)
   {
-    uint8_t qos;
+    mqtt_publish_view_t pub;
+    mqtt_suback_view_t suback;
+    mqtt_connack_view_t connack;
     uint16_t msg_id;
-    uint16_t topic_len;
-    uint8_t* topic;
-    uint8_t* payload = 0;
-    
-    printf("PUBLISH");
 
-    if (mqtt_decode_publish_msg(data, nbytes, &qos, &msg_id, &topic_len, &topic, &payload))
+    if (mqtt_view_connack(&view, &connack))
     {
-      int msg_len = (int)(nbytes-2)-(int)(data-payload);
-      printf(" topic='%.*s', msg='%.*s'", (int)topic_len, topic, msg_len, payload);
+      printf("CONNACK rc=%u sp=%u", connack.u8return_code, connack.u8session_present);
+      if (connack.u8return_code == 0)
+      {
+        client_reset_backoff(psClnt);
+        if (is_subscriber)
+        {
+          uint8_t buf2[64];
+          int n = mqtt_encode_subscribe_msg(buf2, (uint8_t*)"a/b", 3, 1, 12345);
+          client_send(psClnt, (char*)buf2, n);
+        }
+      }
+    }
+    if (view.u8type == CTRL_PINGRESP) { printf("PINGRESP"); }
+    if (mqtt_view_ack(&view, &msg_id)) { printf("ACK %u", msg_id); }
+    if (mqtt_view_suback(&view, &suback))
+    {
+      printf("SUBACK %u, %u filter(s)", suback.u16msg_id, suback.u32ncodes);
+    }
+    if (mqtt_view_publish(&view, &pub))
+    {
+      printf("PUBLISH topic='%.*s', msg='%.*s'", (int)pub.u16topic_len, pub.pu8topic, (int)pub.u32payload_len, pub.pu8payload);
     }
   }
   printf(") '");
@@ -78,6 +93,18 @@ static void got_data(client_t* psClnt, unsigned char* data, int nbytes)
   printf("'\n");
 }
 
+static void publish_tick(wheel_timer_t* psTimer, uint64_t u64now)
+{
+  if (client_state(&c) == CONNECTED)
+  {
+    mqtt_iov_t iov[4];
+    uint32_t niov;
+    mqtt_encode_publish_iov(buf, iov, &niov, (uint8_t*)"a/b", 3, 1, 10, (uint8_t*)"hi mom!", 7);
+    client_sendv(&c, iov, niov);
+  }
+  wheel_add(&r.sWheel, psTimer, u64now + 10000000);
+}
+
 void inthandler(int dummy)
 {
   (void)dummy;
@@ -101,59 +128,38 @@ int main(int argc, char* argv[])
   (void) argv;
   is_subscriber = (argc == 1);
   printf("client, %s\n", (is_subscriber ? "subscriber" : "publisher"));
+#if (CLIENT_LOG == 1)
+  client_log_level = CLIENT_LOG_DEBUG; /* show every send */
+#endif
 
   client_init(&c, "test.mosquitto.org", 1883, buffer, BUFFER_SIZE_BYTES);
   //client_init(&c, "mqtt.fluux.io", 1883, buffer, BUFFER_SIZE_BYTES);
 
-  assert(client_set_callback(&c, CB_RECEIVED_DATA, got_data)        == 1);
-  assert(client_set_callback(&c, CB_ON_CONNECTION, got_connection)  == 1);
-  assert(client_set_callback(&c, CB_ON_DISCONNECT, lost_connection) == 1);
+  int success = client_set_callback(&c, CB_RECEIVED_DATA, got_data);
+  success &= client_set_callback(&c, CB_ON_CONNECTION, got_connection);
+  success &= client_set_callback(&c, CB_ON_DISCONNECT, lost_connection);
+  assert(success == 1);
 
   signal(SIGINT, inthandler);
 
-  const time_t ping_interval = (keepalive_sec - 1);
-  int subscribed = 0;
-  time_t next_pub = time(0) + 10;
-  time_t next_ping = time(0) + ping_interval;
+  /* the reactor sleeps until something happens: data, a PINGREQ due (keepalive), a reconnect or the next publish */
+  client_set_keepalive(&c, (keepalive_sec - 1) * 1000000);
+  if (    (reactor_init(&r, slots, 1) != 1)
+       || (reactor_add(&r, &c) != 1))
+  {
+    fprintf(stderr, "could not set up the reactor\n");
+    return 1;
+  }
+  if (!is_subscriber)
+  {
+    wheel_timer_init(&pub_timer, publish_tick, 0);
+    wheel_add(&r.sWheel, &pub_timer, client_time_us() + 10000000);
+  }
 
-  char buf2[1024];
-  int nbytes;
   while (1)
   {
-    client_poll(&c, 0);
-
-    if (is_subscriber && !subscribed && ((time(0) - c.last_active) >= 2))
-    {
-      nbytes = mqtt_encode_subscribe_msg((uint8_t*)buf2, (uint8_t*)"a/b", 3, 1, 12345);
-      client_send(&c, buf2, nbytes);
-      subscribed = 1;
-      client_poll(&c, 0);
-    }
-
-    if ((time(0) ) >= next_ping)
-    {
-      nbytes = mqtt_encode_ping_msg(buf);
-      if (nbytes != 0)
-      {
-        printf("ping!\n");
-        client_send(&c, (char*)buf, nbytes);
-        client_poll(&c, 0);
-        next_ping = time(0) + ping_interval;
-      }
-    }
-
-    if ((time(0) > next_pub) && !is_subscriber)
-    {
-      nbytes = mqtt_encode_publish_msg((uint8_t*)buf2, (uint8_t*)"a/b", 3, 1, 10, (uint8_t*)"hi mom!", 7);
-      client_send(&c, buf2, nbytes);
-      next_pub = time(0) + 10;
-      client_poll(&c, 1000000);
-    }
-
-    usleep(1000);
+    reactor_poll(&r, 60000000);
   }
 
   return 0;
 }
-
-
@@ -0,0 +1,225 @@
+#include "histogram.h"
+
+#include <string.h>
+
+
+/* Helper functions: */
+static uint32_t _bucket(uint64_t u64value)
+{
+  if (u64value < (1u << HIST_SUB_BITS))
+  {
+    return (uint32_t)u64value;
+  }
+  uint32_t u32msb = 63 - __builtin_clzll(u64value);
+  uint32_t u32exp = u32msb - HIST_SUB_BITS + 1;
+  uint32_t u32sub = (uint32_t)(u64value >> (u32msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+  return (u32exp << HIST_SUB_BITS) | u32sub;
+}
+
+/* Highest value that maps to bucket u32idx */
+static uint64_t _bucket_max(uint32_t u32idx)
+{
+  uint32_t u32exp = u32idx >> HIST_SUB_BITS;
+  uint64_t u64sub = u32idx & ((1u << HIST_SUB_BITS) - 1);
+  if (u32exp == 0)
+  {
+    return u64sub;
+  }
+  uint64_t u64low = ((1ull << HIST_SUB_BITS) | u64sub) << (u32exp - 1);
+  return u64low + ((1ull << (u32exp - 1)) - 1);
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+void histogram_init(histogram_t* psHist)
+{
+  memset(psHist, 0, sizeof(histogram_t));
+  psHist->u64min = UINT64_MAX;
+}
+
+void histogram_record(histogram_t* psHist, uint64_t u64value)
+{
+  psHist->au64count[_bucket(u64value)] += 1;
+  psHist->u64total += 1;
+  psHist->u64sum += u64value;
+  if (u64value < psHist->u64min)
+  {
+    psHist->u64min = u64value;
+  }
+  if (u64value > psHist->u64max)
+  {
+    psHist->u64max = u64value;
+  }
+}
+
+void histogram_record_atomic(histogram_t* psHist, uint64_t u64value)
+{
+  __atomic_fetch_add(&psHist->au64count[_bucket(u64value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&psHist->u64total, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&psHist->u64sum, u64value, __ATOMIC_RELAXED);
+
+  uint64_t u64cur = __atomic_load_n(&psHist->u64min, __ATOMIC_RELAXED);
+  while (    (u64value < u64cur)
+          && (!__atomic_compare_exchange_n(&psHist->u64min, &u64cur, u64value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+  {
+  }
+  u64cur = __atomic_load_n(&psHist->u64max, __ATOMIC_RELAXED);
+  while (    (u64value > u64cur)
+          && (!__atomic_compare_exchange_n(&psHist->u64max, &u64cur, u64value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+  {
+  }
+}
+
+void histogram_merge(histogram_t* psDst, histogram_t* psSrc)
+{
+  uint32_t i;
+  for (i = 0; i < HIST_NBUCKETS; ++i)
+  {
+    psDst->au64count[i] += psSrc->au64count[i];
+  }
+  psDst->u64total += psSrc->u64total;
+  psDst->u64sum += psSrc->u64sum;
+  if (psSrc->u64min < psDst->u64min)
+  {
+    psDst->u64min = psSrc->u64min;
+  }
+  if (psSrc->u64max > psDst->u64max)
+  {
+    psDst->u64max = psSrc->u64max;
+  }
+}
+
+uint64_t histogram_percentile(histogram_t* psHist, double pct)
+{
+  if (psHist->u64total == 0)
+  {
+    return 0;
+  }
+
+  uint64_t u64rank = (uint64_t)((pct / 100.0) * psHist->u64total + 0.5);
+  u64rank = ((u64rank == 0) ? 1 : u64rank);
+
+  uint64_t u64seen = 0;
+  uint32_t i;
+  for (i = 0; i < HIST_NBUCKETS; ++i)
+  {
+    u64seen += psHist->au64count[i];
+    if (u64seen >= u64rank)
+    {
+      uint64_t u64val = _bucket_max(i);
+      return ((u64val > psHist->u64max) ? psHist->u64max : u64val);
+    }
+  }
+  return psHist->u64max;
+}
+
+uint64_t histogram_mean(histogram_t* psHist)
+{
+  return ((psHist->u64total != 0) ? (psHist->u64sum / psHist->u64total) : 0);
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 histogram.c -o histogram_test && ./histogram_test - exits with 1 if a check fails */
+#include <stdio.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+/* v lands in a bucket whose range holds it, tightly, and no wider than v / 2^HIST_SUB_BITS */
+static void _check_value(uint64_t u64value)
+{
+  uint32_t u32idx = _bucket(u64value);
+  check(u32idx < HIST_NBUCKETS);
+  check(_bucket_max(u32idx) >= u64value);
+  check(    (u32idx == 0)
+         || (_bucket_max(u32idx - 1) < u64value));
+  check((_bucket_max(u32idx) - u64value) <= (u64value >> HIST_SUB_BITS));
+}
+
+static void test_buckets(void)
+{
+  uint64_t u64value;
+  uint32_t u32shift;
+
+  /* the exact range, and across its end */
+  for (u64value = 0; u64value < 4096; ++u64value)
+  {
+    _check_value(u64value);
+    check(    (u64value == 0)
+           || (_bucket(u64value) >= _bucket(u64value - 1)));
+  }
+  for (u64value = 0; u64value < (1u << HIST_SUB_BITS); ++u64value)
+  {
+    check((_bucket(u64value) == u64value) && (_bucket_max(u64value) == u64value));
+  }
+
+  /* either side of every power of two, up to the largest value */
+  for (u32shift = HIST_SUB_BITS; u32shift < 64; ++u32shift)
+  {
+    uint64_t u64pow = (1ULL << u32shift);
+    _check_value(u64pow - 1);
+    _check_value(u64pow);
+    _check_value(u64pow + 1);
+    check(_bucket(u64pow) == (_bucket(u64pow - 1) + 1));
+  }
+  check(_bucket(UINT64_MAX) == (HIST_NBUCKETS - 1));
+  check(_bucket_max(HIST_NBUCKETS - 1) == UINT64_MAX);
+}
+
+static void test_stats(void)
+{
+  histogram_t sHist, sHalf1, sHalf2;
+  uint64_t u64value;
+
+  histogram_init(&sHist);
+  check(histogram_percentile(&sHist, 50.0) == 0);
+  check(histogram_mean(&sHist) == 0);
+
+  histogram_init(&sHalf1);
+  histogram_init(&sHalf2);
+  for (u64value = 1; u64value <= 1000; ++u64value)
+  {
+    histogram_record(&sHist, u64value);
+    if (u64value <= 500)
+    {
+      histogram_record(&sHalf1, u64value);
+    }
+    else
+    {
+      histogram_record_atomic(&sHalf2, u64value);
+    }
+  }
+  check((sHist.u64total == 1000) && (sHist.u64min == 1) && (sHist.u64max == 1000));
+  check(histogram_mean(&sHist) == 500);
+  check(histogram_percentile(&sHist, 0.0) == 1);
+  check(histogram_percentile(&sHist, 100.0) == 1000);      /* clamped to the largest value seen */
+  uint64_t u64p50 = histogram_percentile(&sHist, 50.0);
+  check((u64p50 >= 500) && (u64p50 <= (500 + (500 >> HIST_SUB_BITS))));
+  uint64_t u64p99 = histogram_percentile(&sHist, 99.0);
+  check((u64p99 >= 990) && (u64p99 <= 1000));
+
+  histogram_merge(&sHalf1, &sHalf2);
+  check(memcmp(&sHalf1, &sHist, sizeof(histogram_t)) == 0);
+}
+
+
+int main(void)
+{
+  test_buckets();
+  test_stats();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
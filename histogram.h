@@ -0,0 +1,36 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+   Log-linear histogram: values below 2^HIST_SUB_BITS get a bucket each,
+   above that every power of two is split into 2^HIST_SUB_BITS buckets.
+   Relative error of a recorded value is at most 2^-HIST_SUB_BITS.
+*/
+#ifndef HIST_SUB_BITS
+ #define HIST_SUB_BITS  4
+#endif
+#define HIST_NBUCKETS   ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+
+typedef struct
+{
+  uint64_t au64count[HIST_NBUCKETS];
+  uint64_t u64total;
+  uint64_t u64sum;
+  uint64_t u64min;
+  uint64_t u64max;
+} histogram_t;
+
+
+void     histogram_init(histogram_t* psHist);
+void     histogram_record(histogram_t* psHist, uint64_t u64value);
+/* Same as histogram_record, but safe against concurrent readers and writers (relaxed atomics) */
+void     histogram_record_atomic(histogram_t* psHist, uint64_t u64value);
+void     histogram_merge(histogram_t* psDst, histogram_t* psSrc);
+/* Value at or below which pct percent of the recorded values fall, e.g. pct = 99.9 */
+uint64_t histogram_percentile(histogram_t* psHist, double pct);
+uint64_t histogram_mean(histogram_t* psHist);
+
+#endif /* _HISTOGRAM_H_ */
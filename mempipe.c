@@ -0,0 +1,609 @@
+#include "mempipe.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define require(predicate)         assert((predicate))
+
+
+/* Helper functions: */
+
+static void _lock(mempipe_t* psPipe)
+{
+  while (__atomic_test_and_set(&psPipe->lock, __ATOMIC_ACQUIRE))
+  {
+  }
+}
+
+static void _unlock(mempipe_t* psPipe)
+{
+  __atomic_clear(&psPipe->lock, __ATOMIC_RELEASE);
+}
+
+static void _wake(int fd)
+{
+  uint64_t u64one = 1;
+  if (write(fd, &u64one, sizeof(u64one)) < 0)
+  {
+    require(errno == EAGAIN);
+  }
+}
+
+/* Make an end's eventfd readable - the client's may be closed by its own thread any time */
+static void _signal(mempipe_t* psPipe, int end)
+{
+  if (end == MEMPIPE_SERVER)
+  {
+    _wake(psPipe->aefd[MEMPIPE_SERVER]);
+  }
+  else
+  {
+    _lock(psPipe);
+    if (psPipe->aefd[MEMPIPE_CLIENT] >= 0)
+    {
+      _wake(psPipe->aefd[MEMPIPE_CLIENT]);
+    }
+    _unlock(psPipe);
+  }
+}
+
+static uint32_t _room(mempipe_buf_t* psBuf, uint32_t u32tail)
+{
+  return psBuf->u32mask + 1 - (u32tail - __atomic_load_n(&psBuf->u32head, __ATOMIC_ACQUIRE));
+}
+
+static ssize_t _read(mempipe_t* psPipe, int end, int fd, void* pvbuf, size_t nbytes)
+{
+  mempipe_buf_t* psBuf = &psPipe->asBuf[end];
+  uint32_t u32head = psBuf->u32head;
+  uint32_t u32avail = __atomic_load_n(&psBuf->u32tail, __ATOMIC_ACQUIRE) - u32head;
+
+  if (u32avail == 0)
+  {
+    /* clear stale wakeups, announce the wait, then look once more: a writer either sees the flag or we see its data */
+    uint64_t u64count;
+    if (read(fd, &u64count, sizeof(u64count)) < 0)
+    {
+      require(errno == EAGAIN);
+    }
+    __atomic_store_n(&psBuf->u32waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u32avail = __atomic_load_n(&psBuf->u32tail, __ATOMIC_ACQUIRE) - u32head;
+    if (u32avail == 0)
+    {
+      if (__atomic_load_n(&psPipe->au32closed[end ^ 1], __ATOMIC_ACQUIRE))
+      {
+        return 0;
+      }
+      errno = EAGAIN;
+      return -1;
+    }
+    __atomic_store_n(&psBuf->u32waiting, 0, __ATOMIC_RELAXED);
+  }
+
+  uint32_t u32count = ((nbytes < u32avail) ? (uint32_t)nbytes : u32avail);
+  uint32_t u32ofs = u32head & psBuf->u32mask;
+  uint32_t u32first = psBuf->u32mask + 1 - u32ofs;
+  if (u32first > u32count)
+  {
+    u32first = u32count;
+  }
+  memcpy(pvbuf, &psBuf->pu8buf[u32ofs], u32first);
+  memcpy((uint8_t*)pvbuf + u32first, psBuf->pu8buf, u32count - u32first);
+  __atomic_store_n(&psBuf->u32head, u32head + u32count, __ATOMIC_RELEASE);
+
+  /* pairs with the fence in _writev(): a blocked writer either sees the room or gets signalled */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (    (__atomic_load_n(&psBuf->u32blocked, __ATOMIC_RELAXED) != 0)
+       && (_room(psBuf, __atomic_load_n(&psBuf->u32tail, __ATOMIC_ACQUIRE)) >= ((psBuf->u32mask + 1) / 2))
+       && (__atomic_exchange_n(&psBuf->u32blocked, 0, __ATOMIC_ACQ_REL) != 0))
+  {
+    _signal(psPipe, end ^ 1);
+  }
+
+  if (u32count < u32avail)
+  {
+    /* more to come: pollers must see the descriptor readable, like a socket with data left */
+    _wake(fd);
+  }
+  return u32count;
+}
+
+static ssize_t _writev(mempipe_t* psPipe, int end, const struct iovec* asIov, int niov)
+{
+  int peer = end ^ 1;
+  mempipe_buf_t* psBuf = &psPipe->asBuf[peer];
+
+  if (__atomic_load_n(&psPipe->au32closed[peer], __ATOMIC_ACQUIRE))
+  {
+    errno = EPIPE;
+    return -1;
+  }
+
+  uint32_t u32tail = psBuf->u32tail;
+  uint32_t u32free = _room(psBuf, u32tail);
+  uint32_t u32count = 0;
+  size_t total = 0;
+  int i;
+  for (i = 0; (i < niov) && (u32count < u32free); ++i)
+  {
+    const uint8_t* pu8src = asIov[i].iov_base;
+    uint32_t u32len = u32free - u32count;
+    if (asIov[i].iov_len < u32len)
+    {
+      u32len = (uint32_t)asIov[i].iov_len;
+    }
+    uint32_t u32ofs = (u32tail + u32count) & psBuf->u32mask;
+    uint32_t u32first = psBuf->u32mask + 1 - u32ofs;
+    if (u32first > u32len)
+    {
+      u32first = u32len;
+    }
+    memcpy(&psBuf->pu8buf[u32ofs], pu8src, u32first);
+    memcpy(psBuf->pu8buf, pu8src + u32first, u32len - u32first);
+    u32count += u32len;
+  }
+  for (i = 0; i < niov; ++i)
+  {
+    total += asIov[i].iov_len;
+  }
+
+  if (u32count != 0)
+  {
+    __atomic_store_n(&psBuf->u32tail, u32tail + u32count, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in _read() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (    (__atomic_load_n(&psBuf->u32waiting, __ATOMIC_RELAXED) != 0)
+         && (__atomic_exchange_n(&psBuf->u32waiting, 0, __ATOMIC_ACQ_REL) != 0))
+    {
+      _signal(psPipe, peer);
+    }
+  }
+
+  if (u32count < total)
+  {
+    /*
+       Short write: clear a stale wakeup so a poller sleeps until there's room, ask the
+       reader for one, then look once more in case it drained before seeing the flag.
+       Our descriptor stays readable while there's input we haven't seen - the caller
+       owns it, nobody closes it under us.
+    */
+    int fd = psPipe->aefd[end];
+    uint64_t u64count;
+    if (read(fd, &u64count, sizeof(u64count)) < 0)
+    {
+      require(errno == EAGAIN);
+    }
+    u32tail += u32count;
+    __atomic_store_n(&psBuf->u32blocked, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (    (    (_room(psBuf, u32tail) >= ((psBuf->u32mask + 1) / 2))
+              && (__atomic_exchange_n(&psBuf->u32blocked, 0, __ATOMIC_ACQ_REL) != 0))
+         || (__atomic_load_n(&psPipe->asBuf[end].u32waiting, __ATOMIC_RELAXED) == 0)
+         || (__atomic_load_n(&psPipe->au32closed[peer], __ATOMIC_ACQUIRE)))
+    {
+      _wake(fd);
+    }
+  }
+
+  if (    (u32count == 0)
+       && (total != 0))
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  return u32count;
+}
+
+
+/* The client's side, as a transport: */
+
+static uint32_t _transport_resolve(void* pvClnt)
+{
+  client_t* psClnt = pvClnt;
+  return ((psClnt->pvtransport != 0) ? 1 : 0);
+}
+
+/* Every connection gets its own eventfd, so closing it takes it out of any epoll set like a socket */
+static int _transport_connect(void* pvClnt, uint32_t u32idx, int* pconnected)
+{
+  (void) u32idx;
+  client_t* psClnt = pvClnt;
+  mempipe_t* psPipe = psClnt->pvtransport;
+
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0)
+  {
+    client_log(CLIENT_LOG_ERROR, "eventfd: %s\n", strerror(errno));
+    return -1;
+  }
+
+  _lock(psPipe);
+  if (psPipe->u32busy)
+  {
+    _unlock(psPipe);
+    close(fd);
+    client_log(CLIENT_LOG_ERROR, "CLNT%d: connect: %s\n", fd, strerror(ECONNREFUSED));
+    return -1;
+  }
+  psPipe->u32busy = 1;
+  psPipe->u32conns += 1;
+  psPipe->aefd[MEMPIPE_CLIENT] = fd;
+  __atomic_store_n(&psPipe->asBuf[MEMPIPE_CLIENT].u32waiting, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&psPipe->asBuf[MEMPIPE_SERVER].u32blocked, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&psPipe->au32closed[MEMPIPE_CLIENT], 0, __ATOMIC_RELEASE);
+  _unlock(psPipe);
+
+  _signal(psPipe, MEMPIPE_SERVER);
+  *pconnected = 1;
+  return fd;
+}
+
+static int _transport_connect_error(void* pvClnt, int fd)
+{
+  (void) pvClnt;
+  (void) fd;
+  return 0;
+}
+
+static ssize_t _transport_read(void* pvClnt, int fd, void* pvbuf, size_t nbytes)
+{
+  client_t* psClnt = pvClnt;
+  return _read(psClnt->pvtransport, MEMPIPE_CLIENT, fd, pvbuf, nbytes);
+}
+
+static ssize_t _transport_writev(void* pvClnt, int fd, struct iovec* asIov, int niov, int flags)
+{
+  (void) fd;
+  (void) flags;
+  client_t* psClnt = pvClnt;
+  return _writev(psClnt->pvtransport, MEMPIPE_CLIENT, asIov, niov);
+}
+
+static void _transport_close(void* pvClnt, int fd)
+{
+  client_t* psClnt = pvClnt;
+  mempipe_t* psPipe = psClnt->pvtransport;
+
+  _lock(psPipe);
+  if (    (fd < 0)
+       || (psPipe->aefd[MEMPIPE_CLIENT] != fd))
+  {
+    /* not a connection of ours */
+    _unlock(psPipe);
+    return;
+  }
+  psPipe->aefd[MEMPIPE_CLIENT] = -1;
+  __atomic_store_n(&psPipe->au32closed[MEMPIPE_CLIENT], 1, __ATOMIC_RELEASE);
+  _unlock(psPipe);
+
+  close(fd);
+  _signal(psPipe, MEMPIPE_SERVER);
+}
+
+const client_transport_t mempipe_transport =
+{
+  "mempipe", 0,
+  _transport_resolve, _transport_connect, _transport_connect_error, _transport_read, _transport_writev, _transport_close, 0
+};
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+int mempipe_init(mempipe_t* psPipe, uint8_t* pu8to_client, uint8_t* pu8to_server, uint32_t u32size)
+{
+  require(psPipe != 0);
+  require(pu8to_client != 0);
+  require(pu8to_server != 0);
+
+  int success = 0;
+  if (    (u32size != 0)
+       && ((u32size & (u32size - 1)) == 0))
+  {
+    memset(psPipe, 0, sizeof(mempipe_t));
+    psPipe->asBuf[MEMPIPE_CLIENT].pu8buf = pu8to_client;
+    psPipe->asBuf[MEMPIPE_CLIENT].u32mask = u32size - 1;
+    psPipe->asBuf[MEMPIPE_SERVER].pu8buf = pu8to_server;
+    psPipe->asBuf[MEMPIPE_SERVER].u32mask = u32size - 1;
+    psPipe->asBuf[MEMPIPE_CLIENT].u32waiting = 1;
+    psPipe->asBuf[MEMPIPE_SERVER].u32waiting = 1;
+    psPipe->aefd[MEMPIPE_CLIENT] = -1;
+    psPipe->au32closed[MEMPIPE_CLIENT] = 1;  /* no client yet */
+    psPipe->aefd[MEMPIPE_SERVER] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (psPipe->aefd[MEMPIPE_SERVER] < 0)
+    {
+      client_log(CLIENT_LOG_ERROR, "eventfd: %s\n", strerror(errno));
+    }
+    else
+    {
+      success = 1;
+    }
+  }
+  return success;
+}
+
+void mempipe_destroy(mempipe_t* psPipe)
+{
+  require(psPipe != 0);
+  require(psPipe->aefd[MEMPIPE_CLIENT] < 0);
+
+  close(psPipe->aefd[MEMPIPE_SERVER]);
+  psPipe->aefd[MEMPIPE_SERVER] = -1;
+}
+
+ssize_t mempipe_read(mempipe_t* psPipe, void* pvbuf, size_t nbytes)
+{
+  require(psPipe != 0);
+  require(pvbuf != 0);
+
+  return _read(psPipe, MEMPIPE_SERVER, psPipe->aefd[MEMPIPE_SERVER], pvbuf, nbytes);
+}
+
+ssize_t mempipe_writev(mempipe_t* psPipe, const struct iovec* asIov, int niov)
+{
+  require(psPipe != 0);
+  require(asIov != 0);
+
+  return _writev(psPipe, MEMPIPE_SERVER, asIov, niov);
+}
+
+ssize_t mempipe_write(mempipe_t* psPipe, const void* pvbuf, size_t nbytes)
+{
+  require(psPipe != 0);
+
+  struct iovec sIov;
+  sIov.iov_base = (void*)pvbuf;
+  sIov.iov_len = nbytes;
+  return _writev(psPipe, MEMPIPE_SERVER, &sIov, 1);
+}
+
+void mempipe_close(mempipe_t* psPipe)
+{
+  require(psPipe != 0);
+
+  __atomic_store_n(&psPipe->au32closed[MEMPIPE_SERVER], 1, __ATOMIC_RELEASE);
+  _signal(psPipe, MEMPIPE_CLIENT);
+}
+
+void mempipe_reset(mempipe_t* psPipe)
+{
+  require(psPipe != 0);
+  require(__atomic_load_n(&psPipe->au32closed[MEMPIPE_CLIENT], __ATOMIC_ACQUIRE));
+
+  /* the client is gone, nobody else touches the buffers */
+  uint32_t i;
+  for (i = 0; i < 2; ++i)
+  {
+    psPipe->asBuf[i].u32head = psPipe->asBuf[i].u32tail;
+    psPipe->asBuf[i].u32waiting = 1;
+    psPipe->asBuf[i].u32blocked = 0;
+  }
+  __atomic_store_n(&psPipe->au32closed[MEMPIPE_SERVER], 0, __ATOMIC_RELEASE);
+
+  _lock(psPipe);
+  psPipe->u32busy = 0;
+  _unlock(psPipe);
+}
+
+int mempipe_fd(mempipe_t* psPipe)
+{
+  require(psPipe != 0);
+
+  return psPipe->aefd[MEMPIPE_SERVER];
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c mempipe.c && gcc mempipe.o client.c mqtt.c wheel.c ring.c -o mempipe_test -lpthread && ./mempipe_test */
+#include <stdio.h>
+#include <poll.h>
+#include <pthread.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+#define TEST_SIZE     1024
+#define TEST_STREAM   (1024 * 1024)
+#define TEST_WAIT_MS  2000   /* a lost wakeup shows up as a poll timing out */
+
+static mempipe_t sPipe;
+static uint8_t   au8to_client[TEST_SIZE];
+static uint8_t   au8to_server[TEST_SIZE];
+static client_t  sClnt;
+static char      acrxbuf[64];
+
+static int _test_readable(int fd, int timeout_ms)
+{
+  struct pollfd sPfd = { fd, POLLIN, 0 };
+  return (poll(&sPfd, 1, timeout_ms) == 1);
+}
+
+/* The client's end, through the transport as client.c would use it */
+static int _test_connect(client_t* psClnt)
+{
+  int connected = 0;
+  client_init(psClnt, "mempipe", 0, acrxbuf, sizeof(acrxbuf));
+  client_set_transport(psClnt, &mempipe_transport, &sPipe);
+  return mempipe_transport.connect(psClnt, 0, &connected);
+}
+
+static ssize_t _test_client_read(int fd, void* pvbuf, size_t nbytes)
+{
+  return mempipe_transport.read(&sClnt, fd, pvbuf, nbytes);
+}
+
+static ssize_t _test_client_write(int fd, const void* pvbuf, size_t nbytes)
+{
+  struct iovec sIov = { (void*)pvbuf, nbytes };
+  return mempipe_transport.writev(&sClnt, fd, &sIov, 1, 0);
+}
+
+static uint32_t u32timeouts;
+
+/* Server thread: a byte stream to the client, sleeping in poll() whenever the ring is full */
+static void* _test_producer(void* pvarg)
+{
+  (void)pvarg;
+  uint8_t au8chunk[300];
+  uint32_t u32sent = 0;
+  while (    (u32sent < TEST_STREAM)
+          && (__atomic_load_n(&u32timeouts, __ATOMIC_RELAXED) == 0))
+  {
+    uint32_t u32len = TEST_STREAM - u32sent;
+    uint32_t i;
+    if (u32len > sizeof(au8chunk))
+    {
+      u32len = sizeof(au8chunk);
+    }
+    for (i = 0; i < u32len; ++i)
+    {
+      au8chunk[i] = (uint8_t)((u32sent + i) * 7);
+    }
+    ssize_t nbytes = mempipe_write(&sPipe, au8chunk, u32len);
+    if (nbytes > 0)
+    {
+      u32sent += nbytes;
+    }
+    else if (    (nbytes < 0)
+              && (errno == EAGAIN)
+              && (!_test_readable(mempipe_fd(&sPipe), TEST_WAIT_MS)))
+    {
+      __atomic_fetch_add(&u32timeouts, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return 0;
+}
+
+/* A full ring wakes its writer once the reader has drained half of it, not before */
+static void test_backpressure(void)
+{
+  uint8_t au8buf[TEST_SIZE];
+  uint8_t u8byte = 0;
+  check(mempipe_init(&sPipe, au8to_client, au8to_server, TEST_SIZE));
+  int fd = _test_connect(&sClnt);
+  check(fd >= 0);
+  check(_test_readable(mempipe_fd(&sPipe), 0)); /* the connect */
+  check((mempipe_read(&sPipe, au8buf, sizeof(au8buf)) < 0) && (errno == EAGAIN));
+
+  memset(au8buf, 0xA5, sizeof(au8buf));
+  check(mempipe_write(&sPipe, au8buf, sizeof(au8buf)) == TEST_SIZE);
+  check((mempipe_write(&sPipe, &u8byte, 1) < 0) && (errno == EAGAIN));
+  check(!_test_readable(mempipe_fd(&sPipe), 0));
+  check(_test_client_read(fd, au8buf, (TEST_SIZE / 2) - 1) == ((TEST_SIZE / 2) - 1));
+  check(!_test_readable(mempipe_fd(&sPipe), 0));
+  check(_test_client_read(fd, au8buf, 1) == 1);
+  check(_test_readable(mempipe_fd(&sPipe), 0));
+  check(_test_client_read(fd, au8buf, sizeof(au8buf)) == (TEST_SIZE / 2));
+  check((_test_client_read(fd, au8buf, sizeof(au8buf)) < 0) && (errno == EAGAIN));
+
+  /* now with a producer thread blocking in poll() over and over */
+  pthread_t thread;
+  uint32_t u32recv = 0;
+  int intact = 1;
+  u32timeouts = 0;
+  require(pthread_create(&thread, 0, _test_producer, 0) == 0);
+  while (    (u32recv < TEST_STREAM)
+          && (__atomic_load_n(&u32timeouts, __ATOMIC_RELAXED) == 0))
+  {
+    ssize_t nbytes = _test_client_read(fd, au8buf, 100);
+    if (nbytes > 0)
+    {
+      ssize_t i;
+      for (i = 0; i < nbytes; ++i)
+      {
+        intact &= (au8buf[i] == (uint8_t)((u32recv + i) * 7));
+      }
+      u32recv += nbytes;
+    }
+    else if (!_test_readable(fd, TEST_WAIT_MS))
+    {
+      __atomic_fetch_add(&u32timeouts, 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_join(thread, 0);
+  check(u32timeouts == 0);
+  check(u32recv == TEST_STREAM);
+  check(intact);
+
+  mempipe_transport.close(&sClnt, fd);
+  mempipe_reset(&sPipe);
+  mempipe_destroy(&sPipe);
+}
+
+/* Either end closing: EOF for the reader once the data is gone, EPIPE for the writer, then the next connection */
+static void test_close(void)
+{
+  uint8_t au8buf[16];
+  client_t sOther;
+  check(mempipe_init(&sPipe, au8to_client, au8to_server, TEST_SIZE));
+  int fd = _test_connect(&sClnt);
+  check(fd >= 0);
+  check(_test_connect(&sOther) < 0); /* one connection at a time */
+
+  /* the server closes */
+  check(mempipe_write(&sPipe, "bye", 3) == 3);
+  mempipe_close(&sPipe);
+  check(_test_readable(fd, 0));
+  check(_test_client_read(fd, au8buf, sizeof(au8buf)) == 3);
+  check(_test_client_read(fd, au8buf, sizeof(au8buf)) == 0);
+  check((_test_client_write(fd, "x", 1) < 0) && (errno == EPIPE));
+
+  /* the client closes */
+  check(mempipe_read(&sPipe, au8buf, sizeof(au8buf)) < 0);
+  check(_test_client_write(fd, "x", 1) < 0);
+  mempipe_transport.close(&sClnt, fd);
+  check(_test_readable(mempipe_fd(&sPipe), 0));
+  check(mempipe_read(&sPipe, au8buf, sizeof(au8buf)) == 0);
+  check((mempipe_write(&sPipe, "x", 1) < 0) && (errno == EPIPE));
+
+  /* data the client sent before closing is read before EOF */
+  mempipe_reset(&sPipe);
+  fd = _test_connect(&sClnt);
+  check(fd >= 0);
+  check(_test_client_write(fd, "last", 4) == 4);
+  check(mempipe_write(&sPipe, "old", 3) == 3);
+  mempipe_transport.close(&sClnt, fd);
+  check(mempipe_read(&sPipe, au8buf, sizeof(au8buf)) == 4);
+  check(mempipe_read(&sPipe, au8buf, sizeof(au8buf)) == 0);
+  check((mempipe_write(&sPipe, "x", 1) < 0) && (errno == EPIPE));
+
+  /* the next connection starts empty, whatever was left unread */
+  mempipe_reset(&sPipe);
+  fd = _test_connect(&sOther);
+  check(fd >= 0);
+  check(mempipe_write(&sPipe, "new", 3) == 3);
+  check(mempipe_transport.read(&sOther, fd, au8buf, sizeof(au8buf)) == 3);
+  check(memcmp(au8buf, "new", 3) == 0);
+  check(sPipe.u32conns == 3);
+  mempipe_transport.close(&sOther, fd);
+  mempipe_reset(&sPipe);
+  mempipe_destroy(&sPipe);
+}
+
+
+int main(void)
+{
+#if (CLIENT_LOG == 1)
+  client_log_hook = 0;
+#endif
+
+  test_backpressure();
+  test_close();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _MEMPIPE_H_
+#define _MEMPIPE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "client.h"
+
+/* The two ends of a pipe */
+#define MEMPIPE_CLIENT  0
+#define MEMPIPE_SERVER  1
+
+
+/* Bytes on their way to one end: single producer, single consumer */
+typedef struct
+{
+  uint8_t* pu8buf;
+  uint32_t u32mask;                              /* size - 1, the size is a power of 2 */
+  uint32_t u32tail __attribute__((aligned(64))); /* written by the producer */
+  uint32_t u32head __attribute__((aligned(64))); /* written by the consumer */
+  uint32_t u32waiting;                           /* consumer found it empty (or hasn't read yet) - the next write signals its eventfd */
+  uint32_t u32blocked;                           /* producer found it full - the consumer signals the producer's eventfd once half of it is free */
+} mempipe_buf_t;
+
+/*
+   An in-process stream connection between a client_t and a server in the same
+   program - no kernel on the data path, for deterministic benchmarks. The client
+   connects through mempipe_transport with the pipe as pvctx, the server reads and
+   writes its end with mempipe_read() / mempipe_write() and polls mempipe_fd().
+   Each end may be driven by its own thread. One connection at a time: once the
+   server has read EOF it calls mempipe_reset() to accept the next one.
+   An eventfd is always writable, so neither end polls for POLLOUT: after a write
+   came up short, the end's descriptor turns readable once the other end has
+   drained half the ring.
+*/
+typedef struct
+{
+  mempipe_buf_t asBuf[2];      /* [MEMPIPE_CLIENT]: bytes for the client, [MEMPIPE_SERVER]: for the server */
+  int           aefd[2];       /* eventfds, readable while the end has data or EOF to read or room to write again - the client's lives per connection */
+  uint32_t      au32closed[2]; /* the end has closed */
+  uint32_t      u32busy;       /* a client connected since the last mempipe_reset() */
+  uint32_t      u32conns;      /* connections so far */
+  char          lock;          /* guards aefd[MEMPIPE_CLIENT] against the client closing it */
+} mempipe_t;
+
+extern const client_transport_t mempipe_transport;
+
+
+/* Buffers are caller-supplied, size a power of 2. Returns 0 if the eventfd can't be created */
+int     mempipe_init(mempipe_t* psPipe, uint8_t* pu8to_client, uint8_t* pu8to_server, uint32_t u32size);
+void    mempipe_destroy(mempipe_t* psPipe);
+/* Server: like read(2) / writev(2) on a non-blocking socket - -1 with errno EAGAIN when they would
+   block, EPIPE writing to a closed client, 0 from mempipe_read() at EOF. Writes may be partial. */
+ssize_t mempipe_read(mempipe_t* psPipe, void* pvbuf, size_t nbytes);
+ssize_t mempipe_writev(mempipe_t* psPipe, const struct iovec* asIov, int niov);
+ssize_t mempipe_write(mempipe_t* psPipe, const void* pvbuf, size_t nbytes);
+/* Server: close its end, the client reads EOF */
+void    mempipe_close(mempipe_t* psPipe);
+/* Server: after reading EOF, empty the pipe and accept the next connection */
+void    mempipe_reset(mempipe_t* psPipe);
+/* The server's descriptor to poll for POLLIN - data, EOF, or room again after a short write */
+int     mempipe_fd(mempipe_t* psPipe);
+
+#endif /* _MEMPIPE_H_ */
@@ -1,6 +1,7 @@
 #include "mqtt.h"
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 
 
 
@@ -26,21 +27,31 @@ static int mqtt_encode_length(unsigned int nbytes, uint8_t* au8data)
 
 
 
-static int mqtt_decode_length(uint8_t* au8data)
+/*
+   Decode the remaining-length field, reading at most u32nbytes bytes.
+   Returns the number of bytes in the length field [1:4], 0 if more bytes
+   are needed, or -1 if the field is malformed (more than 4 bytes long).
+*/
+static int mqtt_decode_length(uint8_t* au8data, uint32_t u32nbytes, uint32_t* pu32len_out)
 {
-    int nbytes = 0;
-    int multiplier = 1;
-    unsigned int array_idx = 0;
-    uint8_t u8digit;
-    do
+  uint32_t u32len = 0;
+  uint32_t u32multiplier = 1;
+  uint32_t i;
+  for (i = 0; i < 4; ++i)
+  {
+    if (i >= u32nbytes)
+    {
+      return 0; /* need more data */
+    }
+    u32len += (au8data[i] & 127) * u32multiplier;
+    u32multiplier *= 128;
+    if ((au8data[i] & 128) == 0)
     {
-        u8digit = au8data[array_idx++];
-        nbytes += (u8digit & 127) * multiplier;
-        multiplier *= 128;
+      *pu32len_out = u32len;
+      return (i + 1);
     }
-    while (    (++array_idx < 4)
-            && ((u8digit & 128) != 0));
-    return nbytes;
+  }
+  return -1; /* continuation bit set on 4th byte */
 }
 
 
@@ -58,12 +69,13 @@ static int mqtt_encode_msg(uint8_t* pu8dst, uint8_t u8ctrl_type, uint8_t u8flgs,
     pu8dst[0] = (u8ctrl_type << 4) | (u8flgs);
 
     int idx = mqtt_encode_length(u32input_len, &pu8dst[1]);
-    uint32_t i, j;
+    uint32_t i;
     for (i = 0; i < u32nargs; ++i)
     {
-      for (j = 0; j < au32input_len[i]; ++j, ++nbytes_encoded)
+      if (au32input_len[i] != 0)
       {
-        pu8dst[idx + nbytes_encoded + 1] = apu8data_in[i][j];
+        memcpy(&pu8dst[idx + nbytes_encoded + 1], apu8data_in[i], au32input_len[i]);
+        nbytes_encoded += au32input_len[i];
       }
     }
     nbytes_encoded += (1 + idx);
@@ -72,6 +84,37 @@ static int mqtt_encode_msg(uint8_t* pu8dst, uint8_t u8ctrl_type, uint8_t u8flgs,
 }
 
 
+/*
+   Writes fixed header + topic-length into pu8hdr[0..], and the packet identifier (QoS > 0 only)
+   right behind it. Returns the number of header bytes preceding the topic, or 0 on error.
+   *pu32msg_len is set to the remaining length of the packet.
+*/
+static int mqtt_encode_publish_hdr(uint8_t* pu8hdr, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint32_t u32data_len, uint32_t* pu32msg_len)
+{
+  int hdr_len = 0;
+  if (    (pu8hdr != 0)
+       && (u8qos <= QOS_EXACTLY_ONCE))
+  {
+    /* MQTT 3.1.1 section 3.3.2.2: packet identifier is only present for QoS 1 and 2 */
+    uint32_t u32msg_id_len = ((u8qos > QOS_AT_MOST_ONCE) ? sizeof(uint16_t) : 0);
+    uint32_t u32msg_len = sizeof(uint16_t) + u16topic_len + u32msg_id_len + u32data_len;
+    pu8hdr[0] = (CTRL_PUBLISH << 4) | (u8qos << 1);
+    int len_bytes = mqtt_encode_length(u32msg_len, &pu8hdr[1]);
+    if (len_bytes > 0)
+    {
+      hdr_len = 1 + len_bytes;
+      pu8hdr[hdr_len++] = (u16topic_len & 0xFF00) >> 8;
+      pu8hdr[hdr_len++] = (u16topic_len & 0x00FF);
+      pu8hdr[hdr_len + 0] = (u16msg_id & 0xFF00) >> 8;
+      pu8hdr[hdr_len + 1] = (u16msg_id & 0x00FF);
+      *pu32msg_len = u32msg_len;
+    }
+  }
+  return hdr_len;
+}
+
+
+/* Copy-out decoder, kept for compatibility - mqtt_decode_view() decodes in place and checks bounds */
 int mqtt_decode_msg(uint8_t* pu8src, uint8_t* pu8ctrl_type, uint8_t* pu8flgs, uint8_t* pu8data_out, uint32_t* pu32output_len)
 {
   int nbytes_decoded = 0;
@@ -81,39 +124,277 @@ int mqtt_decode_msg(uint8_t* pu8src, uint8_t* pu8ctrl_type, uint8_t* pu8flgs, ui
        && (pu8data_out != 0)
        && (pu32output_len != 0))
   {
-    *pu8ctrl_type = ((*pu8src) >> 4);
-    *pu8flgs = ((*pu8src) & 0x0F);
-    int idx = 1;
-    int nbytes = mqtt_decode_length(&pu8src[idx]);
-    //printf("nbytes = %d\n", nbytes);
-    if (nbytes < 0x80)          /*     0 <= nbytes < 128     */
+    uint32_t u32nbytes;
+    /* caller doesn't tell us how much is readable: assume a complete length field */
+    int len_bytes = mqtt_decode_length(&pu8src[1], 4, &u32nbytes);
+    if (len_bytes > 0)
+    {
+      int idx = 1 + len_bytes;
+      *pu8ctrl_type = ((*pu8src) >> 4);
+      *pu8flgs = ((*pu8src) & 0x0F);
+      memcpy(pu8data_out, &pu8src[idx], u32nbytes);
+      *pu32output_len = u32nbytes;
+      nbytes_decoded = u32nbytes + idx;
+    }
+  }
+  return nbytes_decoded;
+}
+
+
+
+int mqtt_encode_fixed_header(uint8_t* pu8dst, uint8_t u8ctrl_type, uint8_t u8flgs, uint32_t u32remaining_len)
+{
+  int hdr_len = 0;
+  if (    (pu8dst != 0)
+       && (u8ctrl_type > 0)
+       && (u8ctrl_type < 15)
+       && (u8flgs < 16))
+  {
+    int len_bytes = mqtt_encode_length(u32remaining_len, &pu8dst[1]);
+    if (len_bytes > 0)
+    {
+      pu8dst[0] = (u8ctrl_type << 4) | (u8flgs);
+      hdr_len = 1 + len_bytes;
+    }
+  }
+  return hdr_len;
+}
+
+int mqtt_decode_fixed_header(uint8_t* pu8src, uint32_t u32nbytes, uint32_t* pu32remaining_len)
+{
+  int hdr_len = 0;
+  if (    (pu8src != 0)
+       && (pu32remaining_len != 0)
+       && (u32nbytes >= 2))
+  {
+    int len_bytes = mqtt_decode_length(&pu8src[1], u32nbytes - 1, pu32remaining_len);
+    hdr_len = ((len_bytes > 0) ? (1 + len_bytes) : len_bytes);
+  }
+  return hdr_len;
+}
+
+
+
+int mqtt_decode_view(uint8_t* pu8src, uint32_t u32nbytes, mqtt_view_t* psView)
+{
+  int nbytes_decoded = 0;
+  if (psView != 0)
+  {
+    uint32_t u32remaining_len;
+    int hdr_len = mqtt_decode_fixed_header(pu8src, u32nbytes, &u32remaining_len);
+    if (hdr_len < 0)
     {
-      idx += 1;
+      nbytes_decoded = -1;
     }
-    else if (nbytes < 0x4000)   /*   128 <= nbytes < 16384   */
+    else if (    (hdr_len > 0)
+              && ((hdr_len + u32remaining_len) <= u32nbytes))
     {
-      idx += 2;
+      psView->u8type = pu8src[0] >> 4;
+      psView->u8flags = pu8src[0] & 0x0F;
+      psView->u8hdr_len = hdr_len;
+      psView->u32remaining_len = u32remaining_len;
+      psView->pu8pkt = pu8src;
+      psView->pu8body = &pu8src[hdr_len];
+      nbytes_decoded = hdr_len + u32remaining_len;
     }
-    else if (nbytes < 0x200000) /* 16384 <= nbytes < 2097152 */
+  }
+  return nbytes_decoded;
+}
+
+int mqtt_view_publish(mqtt_view_t* psView, mqtt_publish_view_t* psPub)
+{
+  int success = 0;
+  if (    (psView != 0)
+       && (psPub != 0)
+       && (psView->u8type == CTRL_PUBLISH)
+       && (psView->u32remaining_len >= sizeof(uint16_t)))
+  {
+    uint8_t* pu8body = psView->pu8body;
+    uint32_t u32len = psView->u32remaining_len;
+    uint32_t idx;
+
+    psPub->u8qos = (psView->u8flags >> 1) & 3;
+    psPub->u8dup = (psView->u8flags >> 3) & 1;
+    psPub->u8retain = psView->u8flags & 1;
+    psPub->u16topic_len = (pu8body[0] << 8) | pu8body[1];
+    psPub->pu8topic = &pu8body[2];
+    idx = sizeof(uint16_t) + psPub->u16topic_len;
+    if (psPub->u8qos > QOS_AT_MOST_ONCE)
     {
-      idx += 3;
+      if ((idx + sizeof(uint16_t)) <= u32len)
+      {
+        psPub->u16msg_id = (pu8body[idx] << 8) | pu8body[idx + 1];
+      }
+      idx += sizeof(uint16_t);
     }
     else
     {
-      idx += 4;
-      assert(nbytes < 0x10000000);
+      psPub->u16msg_id = 0;
     }
-    /* Copy decoded data to output-buffer */
-    int i;
-    for (i = 0; i < nbytes; ++i)
+    if (    (idx <= u32len)
+         && (psPub->u8qos <= QOS_EXACTLY_ONCE))
     {
-      pu8data_out[i] = pu8src[idx + i];
+      psPub->pu8payload = &pu8body[idx];
+      psPub->u32payload_len = u32len - idx;
+      psPub->pu8props = 0;
+      psPub->u32props_len = 0;
+      success = 1;
     }
-    //memcpy(pu8data_out, &pu8src[idx], nbytes);
-    *pu32output_len = nbytes;
-    nbytes_decoded = nbytes + idx;
   }
-  return nbytes_decoded;
+  return success;
+}
+
+int mqtt_view_suback(mqtt_view_t* psView, mqtt_suback_view_t* psSuback)
+{
+  int success = 0;
+  if (    (psView != 0)
+       && (psSuback != 0)
+       && (psView->u8type == CTRL_SUBACK)
+       && (psView->u32remaining_len >= 3)) /* msg-id + at least one return code */
+  {
+    psSuback->u16msg_id = (psView->pu8body[0] << 8) | psView->pu8body[1];
+    psSuback->pu8codes = &psView->pu8body[2];
+    psSuback->u32ncodes = psView->u32remaining_len - sizeof(uint16_t);
+    success = 1;
+  }
+  return success;
+}
+
+int mqtt_view_connack(mqtt_view_t* psView, mqtt_connack_view_t* psConnack)
+{
+  int success = 0;
+  if (    (psView != 0)
+       && (psConnack != 0)
+       && (psView->u8type == CTRL_CONNACK)
+       && (psView->u32remaining_len >= 2))
+  {
+    psConnack->u8session_present = psView->pu8body[0] & 0x01;
+    psConnack->u8return_code = psView->pu8body[1];
+    success = 1;
+  }
+  return success;
+}
+
+int mqtt_view_ack(mqtt_view_t* psView, uint16_t* pu16msg_id_out)
+{
+  int success = 0;
+  if (    (psView != 0)
+       && (pu16msg_id_out != 0)
+       && (    (psView->u8type == CTRL_PUBACK)
+            || (psView->u8type == CTRL_PUBREC)
+            || (psView->u8type == CTRL_PUBREL)
+            || (psView->u8type == CTRL_PUBCOMP)
+            || (psView->u8type == CTRL_UNSUBACK)
+            || (psView->u8type == CTRL_SUBSCRIBE)
+            || (psView->u8type == CTRL_UNSUBSCRIBE))
+       && (psView->u32remaining_len >= sizeof(uint16_t)))
+  {
+    *pu16msg_id_out = (psView->pu8body[0] << 8) | psView->pu8body[1];
+    success = 1;
+  }
+  return success;
+}
+
+int mqtt_decode_batch(uint8_t* pu8src, uint32_t u32nbytes, mqtt_batch_t* psBatch)
+{
+  uint32_t u32offset = 0;
+  uint32_t n = 0;
+  uint32_t u32nacks = 0;
+
+  if (    (pu8src == 0)
+       || (psBatch == 0))
+  {
+    return -1;
+  }
+
+  while (    (n < psBatch->u32cap)
+          && (u32offset < u32nbytes))
+  {
+    uint8_t* pu8pkt = &pu8src[u32offset];
+    uint32_t u32remaining_len;
+    int hdr_len = mqtt_decode_fixed_header(pu8pkt, u32nbytes - u32offset, &u32remaining_len);
+    if (hdr_len < 0)
+    {
+      return -1;
+    }
+    if (    (hdr_len == 0)
+         || ((hdr_len + u32remaining_len) > (u32nbytes - u32offset)))
+    {
+      break; /* incomplete */
+    }
+
+    uint8_t* pu8body = &pu8pkt[hdr_len];
+    uint8_t u8type = pu8pkt[0] >> 4;
+    uint16_t u16msg_id = 0;
+    uint32_t u32topic_ofs = 0;
+    uint16_t u16topic_len = 0;
+    uint32_t u32payload_ofs = 0;
+    uint32_t u32payload_len = 0;
+
+    switch (u8type)
+    {
+      case CTRL_PUBLISH:
+      {
+        uint8_t u8qos = (pu8pkt[0] >> 1) & 3;
+        uint32_t idx = sizeof(uint16_t);
+        if (    (u32remaining_len < idx)
+             || (u8qos > QOS_EXACTLY_ONCE))
+        {
+          return -1;
+        }
+        u16topic_len = (pu8body[0] << 8) | pu8body[1];
+        idx += u16topic_len;
+        if (u8qos > QOS_AT_MOST_ONCE)
+        {
+          idx += sizeof(uint16_t);
+        }
+        if (idx > u32remaining_len)
+        {
+          return -1;
+        }
+        if (u8qos > QOS_AT_MOST_ONCE)
+        {
+          u16msg_id = (pu8body[idx - 2] << 8) | pu8body[idx - 1];
+        }
+        u32topic_ofs = u32offset + hdr_len + sizeof(uint16_t);
+        u32payload_ofs = u32offset + hdr_len + idx;
+        u32payload_len = u32remaining_len - idx;
+      } break;
+
+      case CTRL_PUBACK:
+      case CTRL_PUBREC:
+      case CTRL_PUBREL:
+      case CTRL_PUBCOMP:
+      case CTRL_SUBACK:
+      case CTRL_UNSUBACK:
+      {
+        if (u32remaining_len < sizeof(uint16_t))
+        {
+          return -1;
+        }
+        u16msg_id = (pu8body[0] << 8) | pu8body[1];
+        psBatch->au8ack_type[u32nacks] = u8type;
+        psBatch->au16ack_id[u32nacks] = u16msg_id;
+        u32nacks += 1;
+      } break;
+    }
+
+    psBatch->au8type[n] = u8type;
+    psBatch->au8flags[n] = pu8pkt[0] & 0x0F;
+    psBatch->au32offset[n] = u32offset;
+    psBatch->au32length[n] = hdr_len + u32remaining_len;
+    psBatch->au16msg_id[n] = u16msg_id;
+    psBatch->au32topic_ofs[n] = u32topic_ofs;
+    psBatch->au16topic_len[n] = u16topic_len;
+    psBatch->au32payload_ofs[n] = u32payload_ofs;
+    psBatch->au32payload_len[n] = u32payload_len;
+    n += 1;
+    u32offset += hdr_len + u32remaining_len;
+  }
+
+  psBatch->u32count = n;
+  psBatch->u32nacks = u32nacks;
+  return (int)u32offset;
 }
 
 
@@ -158,7 +439,7 @@ int mqtt_encode_connect_msg2(uint8_t* pu8dst, uint8_t u8conn_flgs, uint16_t u16k
 /* Simple connect: No username/password, no QoS etc. */
 int mqtt_encode_connect_msg(uint8_t* pu8dst, uint8_t* pu8clientid, uint16_t u16clientid_len) /* u8conn_flgs = 2, u16keepalive = 60 */
 {
-  return mqtt_encode_connect_msg2(pu8dst, 0x02, 60, pu8clientid, u16clientid_len);
+  return mqtt_encode_connect_msg2(pu8dst, MQTT_CONNECT_CLEAN_SESSION, 60, pu8clientid, u16clientid_len);
 }
 
 int mqtt_encode_disconnect_msg(uint8_t* pu8dst)
@@ -172,66 +453,256 @@ int mqtt_encode_ping_msg(uint8_t* pu8dst)
 }
 
 
+static int mqtt_encode_ack_msg(uint8_t* pu8dst, uint8_t u8ctrl_type, uint8_t u8flgs, uint16_t u16msg_id)
+{
+  uint8_t au8msg_id_buf[sizeof(uint16_t)] = { (u16msg_id & 0xFF00) >> 8, (u16msg_id & 0x00FF) };
+  uint8_t* buffers[] = { au8msg_id_buf };
+  uint32_t sizes[] = { sizeof(uint16_t) };
+  return mqtt_encode_msg(pu8dst, u8ctrl_type, u8flgs, buffers, sizes, 1, sizeof(uint16_t));
+}
+
+int mqtt_encode_puback_msg(uint8_t* pu8dst, uint16_t u16msg_id)
+{
+  return mqtt_encode_ack_msg(pu8dst, CTRL_PUBACK, 0, u16msg_id);
+}
+
+int mqtt_encode_pubrec_msg(uint8_t* pu8dst, uint16_t u16msg_id)
+{
+  return mqtt_encode_ack_msg(pu8dst, CTRL_PUBREC, 0, u16msg_id);
+}
+
+int mqtt_encode_pubrel_msg(uint8_t* pu8dst, uint16_t u16msg_id)
+{
+  return mqtt_encode_ack_msg(pu8dst, CTRL_PUBREL, 0x02, u16msg_id); /* flags are reserved, must be 0b0010 */
+}
+
+int mqtt_encode_pubcomp_msg(uint8_t* pu8dst, uint16_t u16msg_id)
+{
+  return mqtt_encode_ack_msg(pu8dst, CTRL_PUBCOMP, 0, u16msg_id);
+}
+
+
 int mqtt_encode_publish_msg(uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len)
 {
   int nbytes_encoded = 0;
-  if (pu8topic != 0)
-  {
-    uint32_t u32msg_len = sizeof(uint16_t) + u16topic_len + sizeof(uint16_t) + u32data_len;
-    uint8_t u8topic_len_msb = (u16topic_len & 0xFF00) >> 8; /* Bug if on Big-Endian machine */
-    uint8_t u8topic_len_lsb = (u16topic_len & 0x00FF);
-    uint8_t u8msg_id_msb    = (u16msg_id & 0xFF00) >> 8;    /* Bug if on Big-Endian machine */
-    uint8_t u8msg_id_lsb    = (u16msg_id & 0x00FF);
-    uint8_t au8topic_len_buf[sizeof(uint16_t)] = { u8topic_len_msb, u8topic_len_lsb };
-    uint8_t au8msg_id_buf[sizeof(uint16_t)] = { u8msg_id_msb, u8msg_id_lsb };
-    uint8_t* buffers[] = { au8topic_len_buf, pu8topic, au8msg_id_buf, pu8payload };
-    uint32_t sizes[] = { sizeof(uint16_t), u16topic_len, sizeof(uint16_t), u32data_len };
-    nbytes_encoded = mqtt_encode_msg(pu8dst, CTRL_PUBLISH, u8qos << 1, buffers, sizes, 4, u32msg_len);
+  mqtt_iov_t asIov[4];
+  uint8_t au8hdr[MQTT_PUBLISH_HDR_MAX];
+  uint32_t u32niov;
+  int nbytes = mqtt_encode_publish_iov(au8hdr, asIov, &u32niov, pu8topic, u16topic_len, u8qos, u16msg_id, pu8payload, u32data_len);
+  if (    (nbytes > 0)
+       && (pu8dst != 0))
+  {
+    uint32_t i;
+    for (i = 0; i < u32niov; ++i)
+    {
+      memcpy(&pu8dst[nbytes_encoded], asIov[i].pu8data, asIov[i].u32len);
+      nbytes_encoded += asIov[i].u32len;
+    }
   }
   return nbytes_encoded;
 }
 
 
+int mqtt_encode_publish_iov(uint8_t* pu8hdr, mqtt_iov_t* asIov, uint32_t* pu32niov, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len)
+{
+  int nbytes_encoded = 0;
+  uint32_t u32msg_len;
+  if (    (pu8topic != 0)
+       && (asIov != 0)
+       && (pu32niov != 0)
+       && (    (u32data_len == 0)
+            || (pu8payload != 0)))
+  {
+    int hdr_len = mqtt_encode_publish_hdr(pu8hdr, u16topic_len, u8qos, u16msg_id, u32data_len, &u32msg_len);
+    if (hdr_len > 0)
+    {
+      uint32_t n = 0;
+      asIov[n].pu8data = pu8hdr;
+      asIov[n++].u32len = hdr_len;
+      asIov[n].pu8data = pu8topic;
+      asIov[n++].u32len = u16topic_len;
+      if (u8qos > QOS_AT_MOST_ONCE)
+      {
+        asIov[n].pu8data = &pu8hdr[hdr_len];
+        asIov[n++].u32len = sizeof(uint16_t);
+      }
+      if (u32data_len != 0)
+      {
+        asIov[n].pu8data = pu8payload;
+        asIov[n++].u32len = u32data_len;
+      }
+      *pu32niov = n;
+      nbytes_encoded = (hdr_len - sizeof(uint16_t)) + u32msg_len;
+    }
+  }
+  return nbytes_encoded;
+}
+
+
+
+
+int mqtt_prepare_publish(mqtt_publish_tmpl_t* psTmpl, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos)
+{
+  int success = 0;
+  if (    (psTmpl != 0)
+       && (pu8topic != 0)
+       && (u16topic_len <= MQTT_TMPL_TOPIC_MAX)
+       && (u8qos <= QOS_EXACTLY_ONCE))
+  {
+    psTmpl->u16topic_len = u16topic_len;
+    psTmpl->u8qos = u8qos;
+    psTmpl->u8hdr0 = (CTRL_PUBLISH << 4) | (u8qos << 1);
+    psTmpl->u32fixed_len = sizeof(uint16_t) + u16topic_len + ((u8qos > QOS_AT_MOST_ONCE) ? sizeof(uint16_t) : 0);
+    psTmpl->au8buf[5] = (u16topic_len & 0xFF00) >> 8;
+    psTmpl->au8buf[6] = (u16topic_len & 0x00FF);
+    memcpy(&psTmpl->au8buf[7], pu8topic, u16topic_len);
+    success = 1;
+  }
+  return success;
+}
+
+int mqtt_encode_prepared_publish_iov(mqtt_publish_tmpl_t* psTmpl, mqtt_iov_t* asIov, uint32_t* pu32niov, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len)
+{
+  int nbytes_encoded = 0;
+  if (    (psTmpl != 0)
+       && (asIov != 0)
+       && (pu32niov != 0)
+       && (    (u32data_len == 0)
+            || (pu8payload != 0)))
+  {
+    uint8_t au8len[4];
+    uint32_t u32msg_len = psTmpl->u32fixed_len + u32data_len;
+    int len_bytes = mqtt_encode_length(u32msg_len, au8len);
+    if (len_bytes > 0)
+    {
+      /* fixed header ends right where the topic-length begins */
+      uint32_t u32start = 5 - (1 + len_bytes);
+      psTmpl->au8buf[u32start] = psTmpl->u8hdr0;
+      memcpy(&psTmpl->au8buf[u32start + 1], au8len, len_bytes);
+      if (psTmpl->u8qos > QOS_AT_MOST_ONCE)
+      {
+        psTmpl->au8buf[7 + psTmpl->u16topic_len] = (u16msg_id & 0xFF00) >> 8;
+        psTmpl->au8buf[8 + psTmpl->u16topic_len] = (u16msg_id & 0x00FF);
+      }
 
+      uint32_t n = 0;
+      asIov[n].pu8data = &psTmpl->au8buf[u32start];
+      asIov[n++].u32len = (1 + len_bytes) + (psTmpl->u32fixed_len);
+      if (u32data_len != 0)
+      {
+        asIov[n].pu8data = pu8payload;
+        asIov[n++].u32len = u32data_len;
+      }
+      *pu32niov = n;
+      nbytes_encoded = (1 + len_bytes) + u32msg_len;
+    }
+  }
+  return nbytes_encoded;
+}
 
-static int encode_pubsub_msg2(uint8_t* pu8dst, uint8_t u8ctrl, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id)
+int mqtt_encode_prepared_publish_msg(mqtt_publish_tmpl_t* psTmpl, uint8_t* pu8dst, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len)
 {
   int nbytes_encoded = 0;
-  if (    (apu8topic != 0)
-       && (u32nargs < MSG_SUB_MAXNTOPICS))
-  {
-    uint8_t topicsizes[sizeof(uint16_t)][MSG_SUB_MAXNTOPICS];
-    uint32_t sizes[1 + (3 * MSG_SUB_MAXNTOPICS)];   /* for each topic a topic-len, the topic itself, and the qos -- hence 3 * max(subs_pr_msg) */
-    uint8_t* buffers[1 + (3 * MSG_SUB_MAXNTOPICS)]; /* msgid, [topic-len + topic + qos]+ */
-    uint8_t u8msg_id_msb    = (u16msg_id & 0xFF00) >> 8;    /* Bug if on Big-Endian machine */
-    uint8_t u8msg_id_lsb    = (u16msg_id & 0x00FF);
-    uint8_t au8msg_id_buf[sizeof(uint16_t)] = { u8msg_id_msb, u8msg_id_lsb };
-    int bufidx = 0;
-    buffers[bufidx] = au8msg_id_buf;
-    sizes[bufidx++] = sizeof(uint16_t);
-    uint32_t u32msg_len = sizeof(uint16_t); /* msgid */
-    uint8_t u8highest_qos = 0;
+  mqtt_iov_t asIov[2];
+  uint32_t u32niov;
+  if (    (pu8dst != 0)
+       && (mqtt_encode_prepared_publish_iov(psTmpl, asIov, &u32niov, u16msg_id, pu8payload, u32data_len) > 0))
+  {
     uint32_t i;
-    for (i = 0; i < u32nargs; ++i)
+    for (i = 0; i < u32niov; ++i)
+    {
+      memcpy(&pu8dst[nbytes_encoded], asIov[i].pu8data, asIov[i].u32len);
+      nbytes_encoded += asIov[i].u32len;
+    }
+  }
+  return nbytes_encoded;
+}
+
+
+
+
+/* Bytes in the remaining-length field for u32len */
+static uint32_t mqtt_length_bytes(uint32_t u32len)
+{
+  return ((u32len < 128) ? 1 : (u32len < 16384) ? 2 : (u32len < 2097152) ? 3 : 4);
+}
+
+/*
+   SUBSCRIBE / UNSUBSCRIBE straight into pu8dst, packing filters from apu8topic[] for as long as the
+   packet stays within u32max_len bytes. UNSUBSCRIBE carries no QoS / options byte, au8qos may be 0 for it.
+   Returns the packet length, 0 if not even the first filter fits. *pu32npacked is set to the filters used.
+*/
+static int encode_pubsub_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t u8protocol, uint8_t u8ctrl, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked)
+{
+  int nbytes_encoded = 0;
+  uint32_t u32npacked = 0;
+  if (    (pu8dst != 0)
+       && (apu8topic != 0)
+       && (au16topic_len != 0)
+       && (    (u8ctrl == CTRL_UNSUBSCRIBE)
+            || (au8qos != 0)))
+  {
+    uint32_t u32opts_len = ((u8ctrl == CTRL_SUBSCRIBE) ? sizeof(uint8_t) : 0);
+    uint32_t u32msg_len = ((u8protocol == MQTT_PROTOCOL_V5) ? (sizeof(uint16_t) + 1) : sizeof(uint16_t)); /* msgid (+ empty property block) */
+
+    /* how many fit: the width of the length field grows with the packet */
+    while (u32npacked < u32nargs)
     {
-      u32msg_len += sizeof(uint16_t) + au16topic_len[i] + sizeof(uint8_t); /* topic-len + topic + qos */
-      uint8_t u8topic_len_msb = (au16topic_len[i] & 0xFF00) >> 8; /* Bug if on Big-Endian machine */
-      uint8_t u8topic_len_lsb = (au16topic_len[i] & 0x00FF);
-      topicsizes[i][0] = u8topic_len_msb;
-      topicsizes[i][1] = u8topic_len_lsb;
-      buffers[bufidx] = topicsizes[i];
-      sizes[bufidx++] = sizeof(uint16_t);
-      buffers[bufidx] = apu8topic[i];
-      sizes[bufidx++] = au16topic_len[i];
-      buffers[bufidx] = &au8qos[i];
-      sizes[bufidx++] = sizeof(uint8_t);
-      /* Send MQTT SUBSCRIBE msg with highest QoS of all subscribtions */
-      if (au8qos[i] > u8highest_qos)
+      uint32_t u32next_len = u32msg_len + sizeof(uint16_t) + au16topic_len[u32npacked] + u32opts_len;
+      if (    (u32next_len >= 0x10000000) /* max MQTT packet size */
+           || ((1 + mqtt_length_bytes(u32next_len) + u32next_len) > u32max_len))
       {
-        u8highest_qos = au8qos[i];
+        break;
       }
+      u32msg_len = u32next_len;
+      u32npacked += 1;
+    }
+
+    if (u32npacked > 0)
+    {
+      /* bits 3-0 of the fixed header are reserved as 0010 for both packet types */
+      pu8dst[0] = (u8ctrl << 4) | 0x02;
+      uint32_t idx = 1 + mqtt_encode_length(u32msg_len, &pu8dst[1]);
+      pu8dst[idx++] = (u16msg_id & 0xFF00) >> 8;
+      pu8dst[idx++] = (u16msg_id & 0x00FF);
+      if (u8protocol == MQTT_PROTOCOL_V5)
+      {
+        pu8dst[idx++] = 0x00; /* no properties */
+      }
+      uint32_t i;
+      for (i = 0; i < u32npacked; ++i)
+      {
+        pu8dst[idx++] = (au16topic_len[i] & 0xFF00) >> 8;
+        pu8dst[idx++] = (au16topic_len[i] & 0x00FF);
+        memcpy(&pu8dst[idx], apu8topic[i], au16topic_len[i]);
+        idx += au16topic_len[i];
+        if (u32opts_len != 0)
+        {
+          pu8dst[idx++] = au8qos[i]; /* MQTT 5: subscription options, QoS in the low bits */
+        }
+      }
+      nbytes_encoded = idx;
+    }
+  }
+  if (pu32npacked != 0)
+  {
+    *pu32npacked = u32npacked;
+  }
+  return nbytes_encoded;
+}
+
+static int encode_pubsub_msg2(uint8_t* pu8dst, uint8_t u8protocol, uint8_t u8ctrl, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id)
+{
+  int nbytes_encoded = 0;
+  uint32_t u32npacked;
+  if (    (u32nargs > 0)
+       && (u32nargs <= MSG_SUB_MAXNTOPICS))
+  {
+    nbytes_encoded = encode_pubsub_packed(pu8dst, UINT32_MAX, u8protocol, u8ctrl, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id, &u32npacked);
+    if (u32npacked != u32nargs)
+    {
+      nbytes_encoded = 0;
     }
-    nbytes_encoded = mqtt_encode_msg(pu8dst, u8ctrl, u8highest_qos << 1, buffers, sizes, bufidx, u32msg_len);
   }
   return nbytes_encoded;
 }
@@ -240,22 +711,32 @@ static int encode_pubsub_msg2(uint8_t* pu8dst, uint8_t u8ctrl, uint8_t** apu8top
 
 int mqtt_encode_subscribe_msg(uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id)
 {
-  return encode_pubsub_msg2(pu8dst, CTRL_SUBSCRIBE, &pu8topic, &u16topic_len, &u8qos, 1, u16msg_id);
+  return encode_pubsub_msg2(pu8dst, MQTT_PROTOCOL_V311, CTRL_SUBSCRIBE, &pu8topic, &u16topic_len, &u8qos, 1, u16msg_id);
 }
 
 int mqtt_encode_unsubscribe_msg(uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id)
 {
-  return encode_pubsub_msg2(pu8dst, CTRL_UNSUBSCRIBE, &pu8topic, &u16topic_len, &u8qos, 1, u16msg_id);
+  return encode_pubsub_msg2(pu8dst, MQTT_PROTOCOL_V311, CTRL_UNSUBSCRIBE, &pu8topic, &u16topic_len, &u8qos, 1, u16msg_id);
 }
 int mqtt_encode_subscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id)
 {
-  return encode_pubsub_msg2(pu8dst, CTRL_SUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id);
+  return encode_pubsub_msg2(pu8dst, MQTT_PROTOCOL_V311, CTRL_SUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id);
 }
 
 
 int mqtt_encode_unsubscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id)
 {
-  return encode_pubsub_msg2(pu8dst, CTRL_UNSUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id);
+  return encode_pubsub_msg2(pu8dst, MQTT_PROTOCOL_V311, CTRL_UNSUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id);
+}
+
+int mqtt_encode_subscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked)
+{
+  return encode_pubsub_packed(pu8dst, u32max_len, MQTT_PROTOCOL_V311, CTRL_SUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id, pu32npacked);
+}
+
+int mqtt_encode_unsubscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked)
+{
+  return encode_pubsub_packed(pu8dst, u32max_len, MQTT_PROTOCOL_V311, CTRL_UNSUBSCRIBE, apu8topic, au16topic_len, 0, u32nargs, u16msg_id, pu32npacked);
 }
 
 
@@ -271,6 +752,18 @@ int mqtt_decode_connack_msg(uint8_t* pu8src, uint32_t u32nbytes)
            && (pu8src[3] == 0x00)); /* 0x00 : Connection Accepted      */
 }
 
+int mqtt_decode_connack_msg2(uint8_t* pu8src, uint32_t u32nbytes, uint8_t* pu8session_present)
+{
+  int success = 0;
+  if (    (pu8session_present != 0)
+       && (mqtt_decode_connack_msg(pu8src, u32nbytes)))
+  {
+    *pu8session_present = (pu8src[2] & 0x01); /* bit 0 of the acknowledge flags */
+    success = 1;
+  }
+  return success;
+}
+
 
 int mqtt_decode_pingresp_msg(uint8_t* pu8src, uint32_t u32nbytes)
 {
@@ -280,12 +773,13 @@ int mqtt_decode_pingresp_msg(uint8_t* pu8src, uint32_t u32nbytes)
            && (pu8src[1] == 0x00)); /* 0x00 : bytes after fixed header  */
 }
 
-int mqtt_decode_puback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out)
+/* PUBACK, PUBREC, PUBREL and PUBCOMP share layout: fixed header + packet identifier */
+static int mqtt_decode_ack_msg(uint8_t* pu8src, uint32_t u32nbytes, uint8_t u8hdr, uint16_t* pu16msg_id_out)
 {
   int success = 0;
   if (    (pu8src != 0)
        && (u32nbytes >= 4)
-       && (pu8src[0] == 0x40)      /* 0x40 : CTRL_PUBACK << 4         */
+       && (pu8src[0] == u8hdr)     /* control type << 4 | flags       */
        && (pu8src[1] == 0x02)      /* 0x02 : bytes after fixed header */
        && (pu16msg_id_out != 0))
   {
@@ -295,17 +789,37 @@ int mqtt_decode_puback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16ms
   return success;
 }
 
+int mqtt_decode_puback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out)
+{
+  return mqtt_decode_ack_msg(pu8src, u32nbytes, 0x40, pu16msg_id_out);  /* 0x40 : CTRL_PUBACK << 4 */
+}
+
+int mqtt_decode_pubrec_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out)
+{
+  return mqtt_decode_ack_msg(pu8src, u32nbytes, 0x50, pu16msg_id_out);  /* 0x50 : CTRL_PUBREC << 4 */
+}
+
+int mqtt_decode_pubrel_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out)
+{
+  return mqtt_decode_ack_msg(pu8src, u32nbytes, 0x62, pu16msg_id_out);  /* 0x62 : CTRL_PUBREL << 4 | 0x02 (reserved flags) */
+}
+
+int mqtt_decode_pubcomp_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out)
+{
+  return mqtt_decode_ack_msg(pu8src, u32nbytes, 0x70, pu16msg_id_out);  /* 0x70 : CTRL_PUBCOMP << 4 */
+}
+
 
 int mqtt_decode_suback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out)
 {
   int success = 0;
-  if (    (pu8src != 0)
-       && (u32nbytes >= 4)
-       && (pu8src[0] == 0x90)      /* 0x90 : CTRL_SUBACK << 4         */
-       && (pu8src[1] == 0x02)      /* 0x02 : bytes after fixed header */
-       && (pu16msg_id_out != 0))
+  mqtt_view_t sView;
+  mqtt_suback_view_t sSuback;
+  if (    (pu16msg_id_out != 0)
+       && (mqtt_decode_view(pu8src, u32nbytes, &sView) > 0)
+       && (mqtt_view_suback(&sView, &sSuback)))
   {
-    *pu16msg_id_out = (pu8src[2] << 8) | pu8src[3];
+    *pu16msg_id_out = sSuback.u16msg_id;
     success = 1;
   }
   return success;
@@ -314,20 +828,21 @@ int mqtt_decode_suback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16ms
 int mqtt_decode_publish_msg(uint8_t* pu8src, uint32_t u32nbytes, uint8_t* pu8qos, uint16_t* pu16msg_id_out, uint16_t* pu16topic_len, uint8_t** ppu8topic, uint8_t** ppu8payload)
 {
   int success = 0;
-  if (    (pu8src != 0)
-       && (u32nbytes >= 6)
-       && (pu8src[0] >> 4 == CTRL_PUBLISH)
+  mqtt_view_t sView;
+  mqtt_publish_view_t sPub;
+  if (    (pu8qos != 0)
        && (pu16msg_id_out != 0)
        && (pu16topic_len != 0)
        && (ppu8topic != 0)
-       && (ppu8payload != 0)    )
-  {
-    *pu8qos = (pu8src[0] >> 1) & 3;
-    uint16_t u16topic_len = (pu8src[2] << 8) | pu8src[3];
-    *pu16topic_len = u16topic_len;
-    *ppu8topic = &pu8src[4];
-    *pu16msg_id_out = (pu8src[4 + u16topic_len] << 8) | pu8src[5 + u16topic_len];
-    *ppu8payload = &pu8src[6 + u16topic_len];
+       && (ppu8payload != 0)
+       && (mqtt_decode_view(pu8src, u32nbytes, &sView) > 0)
+       && (mqtt_view_publish(&sView, &sPub)))
+  {
+    *pu8qos = sPub.u8qos;
+    *pu16msg_id_out = sPub.u16msg_id;
+    *pu16topic_len = sPub.u16topic_len;
+    *ppu8topic = sPub.pu8topic;
+    *ppu8payload = sPub.pu8payload;
     success = 1;
   }
   return success;
@@ -335,8 +850,864 @@ int mqtt_decode_publish_msg(uint8_t* pu8src, uint32_t u32nbytes, uint8_t* pu8qos
 
 
 
+/*
+   Broker side
+*/
+
+int mqtt_view_connect(mqtt_view_t* psView, mqtt_connect_view_t* psConnect)
+{
+  int success = 0;
+  if (    (psView != 0)
+       && (psConnect != 0)
+       && (psView->u8type == CTRL_CONNECT)
+       && (psView->u32remaining_len >= 12)) /* "MQTT", level, flags, keep alive, client id length */
+  {
+    uint8_t* pu8body = psView->pu8body;
+    uint32_t u32len = psView->u32remaining_len;
+    uint16_t u16name_len = (pu8body[0] << 8) | pu8body[1];
+    uint32_t idx = sizeof(uint16_t) + u16name_len;
+    if ((idx + 6) <= u32len)
+    {
+      psConnect->u8protocol = pu8body[idx];
+      psConnect->u8flags = pu8body[idx + 1];
+      psConnect->u16keepalive = (pu8body[idx + 2] << 8) | pu8body[idx + 3];
+      psConnect->u16clientid_len = (pu8body[idx + 4] << 8) | pu8body[idx + 5];
+      psConnect->pu8clientid = &pu8body[idx + 6];
+      success = ((idx + 6 + psConnect->u16clientid_len) <= u32len);
+    }
+  }
+  return success;
+}
+
+int mqtt_view_filter(mqtt_view_t* psView, uint32_t* pu32ofs, uint8_t** ppu8filter, uint16_t* pu16filter_len, uint8_t* pu8qos)
+{
+  int success = 0;
+  if (    (psView != 0)
+       && (pu32ofs != 0)
+       && (ppu8filter != 0)
+       && (pu16filter_len != 0)
+       && (    (psView->u8type == CTRL_SUBSCRIBE)
+            || (psView->u8type == CTRL_UNSUBSCRIBE)))
+  {
+    uint8_t* pu8body = psView->pu8body;
+    uint32_t u32len = psView->u32remaining_len;
+    uint32_t idx = ((*pu32ofs == 0) ? sizeof(uint16_t) : *pu32ofs); /* skip the packet id */
+    uint32_t u32qos_len = ((psView->u8type == CTRL_SUBSCRIBE) ? 1 : 0);
+    if ((idx + sizeof(uint16_t)) <= u32len)
+    {
+      uint16_t u16filter_len = (pu8body[idx] << 8) | pu8body[idx + 1];
+      if ((idx + sizeof(uint16_t) + u16filter_len + u32qos_len) <= u32len)
+      {
+        *ppu8filter = &pu8body[idx + sizeof(uint16_t)];
+        *pu16filter_len = u16filter_len;
+        if (    (u32qos_len != 0)
+             && (pu8qos != 0))
+        {
+          *pu8qos = pu8body[idx + sizeof(uint16_t) + u16filter_len];
+        }
+        *pu32ofs = idx + sizeof(uint16_t) + u16filter_len + u32qos_len;
+        success = 1;
+      }
+    }
+  }
+  return success;
+}
+
+int mqtt_encode_connack_msg(uint8_t* pu8dst, uint8_t u8session_present, uint8_t u8return_code)
+{
+  uint8_t au8data[2] = { (u8session_present & 0x01), u8return_code };
+  uint8_t* buffers[] = { au8data };
+  uint32_t sizes[] = { sizeof(au8data) };
+  return mqtt_encode_msg(pu8dst, CTRL_CONNACK, 0, buffers, sizes, 1, sizeof(au8data));
+}
+
+int mqtt_encode_suback_msg(uint8_t* pu8dst, uint16_t u16msg_id, uint8_t* au8codes, uint32_t u32ncodes)
+{
+  uint8_t au8msg_id_buf[sizeof(uint16_t)] = { (u16msg_id & 0xFF00) >> 8, (u16msg_id & 0x00FF) };
+  uint8_t* buffers[] = { au8msg_id_buf, au8codes };
+  uint32_t sizes[] = { sizeof(uint16_t), u32ncodes };
+  return mqtt_encode_msg(pu8dst, CTRL_SUBACK, 0, buffers, sizes, 2, sizeof(uint16_t) + u32ncodes);
+}
+
+int mqtt_encode_unsuback_msg(uint8_t* pu8dst, uint16_t u16msg_id)
+{
+  return mqtt_encode_ack_msg(pu8dst, CTRL_UNSUBACK, 0, u16msg_id);
+}
+
+int mqtt_encode_pingresp_msg(uint8_t* pu8dst)
+{
+  return mqtt_encode_msg(pu8dst, CTRL_PINGRESP, 0, 0, 0, 0, 0);
+}
+
+
+
+/*
+   MQTT 5
+*/
+
+/* Wire format of each property identifier, 0 = not a valid identifier */
+enum
+{
+  PROP_INVALID,
+  PROP_BYTE,
+  PROP_U16,
+  PROP_U32,
+  PROP_VARINT,
+  PROP_BINARY, /* UTF-8 strings too: u16 length + data */
+  PROP_PAIR,   /* user property: two strings */
+};
+
+static const uint8_t au8prop_type[MQTT5_PROP_SHARED_SUB_AVAIL + 1] =
+{
+  [MQTT5_PROP_PAYLOAD_FORMAT]        = PROP_BYTE,
+  [MQTT5_PROP_MESSAGE_EXPIRY]        = PROP_U32,
+  [MQTT5_PROP_CONTENT_TYPE]          = PROP_BINARY,
+  [MQTT5_PROP_RESPONSE_TOPIC]        = PROP_BINARY,
+  [MQTT5_PROP_CORRELATION_DATA]      = PROP_BINARY,
+  [MQTT5_PROP_SUBSCRIPTION_ID]       = PROP_VARINT,
+  [MQTT5_PROP_SESSION_EXPIRY]        = PROP_U32,
+  [MQTT5_PROP_ASSIGNED_CLIENT_ID]    = PROP_BINARY,
+  [MQTT5_PROP_SERVER_KEEPALIVE]      = PROP_U16,
+  [MQTT5_PROP_AUTH_METHOD]           = PROP_BINARY,
+  [MQTT5_PROP_AUTH_DATA]             = PROP_BINARY,
+  [MQTT5_PROP_REQUEST_PROBLEM_INFO]  = PROP_BYTE,
+  [MQTT5_PROP_WILL_DELAY]            = PROP_U32,
+  [MQTT5_PROP_REQUEST_RESPONSE_INFO] = PROP_BYTE,
+  [MQTT5_PROP_RESPONSE_INFO]         = PROP_BINARY,
+  [MQTT5_PROP_SERVER_REFERENCE]      = PROP_BINARY,
+  [MQTT5_PROP_REASON_STRING]         = PROP_BINARY,
+  [MQTT5_PROP_RECEIVE_MAXIMUM]       = PROP_U16,
+  [MQTT5_PROP_TOPIC_ALIAS_MAXIMUM]   = PROP_U16,
+  [MQTT5_PROP_TOPIC_ALIAS]           = PROP_U16,
+  [MQTT5_PROP_MAXIMUM_QOS]           = PROP_BYTE,
+  [MQTT5_PROP_RETAIN_AVAILABLE]      = PROP_BYTE,
+  [MQTT5_PROP_USER_PROPERTY]         = PROP_PAIR,
+  [MQTT5_PROP_MAXIMUM_PACKET_SIZE]   = PROP_U32,
+  [MQTT5_PROP_WILDCARD_SUB_AVAIL]    = PROP_BYTE,
+  [MQTT5_PROP_SUB_ID_AVAIL]          = PROP_BYTE,
+  [MQTT5_PROP_SHARED_SUB_AVAIL]      = PROP_BYTE,
+};
+
+static int mqtt5_put_u16(uint8_t* pu8dst, uint8_t u8id, uint16_t u16value)
+{
+  pu8dst[0] = u8id;
+  pu8dst[1] = (u16value & 0xFF00) >> 8;
+  pu8dst[2] = (u16value & 0x00FF);
+  return 3;
+}
+
+static int mqtt5_put_u32(uint8_t* pu8dst, uint8_t u8id, uint32_t u32value)
+{
+  pu8dst[0] = u8id;
+  pu8dst[1] = (u32value >> 24) & 0xFF;
+  pu8dst[2] = (u32value >> 16) & 0xFF;
+  pu8dst[3] = (u32value >>  8) & 0xFF;
+  pu8dst[4] = (u32value      ) & 0xFF;
+  return 5;
+}
+
+/* Reads a u16-length prefixed string / binary field, returns bytes consumed or 0 if it doesn't fit */
+static uint32_t mqtt5_get_binary(uint8_t* pu8src, uint32_t u32nbytes, uint8_t** ppu8data, uint16_t* pu16len)
+{
+  uint32_t u32used = 0;
+  if (u32nbytes >= sizeof(uint16_t))
+  {
+    uint16_t u16len = (pu8src[0] << 8) | pu8src[1];
+    if ((sizeof(uint16_t) + u16len) <= u32nbytes)
+    {
+      *ppu8data = &pu8src[2];
+      *pu16len = u16len;
+      u32used = sizeof(uint16_t) + u16len;
+    }
+  }
+  return u32used;
+}
+
+/* Locates the property block at pu8src: returns bytes taken by length field + properties, or -1 if it doesn't fit in u32nbytes */
+static int mqtt5_get_props(uint8_t* pu8src, uint32_t u32nbytes, uint8_t** ppu8props, uint32_t* pu32props_len)
+{
+  uint32_t u32len;
+  int len_bytes = mqtt_decode_length(pu8src, u32nbytes, &u32len);
+  if (    (len_bytes <= 0)
+       || ((len_bytes + u32len) > u32nbytes))
+  {
+    return -1;
+  }
+  *ppu8props = &pu8src[len_bytes];
+  *pu32props_len = u32len;
+  return (len_bytes + u32len);
+}
+
+static void mqtt5_reset_aliases(mqtt5_conn_t* psConn)
+{
+  memset(psConn->asTx, 0, sizeof(psConn->asTx));
+  memset(psConn->asRx, 0, sizeof(psConn->asRx));
+  psConn->u16next_alias = 0;
+}
+
+/* Outbound alias for a topic: index into asTx, or -1 if aliases are unavailable. *pu8known is set if the broker already has it */
+static int mqtt5_tx_alias(mqtt5_conn_t* psConn, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t* pu8known)
+{
+  uint32_t u32nalias = psConn->u16peer_topic_alias_max;
+  if (u32nalias > MQTT5_TOPIC_ALIAS_MAX)
+  {
+    u32nalias = MQTT5_TOPIC_ALIAS_MAX;
+  }
+  *pu8known = 0;
+  if (    (u32nalias == 0)
+       || (u16topic_len == 0)
+       || (u16topic_len > MQTT_TMPL_TOPIC_MAX))
+  {
+    return -1;
+  }
+
+  uint32_t i;
+  for (i = 0; i < u32nalias; ++i)
+  {
+    if (    (psConn->asTx[i].u16len == u16topic_len)
+         && (memcmp(psConn->asTx[i].au8topic, pu8topic, u16topic_len) == 0))
+    {
+      *pu8known = 1;
+      return i;
+    }
+  }
+  return (psConn->u16next_alias % u32nalias);
+}
+
+
+
+int mqtt5_init(mqtt5_conn_t* psConn, uint16_t u16receive_max, uint32_t u32max_packet_size, uint16_t u16topic_alias_max)
+{
+  int success = 0;
+  if (psConn != 0)
+  {
+    memset(psConn, 0, sizeof(mqtt5_conn_t));
+    psConn->u16receive_max = ((u16receive_max == 0) ? 0xFFFF : u16receive_max);
+    psConn->u32max_packet_size = u32max_packet_size;
+    psConn->u16topic_alias_max = ((u16topic_alias_max > MQTT5_TOPIC_ALIAS_MAX) ? MQTT5_TOPIC_ALIAS_MAX : u16topic_alias_max);
+    psConn->u16peer_receive_max = 0xFFFF;
+    psConn->u8peer_max_qos = QOS_EXACTLY_ONCE;
+    success = 1;
+  }
+  return success;
+}
+
+int mqtt5_encode_connect_msg(mqtt5_conn_t* psConn, uint8_t* pu8dst, uint8_t u8conn_flgs, uint16_t u16keepalive, uint8_t* pu8clientid, uint16_t u16clientid_len)
+{
+  int nbytes_encoded = 0;
+  if (    (psConn != 0)
+       && (pu8dst != 0)
+       && (pu8clientid != 0))
+  {
+    uint8_t au8conn_buf[10 + 1 + 5 + 5 + 3 + 3 + 2]; /* variable header, properties, client id length */
+    uint8_t au8props[5 + 5 + 3 + 3];
+    uint32_t u32props_len = 0;
+    int idx = 0;
+
+    /* new network connection: aliases start over and the broker's limits are unknown until CONNACK */
+    mqtt5_reset_aliases(psConn);
+    psConn->u32peer_max_packet_size = 0;
+    psConn->u16peer_receive_max = 0xFFFF;
+    psConn->u16peer_topic_alias_max = 0;
+    psConn->u8peer_max_qos = QOS_EXACTLY_ONCE;
+
+    if (psConn->u32session_expiry != 0)
+    {
+      u32props_len += mqtt5_put_u32(&au8props[u32props_len], MQTT5_PROP_SESSION_EXPIRY, psConn->u32session_expiry);
+    }
+    if (psConn->u32max_packet_size != 0)
+    {
+      u32props_len += mqtt5_put_u32(&au8props[u32props_len], MQTT5_PROP_MAXIMUM_PACKET_SIZE, psConn->u32max_packet_size);
+    }
+    if (psConn->u16receive_max != 0xFFFF)
+    {
+      u32props_len += mqtt5_put_u16(&au8props[u32props_len], MQTT5_PROP_RECEIVE_MAXIMUM, psConn->u16receive_max);
+    }
+    if (psConn->u16topic_alias_max != 0)
+    {
+      u32props_len += mqtt5_put_u16(&au8props[u32props_len], MQTT5_PROP_TOPIC_ALIAS_MAXIMUM, psConn->u16topic_alias_max);
+    }
+
+    au8conn_buf[idx++] = 0x00; /* protocol version length U16 */
+    au8conn_buf[idx++] = 0x04; /* 4 bytes long (MQTT) */
+    au8conn_buf[idx++] = 'M';
+    au8conn_buf[idx++] = 'Q';
+    au8conn_buf[idx++] = 'T';
+    au8conn_buf[idx++] = 'T';
+    au8conn_buf[idx++] = MQTT_PROTOCOL_V5;
+    au8conn_buf[idx++] = u8conn_flgs;
+    au8conn_buf[idx++] = (u16keepalive & 0xFF00) >> 8;
+    au8conn_buf[idx++] = (u16keepalive & 0x00FF);
+    idx += mqtt_encode_length(u32props_len, &au8conn_buf[idx]);
+    memcpy(&au8conn_buf[idx], au8props, u32props_len);
+    idx += u32props_len;
+    au8conn_buf[idx++] = (u16clientid_len & 0xFF00) >> 8;
+    au8conn_buf[idx++] = (u16clientid_len & 0x00FF);
+
+    uint8_t* buffers[] = { au8conn_buf, pu8clientid };
+    uint32_t sizes[] = { idx, u16clientid_len };
+
+    nbytes_encoded = mqtt_encode_msg(pu8dst, CTRL_CONNECT, 0, buffers, sizes, 2, idx + u16clientid_len);
+  }
+  return nbytes_encoded;
+}
+
+int mqtt5_encode_publish_iov(mqtt5_conn_t* psConn, uint8_t* pu8hdr, mqtt_iov_t* asIov, uint32_t* pu32niov, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len)
+{
+  int nbytes_encoded = 0;
+  if (    (psConn != 0)
+       && (pu8hdr != 0)
+       && (pu8topic != 0)
+       && (asIov != 0)
+       && (pu32niov != 0)
+       && (u8qos <= QOS_EXACTLY_ONCE)
+       && (    (u32data_len == 0)
+            || (pu8payload != 0)))
+  {
+    uint8_t u8known;
+    int alias = mqtt5_tx_alias(psConn, pu8topic, u16topic_len, &u8known);
+    uint16_t u16send_topic_len = (u8known ? 0 : u16topic_len);
+    uint32_t u32msg_id_len = ((u8qos > QOS_AT_MOST_ONCE) ? sizeof(uint16_t) : 0);
+    uint32_t u32props_len = ((alias >= 0) ? 3 : 0);
+    uint32_t u32msg_len = sizeof(uint16_t) + u16send_topic_len + u32msg_id_len + 1 + u32props_len + u32data_len;
+
+    pu8hdr[0] = (CTRL_PUBLISH << 4) | (u8qos << 1);
+    int len_bytes = mqtt_encode_length(u32msg_len, &pu8hdr[1]);
+    uint32_t u32total = 1 + len_bytes + u32msg_len;
+    if (    (len_bytes > 0)
+         && (    (psConn->u32peer_max_packet_size == 0)
+              || (u32total <= psConn->u32peer_max_packet_size)))
+    {
+      uint32_t hdr_len = 1 + len_bytes;
+      pu8hdr[hdr_len++] = (u16send_topic_len & 0xFF00) >> 8;
+      pu8hdr[hdr_len++] = (u16send_topic_len & 0x00FF);
+
+      uint32_t tail = hdr_len;
+      if (u8qos > QOS_AT_MOST_ONCE)
+      {
+        pu8hdr[tail++] = (u16msg_id & 0xFF00) >> 8;
+        pu8hdr[tail++] = (u16msg_id & 0x00FF);
+      }
+      pu8hdr[tail++] = u32props_len;
+      if (alias >= 0)
+      {
+        tail += mqtt5_put_u16(&pu8hdr[tail], MQTT5_PROP_TOPIC_ALIAS, alias + 1);
+        if (!u8known)
+        {
+          /* (re)map the alias - the broker learns it from this packet */
+          psConn->asTx[alias].u16len = u16topic_len;
+          memcpy(psConn->asTx[alias].au8topic, pu8topic, u16topic_len);
+          psConn->u16next_alias += 1;
+        }
+      }
+
+      uint32_t n = 0;
+      asIov[n].pu8data = pu8hdr;
+      asIov[n++].u32len = hdr_len;
+      if (u16send_topic_len != 0)
+      {
+        asIov[n].pu8data = pu8topic;
+        asIov[n++].u32len = u16send_topic_len;
+      }
+      asIov[n].pu8data = &pu8hdr[hdr_len];
+      asIov[n++].u32len = tail - hdr_len;
+      if (u32data_len != 0)
+      {
+        asIov[n].pu8data = pu8payload;
+        asIov[n++].u32len = u32data_len;
+      }
+      *pu32niov = n;
+      nbytes_encoded = u32total;
+    }
+  }
+  return nbytes_encoded;
+}
+
+int mqtt5_encode_publish_msg(mqtt5_conn_t* psConn, uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len)
+{
+  int nbytes_encoded = 0;
+  mqtt_iov_t asIov[4];
+  uint8_t au8hdr[MQTT5_PUBLISH_HDR_MAX];
+  uint32_t u32niov;
+  if (    (pu8dst != 0)
+       && (mqtt5_encode_publish_iov(psConn, au8hdr, asIov, &u32niov, pu8topic, u16topic_len, u8qos, u16msg_id, pu8payload, u32data_len) > 0))
+  {
+    uint32_t i;
+    for (i = 0; i < u32niov; ++i)
+    {
+      memcpy(&pu8dst[nbytes_encoded], asIov[i].pu8data, asIov[i].u32len);
+      nbytes_encoded += asIov[i].u32len;
+    }
+  }
+  return nbytes_encoded;
+}
+
+int mqtt5_encode_subscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id)
+{
+  return encode_pubsub_msg2(pu8dst, MQTT_PROTOCOL_V5, CTRL_SUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id);
+}
+
+int mqtt5_encode_unsubscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id)
+{
+  return encode_pubsub_msg2(pu8dst, MQTT_PROTOCOL_V5, CTRL_UNSUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id);
+}
+
+int mqtt5_encode_subscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked)
+{
+  return encode_pubsub_packed(pu8dst, u32max_len, MQTT_PROTOCOL_V5, CTRL_SUBSCRIBE, apu8topic, au16topic_len, au8qos, u32nargs, u16msg_id, pu32npacked);
+}
+
+int mqtt5_encode_unsubscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked)
+{
+  return encode_pubsub_packed(pu8dst, u32max_len, MQTT_PROTOCOL_V5, CTRL_UNSUBSCRIBE, apu8topic, au16topic_len, 0, u32nargs, u16msg_id, pu32npacked);
+}
+
+int mqtt5_next_property(uint8_t* pu8props, uint32_t u32props_len, uint32_t* pu32ofs, mqtt5_property_t* psProp)
+{
+  if (    (pu8props == 0)
+       || (pu32ofs == 0)
+       || (psProp == 0))
+  {
+    return -1;
+  }
+  if (*pu32ofs >= u32props_len)
+  {
+    return 0;
+  }
+
+  uint8_t* p = &pu8props[*pu32ofs];
+  uint32_t u32avail = u32props_len - *pu32ofs - 1;
+  uint32_t u32used = 0;
+  uint8_t u8id = p[0];
+  uint8_t u8type = ((u8id <= MQTT5_PROP_SHARED_SUB_AVAIL) ? au8prop_type[u8id] : PROP_INVALID);
+
+  memset(psProp, 0, sizeof(mqtt5_property_t));
+  psProp->u8id = u8id;
+  p += 1;
+  switch (u8type)
+  {
+    case PROP_BYTE:
+      if (u32avail >= 1)
+      {
+        psProp->u32value = p[0];
+        u32used = 1;
+      }
+      break;
+    case PROP_U16:
+      if (u32avail >= 2)
+      {
+        psProp->u32value = (p[0] << 8) | p[1];
+        u32used = 2;
+      }
+      break;
+    case PROP_U32:
+      if (u32avail >= 4)
+      {
+        psProp->u32value = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        u32used = 4;
+      }
+      break;
+    case PROP_VARINT:
+    {
+      int len_bytes = mqtt_decode_length(p, u32avail, &psProp->u32value);
+      u32used = ((len_bytes > 0) ? len_bytes : 0);
+    } break;
+    case PROP_BINARY:
+      u32used = mqtt5_get_binary(p, u32avail, &psProp->pu8data, &psProp->u16data_len);
+      break;
+    case PROP_PAIR:
+    {
+      u32used = mqtt5_get_binary(p, u32avail, &psProp->pu8data, &psProp->u16data_len);
+      if (u32used > 0)
+      {
+        uint32_t u32used2 = mqtt5_get_binary(&p[u32used], u32avail - u32used, &psProp->pu8data2, &psProp->u16data2_len);
+        u32used = ((u32used2 > 0) ? (u32used + u32used2) : 0);
+      }
+    } break;
+  }
+
+  if (u32used == 0)
+  {
+    return -1;
+  }
+  *pu32ofs += 1 + u32used;
+  return 1;
+}
+
+int mqtt5_view_connack(mqtt5_conn_t* psConn, mqtt_view_t* psView, mqtt_connack_view_t* psConnack)
+{
+  int success = 0;
+  uint8_t* pu8props;
+  uint32_t u32props_len;
+  if (    (psConn != 0)
+       && (mqtt_view_connack(psView, psConnack))
+       && (mqtt5_get_props(&psView->pu8body[2], psView->u32remaining_len - 2, &pu8props, &u32props_len) >= 0))
+  {
+    mqtt5_property_t sProp;
+    uint32_t u32ofs = 0;
+    int rc;
+    while ((rc = mqtt5_next_property(pu8props, u32props_len, &u32ofs, &sProp)) > 0)
+    {
+      switch (sProp.u8id)
+      {
+        case MQTT5_PROP_RECEIVE_MAXIMUM:     psConn->u16peer_receive_max = sProp.u32value;      break;
+        case MQTT5_PROP_MAXIMUM_PACKET_SIZE: psConn->u32peer_max_packet_size = sProp.u32value;  break;
+        case MQTT5_PROP_TOPIC_ALIAS_MAXIMUM: psConn->u16peer_topic_alias_max = sProp.u32value;  break;
+        case MQTT5_PROP_MAXIMUM_QOS:         psConn->u8peer_max_qos = sProp.u32value;           break;
+        case MQTT5_PROP_SESSION_EXPIRY:      psConn->u32session_expiry = sProp.u32value;        break;
+      }
+    }
+    success = (rc == 0);
+  }
+  return success;
+}
+
+int mqtt5_view_publish(mqtt5_conn_t* psConn, mqtt_view_t* psView, mqtt_publish_view_t* psPub)
+{
+  int success = 0;
+  uint8_t* pu8props;
+  uint32_t u32props_len;
+  int nbytes;
+  if (    (psConn != 0)
+       && (mqtt_view_publish(psView, psPub))
+       && ((nbytes = mqtt5_get_props(psPub->pu8payload, psPub->u32payload_len, &pu8props, &u32props_len)) >= 0))
+  {
+    mqtt5_property_t sProp;
+    uint32_t u32ofs = 0;
+    uint32_t u32alias = 0;
+    int rc;
+
+    psPub->pu8props = pu8props;
+    psPub->u32props_len = u32props_len;
+    psPub->pu8payload += nbytes;
+    psPub->u32payload_len -= nbytes;
+
+    while ((rc = mqtt5_next_property(pu8props, u32props_len, &u32ofs, &sProp)) > 0)
+    {
+      if (sProp.u8id == MQTT5_PROP_TOPIC_ALIAS)
+      {
+        u32alias = sProp.u32value;
+      }
+    }
+
+    if (rc == 0)
+    {
+      if (u32alias == 0)
+      {
+        success = (psPub->u16topic_len != 0);
+      }
+      else if (u32alias <= psConn->u16topic_alias_max)
+      {
+        mqtt5_alias_t* psAlias = &psConn->asRx[u32alias - 1];
+        if (psPub->u16topic_len == 0)
+        {
+          /* alias only: topic comes from the table */
+          psPub->pu8topic = psAlias->au8topic;
+          psPub->u16topic_len = psAlias->u16len;
+          success = (psAlias->u16len != 0);
+        }
+        else if (psPub->u16topic_len <= MQTT_TMPL_TOPIC_MAX)
+        {
+          psAlias->u16len = psPub->u16topic_len;
+          memcpy(psAlias->au8topic, psPub->pu8topic, psPub->u16topic_len);
+          success = 1;
+        }
+      }
+    }
+  }
+  return success;
+}
+
+int mqtt5_view_suback(mqtt_view_t* psView, mqtt_suback_view_t* psSuback)
+{
+  int success = 0;
+  uint8_t* pu8props;
+  uint32_t u32props_len;
+  int nbytes;
+  if (    (psView != 0)
+       && (psSuback != 0)
+       && (    (psView->u8type == CTRL_SUBACK)
+            || (psView->u8type == CTRL_UNSUBACK))
+       && (psView->u32remaining_len >= 3)
+       && ((nbytes = mqtt5_get_props(&psView->pu8body[2], psView->u32remaining_len - 2, &pu8props, &u32props_len)) >= 0)
+       && ((uint32_t)(2 + nbytes) < psView->u32remaining_len))
+  {
+    psSuback->u16msg_id = (psView->pu8body[0] << 8) | psView->pu8body[1];
+    psSuback->pu8codes = &psView->pu8body[2 + nbytes];
+    psSuback->u32ncodes = psView->u32remaining_len - (2 + nbytes);
+    success = 1;
+  }
+  return success;
+}
+
+int mqtt5_view_ack(mqtt_view_t* psView, uint16_t* pu16msg_id_out, uint8_t* pu8reason_out)
+{
+  int success = 0;
+  if (    (pu8reason_out != 0)
+       && (mqtt_view_ack(psView, pu16msg_id_out)))
+  {
+    *pu8reason_out = ((psView->u32remaining_len > 2) ? psView->pu8body[2] : 0);
+    success = 1;
+  }
+  return success;
+}
+
+
+
+
 #if defined(TEST) && (TEST == 1)
 
+/* gcc -DTEST=1 mqtt.c -o mqtt_test && ./mqtt_test - exits with 1 if a check fails */
+#include <stdio.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+
+static void test_decode_length(void)
+{
+  uint8_t au8len[] = { 0xff, 0xff, 0xff, 0x7f, 0x00 };
+  uint8_t au8bad[] = { 0x80, 0x80, 0x80, 0x80, 0x01 };
+  uint32_t u32len = 0;
+
+  /* 0 while the continuation bit asks for bytes we don't have, -1 for a fifth length byte */
+  check(mqtt_decode_length(au8len, 0, &u32len) == 0);
+  check(mqtt_decode_length(au8len, 3, &u32len) == 0);
+  check(mqtt_decode_length(au8len, 4, &u32len) == 4);
+  check(u32len == 268435455);
+  check(mqtt_decode_length(&au8len[3], 1, &u32len) == 1);
+  check(u32len == 127);
+  check(mqtt_decode_length(au8bad, 4, &u32len) == -1);
+  check(mqtt_decode_length(au8bad, 5, &u32len) == -1);
+
+  /* every length field size round-trips through the fixed header, at both ends of its range */
+  uint32_t au32edge[] = { 0, 127, 128, 16383, 16384, 2097151, 2097152, 268435455 };
+  int      ahdr_len[] = { 2, 2,   3,   3,     4,     4,       5,       5 };
+  uint8_t au8hdr[5];
+  uint32_t i;
+  for (i = 0; i < (sizeof(au32edge) / sizeof(au32edge[0])); ++i)
+  {
+    check(mqtt_encode_fixed_header(au8hdr, CTRL_PUBLISH, 0, au32edge[i]) == ahdr_len[i]);
+    check(mqtt_decode_fixed_header(au8hdr, ahdr_len[i] - 1, &u32len) == 0);
+    check(mqtt_decode_fixed_header(au8hdr, ahdr_len[i], &u32len) == ahdr_len[i]);
+    check(u32len == au32edge[i]);
+  }
+  check(mqtt_encode_fixed_header(au8hdr, CTRL_PUBLISH, 0, 268435456) == 0);
+
+  uint8_t au8malformed[] = { 0x30, 0xff, 0xff, 0xff, 0xff, 0x01 };
+  check(mqtt_decode_fixed_header(au8malformed, 5, &u32len) == -1);
+  check(mqtt_decode_fixed_header(au8malformed, 1, &u32len) == 0);
+}
+
+static void test_view(void)
+{
+  uint8_t au8buf[64];
+  mqtt_view_t sView;
+  mqtt_publish_view_t sPub;
+  int nbytes = mqtt_encode_publish_msg(au8buf, (uint8_t*)"a/b", 3, QOS_AT_LEAST_ONCE, 0x1234, (uint8_t*)"hello", 5);
+  int i;
+
+  /* 0 until the whole packet is there, then its length - never a view past the end */
+  for (i = 0; i < nbytes; ++i)
+  {
+    check(mqtt_decode_view(au8buf, i, &sView) == 0);
+  }
+  check(mqtt_decode_view(au8buf, nbytes + 3, &sView) == nbytes);
+  check((sView.u8type == CTRL_PUBLISH) && (sView.u8hdr_len == 2) && (sView.u32remaining_len == (uint32_t)(nbytes - 2)));
+  check(mqtt_view_publish(&sView, &sPub));
+  check((sPub.u8qos == QOS_AT_LEAST_ONCE) && (sPub.u16msg_id == 0x1234));
+  check((sPub.u16topic_len == 3) && (memcmp(sPub.pu8topic, "a/b", 3) == 0));
+  check((sPub.u32payload_len == 5) && (memcmp(sPub.pu8payload, "hello", 5) == 0));
+
+  /* a topic length running past the packet, or QoS 3, is rejected */
+  au8buf[3] = 60;
+  check(!mqtt_view_publish(&sView, &sPub));
+  au8buf[3] = 3;
+  sView.u8flags = (3 << 1);
+  check(!mqtt_view_publish(&sView, &sPub));
+
+  /* a QoS 1 PUBLISH too short for its packet id */
+  uint8_t au8short[] = { 0x32, 0x04, 0x00, 0x01, 'a', 0x00 };
+  check(mqtt_decode_view(au8short, sizeof(au8short), &sView) == sizeof(au8short));
+  check(!mqtt_view_publish(&sView, &sPub));
+
+  uint8_t au8bad[] = { 0x30, 0xff, 0xff, 0xff, 0xff, 0x01 };
+  check(mqtt_decode_view(au8bad, sizeof(au8bad), &sView) == -1);
+
+  /* SUBACK with any number of codes, and acks too short for a packet id */
+  uint8_t au8codes[] = { 0x00, 0x01, 0x80 };
+  mqtt_suback_view_t sSuback;
+  nbytes = mqtt_encode_suback_msg(au8buf, 9, au8codes, 3);
+  check(mqtt_decode_view(au8buf, nbytes, &sView) == nbytes);
+  check(mqtt_view_suback(&sView, &sSuback));
+  check((sSuback.u16msg_id == 9) && (sSuback.u32ncodes == 3) && (sSuback.pu8codes[2] == 0x80));
+
+  uint16_t u16msg_id = 0;
+  uint8_t au8ack[] = { CTRL_PUBACK << 4, 0x01, 0x00 };
+  check(mqtt_decode_view(au8ack, sizeof(au8ack), &sView) == sizeof(au8ack));
+  check(!mqtt_view_ack(&sView, &u16msg_id));
+
+  /* the filters of a SUBSCRIBE, one by one */
+  uint8_t* apu8topic[] = { (uint8_t*)"x/+", (uint8_t*)"#" };
+  uint16_t au16topic_len[] = { 3, 1 };
+  uint8_t au8qos[] = { 1, 0 };
+  uint32_t u32ofs = 0;
+  uint8_t* pu8filter;
+  uint16_t u16filter_len;
+  uint8_t u8qos;
+  nbytes = mqtt_encode_subscribe_msg2(au8buf, apu8topic, au16topic_len, au8qos, 2, 5);
+  check(mqtt_decode_view(au8buf, nbytes, &sView) == nbytes);
+  check(mqtt_view_ack(&sView, &u16msg_id) && (u16msg_id == 5));
+  check(mqtt_view_filter(&sView, &u32ofs, &pu8filter, &u16filter_len, &u8qos));
+  check((u16filter_len == 3) && (memcmp(pu8filter, "x/+", 3) == 0) && (u8qos == 1));
+  check(mqtt_view_filter(&sView, &u32ofs, &pu8filter, &u16filter_len, &u8qos));
+  check((u16filter_len == 1) && (pu8filter[0] == '#') && (u8qos == 0));
+  check(!mqtt_view_filter(&sView, &u32ofs, &pu8filter, &u16filter_len, &u8qos));
+}
+
+/* Decode an MQTT 5 PUBLISH with psRx's alias table and compare topic and payload */
+static int test_mqtt5_rx(mqtt5_conn_t* psRx, uint8_t* pu8pkt, int nbytes, const char* topic, const char* payload)
+{
+  mqtt_view_t sView;
+  mqtt_publish_view_t sPub;
+  return (    (mqtt_decode_view(pu8pkt, nbytes, &sView) == nbytes)
+           && (mqtt5_view_publish(psRx, &sView, &sPub))
+           && (sPub.u16topic_len == strlen(topic))
+           && (memcmp(sPub.pu8topic, topic, sPub.u16topic_len) == 0)
+           && (sPub.u32payload_len == strlen(payload))
+           && (memcmp(sPub.pu8payload, payload, sPub.u32payload_len) == 0));
+}
+
+static void test_mqtt5(void)
+{
+  mqtt5_conn_t sTx, sRx, sFresh;
+  mqtt_view_t sView;
+  mqtt_connack_view_t sConnack;
+  uint8_t au8pkt[128];
+  uint8_t au8pkt2[128];
+  int n1, n2;
+
+  mqtt5_init(&sTx, 0, 0, 0);
+  mqtt5_init(&sRx, 0, 0, 4);
+  mqtt5_init(&sFresh, 0, 0, 4);
+
+  /* no aliases before the broker allows them */
+  n1 = mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)"s/t", 3, QOS_AT_MOST_ONCE, 0, (uint8_t*)"1", 1);
+  n2 = mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)"s/t", 3, QOS_AT_MOST_ONCE, 0, (uint8_t*)"1", 1);
+  check((n1 == 9) && (n2 == n1));
+
+  /* CONNACK: topic alias maximum 4, maximum packet size 64 */
+  uint8_t au8connack[] = { 0x20, 11, 0x00, 0x00, 8, MQTT5_PROP_TOPIC_ALIAS_MAXIMUM, 0x00, 0x04, MQTT5_PROP_MAXIMUM_PACKET_SIZE, 0x00, 0x00, 0x00, 64 };
+  check(mqtt_decode_view(au8connack, sizeof(au8connack), &sView) == sizeof(au8connack));
+  check(mqtt5_view_connack(&sTx, &sView, &sConnack));
+  check((sTx.u16peer_topic_alias_max == 4) && (sTx.u32peer_max_packet_size == 64));
+
+  /* the first PUBLISH maps the alias, the next one leaves the topic out */
+  n1 = mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)"sensors/t", 9, QOS_AT_LEAST_ONCE, 1, (uint8_t*)"1", 1);
+  n2 = mqtt5_encode_publish_msg(&sTx, au8pkt2, (uint8_t*)"sensors/t", 9, QOS_AT_LEAST_ONCE, 2, (uint8_t*)"2", 1);
+  check((n1 > 0) && (n2 == (n1 - 9)));
+  check(!test_mqtt5_rx(&sFresh, au8pkt2, n2, "sensors/t", "2")); /* alias nobody mapped */
+  check(test_mqtt5_rx(&sRx, au8pkt, n1, "sensors/t", "1"));
+  check(test_mqtt5_rx(&sRx, au8pkt2, n2, "sensors/t", "2"));
+
+  /* with all 4 aliases taken the oldest is mapped again, and the receiver follows */
+  const char* topics[] = { "t/1", "t/2", "t/3", "t/4" };
+  uint32_t i;
+  for (i = 0; i < 4; ++i)
+  {
+    n1 = mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)topics[i], 3, QOS_AT_MOST_ONCE, 0, (uint8_t*)"x", 1);
+    check(test_mqtt5_rx(&sRx, au8pkt, n1, topics[i], "x"));
+  }
+  n1 = mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)"t/4", 3, QOS_AT_MOST_ONCE, 0, (uint8_t*)"y", 1);
+  check(test_mqtt5_rx(&sRx, au8pkt, n1, "t/4", "y"));
+  n1 = mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)"sensors/t", 9, QOS_AT_MOST_ONCE, 0, (uint8_t*)"z", 1);
+  check(test_mqtt5_rx(&sRx, au8pkt, n1, "sensors/t", "z"));
+
+  /* nothing larger than the broker's maximum packet size is encoded */
+  check(mqtt5_encode_publish_msg(&sTx, au8pkt, (uint8_t*)"big", 3, QOS_AT_MOST_ONCE, 0, au8pkt2, 64) == 0);
+
+  /* property walking stops at a truncated or unknown property */
+  mqtt5_property_t sProp;
+  uint8_t au8props[] = { MQTT5_PROP_TOPIC_ALIAS, 0x00, 0x07, MQTT5_PROP_TOPIC_ALIAS, 0x00 };
+  uint8_t au8unknown[] = { 0x00, 0x01 };
+  uint32_t u32ofs = 0;
+  check((mqtt5_next_property(au8props, 3, &u32ofs, &sProp) == 1) && (sProp.u32value == 7));
+  check(mqtt5_next_property(au8props, 3, &u32ofs, &sProp) == 0);
+  check(mqtt5_next_property(au8props, sizeof(au8props), &u32ofs, &sProp) == -1);
+  u32ofs = 0;
+  check(mqtt5_next_property(au8unknown, sizeof(au8unknown), &u32ofs, &sProp) == -1);
+}
+
+static void test_batch(void)
+{
+  uint8_t au8buf[256];
+  uint32_t au32len[6];
+  uint32_t u32len = 0;
+  uint8_t au8codes[] = { 0x01, 0x80 };
+
+  au32len[0] = mqtt_encode_publish_msg(&au8buf[u32len], (uint8_t*)"a/b", 3, QOS_AT_LEAST_ONCE, 11, (uint8_t*)"hello", 5);
+  u32len += au32len[0];
+  au32len[1] = mqtt_encode_puback_msg(&au8buf[u32len], 12);
+  u32len += au32len[1];
+  au32len[2] = mqtt_encode_publish_msg(&au8buf[u32len], (uint8_t*)"c", 1, QOS_AT_MOST_ONCE, 0, 0, 0);
+  u32len += au32len[2];
+  au32len[3] = mqtt_encode_pubrec_msg(&au8buf[u32len], 13);
+  u32len += au32len[3];
+  au32len[4] = mqtt_encode_suback_msg(&au8buf[u32len], 14, au8codes, 2);
+  u32len += au32len[4];
+  au32len[5] = mqtt_encode_publish_msg(&au8buf[u32len], (uint8_t*)"d", 1, QOS_AT_MOST_ONCE, 0, (uint8_t*)"partial", 7);
+  uint32_t u32whole = u32len;
+  u32len += au32len[5] - 1; /* the last packet is one byte short */
+
+  uint8_t  au8type[5], au8flags[5], au8ack_type[5];
+  uint16_t au16msg_id[5], au16topic_len[5], au16ack_id[5];
+  uint32_t au32offset[5], au32length[5], au32topic_ofs[5], au32payload_ofs[5], au32payload_len[5];
+  mqtt_batch_t sBatch = { 5, 0, au8type, au8flags, au32offset, au32length, au16msg_id, au32topic_ofs, au16topic_len,
+                          au32payload_ofs, au32payload_len, 0, au8ack_type, au16ack_id };
+
+  /* room for all: the five complete packets, the partial one is left */
+  check(mqtt_decode_batch(au8buf, u32len, &sBatch) == (int)u32whole);
+  check((sBatch.u32count == 5) && (sBatch.u32nacks == 3));
+  check((au8type[0] == CTRL_PUBLISH) && (au16msg_id[0] == 11) && (au8flags[0] == (QOS_AT_LEAST_ONCE << 1)));
+  check((au16topic_len[0] == 3) && (memcmp(&au8buf[au32topic_ofs[0]], "a/b", 3) == 0));
+  check((au32payload_len[0] == 5) && (memcmp(&au8buf[au32payload_ofs[0]], "hello", 5) == 0));
+  check((au8type[2] == CTRL_PUBLISH) && (au16msg_id[2] == 0) && (au32payload_len[2] == 0));
+  check((au8ack_type[0] == CTRL_PUBACK) && (au16ack_id[0] == 12));
+  check((au8ack_type[1] == CTRL_PUBREC) && (au16ack_id[1] == 13));
+  check((au8ack_type[2] == CTRL_SUBACK) && (au16ack_id[2] == 14));
+  uint32_t i, u32ofs = 0;
+  for (i = 0; i < 5; ++i)
+  {
+    check((au32offset[i] == u32ofs) && (au32length[i] == au32len[i]));
+    u32ofs += au32len[i];
+  }
+
+  /* at the cap: stops after u32cap packets and says how far it got */
+  sBatch.u32cap = 2;
+  check(mqtt_decode_batch(au8buf, u32len, &sBatch) == (int)(au32len[0] + au32len[1]));
+  check((sBatch.u32count == 2) && (sBatch.u32nacks == 1));
+  sBatch.u32cap = 0;
+  check(mqtt_decode_batch(au8buf, u32len, &sBatch) == 0);
+  check(sBatch.u32count == 0);
+
+  /* a partial first packet is not consumed, and empty input is fine */
+  sBatch.u32cap = 5;
+  check(mqtt_decode_batch(au8buf, au32len[0] - 1, &sBatch) == 0);
+  check(sBatch.u32count == 0);
+  check(mqtt_decode_batch(au8buf, 0, &sBatch) == 0);
+
+  /* malformed: QoS 3, a topic past the end of its packet, an ack without packet id */
+  uint8_t au8qos3[] = { 0x36, 0x03, 0x00, 0x01, 'a' };
+  uint8_t au8topic[] = { 0x30, 0x03, 0x00, 0x09, 'a' };
+  uint8_t au8ack[] = { CTRL_PUBACK << 4, 0x01, 0x00 };
+  check(mqtt_decode_batch(au8qos3, sizeof(au8qos3), &sBatch) == -1);
+  check(mqtt_decode_batch(au8topic, sizeof(au8topic), &sBatch) == -1);
+  check(mqtt_decode_batch(au8ack, sizeof(au8ack), &sBatch) == -1);
+}
+
+
 int main(void)
 {
   // int mqtt_encode_connect_msg2(uint8_t* pu8dst, uint8_t u8conn_flgs, uint16_t u16keepalive, uint8_t* pu8clientid, uint16_t u16clientid_len)
@@ -433,8 +1804,13 @@ int main(void)
   printf("puback(msg) = %d \n", mqtt_decode_puback_msg(au8puback_msg, sizeof(au8puback_msg), &u16msg_id));
 
 
+  test_decode_length();
+  test_view();
+  test_mqtt5();
+  test_batch();
 
-  return 0;
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
 }
 
 #endif
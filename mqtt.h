@@ -1,7 +1,39 @@
+#ifndef _MQTT_H_
+#define _MQTT_H_
+
 #include <stdint.h>
 
-/* Max number of topics one can subscribe to in a single SUBSCRIBE message */
-#define MSG_SUB_MAXNTOPICS 8 
+/* Max number of topics one can subscribe to in a single SUBSCRIBE message with mqtt_encode_subscribe_msg2(),
+   see mqtt_encode_subscribe_packed() for more */
+#define MSG_SUB_MAXNTOPICS 8
+
+/* Size of PUBACK, PUBREC, PUBREL and PUBCOMP packets */
+#define MQTT_ACK_MSG_LEN 4
+
+/* DUP flag in the fixed header of a retransmitted PUBLISH */
+#define MQTT_FLAG_DUP    0x08
+
+/* Max size of the scratch header used by mqtt_encode_publish_iov: fixed header (5) + topic-len (2) + msg-id (2) */
+#define MQTT_PUBLISH_HDR_MAX 9
+
+/* Longest topic a prepared publish template can hold */
+#define MQTT_TMPL_TOPIC_MAX  128
+
+/* Connect flags for mqtt_encode_connect_msg2: without CLEAN_SESSION the broker keeps subscriptions and
+   undelivered QoS 1/2 messages across connections, see mqtt_decode_connack_msg2() */
+#define MQTT_CONNECT_CLEAN_SESSION 0x02
+
+/* Protocol level byte in CONNECT */
+#define MQTT_PROTOCOL_V311   4
+#define MQTT_PROTOCOL_V5     5
+
+/* MQTT 5: scratch header for mqtt5_encode_publish_iov: fixed header (5) + topic-len (2) + msg-id (2) + property-len (1) + topic alias (3) */
+#define MQTT5_PUBLISH_HDR_MAX 13
+
+/* MQTT 5: max number of topic aliases kept per direction and connection */
+#ifndef MQTT5_TOPIC_ALIAS_MAX
+ #define MQTT5_TOPIC_ALIAS_MAX 16
+#endif
 
 /* Control Command Types */
 enum
@@ -31,6 +63,173 @@ enum
 };
 
 
+/* MQTT 5 property identifiers */
+enum
+{
+  MQTT5_PROP_PAYLOAD_FORMAT       = 0x01,
+  MQTT5_PROP_MESSAGE_EXPIRY       = 0x02,
+  MQTT5_PROP_CONTENT_TYPE         = 0x03,
+  MQTT5_PROP_RESPONSE_TOPIC       = 0x08,
+  MQTT5_PROP_CORRELATION_DATA     = 0x09,
+  MQTT5_PROP_SUBSCRIPTION_ID      = 0x0B,
+  MQTT5_PROP_SESSION_EXPIRY       = 0x11,
+  MQTT5_PROP_ASSIGNED_CLIENT_ID   = 0x12,
+  MQTT5_PROP_SERVER_KEEPALIVE     = 0x13,
+  MQTT5_PROP_AUTH_METHOD          = 0x15,
+  MQTT5_PROP_AUTH_DATA            = 0x16,
+  MQTT5_PROP_REQUEST_PROBLEM_INFO = 0x17,
+  MQTT5_PROP_WILL_DELAY           = 0x18,
+  MQTT5_PROP_REQUEST_RESPONSE_INFO= 0x19,
+  MQTT5_PROP_RESPONSE_INFO        = 0x1A,
+  MQTT5_PROP_SERVER_REFERENCE     = 0x1C,
+  MQTT5_PROP_REASON_STRING        = 0x1F,
+  MQTT5_PROP_RECEIVE_MAXIMUM      = 0x21,
+  MQTT5_PROP_TOPIC_ALIAS_MAXIMUM  = 0x22,
+  MQTT5_PROP_TOPIC_ALIAS          = 0x23,
+  MQTT5_PROP_MAXIMUM_QOS          = 0x24,
+  MQTT5_PROP_RETAIN_AVAILABLE     = 0x25,
+  MQTT5_PROP_USER_PROPERTY        = 0x26,
+  MQTT5_PROP_MAXIMUM_PACKET_SIZE  = 0x27,
+  MQTT5_PROP_WILDCARD_SUB_AVAIL   = 0x28,
+  MQTT5_PROP_SUB_ID_AVAIL         = 0x29,
+  MQTT5_PROP_SHARED_SUB_AVAIL     = 0x2A,
+};
+
+
+/* Scatter/gather element: points into memory owned by the caller */
+typedef struct
+{
+  uint8_t* pu8data;
+  uint32_t u32len;
+} mqtt_iov_t;
+
+/* In-place view of one complete packet in a receive buffer */
+typedef struct
+{
+  uint8_t  u8type;            /* CTRL_xxx */
+  uint8_t  u8flags;           /* low nibble of the first byte */
+  uint8_t  u8hdr_len;         /* fixed header length [2:5] */
+  uint32_t u32remaining_len;
+  uint8_t* pu8pkt;            /* first byte of the packet */
+  uint8_t* pu8body;           /* variable header, pu8pkt + u8hdr_len */
+} mqtt_view_t;
+
+typedef struct
+{
+  uint8_t  u8qos;
+  uint8_t  u8dup;
+  uint8_t  u8retain;
+  uint16_t u16msg_id;         /* 0 for QoS 0 */
+  uint16_t u16topic_len;
+  uint8_t* pu8topic;
+  uint8_t* pu8payload;
+  uint32_t u32payload_len;
+  uint8_t* pu8props;          /* MQTT 5 only: properties, walk with mqtt5_next_property() */
+  uint32_t u32props_len;
+} mqtt_publish_view_t;
+
+typedef struct
+{
+  uint16_t u16msg_id;
+  uint32_t u32ncodes;         /* one return code per topic filter in the SUBSCRIBE */
+  uint8_t* pu8codes;          /* granted QoS [0:2] or 0x80 for failure */
+} mqtt_suback_view_t;
+
+typedef struct
+{
+  uint8_t  u8session_present;
+  uint8_t  u8return_code;     /* 0 = accepted */
+} mqtt_connack_view_t;
+
+typedef struct
+{
+  uint8_t  u8protocol;        /* MQTT_PROTOCOL_V311, MQTT_PROTOCOL_V5 */
+  uint8_t  u8flags;           /* connect flags, e.g. MQTT_CONNECT_CLEAN_SESSION */
+  uint16_t u16keepalive;      /* seconds, 0 = none */
+  uint8_t* pu8clientid;
+  uint16_t u16clientid_len;
+} mqtt_connect_view_t;
+
+/*
+   Batch decode: one pass over a receive buffer describes every complete packet
+   in parallel arrays (structure of arrays), all u32cap long and supplied by the
+   caller. Offsets are relative to the start of the decoded buffer. The ids of
+   all acknowledgements are listed once more, in order, in au8ack_type/au16ack_id.
+*/
+typedef struct
+{
+  uint32_t  u32cap;           /* length of every array */
+  uint32_t  u32count;         /* packets described */
+  uint8_t*  au8type;          /* CTRL_xxx */
+  uint8_t*  au8flags;         /* low nibble of the first byte */
+  uint32_t* au32offset;       /* first byte of the packet */
+  uint32_t* au32length;       /* whole packet, fixed header included */
+  uint16_t* au16msg_id;       /* 0 if the packet has none */
+  uint32_t* au32topic_ofs;    /* PUBLISH: topic span, 0 length for other packets */
+  uint16_t* au16topic_len;
+  uint32_t* au32payload_ofs;  /* PUBLISH: payload span - with MQTT 5 it starts with the property block */
+  uint32_t* au32payload_len;
+  uint32_t  u32nacks;         /* PUBACK, PUBREC, PUBREL, PUBCOMP, SUBACK and UNSUBACK */
+  uint8_t*  au8ack_type;
+  uint16_t* au16ack_id;
+} mqtt_batch_t;
+
+/* MQTT 5: one decoded property - pointers reference the packet */
+typedef struct
+{
+  uint8_t  u8id;              /* MQTT5_PROP_xxx */
+  uint32_t u32value;          /* byte, two/four byte integer and variable byte integer properties */
+  uint8_t* pu8data;           /* string and binary properties, name of a user property */
+  uint16_t u16data_len;
+  uint8_t* pu8data2;          /* value of a user property */
+  uint16_t u16data2_len;
+} mqtt5_property_t;
+
+typedef struct
+{
+  uint16_t u16len;            /* 0 = unused */
+  uint8_t  au8topic[MQTT_TMPL_TOPIC_MAX];
+} mqtt5_alias_t;
+
+/*
+   MQTT 5 per-connection state: the limits we announce in CONNECT, the limits
+   the broker returned in CONNACK and both topic alias tables. Aliases only live
+   as long as the network connection, mqtt5_encode_connect_msg() clears them.
+*/
+typedef struct
+{
+  /* ours, sent in CONNECT */
+  uint32_t u32session_expiry;       /* seconds, 0 = session ends with the connection */
+  uint32_t u32max_packet_size;      /* 0 = no limit */
+  uint16_t u16receive_max;          /* inbound QoS 1/2 PUBLISHes we accept unacknowledged */
+  uint16_t u16topic_alias_max;      /* inbound aliases the broker may use [0:MQTT5_TOPIC_ALIAS_MAX] */
+
+  /* broker's, from CONNACK */
+  uint32_t u32peer_max_packet_size; /* 0 = no limit */
+  uint16_t u16peer_receive_max;
+  uint16_t u16peer_topic_alias_max;
+  uint8_t  u8peer_max_qos;
+
+  uint16_t u16next_alias;           /* next outbound alias to (re)assign, round-robin */
+  mqtt5_alias_t asTx[MQTT5_TOPIC_ALIAS_MAX];
+  mqtt5_alias_t asRx[MQTT5_TOPIC_ALIAS_MAX];
+} mqtt5_conn_t;
+
+/*
+   Prepared publish: topic, topic-length and flags are encoded once by
+   mqtt_prepare_publish(). au8buf is laid out as
+     [ fixed header, right-aligned in 5 bytes ][ topic-len ][ topic ][ msg-id ]
+   and each send only patches remaining-length and msg-id in place.
+*/
+typedef struct
+{
+  uint32_t u32fixed_len;  /* remaining length minus the payload */
+  uint16_t u16topic_len;
+  uint8_t  u8qos;
+  uint8_t  u8hdr0;        /* first byte of the fixed header */
+  uint8_t  au8buf[5 + 2 + MQTT_TMPL_TOPIC_MAX + 2];
+} mqtt_publish_tmpl_t;
+
 
 /* Simple connect: No username/password, no QoS etc. */
 int mqtt_encode_connect_msg(uint8_t* pu8dst, uint8_t* pu8clientid, uint16_t u16clientid_len); /* u8conn_flgs = 2, u16keepalive = 60 */
@@ -39,17 +238,92 @@ int mqtt_encode_connect_msg2(uint8_t* pu8dst, uint8_t u8conn_flgs, uint16_t u16k
 int mqtt_encode_disconnect_msg(uint8_t* pu8dst);
 int mqtt_encode_ping_msg(uint8_t* pu8dst);
 int mqtt_encode_publish_msg(uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len);
+int mqtt_encode_puback_msg(uint8_t* pu8dst, uint16_t u16msg_id);
+int mqtt_encode_pubrec_msg(uint8_t* pu8dst, uint16_t u16msg_id);
+int mqtt_encode_pubrel_msg(uint8_t* pu8dst, uint16_t u16msg_id);
+int mqtt_encode_pubcomp_msg(uint8_t* pu8dst, uint16_t u16msg_id);
+/* Zero-copy publish: header bytes go into pu8hdr[MQTT_PUBLISH_HDR_MAX], asIov[4] references pu8hdr, topic and payload.
+   Returns total packet length, *pu32niov is set to the number of iov entries used. */
+int mqtt_encode_publish_iov(uint8_t* pu8hdr, mqtt_iov_t* asIov, uint32_t* pu32niov, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len);
+/* Prepared publish: encode topic and QoS once, then send many times. Returns 1 on success */
+int mqtt_prepare_publish(mqtt_publish_tmpl_t* psTmpl, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos);
+/* asIov[2] references the template and the payload - valid until the template is used again. Returns total packet length */
+int mqtt_encode_prepared_publish_iov(mqtt_publish_tmpl_t* psTmpl, mqtt_iov_t* asIov, uint32_t* pu32niov, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len);
+int mqtt_encode_prepared_publish_msg(mqtt_publish_tmpl_t* psTmpl, uint8_t* pu8dst, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len);
 int mqtt_encode_subscribe_msg(uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id);
 int mqtt_encode_subscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id);
 int mqtt_encode_unsubscribe_msg(uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id);
 int mqtt_encode_unsubscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id);
+/* Bulk (UN)SUBSCRIBE: as many filters as fit in u32max_len bytes, starting with the first. Returns the packet
+   length, 0 if not even the first one fits, and sets *pu32npacked to the number of filters in the packet. */
+int mqtt_encode_subscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked);
+int mqtt_encode_unsubscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked);
+/* Broker side replies */
+int mqtt_encode_connack_msg(uint8_t* pu8dst, uint8_t u8session_present, uint8_t u8return_code);
+int mqtt_encode_suback_msg(uint8_t* pu8dst, uint16_t u16msg_id, uint8_t* au8codes, uint32_t u32ncodes);
+int mqtt_encode_unsuback_msg(uint8_t* pu8dst, uint16_t u16msg_id);
+int mqtt_encode_pingresp_msg(uint8_t* pu8dst);
 
 int mqtt_decode_connack_msg(uint8_t* pu8src, uint32_t u32nbytes);
+/* As above, and *pu8session_present = 1 if the broker resumed the session (subscriptions are still in place) */
+int mqtt_decode_connack_msg2(uint8_t* pu8src, uint32_t u32nbytes, uint8_t* pu8session_present);
 int mqtt_decode_pingresp_msg(uint8_t* pu8src, uint32_t u32nbytes);
 int mqtt_decode_puback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id);
+int mqtt_decode_pubrec_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id);
+int mqtt_decode_pubrel_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id);
+int mqtt_decode_pubcomp_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id);
+/* Any number of return codes - read them with mqtt_view_suback() */
 int mqtt_decode_suback_msg(uint8_t* pu8src, uint32_t u32nbytes, uint16_t* pu16msg_id_out);
 
+/* Write just the fixed header of a packet whose variable header and payload are sent separately.
+   Returns header length [2:5], or 0 if u32remaining_len is too large */
+int mqtt_encode_fixed_header(uint8_t* pu8dst, uint8_t u8ctrl_type, uint8_t u8flgs, uint32_t u32remaining_len);
+/* Parse the fixed header of a (possibly partial) packet in a byte stream.
+   Returns header length [2:5], 0 if more bytes are needed, or -1 if malformed.
+   A complete packet is available once u32nbytes >= header length + *pu32remaining_len */
+int mqtt_decode_fixed_header(uint8_t* pu8src, uint32_t u32nbytes, uint32_t* pu32remaining_len);
+/* Zero-copy decoding: returns packet length if pu8src holds a complete packet, 0 if more bytes are needed, -1 if malformed */
+int mqtt_decode_view(uint8_t* pu8src, uint32_t u32nbytes, mqtt_view_t* psView);
+int mqtt_view_publish(mqtt_view_t* psView, mqtt_publish_view_t* psPub);
+int mqtt_view_suback(mqtt_view_t* psView, mqtt_suback_view_t* psSuback);
+int mqtt_view_connack(mqtt_view_t* psView, mqtt_connack_view_t* psConnack);
+/* PUBACK, PUBREC, PUBREL, PUBCOMP and UNSUBACK - and the packet id of a SUBSCRIBE / UNSUBSCRIBE */
+int mqtt_view_ack(mqtt_view_t* psView, uint16_t* pu16msg_id_out);
+/* Broker side: the fixed part of a CONNECT, will and credentials are not looked at */
+int mqtt_view_connect(mqtt_view_t* psView, mqtt_connect_view_t* psConnect);
+/* Broker side: next topic filter of a SUBSCRIBE (with its requested QoS) or UNSUBSCRIBE. Start with *pu32ofs = 0,
+   read the packet id with mqtt_view_ack(). Returns 0 after the last one. */
+int mqtt_view_filter(mqtt_view_t* psView, uint32_t* pu32ofs, uint8_t** ppu8filter, uint16_t* pu16filter_len, uint8_t* pu8qos);
+/* Describe the complete packets in pu8src, up to psBatch->u32cap of them. Returns the number of bytes
+   they take (a trailing partial packet is left alone), or -1 for a malformed packet. */
+int mqtt_decode_batch(uint8_t* pu8src, uint32_t u32nbytes, mqtt_batch_t* psBatch);
 int mqtt_decode_msg(uint8_t* pu8src, uint8_t* pu8ctrl_type, uint8_t* pu8flgs, uint8_t* pu8data_out, uint32_t* pu32output_len);
 int mqtt_decode_publish_msg(uint8_t* pu8src, uint32_t u32nbytes, uint8_t* pu8qos, uint16_t* pu16msg_id_out, uint16_t* pu16topic_len, uint8_t** ppu8topic, uint8_t** ppu8payload);
 
+/*
+   MQTT 5 codec mode - choose it by connecting with mqtt5_encode_connect_msg().
+   PINGREQ, DISCONNECT and the outbound acks are encoded as in 3.1.1.
+*/
+int mqtt5_init(mqtt5_conn_t* psConn, uint16_t u16receive_max, uint32_t u32max_packet_size, uint16_t u16topic_alias_max);
+int mqtt5_encode_connect_msg(mqtt5_conn_t* psConn, uint8_t* pu8dst, uint8_t u8conn_flgs, uint16_t u16keepalive, uint8_t* pu8clientid, uint16_t u16clientid_len);
+/* Like mqtt_encode_publish_iov but pu8hdr holds MQTT5_PUBLISH_HDR_MAX bytes. Repeated topics are replaced by a topic alias
+   once the broker allows it. Returns 0 if the packet would exceed the broker's maximum packet size */
+int mqtt5_encode_publish_iov(mqtt5_conn_t* psConn, uint8_t* pu8hdr, mqtt_iov_t* asIov, uint32_t* pu32niov, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len);
+int mqtt5_encode_publish_msg(mqtt5_conn_t* psConn, uint8_t* pu8dst, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint16_t u16msg_id, uint8_t* pu8payload, uint32_t u32data_len);
+int mqtt5_encode_subscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id);
+int mqtt5_encode_unsubscribe_msg2(uint8_t* pu8dst, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id);
+/* Pass psConn->u32peer_max_packet_size (if not 0) as u32max_len */
+int mqtt5_encode_subscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint8_t* au8qos, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked);
+int mqtt5_encode_unsubscribe_packed(uint8_t* pu8dst, uint32_t u32max_len, uint8_t** apu8topic, uint16_t* au16topic_len, uint32_t u32nargs, uint16_t u16msg_id, uint32_t* pu32npacked);
+/* Reads the broker's limits into psConn */
+int mqtt5_view_connack(mqtt5_conn_t* psConn, mqtt_view_t* psView, mqtt_connack_view_t* psConnack);
+/* Resolves inbound topic aliases: pu8topic may point into psConn's alias table */
+int mqtt5_view_publish(mqtt5_conn_t* psConn, mqtt_view_t* psView, mqtt_publish_view_t* psPub);
+/* SUBACK, and UNSUBACK which has a reason code per filter in MQTT 5 too */
+int mqtt5_view_suback(mqtt_view_t* psView, mqtt_suback_view_t* psSuback);
+/* PUBACK, PUBREC, PUBREL, PUBCOMP and UNSUBACK - reason code 0 if the broker omitted it */
+int mqtt5_view_ack(mqtt_view_t* psView, uint16_t* pu16msg_id_out, uint8_t* pu8reason_out);
+/* Walk a property block: returns 1 and advances *pu32ofs per property, 0 at the end, -1 if malformed */
+int mqtt5_next_property(uint8_t* pu8props, uint32_t u32props_len, uint32_t* pu32ofs, mqtt5_property_t* psProp);
 
+#endif /* _MQTT_H_ */
@@ -0,0 +1,263 @@
+/*
+   Codec microbenchmark for mqtt.c
+
+   Measures ns/op and MB/s of the encoders and decoders across payload sizes
+   that exercise every width of the remaining-length field (1-4 bytes) and
+   every QoS level. Output is CSV on stdout, one line per case:
+
+     op,qos,payload_bytes,packet_bytes,len_bytes,iterations,ns_per_op,mb_per_s
+
+   Compile and run:
+
+     gcc -O2 mqtt.c mqtt_bench.c -o mqtt_bench
+     ./mqtt_bench [min-ms-per-case]
+*/
+#include "mqtt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define MAX_PAYLOAD  (2 * 1024 * 1024 + 64) /* 4-byte remaining-length needs >= 2 MB */
+#define TOPIC        "bench/sensor/temperature"
+
+static uint8_t au8payload[MAX_PAYLOAD];
+static uint8_t au8pkt[MAX_PAYLOAD + 64];
+static uint8_t au8out[MAX_PAYLOAD + 64];
+
+/* Keeps the compiler from optimizing away the work being measured */
+static volatile uint32_t u32sink;
+
+static uint32_t min_ns = 50 * 1000 * 1000;
+
+static const uint32_t au32sizes[] =
+{
+  0,                    /* 1 byte remaining-length  */
+  16,
+  100,
+  1024,                 /* 2 bytes remaining-length */
+  8 * 1024,
+  64 * 1024,            /* 3 bytes remaining-length */
+  256 * 1024,
+  2 * 1024 * 1024,      /* 4 bytes remaining-length */
+};
+#define NSIZES (sizeof(au32sizes) / sizeof(au32sizes[0]))
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static int len_bytes(uint32_t u32pkt_len)
+{
+  uint32_t u32remaining_len;
+  int hdr_len = mqtt_decode_fixed_header(au8pkt, u32pkt_len, &u32remaining_len);
+  return hdr_len - 1;
+}
+
+static void report(const char* op, int qos, uint32_t u32payload, uint32_t u32pkt_len, uint32_t u32iters, uint64_t u64ns)
+{
+  double ns_per_op = (double)u64ns / u32iters;
+  double mb_per_s = (u32pkt_len * 1000.0) / ns_per_op; /* bytes/ns * 1000 = MB/s */
+  printf("%s,%d,%u,%u,%d,%u,%.1f,%.1f\n", op, qos, u32payload, u32pkt_len, len_bytes(u32pkt_len), u32iters, ns_per_op, mb_per_s);
+}
+
+/* Run body in doubling batches until one batch takes at least min_ns, then report it */
+#define BENCH(op, qos, payload, pkt_len, body)                   \
+  do {                                                           \
+    uint32_t u32iters = 1;                                       \
+    uint64_t u64elapsed;                                         \
+    for (;;)                                                     \
+    {                                                            \
+      uint32_t it;                                               \
+      uint64_t u64start = now_ns();                              \
+      for (it = 0; it < u32iters; ++it)                          \
+      {                                                          \
+        body;                                                    \
+      }                                                          \
+      u64elapsed = now_ns() - u64start;                          \
+      if ((u64elapsed >= min_ns) || (u32iters >= (1u << 30)))    \
+        break;                                                   \
+      u32iters *= 2;                                             \
+    }                                                            \
+    report(op, qos, payload, pkt_len, u32iters, u64elapsed);     \
+  } while (0)
+
+
+static void bench_publish(uint32_t u32size, uint8_t u8qos)
+{
+  uint16_t u16topic_len = strlen(TOPIC);
+  int pkt_len = mqtt_encode_publish_msg(au8pkt, (uint8_t*)TOPIC, u16topic_len, u8qos, 4711, au8payload, u32size);
+  if (pkt_len <= 0)
+  {
+    fprintf(stderr, "encode failed: size=%u qos=%u\n", u32size, u8qos);
+    exit(1);
+  }
+
+  /* Verify round trip before timing anything */
+  {
+    uint8_t u8qos_out, u8ctrl, u8flgs;
+    uint16_t u16msg_id, u16tlen;
+    uint8_t* pu8topic;
+    uint8_t* pu8pay;
+    uint32_t u32out_len;
+    if (    (!mqtt_decode_publish_msg(au8pkt, pkt_len, &u8qos_out, &u16msg_id, &u16tlen, &pu8topic, &pu8pay))
+         || (u8qos_out != u8qos)
+         || (u16tlen != u16topic_len)
+         || ((uint32_t)(&au8pkt[pkt_len] - pu8pay) != u32size)
+         || (mqtt_decode_msg(au8pkt, &u8ctrl, &u8flgs, au8out, &u32out_len) != pkt_len)
+         || (u8ctrl != CTRL_PUBLISH))
+    {
+      fprintf(stderr, "round trip failed: size=%u qos=%u\n", u32size, u8qos);
+      exit(1);
+    }
+  }
+
+  BENCH("encode_publish", u8qos, u32size, pkt_len,
+        u32sink += mqtt_encode_publish_msg(au8pkt, (uint8_t*)TOPIC, u16topic_len, u8qos, 4711, au8payload, u32size));
+
+  {
+    uint8_t au8hdr[MQTT_PUBLISH_HDR_MAX];
+    mqtt_iov_t asIov[4];
+    uint32_t u32niov;
+    BENCH("encode_publish_iov", u8qos, u32size, pkt_len,
+          u32sink += mqtt_encode_publish_iov(au8hdr, asIov, &u32niov, (uint8_t*)TOPIC, u16topic_len, u8qos, 4711, au8payload, u32size));
+  }
+
+  {
+    mqtt_publish_tmpl_t sTmpl;
+    mqtt_iov_t asIov[2];
+    uint32_t u32niov;
+    mqtt_prepare_publish(&sTmpl, (uint8_t*)TOPIC, u16topic_len, u8qos);
+    if (    (mqtt_encode_prepared_publish_msg(&sTmpl, au8out, 4711, au8payload, u32size) != pkt_len)
+         || (memcmp(au8out, au8pkt, pkt_len) != 0))
+    {
+      fprintf(stderr, "prepared publish differs: size=%u qos=%u\n", u32size, u8qos);
+      exit(1);
+    }
+    BENCH("encode_prepared_iov", u8qos, u32size, pkt_len,
+          u32sink += mqtt_encode_prepared_publish_iov(&sTmpl, asIov, &u32niov, 4711, au8payload, u32size));
+  }
+
+  {
+    uint8_t u8ctrl, u8flgs;
+    uint32_t u32out_len;
+    BENCH("decode_msg", u8qos, u32size, pkt_len,
+          u32sink += mqtt_decode_msg(au8pkt, &u8ctrl, &u8flgs, au8out, &u32out_len));
+  }
+
+  {
+    uint8_t u8qos_out;
+    uint16_t u16msg_id, u16tlen;
+    uint8_t* pu8topic;
+    uint8_t* pu8pay;
+    BENCH("decode_publish", u8qos, u32size, pkt_len,
+          u32sink += mqtt_decode_publish_msg(au8pkt, pkt_len, &u8qos_out, &u16msg_id, &u16tlen, &pu8topic, &pu8pay));
+  }
+}
+
+static void bench_subscribe(uint32_t u32ntopics, uint8_t u8qos)
+{
+  uint8_t* apu8topic[MSG_SUB_MAXNTOPICS];
+  uint16_t au16topic_len[MSG_SUB_MAXNTOPICS];
+  uint8_t au8qos[MSG_SUB_MAXNTOPICS];
+  uint32_t i;
+  for (i = 0; i < u32ntopics; ++i)
+  {
+    apu8topic[i] = (uint8_t*)TOPIC;
+    au16topic_len[i] = strlen(TOPIC);
+    au8qos[i] = u8qos;
+  }
+
+  int pkt_len = mqtt_encode_subscribe_msg2(au8pkt, apu8topic, au16topic_len, au8qos, u32ntopics, 4711);
+  if (pkt_len <= 0)
+  {
+    fprintf(stderr, "encode failed: subscribe ntopics=%u\n", u32ntopics);
+    exit(1);
+  }
+  /* payload column holds the number of topic filters for subscribe */
+  BENCH("encode_subscribe", u8qos, u32ntopics, pkt_len,
+        u32sink += mqtt_encode_subscribe_msg2(au8pkt, apu8topic, au16topic_len, au8qos, u32ntopics, 4711));
+}
+
+/* A receive buffer of small PUBLISHes and PUBACKs: one batch pass vs. a view per packet */
+#define BATCH_NPKTS  64
+static void bench_batch(uint8_t u8qos)
+{
+  uint8_t  au8type[BATCH_NPKTS], au8flags[BATCH_NPKTS], au8ack_type[BATCH_NPKTS];
+  uint16_t au16msg_id[BATCH_NPKTS], au16topic_len[BATCH_NPKTS], au16ack_id[BATCH_NPKTS];
+  uint32_t au32offset[BATCH_NPKTS], au32length[BATCH_NPKTS], au32topic_ofs[BATCH_NPKTS], au32payload_ofs[BATCH_NPKTS], au32payload_len[BATCH_NPKTS];
+  mqtt_batch_t sBatch = { BATCH_NPKTS, 0, au8type, au8flags, au32offset, au32length, au16msg_id, au32topic_ofs, au16topic_len,
+                          au32payload_ofs, au32payload_len, 0, au8ack_type, au16ack_id };
+  uint32_t u32len = 0;
+  uint32_t i;
+  for (i = 0; i < BATCH_NPKTS; ++i)
+  {
+    if ((u8qos != QOS_AT_MOST_ONCE) && (i & 1))
+    {
+      u32len += mqtt_encode_puback_msg(&au8pkt[u32len], i);
+    }
+    else
+    {
+      u32len += mqtt_encode_publish_msg(&au8pkt[u32len], (uint8_t*)TOPIC, strlen(TOPIC), u8qos, i + 1, au8payload, 16);
+    }
+  }
+  if (    (mqtt_decode_batch(au8pkt, u32len, &sBatch) != (int)u32len)
+       || (sBatch.u32count != BATCH_NPKTS))
+  {
+    fprintf(stderr, "batch decode failed: qos=%u\n", u8qos);
+    exit(1);
+  }
+
+  /* payload column holds the number of packets in the buffer */
+  BENCH("decode_batch", u8qos, BATCH_NPKTS, u32len,
+        u32sink += mqtt_decode_batch(au8pkt, u32len, &sBatch) + sBatch.u32nacks);
+
+  BENCH("decode_view_loop", u8qos, BATCH_NPKTS, u32len,
+        {
+          uint32_t u32ofs = 0;
+          while (u32ofs < u32len)
+          {
+            mqtt_view_t sView;
+            mqtt_publish_view_t sPub;
+            uint16_t u16msg_id;
+            u32ofs += mqtt_decode_view(&au8pkt[u32ofs], u32len - u32ofs, &sView);
+            u32sink += ((sView.u8type == CTRL_PUBLISH) ? mqtt_view_publish(&sView, &sPub) : mqtt_view_ack(&sView, &u16msg_id));
+          }
+        });
+}
+
+
+int main(int argc, char* argv[])
+{
+  uint32_t i;
+  uint8_t u8qos;
+
+  if (argc > 1)
+  {
+    min_ns = (uint32_t)atoi(argv[1]) * 1000 * 1000;
+  }
+
+  for (i = 0; i < sizeof(au8payload); ++i)
+  {
+    au8payload[i] = (uint8_t)i;
+  }
+
+  printf("op,qos,payload_bytes,packet_bytes,len_bytes,iterations,ns_per_op,mb_per_s\n");
+  for (u8qos = QOS_AT_MOST_ONCE; u8qos <= QOS_EXACTLY_ONCE; ++u8qos)
+  {
+    for (i = 0; i < NSIZES; ++i)
+    {
+      bench_publish(au32sizes[i], u8qos);
+    }
+    bench_subscribe(1, u8qos);
+    bench_subscribe(MSG_SUB_MAXNTOPICS, u8qos);
+    bench_batch(u8qos);
+  }
+
+  return (u32sink == 0xFFFFFFFF); /* never true, just uses the sink */
+}
@@ -0,0 +1,410 @@
+#include "reactor.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+/* Helper functions: */
+
+/* Register the events the client's state calls for: connect completion, inbound data and pending output */
+static void _update_events(reactor_t* psReactor, client_t* psClnt)
+{
+  uint32_t u32want = 0;
+  if (psClnt->state == CONNECTING)
+  {
+    u32want = EPOLLOUT;
+  }
+  else if (psClnt->state == CONNECTED)
+  {
+    /* a non-socket descriptor like a mempipe eventfd is always writable - it turns readable when there's room again */
+    u32want = EPOLLIN;
+    if (    (psClnt->txbuflen != 0)
+         && (psClnt->psTransport->flags & CLIENT_TRANSPORT_SOCKET))
+    {
+      u32want |= EPOLLOUT;
+    }
+  }
+
+  if (u32want != psClnt->evmask)
+  {
+    struct epoll_event sEv;
+    memset(&sEv, 0, sizeof(sEv));
+    sEv.events = u32want;
+    sEv.data.ptr = psClnt;
+
+    int op = ((psClnt->evmask == 0) ? EPOLL_CTL_ADD : ((u32want == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD));
+    if (epoll_ctl(psReactor->epfd, op, psClnt->sockfd, &sEv) < 0)
+    {
+      client_log(CLIENT_LOG_ERROR, "CLNT%d: epoll_ctl: %s\n", psClnt->sockfd, strerror(errno));
+    }
+    else
+    {
+      psClnt->evmask = u32want;
+    }
+  }
+}
+
+static void _min_deadline(uint64_t* pu64next, uint64_t u64deadline)
+{
+  if (u64deadline < *pu64next)
+  {
+    *pu64next = u64deadline;
+  }
+}
+
+
+/* The client's wheel timer: run its timeouts, then sleep until the next one */
+static void _on_timer(wheel_timer_t* psTimer, uint64_t u64now)
+{
+  client_t* psClnt = psTimer->pvctx;
+  reactor_t* psReactor = (reactor_t*)((char*)psClnt->psWheel - offsetof(reactor_t, sWheel));
+  uint64_t u64next = UINT64_MAX;
+
+  reactor_service_timers(psReactor, psClnt, u64now, &u64next);
+  /* uring.c keeps the reactor for its timers only, without an epoll set */
+  if (    (psReactor->epfd >= 0)
+       && (psClnt->psWheel != 0))
+  {
+    _update_events(psReactor, psClnt);
+  }
+  if (    (u64next != UINT64_MAX)
+       && (psClnt->psWheel != 0)
+       && (    (!wheel_pending(psTimer))
+            || (psTimer->u64deadline_us > u64next)))
+  {
+    wheel_add(psClnt->psWheel, psTimer, u64next);
+  }
+}
+
+/* Send what other threads queued for the client. A full batch may leave more behind: come back on the next poll. */
+static void _drain_queue(client_t* psClnt)
+{
+  if (client_drain_queue(psClnt) == CLIENT_QUEUE_BATCH)
+  {
+    client_queue_wake(psClnt);
+  }
+}
+
+static void _dispatch(client_t* psClnt, uint32_t u32events)
+{
+  if (psClnt->state == CONNECTING)
+  {
+    client_finish_connect(psClnt);
+  }
+  else if (psClnt->state == CONNECTED)
+  {
+    if (    (u32events & EPOLLOUT)
+         || (    (psClnt->txbuflen != 0)
+              && (!(psClnt->psTransport->flags & CLIENT_TRANSPORT_SOCKET))))
+    {
+      client_flush(psClnt);
+    }
+    if (    (psClnt->state == CONNECTED)
+         && (u32events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    {
+      client_recv(psClnt, 0);
+    }
+  }
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+/* Timeout events: (re)connect, connect timeout, tx flush delay and idle timeout */
+void reactor_service_timers(reactor_t* psReactor, client_t* psClnt, uint64_t u64now, uint64_t* pu64next)
+{
+  require(psReactor != 0);
+  require(psClnt != 0);
+
+  switch (psClnt->state)
+  {
+    case CREATED:
+    {
+      client_connect(psClnt);
+    } break;
+
+    case DISCONNECTED:
+    {
+      uint64_t u64retry = psClnt->state_since_us + psClnt->reconnect_delay_us;
+      if (u64now >= u64retry)
+      {
+        client_connect(psClnt);
+      }
+      else
+      {
+        _min_deadline(pu64next, u64retry);
+      }
+    } break;
+
+    case CONNECTING:
+    {
+      uint64_t u64expiry = psClnt->state_since_us + psReactor->connect_timeout_us;
+      if (u64now >= u64expiry)
+      {
+        client_log(CLIENT_LOG_ERROR, "CLNT%d: connect timed out.\n", psClnt->sockfd);
+        client_disconnect(psClnt);
+      }
+      else
+      {
+        _min_deadline(pu64next, u64expiry);
+        /* Happy Eyeballs: staggered attempts on the other candidate addresses */
+        _min_deadline(pu64next, client_connect_poll(psClnt, u64now));
+      }
+    } break;
+
+    case CONNECTED:
+    {
+      if (    (psClnt->txbuflen != 0)
+           && (!psClnt->tx_async))
+      {
+        uint64_t u64flush = psClnt->tx_first_us + psClnt->tx_flush_delay_us;
+        if (u64now >= u64flush)
+        {
+          client_flush(psClnt);
+        }
+        else
+        {
+          _min_deadline(pu64next, u64flush);
+        }
+      }
+      _min_deadline(pu64next, client_keepalive_poll(psClnt, u64now));
+      if (psClnt->idle_timeout_us != 0)
+      {
+        uint64_t u64last = ((psClnt->last_active_us > psClnt->last_timeout_us) ? psClnt->last_active_us : psClnt->last_timeout_us);
+        uint64_t u64idle = u64last + psClnt->idle_timeout_us;
+        if (u64now >= u64idle)
+        {
+          psClnt->last_timeout_us = u64now;
+          psClnt->client_timeout(psClnt);
+          u64idle = u64now + psClnt->idle_timeout_us;
+        }
+        _min_deadline(pu64next, u64idle);
+      }
+    } break;
+  }
+}
+
+
+void reactor_attach_timers(reactor_t* psReactor, client_t* psClnt)
+{
+  require(psReactor != 0);
+  require(psClnt != 0);
+
+  psClnt->psWheel = &psReactor->sWheel;
+  wheel_timer_init(&psClnt->sTimer, _on_timer, psClnt);
+  wheel_add(psClnt->psWheel, &psClnt->sTimer, client_time_us());
+}
+
+void reactor_detach_timers(reactor_t* psReactor, client_t* psClnt)
+{
+  require(psReactor != 0);
+  require(psClnt != 0);
+
+  wheel_cancel(&psReactor->sWheel, &psClnt->sTimer);
+  psClnt->psWheel = 0;
+}
+
+int reactor_init(reactor_t* psReactor, client_t** apsSlots, uint32_t u32nslots)
+{
+  require(psReactor != 0);
+  require(apsSlots != 0);
+
+  psReactor->apsClnt = apsSlots;
+  psReactor->u32nslots = u32nslots;
+  psReactor->u32nclients = 0;
+  psReactor->connect_timeout_us = REACTOR_CONNECT_TIMEOUT_US;
+  wheel_init(&psReactor->sWheel, client_time_us());
+  psReactor->wakefd = -1;
+  psReactor->pvready = 0;
+  psReactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (psReactor->epfd < 0)
+  {
+    client_log(CLIENT_LOG_ERROR, "epoll_create1: %s\n", strerror(errno));
+    return 0;
+  }
+
+  psReactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event sEv;
+  memset(&sEv, 0, sizeof(sEv));
+  sEv.events = EPOLLIN;
+  sEv.data.ptr = 0;
+  if (    (psReactor->wakefd < 0)
+       || (epoll_ctl(psReactor->epfd, EPOLL_CTL_ADD, psReactor->wakefd, &sEv) < 0))
+  {
+    client_log(CLIENT_LOG_ERROR, "eventfd: %s\n", strerror(errno));
+    reactor_close(psReactor);
+    return 0;
+  }
+
+  return 1;
+}
+
+void reactor_close(reactor_t* psReactor)
+{
+  require(psReactor != 0);
+
+  while (psReactor->u32nclients > 0)
+  {
+    reactor_remove(psReactor, psReactor->apsClnt[0]);
+  }
+  if (psReactor->wakefd >= 0)
+  {
+    close(psReactor->wakefd);
+    psReactor->wakefd = -1;
+  }
+  if (psReactor->epfd >= 0)
+  {
+    close(psReactor->epfd);
+    psReactor->epfd = -1;
+  }
+}
+
+void reactor_wake(reactor_t* psReactor)
+{
+  require(psReactor != 0);
+
+  uint64_t u64one = 1;
+  /* EAGAIN means the counter is saturated - it is readable either way */
+  if (write(psReactor->wakefd, &u64one, sizeof(u64one)) < 0)
+  {
+    require(errno == EAGAIN);
+  }
+}
+
+int reactor_add(reactor_t* psReactor, client_t* psClnt)
+{
+  require(psReactor != 0);
+  require(psClnt != 0);
+
+  int success = 0;
+  if (psReactor->u32nclients < psReactor->u32nslots)
+  {
+    client_set_nonblocking(psClnt, 1);
+    psClnt->evmask = 0;
+    psClnt->queue_ready = 0;
+    __atomic_store_n(&psClnt->ppvqueue_ready, &psReactor->pvready, __ATOMIC_RELAXED);
+    __atomic_store_n(&psClnt->queue_wakefd, psReactor->wakefd, __ATOMIC_RELEASE);
+    psReactor->apsClnt[psReactor->u32nclients++] = psClnt;
+    reactor_attach_timers(psReactor, psClnt);
+    success = 1;
+  }
+  return success;
+}
+
+int reactor_remove(reactor_t* psReactor, client_t* psClnt)
+{
+  require(psReactor != 0);
+  require(psClnt != 0);
+
+  int success = 0;
+  uint32_t i;
+  for (i = 0; i < psReactor->u32nclients; ++i)
+  {
+    if (psReactor->apsClnt[i] == psClnt)
+    {
+      if (psClnt->evmask != 0)
+      {
+        epoll_ctl(psReactor->epfd, EPOLL_CTL_DEL, psClnt->sockfd, 0);
+        psClnt->evmask = 0;
+      }
+      reactor_detach_timers(psReactor, psClnt);
+      __atomic_store_n(&psClnt->queue_wakefd, -1, __ATOMIC_RELAXED);
+      __atomic_store_n(&psClnt->ppvqueue_ready, 0, __ATOMIC_RELAXED);
+
+      /* take it off the ready list: empty the list and put everybody else back */
+      client_t* psReady = __atomic_exchange_n(&psReactor->pvready, 0, __ATOMIC_ACQUIRE);
+      while (psReady != 0)
+      {
+        client_t* psNext = psReady->pvqueue_next;
+        __atomic_store_n(&psReady->queue_ready, 0, __ATOMIC_RELEASE);
+        if (psReady != psClnt)
+        {
+          client_queue_wake(psReady);
+        }
+        psReady = psNext;
+      }
+
+      /* order of the slot table does not matter: move the last one into the hole */
+      psReactor->apsClnt[i] = psReactor->apsClnt[--psReactor->u32nclients];
+      success = 1;
+      break;
+    }
+  }
+  return success;
+}
+
+int reactor_poll(reactor_t* psReactor, uint32_t timeout_us)
+{
+  require(psReactor != 0);
+
+  struct epoll_event asEv[REACTOR_MAX_EVENTS];
+  uint64_t u64now = client_time_us();
+  uint64_t u64next = u64now + timeout_us;
+
+  /* only clients with a timer due are looked at */
+  wheel_advance(&psReactor->sWheel, u64now);
+  _min_deadline(&u64next, wheel_next_deadline(&psReactor->sWheel));
+
+  /* epoll_wait() has millisecond resolution - round up so we don't wake early and spin */
+  u64now = client_time_us();
+  int timeout_ms = ((u64next > u64now) ? (int)((u64next - u64now + 999) / 1000) : 0);
+  int nevents = epoll_wait(psReactor->epfd, asEv, REACTOR_MAX_EVENTS, timeout_ms);
+  if (nevents < 0)
+  {
+    if (errno != EINTR)
+    {
+      client_log(CLIENT_LOG_ERROR, "epoll_wait: %s\n", strerror(errno));
+    }
+    nevents = 0;
+  }
+
+  int n;
+  for (n = 0; n < nevents; ++n)
+  {
+    client_t* psClnt = asEv[n].data.ptr;
+    if (psClnt == 0)
+    {
+      uint64_t u64count;
+      if (read(psReactor->wakefd, &u64count, sizeof(u64count)) < 0)
+      {
+        require(errno == EAGAIN);
+      }
+      /* publish queues: only the clients on the ready list have something queued */
+      client_t* psQueued = __atomic_exchange_n(&psReactor->pvready, 0, __ATOMIC_ACQUIRE);
+      while (psQueued != 0)
+      {
+        /* read the link first - once queue_ready is clear an enqueue may push the client again */
+        client_t* psNext = psQueued->pvqueue_next;
+        __atomic_exchange_n(&psQueued->queue_ready, 0, __ATOMIC_ACQ_REL);
+        if (psQueued->state == CONNECTED)
+        {
+          _drain_queue(psQueued);
+          _update_events(psReactor, psQueued);
+        }
+        psQueued = psNext;
+      }
+      continue;
+    }
+    /* skip stale events for a client closed earlier in this batch */
+    if (psClnt->evmask != 0)
+    {
+      _dispatch(psClnt, asEv[n].events);
+      if (psClnt->psQueue != 0)
+      {
+        _drain_queue(psClnt);
+      }
+      _update_events(psReactor, psClnt);
+    }
+  }
+
+  return nevents;
+}
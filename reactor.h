@@ -0,0 +1,52 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+#include "client.h"
+#include "wheel.h"
+
+#define REACTOR_MAX_EVENTS         64      /* events fetched per epoll_wait() */
+#define REACTOR_CONNECT_TIMEOUT_US 5000000 /* default: give up a connect() attempt after 5 sec */
+
+
+/*
+   Drives many client_t's from one thread with epoll.
+   The reactor does not own the clients, it only keeps pointers to them
+   in a slot table supplied by the caller - no dynamic allocation.
+   Each client's timers (connect, reconnect, flush, idle, keepalive) and the
+   retransmit timers of sessions on top of them live in one timer wheel, and
+   reactor_poll() sleeps until the earliest deadline. The application can put
+   its own wheel_timer_t's on sWheel too. Other threads can interrupt a
+   sleeping reactor_poll() with reactor_wake().
+*/
+typedef struct
+{
+  int        epfd;
+  int        wakefd;             /* eventfd for reactor_wake(), registered with data.ptr = 0 */
+  void*      pvready;            /* clients client_enqueue() woke us for, linked through pvqueue_next */
+  client_t** apsClnt;            /* slot table, u32nslots long */
+  uint32_t   u32nslots;
+  uint32_t   u32nclients;
+  uint32_t   connect_timeout_us;
+  wheel_t    sWheel;
+} reactor_t;
+
+
+int  reactor_init(reactor_t* psReactor, client_t** apsSlots, uint32_t u32nslots);
+void reactor_close(reactor_t* psReactor);
+/* Puts the client in non-blocking mode, it connects on the next reactor_poll() */
+int  reactor_add(reactor_t* psReactor, client_t* psClnt);
+/* Other threads must have stopped calling client_enqueue() for the client */
+int  reactor_remove(reactor_t* psReactor, client_t* psClnt);
+/* Run timers, wait up to timeout_us for socket events and dispatch them. Returns number of socket events. */
+int  reactor_poll(reactor_t* psReactor, uint32_t timeout_us);
+/* Any thread: make a reactor_poll() in progress, or the next one, return without waiting */
+void reactor_wake(reactor_t* psReactor);
+/* Connect, reconnect, connect timeout, tx flush delay, idle timeout and keepalive for one client.
+   Lowers *pu64next to the client's next deadline. */
+void reactor_service_timers(reactor_t* psReactor, client_t* psClnt, uint64_t u64now, uint64_t* pu64next);
+/* Put the client's timer on the reactor's wheel, or take it off - used by reactor_add/remove() and uring.c */
+void reactor_attach_timers(reactor_t* psReactor, client_t* psClnt);
+void reactor_detach_timers(reactor_t* psReactor, client_t* psClnt);
+
+#endif /* _REACTOR_H_ */
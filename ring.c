@@ -0,0 +1,299 @@
+#include "ring.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define require(predicate)         assert((predicate))
+
+
+/*
+   Slot i is free for the producer claiming position pos when seq == pos,
+   and holds a complete element for the consumer at pos when seq == pos + 1.
+   Releasing a slot sets seq = pos + capacity, the position it is next written at.
+*/
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+int ring_init(ring_t* psRing, uint32_t* au32seq, void* pvelems, uint32_t u32elem_size, uint32_t u32capacity)
+{
+  require(psRing != 0);
+  require(au32seq != 0);
+  require(pvelems != 0);
+
+  int success = 0;
+  if (    (u32capacity != 0)
+       && ((u32capacity & (u32capacity - 1)) == 0))
+  {
+    memset(psRing, 0, sizeof(ring_t));
+    psRing->au32seq = au32seq;
+    psRing->pu8elems = pvelems;
+    psRing->u32elem_size = u32elem_size;
+    psRing->u32mask = u32capacity - 1;
+    uint32_t i;
+    for (i = 0; i < u32capacity; ++i)
+    {
+      au32seq[i] = i;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    success = 1;
+  }
+  return success;
+}
+
+int ring_push(ring_t* psRing, const void* pvelem)
+{
+  require(psRing != 0);
+  require(pvelem != 0);
+
+  uint32_t u32pos = __atomic_load_n(&psRing->u32tail, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    uint32_t u32seq = __atomic_load_n(&psRing->au32seq[u32pos & psRing->u32mask], __ATOMIC_ACQUIRE);
+    int32_t dif = (int32_t)(u32seq - u32pos);
+    if (dif == 0)
+    {
+      /* slot is free - claim the position (on failure u32pos is reloaded) */
+      if (__atomic_compare_exchange_n(&psRing->u32tail, &u32pos, u32pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        break;
+      }
+    }
+    else if (dif < 0)
+    {
+      return 0; /* full: the consumer hasn't released this slot from the previous lap */
+    }
+    else
+    {
+      u32pos = __atomic_load_n(&psRing->u32tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  uint32_t u32slot = u32pos & psRing->u32mask;
+  memcpy(&psRing->pu8elems[u32slot * psRing->u32elem_size], pvelem, psRing->u32elem_size);
+  __atomic_store_n(&psRing->au32seq[u32slot], u32pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void* ring_peek(ring_t* psRing)
+{
+  require(psRing != 0);
+
+  uint32_t u32pos = psRing->u32head;
+  uint32_t u32slot = u32pos & psRing->u32mask;
+  if (__atomic_load_n(&psRing->au32seq[u32slot], __ATOMIC_ACQUIRE) != (u32pos + 1))
+  {
+    return 0;
+  }
+  return &psRing->pu8elems[u32slot * psRing->u32elem_size];
+}
+
+void ring_release(ring_t* psRing)
+{
+  require(psRing != 0);
+
+  uint32_t u32pos = psRing->u32head;
+  __atomic_store_n(&psRing->au32seq[u32pos & psRing->u32mask], u32pos + psRing->u32mask + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&psRing->u32head, u32pos + 1, __ATOMIC_RELAXED);
+}
+
+int ring_pop(ring_t* psRing, void* pvelem)
+{
+  require(psRing != 0);
+  require(pvelem != 0);
+
+  void* pvsrc = ring_peek(psRing);
+  if (pvsrc == 0)
+  {
+    return 0;
+  }
+  memcpy(pvelem, pvsrc, psRing->u32elem_size);
+  ring_release(psRing);
+  return 1;
+}
+
+uint32_t ring_count(ring_t* psRing)
+{
+  require(psRing != 0);
+
+  uint32_t u32head = __atomic_load_n(&psRing->u32head, __ATOMIC_RELAXED);
+  uint32_t u32tail = __atomic_load_n(&psRing->u32tail, __ATOMIC_RELAXED);
+  uint32_t u32count = u32tail - u32head;
+  /* the two loads aren't atomic together - clamp what a racing reader may see */
+  return ((u32count > (psRing->u32mask + 1)) ? 0 : u32count);
+}
+
+uint32_t ring_capacity(ring_t* psRing)
+{
+  require(psRing != 0);
+
+  return psRing->u32mask + 1;
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c ring.c && gcc ring.o -o ring_test -lpthread && ./ring_test */
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+#define TEST_CAPACITY   64
+#define TEST_PRODUCERS  4
+#define TEST_PER_THREAD 200000
+
+typedef struct
+{
+  uint32_t u32producer;
+  uint32_t u32nr;
+} test_elem_t;
+
+static ring_t      sRing;
+static uint32_t    au32seq[TEST_CAPACITY];
+static test_elem_t asElems[TEST_CAPACITY];
+
+/* An empty ring as if u32pos elements had already gone through it */
+static void _test_ring_at(uint32_t u32pos)
+{
+  uint32_t i;
+  require(ring_init(&sRing, au32seq, asElems, sizeof(test_elem_t), TEST_CAPACITY));
+  for (i = 0; i < TEST_CAPACITY; ++i)
+  {
+    uint32_t u32slot_pos = u32pos + i;
+    au32seq[u32slot_pos & sRing.u32mask] = u32slot_pos;
+  }
+  sRing.u32head = u32pos;
+  sRing.u32tail = u32pos;
+}
+
+/* Fill, refuse, drain, refuse - starting at u32pos */
+static void _test_edges(uint32_t u32pos)
+{
+  test_elem_t sElem = { 0, 0 };
+  uint32_t i;
+  int ok = 1;
+  _test_ring_at(u32pos);
+
+  check(ring_count(&sRing) == 0);
+  check(ring_peek(&sRing) == 0);
+  check(!ring_pop(&sRing, &sElem));
+  for (i = 0; i < TEST_CAPACITY; ++i)
+  {
+    sElem.u32nr = i;
+    ok &= ring_push(&sRing, &sElem);
+  }
+  check(ok);
+  check(ring_count(&sRing) == TEST_CAPACITY);
+  sElem.u32nr = TEST_CAPACITY;
+  check(!ring_push(&sRing, &sElem));
+
+  /* one slot freed, one push taken - and the ring is full again */
+  check(((test_elem_t*)ring_peek(&sRing))->u32nr == 0);
+  ring_release(&sRing);
+  check(ring_push(&sRing, &sElem));
+  check(!ring_push(&sRing, &sElem));
+
+  for (i = 1; i <= TEST_CAPACITY; ++i)
+  {
+    ok &= (ring_pop(&sRing, &sElem) && (sElem.u32nr == i));
+  }
+  check(ok);
+  check(ring_count(&sRing) == 0);
+  check(!ring_pop(&sRing, &sElem));
+  check(ring_push(&sRing, &sElem));
+}
+
+static void test_edges(void)
+{
+  uint32_t au32seq_bad[12];
+  test_elem_t asElems_bad[12];
+  check(!ring_init(&sRing, au32seq_bad, asElems_bad, sizeof(test_elem_t), 12));
+  check(!ring_init(&sRing, au32seq_bad, asElems_bad, sizeof(test_elem_t), 0));
+
+  _test_edges(0);
+  _test_edges(1000);
+  _test_edges(0xFFFFFFFF - (TEST_CAPACITY / 2)); /* positions wrap around 2^32 halfway */
+  check(ring_capacity(&sRing) == TEST_CAPACITY);
+}
+
+static void* _test_producer(void* pvarg)
+{
+  test_elem_t sElem;
+  sElem.u32producer = (uint32_t)(uintptr_t)pvarg;
+  for (sElem.u32nr = 0; sElem.u32nr < TEST_PER_THREAD; ++sElem.u32nr)
+  {
+    while (!ring_push(&sRing, &sElem))
+    {
+      sched_yield();
+    }
+  }
+  return 0;
+}
+
+/* Producers hammer a small ring: every element arrives exactly once and in order per producer */
+static void test_stress(void)
+{
+  pthread_t athread[TEST_PRODUCERS];
+  uint32_t au32next[TEST_PRODUCERS] = { 0 };
+  uint32_t u32total = 0;
+  uint32_t u32full_seen = 0;
+  int inorder = 1;
+  uint32_t i;
+
+  _test_ring_at(0xFFFFFFFF - 1000);
+  for (i = 0; i < TEST_PRODUCERS; ++i)
+  {
+    require(pthread_create(&athread[i], 0, _test_producer, (void*)(uintptr_t)i) == 0);
+  }
+  while (u32total < (TEST_PRODUCERS * TEST_PER_THREAD))
+  {
+    test_elem_t sElem;
+    uint32_t u32count = ring_count(&sRing);
+    if (u32count == TEST_CAPACITY)
+    {
+      u32full_seen += 1;
+    }
+    if (!ring_pop(&sRing, &sElem))
+    {
+      sched_yield();
+      continue;
+    }
+    if (    (sElem.u32producer >= TEST_PRODUCERS)
+         || (sElem.u32nr != au32next[sElem.u32producer]))
+    {
+      inorder = 0;
+      break;
+    }
+    au32next[sElem.u32producer] += 1;
+    u32total += 1;
+  }
+  for (i = 0; i < TEST_PRODUCERS; ++i)
+  {
+    pthread_join(athread[i], 0);
+  }
+  check(inorder);
+  check(u32total == (TEST_PRODUCERS * TEST_PER_THREAD));
+  check(ring_count(&sRing) == 0);
+  check(u32full_seen != 0); /* the producers did run into a full ring */
+}
+
+
+int main(void)
+{
+  test_edges();
+  test_stress();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
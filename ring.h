@@ -0,0 +1,39 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+
+#define RING_CACHELINE     64
+
+
+/*
+   Bounded lock-free queue of fixed-size elements: any number of producer threads, one consumer.
+   Each slot carries a sequence number telling whose turn it is (Vyukov), so producers only
+   contend on the tail and never wait for each other to finish copying.
+   Storage is supplied by the caller - no dynamic allocation.
+*/
+typedef struct
+{
+  uint32_t* au32seq;             /* per-slot sequence, u32capacity long */
+  uint8_t*  pu8elems;            /* u32capacity * u32elem_size bytes */
+  uint32_t  u32elem_size;
+  uint32_t  u32mask;             /* capacity - 1 */
+  uint32_t  u32tail __attribute__((aligned(RING_CACHELINE)));  /* producers */
+  uint32_t  u32head __attribute__((aligned(RING_CACHELINE)));  /* consumer */
+} ring_t;
+
+
+/* u32capacity must be a power of 2. Returns 1 on success. */
+int  ring_init(ring_t* psRing, uint32_t* au32seq, void* pvelems, uint32_t u32elem_size, uint32_t u32capacity);
+/* Any thread: copy one element in. Returns 0 if the ring is full. */
+int  ring_push(ring_t* psRing, const void* pvelem);
+/* Consumer only: copy the oldest element out. Returns 0 if the ring is empty. */
+int  ring_pop(ring_t* psRing, void* pvelem);
+/* Consumer only: the oldest element in place, 0 if empty - release it with ring_release() */
+void* ring_peek(ring_t* psRing);
+void ring_release(ring_t* psRing);
+/* Any thread: number of elements queued - a snapshot, it may change right away */
+uint32_t ring_count(ring_t* psRing);
+uint32_t ring_capacity(ring_t* psRing);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include "runtime.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <string.h>
+
+
+/* Helper functions: */
+
+static void _done(runtime_shard_t* psShard, runtime_msg_t* psMsg, int status)
+{
+  runtime_t* psRuntime = psShard->psRuntime;
+  if (status != RUNTIME_SENT)
+  {
+    __atomic_fetch_add(&psShard->u64dropped, 1, __ATOMIC_RELAXED);
+  }
+  if (psRuntime->message_done != 0)
+  {
+    psRuntime->message_done(psRuntime, psMsg->u32conn, psMsg->pvctx, status);
+  }
+}
+
+static void _dispatch(runtime_shard_t* psShard, runtime_msg_t* psMsg)
+{
+  runtime_t* psRuntime = psShard->psRuntime;
+  client_t* psClnt = &psRuntime->asClnt[psMsg->u32conn];
+
+  if (psMsg->u8qos == 0)
+  {
+    int status = RUNTIME_OFFLINE;
+    if (psClnt->state == CONNECTED)
+    {
+      uint8_t au8hdr[MQTT_PUBLISH_HDR_MAX];
+      mqtt_iov_t asIov[4];
+      uint32_t u32niov;
+      if (    (mqtt_encode_publish_iov(au8hdr, asIov, &u32niov, psMsg->pu8topic, psMsg->u16topic_len, 0, 0, psMsg->pu8payload, psMsg->u32payload_len) > 0)
+           && (client_sendv(psClnt, asIov, u32niov) > 0))
+      {
+        status = RUNTIME_SENT;
+      }
+    }
+    _done(psShard, psMsg, status);
+  }
+  else if (    (psRuntime->asSess == 0)
+            || (session_publish(&psRuntime->asSess[psMsg->u32conn], psMsg->pu8topic, psMsg->u16topic_len, psMsg->u8qos, psMsg->pu8payload, psMsg->u32payload_len, psMsg->pvctx) == 0))
+  {
+    _done(psShard, psMsg, RUNTIME_REJECTED);
+  }
+}
+
+/* Hand queued publishes to their connections, at most RUNTIME_DRAIN_MAX. Returns how many. */
+static uint32_t _drain(runtime_shard_t* psShard)
+{
+  uint32_t u32count = 0;
+  runtime_msg_t* psMsg;
+  while (    (u32count < RUNTIME_DRAIN_MAX)
+          && ((psMsg = ring_peek(&psShard->sRing)) != 0))
+  {
+    _dispatch(psShard, psMsg);
+    ring_release(&psShard->sRing);
+    u32count += 1;
+  }
+  __atomic_fetch_add(&psShard->u64handled, u32count, __ATOMIC_RELAXED);
+  return u32count;
+}
+
+static void* _worker(void* pvarg)
+{
+  runtime_shard_t* psShard = pvarg;
+  runtime_t* psRuntime = psShard->psRuntime;
+
+  if (psShard->cpu >= 0)
+  {
+    cpu_set_t sSet;
+    CPU_ZERO(&sSet);
+    CPU_SET(psShard->cpu, &sSet);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(sSet), &sSet);
+    if (err != 0)
+    {
+      client_log(CLIENT_LOG_ERROR, "SHARD%u: pthread_setaffinity_np: %s\n", psShard->u32index, strerror(err));
+    }
+  }
+
+  while (!__atomic_load_n(&psRuntime->stop, __ATOMIC_ACQUIRE))
+  {
+    uint32_t u32timeout_us = RUNTIME_POLL_US;
+    if (_drain(psShard) == RUNTIME_DRAIN_MAX)
+    {
+      u32timeout_us = 0;
+    }
+    else
+    {
+      /* announce the sleep, then look once more: a producer either sees the flag or we see its message */
+      __atomic_store_n(&psShard->u32sleeping, 1, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (ring_peek(&psShard->sRing) != 0)
+      {
+        u32timeout_us = 0;
+      }
+    }
+    reactor_poll(&psShard->sReactor, u32timeout_us);
+    __atomic_store_n(&psShard->u32sleeping, 0, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/* The n'th CPU in our affinity mask, wrapping around */
+static int _nth_cpu(uint32_t u32n)
+{
+  cpu_set_t sSet;
+  if (sched_getaffinity(0, sizeof(sSet), &sSet) != 0)
+  {
+    return -1;
+  }
+  int ncpus = CPU_COUNT(&sSet);
+  int skip = (int)(u32n % (uint32_t)ncpus);
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+  {
+    if (CPU_ISSET(cpu, &sSet) && (skip-- == 0))
+    {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+int runtime_init(runtime_t* psRuntime, runtime_shard_t* asShards, uint32_t u32nshards, client_t* asClnt, session_t* asSess, client_t** apsSlots, uint32_t u32nconns)
+{
+  require(psRuntime != 0);
+  require(asShards != 0);
+  require(asClnt != 0);
+  require(apsSlots != 0);
+  require(u32nshards != 0);
+
+  memset(psRuntime, 0, sizeof(runtime_t));
+  psRuntime->asShards = asShards;
+  psRuntime->u32nshards = u32nshards;
+  psRuntime->asClnt = asClnt;
+  psRuntime->asSess = asSess;
+  psRuntime->u32nconns = u32nconns;
+  psRuntime->u32per_shard = (u32nconns + u32nshards - 1) / u32nshards;
+
+  uint32_t i;
+  for (i = 0; i < u32nshards; ++i)
+  {
+    runtime_shard_t* psShard = &asShards[i];
+    memset(psShard, 0, sizeof(runtime_shard_t));
+    psShard->psRuntime = psRuntime;
+    psShard->u32index = i;
+    psShard->cpu = -1;
+    psShard->u32first = i * psRuntime->u32per_shard;
+    if (psShard->u32first > u32nconns)
+    {
+      psShard->u32first = u32nconns;
+    }
+    psShard->u32nconns = u32nconns - psShard->u32first;
+    if (psShard->u32nconns > psRuntime->u32per_shard)
+    {
+      psShard->u32nconns = psRuntime->u32per_shard;
+    }
+
+    ring_init(&psShard->sRing, psShard->au32seq, psShard->asMsg, sizeof(runtime_msg_t), RUNTIME_RING_SIZE);
+    if (!reactor_init(&psShard->sReactor, &apsSlots[psShard->u32first], psShard->u32nconns))
+    {
+      while (i-- > 0)
+      {
+        reactor_close(&asShards[i].sReactor);
+      }
+      return 0;
+    }
+    uint32_t j;
+    for (j = 0; j < psShard->u32nconns; ++j)
+    {
+      reactor_add(&psShard->sReactor, &asClnt[psShard->u32first + j]);
+    }
+  }
+  return 1;
+}
+
+void runtime_set_callback(runtime_t* psRuntime, void* funcptr)
+{
+  require(psRuntime != 0);
+
+  psRuntime->message_done = funcptr;
+}
+
+int runtime_start(runtime_t* psRuntime, int pin)
+{
+  require(psRuntime != 0);
+
+  __atomic_store_n(&psRuntime->stop, 0, __ATOMIC_RELEASE);
+  uint32_t i;
+  for (i = 0; i < psRuntime->u32nshards; ++i)
+  {
+    runtime_shard_t* psShard = &psRuntime->asShards[i];
+    psShard->cpu = (pin ? _nth_cpu(i) : -1);
+    int err = pthread_create(&psShard->thread, 0, _worker, psShard);
+    if (err != 0)
+    {
+      client_log(CLIENT_LOG_ERROR, "pthread_create: %s\n", strerror(err));
+      /* take down the ones already running */
+      __atomic_store_n(&psRuntime->stop, 1, __ATOMIC_RELEASE);
+      while (i-- > 0)
+      {
+        reactor_wake(&psRuntime->asShards[i].sReactor);
+        pthread_join(psRuntime->asShards[i].thread, 0);
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void runtime_stop(runtime_t* psRuntime)
+{
+  require(psRuntime != 0);
+
+  __atomic_store_n(&psRuntime->stop, 1, __ATOMIC_RELEASE);
+  uint32_t i;
+  for (i = 0; i < psRuntime->u32nshards; ++i)
+  {
+    reactor_wake(&psRuntime->asShards[i].sReactor);
+  }
+  for (i = 0; i < psRuntime->u32nshards; ++i)
+  {
+    pthread_join(psRuntime->asShards[i].thread, 0);
+    reactor_close(&psRuntime->asShards[i].sReactor);
+  }
+}
+
+runtime_shard_t* runtime_shard_of(runtime_t* psRuntime, uint32_t u32conn)
+{
+  require(psRuntime != 0);
+  require(u32conn < psRuntime->u32nconns);
+
+  return &psRuntime->asShards[u32conn / psRuntime->u32per_shard];
+}
+
+int runtime_publish(runtime_t* psRuntime, uint32_t u32conn, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint8_t* pu8payload, uint32_t u32data_len, void* pvctx)
+{
+  require(psRuntime != 0);
+  require(u8qos <= 2);
+
+  runtime_shard_t* psShard = runtime_shard_of(psRuntime, u32conn);
+  runtime_msg_t sMsg;
+  sMsg.u32conn = u32conn;
+  sMsg.u16topic_len = u16topic_len;
+  sMsg.u8qos = u8qos;
+  sMsg.u32payload_len = u32data_len;
+  sMsg.pu8topic = pu8topic;
+  sMsg.pu8payload = pu8payload;
+  sMsg.pvctx = pvctx;
+
+  if (!ring_push(&psShard->sRing, &sMsg))
+  {
+    __atomic_fetch_add(&psShard->u64ring_full, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  /* pairs with the fence in _worker() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (    (__atomic_load_n(&psShard->u32sleeping, __ATOMIC_RELAXED) != 0)
+       && (__atomic_exchange_n(&psShard->u32sleeping, 0, __ATOMIC_ACQ_REL) != 0))
+  {
+    reactor_wake(&psShard->sReactor);
+  }
+  return 1;
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c runtime.c && gcc runtime.o client.c mqtt.c wheel.c ring.c reactor.c session.c -o runtime_test -lpthread && ./runtime_test */
+#include <stdio.h>
+#include <time.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+#define TEST_ROUNDS   500
+#define TEST_LATE_US  (RUNTIME_POLL_US / 4)  /* a lost wakeup waits out the whole RUNTIME_POLL_US */
+
+static uint32_t u32ndone;
+
+static void _test_done(runtime_t* psRuntime, uint32_t u32conn, void* pvctx, int status)
+{
+  (void)psRuntime; (void)u32conn; (void)pvctx;
+  check(status == RUNTIME_OFFLINE);
+  __atomic_fetch_add(&u32ndone, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t _test_now_us(void)
+{
+  struct timespec sTs;
+  clock_gettime(CLOCK_MONOTONIC, &sTs);
+  return ((uint64_t)sTs.tv_sec * 1000000) + (sTs.tv_nsec / 1000);
+}
+
+/* Wait for u32ndone to reach u32n, returns the microseconds it took */
+static uint64_t _test_wait_done(uint32_t u32n)
+{
+  uint64_t u64start = _test_now_us();
+  while (    (__atomic_load_n(&u32ndone, __ATOMIC_ACQUIRE) < u32n)
+          && ((_test_now_us() - u64start) < (2 * RUNTIME_POLL_US)))
+  {
+    sched_yield();
+  }
+  return _test_now_us() - u64start;
+}
+
+/* A publish to a sleeping worker wakes it at once, whether it is already asleep or about to be */
+static void test_wakeup(void)
+{
+  static runtime_shard_t sShard;
+  static runtime_t sRuntime;
+  static client_t sClnt;
+  static client_t* psSlot;
+  static char acrxbuf[64];
+  uint32_t i;
+  uint32_t u32late = 0;
+  uint32_t u32asleep = 0;
+
+  client_init(&sClnt, "127.0.0.1", 1883, acrxbuf, sizeof(acrxbuf));
+  check(runtime_init(&sRuntime, &sShard, 1, &sClnt, 0, &psSlot, 1));
+  runtime_set_callback(&sRuntime, _test_done);
+  check(runtime_start(&sRuntime, 0));
+
+  for (i = 0; i < TEST_ROUNDS; ++i)
+  {
+    /* every other round the publish lands after the worker announced its sleep, the others race it */
+    if (i & 1)
+    {
+      while (__atomic_load_n(&sShard.u32sleeping, __ATOMIC_ACQUIRE) == 0)
+      {
+        sched_yield();
+      }
+      u32asleep += 1;
+    }
+    check(runtime_publish(&sRuntime, 0, (uint8_t*)"t", 1, 0, (uint8_t*)"x", 1, 0));
+    if (_test_wait_done(i + 1) > TEST_LATE_US)
+    {
+      u32late += 1;
+      break;
+    }
+  }
+  check(u32late == 0);
+  check(u32asleep == (TEST_ROUNDS / 2));
+  check(__atomic_load_n(&u32ndone, __ATOMIC_ACQUIRE) == TEST_ROUNDS);
+  check(__atomic_load_n(&sShard.u64handled, __ATOMIC_RELAXED) == TEST_ROUNDS);
+  check(__atomic_load_n(&sShard.u64dropped, __ATOMIC_RELAXED) == TEST_ROUNDS);
+
+  /* a burst larger than one drain is handled in full without sleeping in between */
+  uint64_t u64start = _test_now_us();
+  for (i = 0; i < (RUNTIME_RING_SIZE / 2); ++i)
+  {
+    check(runtime_publish(&sRuntime, 0, (uint8_t*)"t", 1, 0, (uint8_t*)"x", 1, 0));
+  }
+  _test_wait_done(TEST_ROUNDS + (RUNTIME_RING_SIZE / 2));
+  check((_test_now_us() - u64start) < TEST_LATE_US);
+  check(__atomic_load_n(&u32ndone, __ATOMIC_ACQUIRE) == (TEST_ROUNDS + (RUNTIME_RING_SIZE / 2)));
+
+  runtime_stop(&sRuntime);
+}
+
+
+int main(void)
+{
+#if (CLIENT_LOG == 1)
+  client_log_hook = 0;
+#endif
+
+  test_wakeup();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
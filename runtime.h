@@ -0,0 +1,97 @@
+#ifndef _RUNTIME_H_
+#define _RUNTIME_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "client.h"
+#include "session.h"
+#include "reactor.h"
+#include "ring.h"
+
+#define RUNTIME_RING_SIZE   1024     /* publishes queued per shard, must be a power of 2 */
+#define RUNTIME_DRAIN_MAX   256      /* publishes handled per loop before looking at the sockets again */
+#define RUNTIME_POLL_US     1000000  /* longest sleep in reactor_poll(), timers and wakeups cut it short */
+
+/* Status passed to the message_done callback */
+enum
+{
+  RUNTIME_SENT,                /* QoS 0: handed to the socket or copied to txbuf */
+  RUNTIME_OFFLINE,             /* QoS 0: dropped, the connection is down */
+  RUNTIME_REJECTED,            /* QoS 1/2: the session window is full, or no session */
+};
+
+
+/* A publish on its way to the owning shard. Topic and payload are not copied. */
+typedef struct
+{
+  uint32_t  u32conn;
+  uint16_t  u16topic_len;
+  uint8_t   u8qos;
+  uint32_t  u32payload_len;
+  uint8_t*  pu8topic;
+  uint8_t*  pu8payload;
+  void*     pvctx;
+} runtime_msg_t;
+
+struct runtime_s;
+
+/* One worker thread with its own event loop - touches only its own block of connections */
+typedef struct
+{
+  struct runtime_s* psRuntime;
+  uint32_t      u32index;
+  uint32_t      u32first;         /* connections [u32first, u32first + u32nconns) */
+  uint32_t      u32nconns;
+  int           cpu;              /* pinned to this CPU, -1 = not pinned */
+  pthread_t     thread;
+  reactor_t     sReactor;
+
+  /* Cross-thread handoff: producers push, then wake the loop if it is about to sleep */
+  ring_t        sRing;
+  uint32_t      au32seq[RUNTIME_RING_SIZE];
+  runtime_msg_t asMsg[RUNTIME_RING_SIZE];
+  uint32_t      u32sleeping;
+
+  /* Counters, relaxed atomics */
+  uint64_t      u64handled;       /* taken off the ring */
+  uint64_t      u64dropped;       /* RUNTIME_OFFLINE or RUNTIME_REJECTED */
+  uint64_t      u64ring_full;     /* runtime_publish() calls refused */
+} runtime_shard_t;
+
+/*
+   Sharded runtime: connections are split in contiguous blocks over N worker threads,
+   each driving its block with a reactor. All client and session callbacks run on the
+   owning worker thread. Any thread may call runtime_publish(), the message is handed
+   to the owner through a lock-free ring.
+   Clients, sessions, slot table and shards are supplied by the caller - no dynamic allocation.
+*/
+typedef struct runtime_s
+{
+  runtime_shard_t* asShards;
+  uint32_t   u32nshards;
+  client_t*  asClnt;
+  session_t* asSess;              /* parallel to asClnt, 0 = QoS 0 only */
+  uint32_t   u32nconns;
+  uint32_t   u32per_shard;
+  int        stop;
+
+  /* Called on the owning thread for every QoS 0 publish, and for QoS 1/2 publishes the session didn't take.
+     Accepted QoS 1/2 publishes complete through the session's message_complete callback instead. */
+  void (*message_done)(struct runtime_s* psRuntime, uint32_t u32conn, void* pvctx, int status);
+} runtime_t;
+
+
+/* Clients must be initialized with their callbacks set, sessions initialized on top of them.
+   apsSlots holds u32nconns pointers. Returns 1 on success. */
+int  runtime_init(runtime_t* psRuntime, runtime_shard_t* asShards, uint32_t u32nshards, client_t* asClnt, session_t* asSess, client_t** apsSlots, uint32_t u32nconns);
+void runtime_set_callback(runtime_t* psRuntime, void* funcptr);
+/* Start the worker threads, pinning shard i to the i'th CPU we may run on if pin != 0 */
+int  runtime_start(runtime_t* psRuntime, int pin);
+/* Stop and join the workers. The connections stay open, the caller owns them again. */
+void runtime_stop(runtime_t* psRuntime);
+/* Any thread: queue a publish for connection u32conn. Returns 0 if the shard's ring is full.
+   Topic and payload must stay valid until message_done, or the session's message_complete, is called. */
+int  runtime_publish(runtime_t* psRuntime, uint32_t u32conn, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint8_t* pu8payload, uint32_t u32data_len, void* pvctx);
+runtime_shard_t* runtime_shard_of(runtime_t* psRuntime, uint32_t u32conn);
+
+#endif /* _RUNTIME_H_ */
@@ -0,0 +1,768 @@
+#include "session.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+/* Helper functions: */
+static void _dummy_complete(session_t* s, uint16_t i, void* c, uint8_t r) { (void) s; (void) i; (void) c; (void) r; }
+
+/* Retransmit timer on the client's wheel - only ever moved earlier here, session_poll() re-arms it */
+static void _arm_retry(session_t* psSess, uint64_t u64deadline)
+{
+  wheel_t* psWheel = psSess->psClnt->psWheel;
+  if (    (psWheel != 0)
+       && (    (!wheel_pending(&psSess->sRetry))
+            || (psSess->sRetry.u64deadline_us > u64deadline)))
+  {
+    wheel_add(psWheel, &psSess->sRetry, u64deadline);
+  }
+}
+
+static void _on_retry(wheel_timer_t* psTimer, uint64_t u64now)
+{
+  (void) u64now;
+  session_poll(psTimer->pvctx);
+}
+
+static inflight_t* _slot(session_t* psSess, uint16_t u16msg_id)
+{
+  return &psSess->asInflight[u16msg_id & (SESSION_INFLIGHT_MAX - 1)];
+}
+
+/* Find a packet id whose slot is free. Only called while u32inflight < u32window <= SESSION_INFLIGHT_MAX */
+static uint16_t _alloc_id(session_t* psSess)
+{
+  uint16_t u16id = psSess->u16next_id;
+  while (    (u16id == 0)
+          || (u16id > SESSION_ID_LAST)
+          || (_slot(psSess, u16id)->u8state != INFLIGHT_FREE))
+  {
+    u16id = ((u16id >= SESSION_ID_LAST) ? 1 : (u16id + 1));
+  }
+  psSess->u16next_id = u16id + 1;
+  return u16id;
+}
+
+/* (Re)transmit a PUBLISH from its table entry - a retransmission has the DUP flag set */
+static int _send_publish(session_t* psSess, inflight_t* psMsg, int dup)
+{
+  mqtt_iov_t asIov[4];
+  uint32_t u32niov;
+  int nbytes;
+  if (psSess->psMqtt5 != 0)
+  {
+    nbytes = mqtt5_encode_publish_iov(psSess->psMqtt5, psMsg->au8hdr, asIov, &u32niov, psMsg->pu8topic, psMsg->u16topic_len, psMsg->u8qos, psMsg->u16msg_id, psMsg->pu8payload, psMsg->u32payload_len);
+  }
+  else
+  {
+    nbytes = mqtt_encode_publish_iov(psMsg->au8hdr, asIov, &u32niov, psMsg->pu8topic, psMsg->u16topic_len, psMsg->u8qos, psMsg->u16msg_id, psMsg->pu8payload, psMsg->u32payload_len);
+  }
+  if (nbytes > 0)
+  {
+    if (dup)
+    {
+      psMsg->au8hdr[0] |= MQTT_FLAG_DUP;
+    }
+    psMsg->u64sent_us = client_time_us();
+    nbytes = client_sendv(psSess->psClnt, asIov, u32niov);
+  }
+  return (nbytes > 0);
+}
+
+static int _send_ack(session_t* psSess, int (*encoder)(uint8_t*, uint16_t), uint16_t u16msg_id)
+{
+  uint8_t au8ack[MQTT_ACK_MSG_LEN];
+  int nbytes = encoder(au8ack, u16msg_id);
+  return (client_send(psSess->psClnt, (char*)au8ack, nbytes) > 0);
+}
+
+static void _complete(session_t* psSess, inflight_t* psMsg, uint8_t u8reason)
+{
+  void* pvctx = psMsg->pvctx;
+  uint16_t u16msg_id = psMsg->u16msg_id;
+  CLIENT_STAT_HIST(psSess->psClnt, sAckRtt, client_time_us() - psMsg->u64sent_us);
+  psMsg->u8state = INFLIGHT_FREE;
+  psSess->u32inflight -= 1;
+  psSess->message_complete(psSess, u16msg_id, pvctx, u8reason);
+}
+
+static void _retransmit(session_t* psSess, inflight_t* psMsg)
+{
+  if (psMsg->u8state == INFLIGHT_WAIT_PUBCOMP)
+  {
+    psMsg->u64sent_us = client_time_us();
+    _send_ack(psSess, mqtt_encode_pubrel_msg, psMsg->u16msg_id);
+  }
+  else
+  {
+    _send_publish(psSess, psMsg, 1);
+  }
+}
+
+/* Inbound QoS 2 bookkeeping: returns index of u16msg_id in the pending list, or -1 */
+static int _rx_find(session_t* psSess, uint16_t u16msg_id)
+{
+  uint32_t i;
+  for (i = 0; i < psSess->u32rx_pending; ++i)
+  {
+    if (psSess->au16rx_pending[i] == u16msg_id)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* PUBACK, PUBREC, PUBCOMP and PUBREL for our side of the message flows, u8reason is the MQTT 5
+   reason code or 0. Returns 0 for other packet types. */
+static int _handle_ack(session_t* psSess, uint8_t u8type, uint16_t u16msg_id, uint8_t u8reason)
+{
+  inflight_t* psMsg = _slot(psSess, u16msg_id);
+  switch (u8type)
+  {
+    case CTRL_PUBACK:
+    {
+      if (    (psMsg->u8state == INFLIGHT_WAIT_PUBACK)
+           && (psMsg->u16msg_id == u16msg_id))
+      {
+        _complete(psSess, psMsg, u8reason);
+      }
+    } break;
+
+    case CTRL_PUBREC:
+    {
+      if (    (psMsg->u8state == INFLIGHT_WAIT_PUBREC)
+           && (psMsg->u16msg_id == u16msg_id)
+           && (u8reason >= 0x80))
+      {
+        /* MQTT 5 section 4.3.3: a failed PUBREC ends the flow, there is no PUBREL */
+        _complete(psSess, psMsg, u8reason);
+      }
+      else if (    (    (psMsg->u8state == INFLIGHT_WAIT_PUBREC)
+                     || (psMsg->u8state == INFLIGHT_WAIT_PUBCOMP)) /* our PUBREL may have been lost */
+                && (psMsg->u16msg_id == u16msg_id))
+      {
+        /* payload no longer needed by the session, only the packet id */
+        psMsg->u8state = INFLIGHT_WAIT_PUBCOMP;
+        psMsg->u64sent_us = client_time_us();
+        _send_ack(psSess, mqtt_encode_pubrel_msg, u16msg_id);
+      }
+    } break;
+
+    case CTRL_PUBCOMP:
+    {
+      if (    (psMsg->u8state == INFLIGHT_WAIT_PUBCOMP)
+           && (psMsg->u16msg_id == u16msg_id))
+      {
+        _complete(psSess, psMsg, u8reason);
+      }
+    } break;
+
+    case CTRL_PUBREL:
+    {
+      int idx = _rx_find(psSess, u16msg_id);
+      if (idx >= 0)
+      {
+        psSess->au16rx_pending[idx] = psSess->au16rx_pending[--psSess->u32rx_pending];
+      }
+      /* always answer, the broker may be retransmitting PUBREL after our PUBCOMP got lost */
+      _send_ack(psSess, mqtt_encode_pubcomp_msg, u16msg_id);
+    } break;
+
+    default:
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int _handle_inbound_publish(session_t* psSess, mqtt_view_t* psView)
+{
+  int consumed = 0;
+  int decoded;
+  mqtt_publish_view_t sPub;
+
+  if (psSess->psMqtt5 != 0)
+  {
+    decoded = mqtt5_view_publish(psSess->psMqtt5, psView, &sPub);
+  }
+  else
+  {
+    decoded = mqtt_view_publish(psView, &sPub);
+  }
+  if (decoded)
+  {
+    consumed = session_ack_publish(psSess, sPub.u8qos, sPub.u16msg_id);
+  }
+  return consumed;
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+void session_init(session_t* psSess, client_t* psClnt, uint32_t u32window)
+{
+  require(psSess != 0);
+  require(psClnt != 0);
+
+  memset(psSess, 0, sizeof(session_t));
+  psSess->psClnt = psClnt;
+  psSess->u32window = (((u32window == 0) || (u32window > SESSION_INFLIGHT_MAX)) ? SESSION_INFLIGHT_MAX : u32window);
+  psSess->u16next_id = 1;
+  psSess->retry_us = SESSION_RETRY_US;
+  psSess->message_complete = (void*)_dummy_complete;
+  wheel_timer_init(&psSess->sRetry, _on_retry, psSess);
+}
+
+void session_set_callback(session_t* psSess, void* funcptr)
+{
+  require(psSess != 0);
+  require(funcptr != 0);
+
+  psSess->message_complete = funcptr;
+}
+
+void session_set_mqtt5(session_t* psSess, mqtt5_conn_t* psConn)
+{
+  require(psSess != 0);
+
+  psSess->psMqtt5 = psConn;
+}
+
+uint16_t session_publish(session_t* psSess, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint8_t* pu8payload, uint32_t u32data_len, void* pvctx)
+{
+  require(psSess != 0);
+  require(    (u8qos == QOS_AT_LEAST_ONCE)
+           || (u8qos == QOS_EXACTLY_ONCE));
+
+  uint16_t u16msg_id = 0;
+  uint32_t u32window = psSess->u32window;
+  if (    (psSess->psMqtt5 != 0)
+       && (psSess->psMqtt5->u16peer_receive_max < u32window))
+  {
+    u32window = psSess->psMqtt5->u16peer_receive_max;
+  }
+  if (psSess->u32inflight < u32window)
+  {
+    uint16_t u16id = _alloc_id(psSess);
+    inflight_t* psMsg = _slot(psSess, u16id);
+    psMsg->u8state = ((u8qos == QOS_AT_LEAST_ONCE) ? INFLIGHT_WAIT_PUBACK : INFLIGHT_WAIT_PUBREC);
+    psMsg->u8qos = u8qos;
+    psMsg->u16msg_id = u16id;
+    psMsg->pu8topic = pu8topic;
+    psMsg->u16topic_len = u16topic_len;
+    psMsg->pu8payload = pu8payload;
+    psMsg->u32payload_len = u32data_len;
+    psMsg->pvctx = pvctx;
+    psSess->u32inflight += 1;
+
+    /* a failed send keeps the message in flight - it goes out again on retransmit */
+    _send_publish(psSess, psMsg, 0);
+    _arm_retry(psSess, client_time_us() + psSess->retry_us);
+    u16msg_id = u16id;
+  }
+  return u16msg_id;
+}
+
+int session_handle_packet(session_t* psSess, uint8_t* pu8pkt, uint32_t u32nbytes)
+{
+  require(psSess != 0);
+  require(pu8pkt != 0);
+
+  int consumed = 0;
+  uint16_t u16msg_id;
+  uint8_t u8reason = 0;
+  mqtt_view_t sView;
+
+  if (mqtt_decode_view(pu8pkt, u32nbytes, &sView) <= 0)
+  {
+    return 0;
+  }
+
+  /* acks are read through the view: MQTT 5 may append a reason code and properties */
+  switch (sView.u8type)
+  {
+    case CTRL_PUBACK:
+    case CTRL_PUBREC:
+    case CTRL_PUBCOMP:
+    case CTRL_PUBREL:
+    {
+      int decoded;
+      consumed = 1;
+      if (psSess->psMqtt5 != 0)
+      {
+        decoded = mqtt5_view_ack(&sView, &u16msg_id, &u8reason);
+      }
+      else
+      {
+        decoded = mqtt_view_ack(&sView, &u16msg_id);
+      }
+      if (decoded)
+      {
+        _handle_ack(psSess, sView.u8type, u16msg_id, u8reason);
+      }
+    } break;
+
+    case CTRL_PUBLISH:
+    {
+      consumed = _handle_inbound_publish(psSess, &sView);
+    } break;
+  }
+
+  return consumed;
+}
+
+uint32_t session_handle_acks(session_t* psSess, mqtt_batch_t* psBatch)
+{
+  require(psSess != 0);
+  require(psBatch != 0);
+
+  uint32_t u32handled = 0;
+  uint32_t i;
+  for (i = 0; i < psBatch->u32nacks; ++i)
+  {
+    u32handled += _handle_ack(psSess, psBatch->au8ack_type[i], psBatch->au16ack_id[i], 0);
+  }
+  return u32handled;
+}
+
+int session_ack_publish(session_t* psSess, uint8_t u8qos, uint16_t u16msg_id)
+{
+  require(psSess != 0);
+
+  int duplicate = 0;
+  if (u8qos == QOS_AT_LEAST_ONCE)
+  {
+    _send_ack(psSess, mqtt_encode_puback_msg, u16msg_id);
+  }
+  else if (u8qos == QOS_EXACTLY_ONCE)
+  {
+    if (_rx_find(psSess, u16msg_id) >= 0)
+    {
+      duplicate = 1; /* already delivered to the application */
+    }
+    else if (psSess->u32rx_pending == SESSION_INFLIGHT_MAX)
+    {
+      /* without a free slot a redelivery couldn't be recognized: no PUBREC, the broker sends it again */
+      client_log(CLIENT_LOG_ERROR, "SESSION: %u QoS 2 messages awaiting PUBREL, refusing msg id %u.\n", (unsigned)SESSION_INFLIGHT_MAX, u16msg_id);
+      return 1;
+    }
+    else
+    {
+      psSess->au16rx_pending[psSess->u32rx_pending++] = u16msg_id;
+    }
+    _send_ack(psSess, mqtt_encode_pubrec_msg, u16msg_id);
+  }
+  return duplicate;
+}
+
+void session_poll(session_t* psSess)
+{
+  require(psSess != 0);
+
+  if (psSess->u32inflight == 0)
+  {
+    return;
+  }
+
+  uint64_t u64now = client_time_us();
+  if (client_state(psSess->psClnt) != CONNECTED)
+  {
+    _arm_retry(psSess, u64now + psSess->retry_us);
+    return;
+  }
+
+  uint64_t u64next = UINT64_MAX;
+  uint32_t i;
+  for (i = 0; i < SESSION_INFLIGHT_MAX; ++i)
+  {
+    inflight_t* psMsg = &psSess->asInflight[i];
+    if (psMsg->u8state != INFLIGHT_FREE)
+    {
+      if ((u64now - psMsg->u64sent_us) >= psSess->retry_us)
+      {
+        _retransmit(psSess, psMsg);
+      }
+      if ((psMsg->u64sent_us + psSess->retry_us) < u64next)
+      {
+        u64next = psMsg->u64sent_us + psSess->retry_us;
+      }
+    }
+  }
+  if (u64next != UINT64_MAX)
+  {
+    _arm_retry(psSess, u64next);
+  }
+}
+
+void session_resend_all(session_t* psSess)
+{
+  require(psSess != 0);
+
+  uint32_t i;
+  for (i = 0; i < SESSION_INFLIGHT_MAX; ++i)
+  {
+    if (psSess->asInflight[i].u8state != INFLIGHT_FREE)
+    {
+      _retransmit(psSess, &psSess->asInflight[i]);
+    }
+  }
+}
+
+int session_connack(session_t* psSess, uint8_t u8session_present)
+{
+  require(psSess != 0);
+
+  if (u8session_present)
+  {
+    /* the broker kept our session: finish the exchanges where they were */
+    session_resend_all(psSess);
+    return 0;
+  }
+
+  /* new session: the broker knows none of our packet ids */
+  psSess->u32rx_pending = 0;
+  uint32_t i;
+  for (i = 0; i < SESSION_INFLIGHT_MAX; ++i)
+  {
+    inflight_t* psMsg = &psSess->asInflight[i];
+    if (psMsg->u8state == INFLIGHT_WAIT_PUBCOMP)
+    {
+      _complete(psSess, psMsg, 0);  /* PUBREC received - the broker took ownership before it lost the session */
+    }
+    else if (psMsg->u8state != INFLIGHT_FREE)
+    {
+      _send_publish(psSess, psMsg, 0);
+    }
+  }
+  return 1;
+}
+
+uint32_t session_inflight(session_t* psSess)
+{
+  require(psSess != 0);
+
+  return psSess->u32inflight;
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c session.c && gcc session.o client.c mqtt.c wheel.c ring.c -o session_test && ./session_test */
+#include <stdio.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+/* Loopback transport: what the session sends collects in au8sent, the test plays the broker */
+static uint8_t  au8sent[8192];
+static uint32_t u32sent;
+
+static ssize_t _test_writev(void* pvClnt, int fd, struct iovec* asIov, int niov, int flags)
+{
+  (void)pvClnt; (void)fd; (void)flags;
+  ssize_t nbytes = 0;
+  int i;
+  for (i = 0; i < niov; ++i)
+  {
+    require((u32sent + asIov[i].iov_len) <= sizeof(au8sent));
+    memcpy(&au8sent[u32sent], asIov[i].iov_base, asIov[i].iov_len);
+    u32sent += asIov[i].iov_len;
+    nbytes += asIov[i].iov_len;
+  }
+  return nbytes;
+}
+
+static const client_transport_t sTestTransport = { "test", 0, 0, 0, 0, 0, _test_writev, 0, 0 };
+
+/* One packet the session sent */
+typedef struct
+{
+  uint8_t  u8type;
+  uint8_t  u8flags;
+  uint16_t u16msg_id;
+} sent_t;
+
+static sent_t   asSent[SESSION_INFLIGHT_MAX * 2];
+static uint32_t u32nsent;
+
+/* Split what was sent since the last call into asSent */
+static void _test_take_sent(void)
+{
+  uint32_t u32ofs = 0;
+  u32nsent = 0;
+  while (u32ofs < u32sent)
+  {
+    mqtt_view_t sView;
+    mqtt_publish_view_t sPub;
+    int len = mqtt_decode_view(&au8sent[u32ofs], u32sent - u32ofs, &sView);
+    require(len > 0);
+    require(u32nsent < (sizeof(asSent) / sizeof(asSent[0])));
+    asSent[u32nsent].u8type = sView.u8type;
+    asSent[u32nsent].u8flags = sView.u8flags;
+    asSent[u32nsent].u16msg_id = 0;
+    if (sView.u8type == CTRL_PUBLISH)
+    {
+      require(mqtt_view_publish(&sView, &sPub));
+      asSent[u32nsent].u16msg_id = sPub.u16msg_id;
+    }
+    else
+    {
+      require(mqtt_view_ack(&sView, &asSent[u32nsent].u16msg_id));
+    }
+    u32nsent += 1;
+    u32ofs += len;
+  }
+  u32sent = 0;
+}
+
+/* Was packet i of the last _test_take_sent() this one? */
+static int _test_was(uint32_t i, uint8_t u8type, uint16_t u16msg_id, int dup)
+{
+  return (    (i < u32nsent)
+           && (asSent[i].u8type == u8type)
+           && (asSent[i].u16msg_id == u16msg_id)
+           && (((asSent[i].u8flags & MQTT_FLAG_DUP) != 0) == (dup != 0)));
+}
+
+static uint16_t au16done[SESSION_INFLIGHT_MAX * 2];
+static uint8_t  au8done_reason[SESSION_INFLIGHT_MAX * 2];
+static uint32_t u32ndone;
+
+static void _test_complete(session_t* psSess, uint16_t u16msg_id, void* pvctx, uint8_t u8reason)
+{
+  (void)psSess; (void)pvctx;
+  if (u32ndone < (sizeof(au16done) / sizeof(au16done[0])))
+  {
+    au16done[u32ndone] = u16msg_id;
+    au8done_reason[u32ndone] = u8reason;
+  }
+  u32ndone += 1;
+}
+
+/* A connected client on the loopback transport, a session on top */
+static void _test_session(session_t* psSess, client_t* psClnt, uint32_t u32window)
+{
+  static char acrxbuf[256];
+  client_init(psClnt, "127.0.0.1", 1883, acrxbuf, sizeof(acrxbuf));
+  client_set_transport(psClnt, &sTestTransport, 0);
+  psClnt->state = CONNECTED;
+  session_init(psSess, psClnt, u32window);
+  session_set_callback(psSess, _test_complete);
+  u32sent = 0;
+  u32ndone = 0;
+}
+
+static uint16_t _test_publish(session_t* psSess, uint8_t u8qos)
+{
+  return session_publish(psSess, (uint8_t*)"t", 1, u8qos, (uint8_t*)"x", 1, 0);
+}
+
+/* Feed an ack as the broker, u8reason >= 0 appends an MQTT 5 reason code */
+static int _test_ack(session_t* psSess, uint8_t u8type, uint16_t u16msg_id, int reason)
+{
+  uint8_t au8pkt[5];
+  au8pkt[0] = (u8type << 4) | ((u8type == CTRL_PUBREL) ? 0x02 : 0x00);
+  au8pkt[1] = ((reason >= 0) ? 3 : 2);
+  au8pkt[2] = (u16msg_id >> 8);
+  au8pkt[3] = (u16msg_id & 0xFF);
+  au8pkt[4] = (uint8_t)reason;
+  return session_handle_packet(psSess, au8pkt, ((reason >= 0) ? 5 : 4));
+}
+
+static void test_flows(void)
+{
+  session_t sSess;
+  client_t sClnt;
+  uint8_t au8pkt[64];
+  _test_session(&sSess, &sClnt, 0);
+
+  /* QoS 1 */
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 1);
+  _test_take_sent();
+  check((u32nsent == 1) && _test_was(0, CTRL_PUBLISH, 1, 0));
+  check(_test_ack(&sSess, CTRL_PUBACK, 1, -1));
+  check((u32ndone == 1) && (au16done[0] == 1) && (au8done_reason[0] == 0));
+  check(_test_ack(&sSess, CTRL_PUBACK, 1, -1));            /* a second PUBACK completes nothing */
+  check(u32ndone == 1);
+
+  /* QoS 2, a repeated PUBREC is answered again */
+  check(_test_publish(&sSess, QOS_EXACTLY_ONCE) == 2);
+  check(_test_ack(&sSess, CTRL_PUBREC, 2, -1));
+  check(_test_ack(&sSess, CTRL_PUBREC, 2, -1));
+  _test_take_sent();
+  check((u32nsent == 3) && _test_was(1, CTRL_PUBREL, 2, 0) && _test_was(2, CTRL_PUBREL, 2, 0));
+  check(u32ndone == 1);
+  check(_test_ack(&sSess, CTRL_PUBCOMP, 2, -1));
+  check((u32ndone == 2) && (au16done[1] == 2));
+  check(session_inflight(&sSess) == 0);
+
+  /* inbound QoS 2: delivered once until the PUBREL, every copy gets its PUBREC */
+  int len = mqtt_encode_publish_msg(au8pkt, (uint8_t*)"t", 1, QOS_EXACTLY_ONCE, 9, (uint8_t*)"x", 1);
+  check(session_handle_packet(&sSess, au8pkt, len) == 0);
+  au8pkt[0] |= MQTT_FLAG_DUP;
+  check(session_handle_packet(&sSess, au8pkt, len) == 1);
+  check(_test_ack(&sSess, CTRL_PUBREL, 9, -1));
+  au8pkt[0] &= ~MQTT_FLAG_DUP;
+  check(session_handle_packet(&sSess, au8pkt, len) == 0);
+  _test_take_sent();
+  check((u32nsent == 4) && _test_was(0, CTRL_PUBREC, 9, 0) && _test_was(1, CTRL_PUBREC, 9, 0)
+        && _test_was(2, CTRL_PUBCOMP, 9, 0) && _test_was(3, CTRL_PUBREC, 9, 0));
+}
+
+/* MQTT 5: a failure reason code ends the flow and reaches the callback */
+static void test_reason_codes(void)
+{
+  session_t sSess;
+  client_t sClnt;
+  mqtt5_conn_t sMqtt5;
+  _test_session(&sSess, &sClnt, 0);
+  mqtt5_init(&sMqtt5, 0, 0, 0);
+  session_set_mqtt5(&sSess, &sMqtt5);
+
+  uint16_t u16id1 = _test_publish(&sSess, QOS_AT_LEAST_ONCE);
+  uint16_t u16id2 = _test_publish(&sSess, QOS_EXACTLY_ONCE);
+  uint16_t u16id3 = _test_publish(&sSess, QOS_EXACTLY_ONCE);
+  uint16_t u16id4 = _test_publish(&sSess, QOS_EXACTLY_ONCE);
+  _test_take_sent();
+  check(u32nsent == 4);
+
+  check(_test_ack(&sSess, CTRL_PUBACK, u16id1, 0x87));     /* not authorized */
+  check((u32ndone == 1) && (au16done[0] == u16id1) && (au8done_reason[0] == 0x87));
+
+  check(_test_ack(&sSess, CTRL_PUBREC, u16id2, 0x80));     /* failed: no PUBREL */
+  _test_take_sent();
+  check(u32nsent == 0);
+  check((u32ndone == 2) && (au16done[1] == u16id2) && (au8done_reason[1] == 0x80));
+
+  check(_test_ack(&sSess, CTRL_PUBREC, u16id3, 0x10));     /* no matching subscribers is a success */
+  _test_take_sent();
+  check((u32nsent == 1) && _test_was(0, CTRL_PUBREL, u16id3, 0));
+  check(_test_ack(&sSess, CTRL_PUBCOMP, u16id3, 0x00));
+  check((u32ndone == 3) && (au8done_reason[2] == 0));
+
+  check(_test_ack(&sSess, CTRL_PUBREC, u16id4, -1));       /* reason code left out: success */
+  check(_test_ack(&sSess, CTRL_PUBCOMP, u16id4, 0x92));    /* packet identifier not found */
+  check((u32ndone == 4) && (au16done[3] == u16id4) && (au8done_reason[3] == 0x92));
+  check(session_inflight(&sSess) == 0);
+}
+
+/* Packet ids wrap at SESSION_ID_LAST and skip those whose slot (id & 63) is taken */
+static void test_ids(void)
+{
+  session_t sSess;
+  client_t sClnt;
+  _test_session(&sSess, &sClnt, 4);
+
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 1);
+  sSess.u16next_id = 1 + SESSION_INFLIGHT_MAX;                  /* same slot as id 1 */
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 2 + SESSION_INFLIGHT_MAX);
+  sSess.u16next_id = SESSION_ID_LAST;
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == SESSION_ID_LAST);
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 3);          /* wrapped, past 0 and the slots of 1 and 66 */
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 0);          /* window full */
+  check(session_inflight(&sSess) == 4);
+
+  /* an ack for another id in the same slot completes nothing */
+  check(_test_ack(&sSess, CTRL_PUBACK, 2 + (2 * SESSION_INFLIGHT_MAX), -1));
+  check(u32ndone == 0);
+  check(_test_ack(&sSess, CTRL_PUBACK, 2 + SESSION_INFLIGHT_MAX, -1));
+  check((u32ndone == 1) && (au16done[0] == 2 + SESSION_INFLIGHT_MAX));
+  sSess.u16next_id = 1;
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 2);          /* its slot is free again */
+
+  /* a full table: every slot busy, ids still unique */
+  _test_session(&sSess, &sClnt, 0);
+  sSess.u16next_id = SESSION_ID_LAST - 10;
+  uint32_t i;
+  int unique = 1;
+  for (i = 0; i < SESSION_INFLIGHT_MAX; ++i)
+  {
+    uint16_t u16id = _test_publish(&sSess, QOS_AT_LEAST_ONCE);
+    unique &= ((u16id != 0) && (u16id <= SESSION_ID_LAST) && (_slot(&sSess, u16id)->u16msg_id == u16id));
+  }
+  check(unique);
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 0);
+}
+
+/* session_poll() resends with DUP set once retry_us has passed, and only while connected */
+static void test_retransmit(void)
+{
+  session_t sSess;
+  client_t sClnt;
+  _test_session(&sSess, &sClnt, 0);
+
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 1);
+  check(_test_publish(&sSess, QOS_EXACTLY_ONCE) == 2);
+  check(_test_ack(&sSess, CTRL_PUBREC, 2, -1));
+  _test_take_sent();
+
+  session_poll(&sSess);                              /* not due yet */
+  _test_take_sent();
+  check(u32nsent == 0);
+
+  sSess.retry_us = 0;
+  session_poll(&sSess);
+  _test_take_sent();
+  check((u32nsent == 2) && _test_was(0, CTRL_PUBLISH, 1, 1) && _test_was(1, CTRL_PUBREL, 2, 0));
+
+  sClnt.state = DISCONNECTED;
+  session_poll(&sSess);
+  _test_take_sent();
+  check(u32nsent == 0);
+}
+
+static void test_connack(void)
+{
+  session_t sSess;
+  client_t sClnt;
+  uint8_t au8pkt[64];
+  _test_session(&sSess, &sClnt, 0);
+
+  check(_test_publish(&sSess, QOS_AT_LEAST_ONCE) == 1);
+  check(_test_publish(&sSess, QOS_EXACTLY_ONCE) == 2);
+  check(_test_publish(&sSess, QOS_EXACTLY_ONCE) == 3);
+  check(_test_ack(&sSess, CTRL_PUBREC, 3, -1));
+  int len = mqtt_encode_publish_msg(au8pkt, (uint8_t*)"t", 1, QOS_EXACTLY_ONCE, 9, (uint8_t*)"x", 1);
+  check(session_handle_packet(&sSess, au8pkt, len) == 0);
+  _test_take_sent();
+
+  /* session kept: everything picks up where it was */
+  check(session_connack(&sSess, 1) == 0);
+  _test_take_sent();
+  check((u32nsent == 3) && _test_was(0, CTRL_PUBLISH, 1, 1) && _test_was(1, CTRL_PUBLISH, 2, 1) && _test_was(2, CTRL_PUBREL, 3, 0));
+  check(session_handle_packet(&sSess, au8pkt, len) == 1);
+  _test_take_sent();
+
+  /* session lost: the broker took 3 before it lost it, the rest starts over without DUP */
+  check(session_connack(&sSess, 0) == 1);
+  check((u32ndone == 1) && (au16done[0] == 3) && (au8done_reason[0] == 0));
+  _test_take_sent();
+  check((u32nsent == 2) && _test_was(0, CTRL_PUBLISH, 1, 0) && _test_was(1, CTRL_PUBLISH, 2, 0));
+  check(session_inflight(&sSess) == 2);
+  check(session_handle_packet(&sSess, au8pkt, len) == 0);       /* 9 is a new message now */
+}
+
+
+int main(void)
+{
+  test_flows();
+  test_reason_codes();
+  test_ids();
+  test_retransmit();
+  test_connack();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdint.h>
+#include "client.h"
+#include "mqtt.h"
+
+#define SESSION_INFLIGHT_MAX  64       /* size of the in-flight table, must be a power of 2 */
+#define SESSION_RETRY_US      5000000  /* default: retransmit unacknowledged packets after 5 sec */
+#define SESSION_ID_LAST       0xFEFF   /* packet ids above are left to SUBSCRIBE / UNSUBSCRIBE, see subscribe.h */
+
+
+/* State of an outbound QoS 1/2 message */
+typedef enum
+{
+  INFLIGHT_FREE,
+  INFLIGHT_WAIT_PUBACK,  /* QoS 1: PUBLISH sent                  */
+  INFLIGHT_WAIT_PUBREC,  /* QoS 2: PUBLISH sent                  */
+  INFLIGHT_WAIT_PUBCOMP, /* QoS 2: PUBREC received, PUBREL sent  */
+} inflight_state_t;
+
+/*
+   One outbound message. Topic and payload are not copied - they must stay
+   valid until the completion callback has been called for the message.
+*/
+typedef struct
+{
+  uint8_t   au8hdr[MQTT5_PUBLISH_HDR_MAX]; /* scratch PUBLISH header, fits both protocol versions */
+  uint8_t   u8state;
+  uint8_t   u8qos;
+  uint16_t  u16msg_id;
+  uint16_t  u16topic_len;
+  uint8_t*  pu8topic;
+  uint8_t*  pu8payload;
+  uint32_t  u32payload_len;
+  uint64_t  u64sent_us;
+  void*     pvctx;
+} inflight_t;
+
+/*
+   QoS 1 / QoS 2 session on top of a client_t.
+   The in-flight table is indexed by packet identifier: slot = id % SESSION_INFLIGHT_MAX.
+*/
+typedef struct
+{
+  client_t*  psClnt;
+  inflight_t asInflight[SESSION_INFLIGHT_MAX];
+  uint32_t   u32window;    /* max number of outbound messages in flight */
+  uint32_t   u32inflight;
+  uint16_t   u16next_id;
+  uint32_t   retry_us;
+  mqtt5_conn_t* psMqtt5;   /* MQTT 5 connection state, 0 for MQTT 3.1.1 */
+
+  /* Inbound QoS 2: packet ids we sent PUBREC for and await PUBREL on */
+  uint16_t   au16rx_pending[SESSION_INFLIGHT_MAX];
+  uint32_t   u32rx_pending;
+
+  /* Called once per outbound message when its flow ends: acknowledged (PUBACK or PUBCOMP) with u8reason 0,
+     or refused by an MQTT 5 broker with the reason code (>= 0x80) of the PUBACK, PUBREC or PUBCOMP */
+  void (*message_complete)(void* psSess, uint16_t u16msg_id, void* pvctx, uint8_t u8reason);
+
+  /* Runs session_poll() when the oldest message is due, while the client is on a reactor or uring.
+     Keep the session around as long as this may be pending. */
+  wheel_timer_t sRetry;
+} session_t;
+
+
+void session_init(session_t* psSess, client_t* psClnt, uint32_t u32window);
+void session_set_callback(session_t* psSess, void* funcptr);
+/* Encode and decode as MQTT 5 using psConn (aliases, broker's Receive Maximum). Pass 0 to go back to 3.1.1 */
+void session_set_mqtt5(session_t* psSess, mqtt5_conn_t* psConn);
+/* Send a QoS 1/2 PUBLISH. Returns the packet id, or 0 if the window is full. A message
+   the client couldn't send right away is still in flight and goes out on retransmit */
+uint16_t session_publish(session_t* psSess, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint8_t* pu8payload, uint32_t u32data_len, void* pvctx);
+/* Feed an inbound packet. Returns 1 if the session consumed it, 0 if the application should handle it */
+int  session_handle_packet(session_t* psSess, uint8_t* pu8pkt, uint32_t u32nbytes);
+/* Retire all PUBACK/PUBREC/PUBREL/PUBCOMP ids of a batch from mqtt_decode_batch() in one loop,
+   returns how many. The batch's PUBLISHes are the application's, acknowledge them with session_ack_publish().
+   A batch has no MQTT 5 reason codes, so with MQTT 5 feed the acks to session_handle_packet() instead. */
+uint32_t session_handle_acks(session_t* psSess, mqtt_batch_t* psBatch);
+/* Acknowledge an inbound PUBLISH that bypassed session_handle_packet(), e.g. from the client_publish_end
+   callback of a streamed one. Returns 1 if the application must not deliver it: a QoS 2 duplicate it
+   already has, or a QoS 2 message refused (not acknowledged) while SESSION_INFLIGHT_MAX await PUBREL. */
+int  session_ack_publish(session_t* psSess, uint8_t u8qos, uint16_t u16msg_id);
+/* Retransmit (with DUP set) everything unacknowledged for longer than retry_us - called by the
+   retransmit timer when the client is driven by a reactor, otherwise call it from the poll loop */
+void session_poll(session_t* psSess);
+/* Retransmit everything in flight right away, e.g. after reconnecting with clean-session = 0 */
+void session_resend_all(session_t* psSess);
+/* Call on every accepted CONNACK. Resumes (session_present = 1) or restarts the message flows,
+   returns 1 if the broker has no session for us and subscriptions must be sent again. */
+int  session_connack(session_t* psSess, uint8_t u8session_present);
+uint32_t session_inflight(session_t* psSess);
+
+#endif /* _SESSION_H_ */
@@ -0,0 +1,587 @@
+#include "spool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* One record in the ring, followed by topic and payload and padded to 8 bytes */
+typedef struct
+{
+  uint32_t  u32len;         /* whole record, 0 = wrap marker: continue at the start of the ring */
+  uint8_t   u8qos;
+  uint8_t   u8acked;
+  uint16_t  u16topic_len;
+  uint32_t  u32payload_len;
+} spool_rec_t;
+
+
+/* Helper functions: */
+
+static spool_rec_t* _rec(spool_t* psSpool, uint64_t u64pos)
+{
+  return (spool_rec_t*)&psSpool->pu8ring[u64pos % psSpool->psHdr->u64capacity];
+}
+
+/* Bytes from u64pos to the end of the ring */
+static uint64_t _room_to_end(spool_t* psSpool, uint64_t u64pos)
+{
+  return psSpool->psHdr->u64capacity - (u64pos % psSpool->psHdr->u64capacity);
+}
+
+/* Position of the record after the one at u64pos, stepping over a wrap marker */
+static uint64_t _next(spool_t* psSpool, uint64_t u64pos)
+{
+  spool_rec_t* psRec = _rec(psSpool, u64pos);
+  return u64pos + ((psRec->u32len == 0) ? _room_to_end(psSpool, u64pos) : psRec->u32len);
+}
+
+/* Move the checkpoint past acknowledged records - never past what has been sent */
+static void _advance_head(spool_t* psSpool)
+{
+  uint64_t u64head = psSpool->psHdr->u64head;
+  while (u64head < psSpool->u64send)
+  {
+    spool_rec_t* psRec = _rec(psSpool, u64head);
+    if (    (psRec->u32len != 0)
+         && (!psRec->u8acked))
+    {
+      break;
+    }
+    u64head = _next(psSpool, u64head);
+  }
+  __atomic_store_n(&psSpool->psHdr->u64head, u64head, __ATOMIC_RELEASE);
+}
+
+/* End of the chain of intact records from head to tail - a record must fit in the ring and in the
+   tail, and hold its topic and payload. Pages of the mapping reach the disk in no particular order,
+   so after a crash the header may count records that were never written. */
+static uint64_t _scan(spool_t* psSpool)
+{
+  spool_hdr_t* psHdr = psSpool->psHdr;
+  uint64_t u64pos = psHdr->u64head;
+  while (u64pos < psHdr->u64tail)
+  {
+    spool_rec_t* psRec = _rec(psSpool, u64pos);
+    uint64_t u64room = _room_to_end(psSpool, u64pos);
+    uint64_t u64len = ((psRec->u32len == 0) ? u64room : psRec->u32len);
+    if (    (u64len > u64room)
+         || (u64len > (psHdr->u64tail - u64pos)))
+    {
+      break;
+    }
+    if (    (psRec->u32len != 0)
+         && (    (psRec->u32len & 7)
+              || (psRec->u32len < SPOOL_REC_HDR)
+              || ((SPOOL_REC_HDR + psRec->u16topic_len + (uint64_t)psRec->u32payload_len) > psRec->u32len)
+              || (    (psRec->u8qos != QOS_AT_LEAST_ONCE)
+                   && (psRec->u8qos != QOS_EXACTLY_ONCE))
+              || (psRec->u8acked > 1)))
+    {
+      break;
+    }
+    u64pos += u64len;
+  }
+  return u64pos;
+}
+
+static void _init_header(spool_hdr_t* psHdr, uint64_t u64capacity)
+{
+  psHdr->u32magic = SPOOL_MAGIC;
+  psHdr->u32version = SPOOL_VERSION;
+  psHdr->u64capacity = u64capacity;
+  psHdr->u64head = 0;
+  psHdr->u64tail = 0;
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+int spool_open(spool_t* psSpool, const char* path, uint64_t u64capacity, session_t* psSess)
+{
+  require(psSpool != 0);
+  require(path != 0);
+  require(psSess != 0);
+
+  memset(psSpool, 0, sizeof(spool_t));
+  psSpool->psSess = psSess;
+  psSpool->fd = -1;
+  u64capacity = (u64capacity + 7) & ~7ULL;
+  if (    (u64capacity == 0)
+       || (u64capacity > SPOOL_CAPACITY_MAX))
+  {
+    client_log(CLIENT_LOG_ERROR, "spool: capacity %llu out of range.\n", (unsigned long long)u64capacity);
+    return 0;
+  }
+  psSpool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (psSpool->fd < 0)
+  {
+    client_log(CLIENT_LOG_ERROR, "spool: open %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+
+  struct stat sSt;
+  int created = 0;
+  if (fstat(psSpool->fd, &sSt) < 0)
+  {
+    client_log(CLIENT_LOG_ERROR, "spool: fstat %s: %s\n", path, strerror(errno));
+    spool_close(psSpool);
+    return 0;
+  }
+  if ((uint64_t)sSt.st_size <= SPOOL_HDR_SIZE)
+  {
+    if (ftruncate(psSpool->fd, SPOOL_HDR_SIZE + u64capacity) < 0)
+    {
+      client_log(CLIENT_LOG_ERROR, "spool: ftruncate %s: %s\n", path, strerror(errno));
+      spool_close(psSpool);
+      return 0;
+    }
+    created = 1;
+    psSpool->u64map_sz = SPOOL_HDR_SIZE + u64capacity;
+  }
+  else if ((uint64_t)(sSt.st_size - SPOOL_HDR_SIZE) > SPOOL_CAPACITY_MAX)
+  {
+    client_log(CLIENT_LOG_ERROR, "spool: %s is too large for a spool file.\n", path);
+    spool_close(psSpool);
+    return 0;
+  }
+  else
+  {
+    psSpool->u64map_sz = sSt.st_size;
+  }
+
+  void* pvmap = mmap(0, psSpool->u64map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, psSpool->fd, 0);
+  if (pvmap == MAP_FAILED)
+  {
+    client_log(CLIENT_LOG_ERROR, "spool: mmap %s: %s\n", path, strerror(errno));
+    psSpool->pu8map = 0;
+    spool_close(psSpool);
+    return 0;
+  }
+  psSpool->pu8map = pvmap;
+  psSpool->psHdr = (spool_hdr_t*)psSpool->pu8map;
+  psSpool->pu8ring = &psSpool->pu8map[SPOOL_HDR_SIZE];
+
+  spool_hdr_t* psHdr = psSpool->psHdr;
+  if (created)
+  {
+    _init_header(psHdr, u64capacity);
+  }
+  else if (    (psHdr->u32magic != SPOOL_MAGIC)
+            || (psHdr->u32version != SPOOL_VERSION)
+            || (psHdr->u64capacity != (psSpool->u64map_sz - SPOOL_HDR_SIZE))
+            || (psHdr->u64capacity & 7)
+            || (psHdr->u64head & 7)
+            || (psHdr->u64tail & 7)
+            || (psHdr->u64head > psHdr->u64tail)
+            || ((psHdr->u64tail - psHdr->u64head) > psHdr->u64capacity))
+  {
+    client_log(CLIENT_LOG_ERROR, "spool: %s is not a valid spool file, starting empty.\n", path);
+    _init_header(psHdr, psSpool->u64map_sz - SPOOL_HDR_SIZE);
+  }
+  else
+  {
+    uint64_t u64end = _scan(psSpool);
+    if (u64end != psHdr->u64tail)
+    {
+      client_log(CLIENT_LOG_ERROR, "spool: %s has a damaged record at %llu, dropping %llu bytes.\n", path,
+                 (unsigned long long)u64end, (unsigned long long)(psHdr->u64tail - u64end));
+      psHdr->u64tail = u64end;
+    }
+    client_log(CLIENT_LOG_INFO, "spool: %s has %llu bytes unacknowledged.\n", path, (unsigned long long)(psHdr->u64tail - psHdr->u64head));
+  }
+
+  /* whatever was in flight before a restart is sent again */
+  psSpool->u64send = psHdr->u64head;
+  return 1;
+}
+
+void spool_close(spool_t* psSpool)
+{
+  require(psSpool != 0);
+
+  if (psSpool->pu8map != 0)
+  {
+    msync(psSpool->pu8map, psSpool->u64map_sz, MS_SYNC);
+    munmap(psSpool->pu8map, psSpool->u64map_sz);
+    psSpool->pu8map = 0;
+    psSpool->psHdr = 0;
+    psSpool->pu8ring = 0;
+  }
+  if (psSpool->fd >= 0)
+  {
+    close(psSpool->fd);
+    psSpool->fd = -1;
+  }
+}
+
+int spool_publish(spool_t* psSpool, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint8_t* pu8payload, uint32_t u32data_len)
+{
+  require(psSpool != 0);
+  require(psSpool->psHdr != 0);
+  require(    (u8qos == QOS_AT_LEAST_ONCE)
+           || (u8qos == QOS_EXACTLY_ONCE));
+
+  spool_hdr_t* psHdr = psSpool->psHdr;
+  uint64_t u64size = (SPOOL_REC_HDR + u16topic_len + (uint64_t)u32data_len + 7) & ~7ULL;
+  uint64_t u64tail = psHdr->u64tail;
+  uint64_t u64room = _room_to_end(psSpool, u64tail);
+  uint64_t u64need = u64size + ((u64room < u64size) ? u64room : 0);
+
+  if (    (u64size > psHdr->u64capacity)
+       || ((psHdr->u64capacity - (u64tail - psHdr->u64head)) < u64need))
+  {
+    return 0;
+  }
+
+  if (u64room < u64size)
+  {
+    /* records don't wrap around the end of the ring */
+    _rec(psSpool, u64tail)->u32len = 0;
+    u64tail += u64room;
+  }
+
+  spool_rec_t* psRec = _rec(psSpool, u64tail);
+  psRec->u32len = u64size;
+  psRec->u8qos = u8qos;
+  psRec->u8acked = 0;
+  psRec->u16topic_len = u16topic_len;
+  psRec->u32payload_len = u32data_len;
+  memcpy((uint8_t*)psRec + SPOOL_REC_HDR, pu8topic, u16topic_len);
+  memcpy((uint8_t*)psRec + SPOOL_REC_HDR + u16topic_len, pu8payload, u32data_len);
+
+  /* publish the tail only once the record is complete */
+  __atomic_store_n(&psHdr->u64tail, u64tail + u64size, __ATOMIC_RELEASE);
+
+  spool_drain(psSpool);
+  return 1;
+}
+
+uint32_t spool_drain(spool_t* psSpool)
+{
+  require(psSpool != 0);
+  require(psSpool->psHdr != 0);
+
+  client_t* psClnt = psSpool->psSess->psClnt;
+  uint32_t u32sent = 0;
+  while (    (psSpool->u64send < psSpool->psHdr->u64tail)
+          && (client_state(psClnt) == CONNECTED))
+  {
+    spool_rec_t* psRec = _rec(psSpool, psSpool->u64send);
+    if (    (psRec->u32len != 0)
+         && (!psRec->u8acked))
+    {
+      uint8_t* pu8topic = (uint8_t*)psRec + SPOOL_REC_HDR;
+      if (session_publish(psSpool->psSess, pu8topic, psRec->u16topic_len, psRec->u8qos, pu8topic + psRec->u16topic_len, psRec->u32payload_len, psRec) == 0)
+      {
+        break; /* window full - continue once acks come in */
+      }
+      u32sent += 1;
+    }
+    psSpool->u64send = _next(psSpool, psSpool->u64send);
+  }
+
+  /* with batching enabled the whole drain goes out in as few writes as the txbuf allows */
+  if (    (u32sent != 0)
+       && (psClnt->txbuflen != 0)
+       && (!psClnt->tx_async))
+  {
+    client_flush(psClnt);
+  }
+  return u32sent;
+}
+
+int spool_complete(spool_t* psSpool, void* pvctx)
+{
+  require(psSpool != 0);
+  require(psSpool->psHdr != 0);
+
+  uint8_t* pu8rec = pvctx;
+  if (    (pu8rec < psSpool->pu8ring)
+       || (pu8rec >= (psSpool->pu8ring + psSpool->psHdr->u64capacity)))
+  {
+    return 0;
+  }
+
+  ((spool_rec_t*)pu8rec)->u8acked = 1;
+  _advance_head(psSpool);
+  return 1;
+}
+
+int spool_sync(spool_t* psSpool)
+{
+  require(psSpool != 0);
+  require(psSpool->pu8map != 0);
+
+  return (msync(psSpool->pu8map, psSpool->u64map_sz, MS_SYNC) == 0);
+}
+
+uint64_t spool_used(spool_t* psSpool)
+{
+  require(psSpool != 0);
+  require(psSpool->psHdr != 0);
+
+  return psSpool->psHdr->u64tail - psSpool->psHdr->u64head;
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c spool.c && gcc spool.o session.c client.c mqtt.c wheel.c ring.c -o spool_test && ./spool_test */
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+#define TEST_CAPACITY 256
+
+/* Loopback transport: what the session sends collects in au8sent, the test plays the broker */
+static uint8_t  au8sent[8192];
+static uint32_t u32sent;
+
+static ssize_t _test_writev(void* pvClnt, int fd, struct iovec* asIov, int niov, int flags)
+{
+  (void)pvClnt; (void)fd; (void)flags;
+  ssize_t nbytes = 0;
+  int i;
+  for (i = 0; i < niov; ++i)
+  {
+    require((u32sent + asIov[i].iov_len) <= sizeof(au8sent));
+    memcpy(&au8sent[u32sent], asIov[i].iov_base, asIov[i].iov_len);
+    u32sent += asIov[i].iov_len;
+    nbytes += asIov[i].iov_len;
+  }
+  return nbytes;
+}
+
+static const client_transport_t sTestTransport = { "test", 0, 0, 0, 0, 0, _test_writev, 0, 0 };
+
+static char     acpath[64];
+static spool_t  sSpool;
+static session_t sSess;
+static client_t sClnt;
+
+/* Payloads of the PUBLISH packets sent since the last call, as numbers, and their ids */
+static uint32_t au32sent_nr[64];
+static uint16_t au16sent_id[64];
+static uint32_t u32nsent;
+
+static void _test_take_sent(void)
+{
+  uint32_t u32ofs = 0;
+  u32nsent = 0;
+  while (u32ofs < u32sent)
+  {
+    mqtt_view_t sView;
+    mqtt_publish_view_t sPub;
+    int len = mqtt_decode_view(&au8sent[u32ofs], u32sent - u32ofs, &sView);
+    require(len > 0);
+    require(u32nsent < (sizeof(au32sent_nr) / sizeof(au32sent_nr[0])));
+    require(mqtt_view_publish(&sView, &sPub));
+    require(sPub.u32payload_len == sizeof(uint32_t));
+    memcpy(&au32sent_nr[u32nsent], sPub.pu8payload, sizeof(uint32_t));
+    au16sent_id[u32nsent] = sPub.u16msg_id;
+    u32nsent += 1;
+    u32ofs += len;
+  }
+  u32sent = 0;
+}
+
+static void _test_complete(session_t* psSess, uint16_t u16msg_id, void* pvctx, uint8_t u8reason)
+{
+  (void)psSess; (void)u16msg_id; (void)u8reason;
+  check(spool_complete(&sSpool, pvctx));
+}
+
+/* (Re)open the spool on a fresh connected session, as after a restart */
+static int _test_open(uint64_t u64capacity)
+{
+  static char acrxbuf[256];
+  client_init(&sClnt, "127.0.0.1", 1883, acrxbuf, sizeof(acrxbuf));
+  client_set_transport(&sClnt, &sTestTransport, 0);
+  sClnt.state = CONNECTED;
+  session_init(&sSess, &sClnt, 64);
+  session_set_callback(&sSess, _test_complete);
+  u32sent = 0;
+  return spool_open(&sSpool, acpath, u64capacity, &sSess);
+}
+
+/* Message nr on topic "spool/test" - 12 + 10 + 4 bytes, a 32 byte record */
+static int _test_publish(uint32_t u32nr)
+{
+  return spool_publish(&sSpool, (uint8_t*)"spool/test", 10, QOS_AT_LEAST_ONCE, (uint8_t*)&u32nr, sizeof(u32nr));
+}
+
+static void _test_puback(uint16_t u16msg_id)
+{
+  uint8_t au8pkt[4] = { CTRL_PUBACK << 4, 2, u16msg_id >> 8, u16msg_id & 0xFF };
+  check(session_handle_packet(&sSess, au8pkt, sizeof(au8pkt)) == 1);
+}
+
+/* Messages are kept until acknowledged, after a restart only the unacknowledged ones are sent again */
+static void test_replay(void)
+{
+  uint32_t i;
+  unlink(acpath);
+  check(_test_open(TEST_CAPACITY));
+  for (i = 0; i < 5; ++i)
+  {
+    check(_test_publish(i));
+  }
+  _test_take_sent();
+  check(u32nsent == 5);
+  check(spool_used(&sSpool) == (5 * 32));
+
+  /* acks out of order: the head only moves past the first two */
+  _test_puback(au16sent_id[0]);
+  _test_puback(au16sent_id[3]);
+  _test_puback(au16sent_id[1]);
+  check(spool_used(&sSpool) == (3 * 32));
+  spool_close(&sSpool);
+
+  check(_test_open(0x100000)); /* the file keeps its capacity */
+  check(sSpool.psHdr->u64capacity == TEST_CAPACITY);
+  check(spool_used(&sSpool) == (3 * 32));
+  check(spool_drain(&sSpool) == 2); /* 3 was acknowledged */
+  _test_take_sent();
+  check(u32nsent == 2);
+  check((au32sent_nr[0] == 2) && (au32sent_nr[1] == 4));
+  _test_puback(au16sent_id[0]);
+  _test_puback(au16sent_id[1]);
+  check(spool_used(&sSpool) == 0);
+  spool_close(&sSpool);
+
+  check(_test_open(TEST_CAPACITY));
+  check(spool_drain(&sSpool) == 0);
+  spool_close(&sSpool);
+}
+
+/* A record that doesn't fit before the end of the ring starts over at the beginning */
+static void test_wrap(void)
+{
+  uint32_t i;
+  unlink(acpath);
+  check(_test_open(TEST_CAPACITY - 8));
+  for (i = 0; i < 7; ++i)
+  {
+    check(_test_publish(i));
+  }
+  _test_take_sent();
+  for (i = 0; i < 7; ++i)
+  {
+    _test_puback(au16sent_id[i]);
+  }
+  check(spool_used(&sSpool) == 0);
+
+  /* 224 bytes in, 24 to the end: the first record goes behind a wrap marker */
+  for (i = 10; i < 17; ++i)
+  {
+    check(_test_publish(i));
+  }
+  check(_rec(&sSpool, 224)->u32len == 0);
+  check(!_test_publish(17)); /* full */
+  check(spool_used(&sSpool) == (TEST_CAPACITY - 8));
+  spool_close(&sSpool);
+
+  check(_test_open(TEST_CAPACITY));
+  check(spool_used(&sSpool) == (TEST_CAPACITY - 8));
+  check(spool_drain(&sSpool) == 7);
+  _test_take_sent();
+  int inorder = (u32nsent == 7);
+  for (i = 0; i < u32nsent; ++i)
+  {
+    inorder &= (au32sent_nr[i] == (10 + i));
+  }
+  check(inorder);
+  spool_close(&sSpool);
+}
+
+/* Records the header counts but that never reached the disk intact are dropped on reopen */
+static void test_damaged(void)
+{
+  uint32_t i;
+  int fd;
+  unlink(acpath);
+  check(_test_open(TEST_CAPACITY));
+  for (i = 0; i < 4; ++i)
+  {
+    check(_test_publish(i));
+  }
+  spool_close(&sSpool);
+
+  /* the third record's payload runs past its length */
+  uint32_t u32payload_len = 100;
+  fd = open(acpath, O_RDWR);
+  check(pwrite(fd, &u32payload_len, sizeof(u32payload_len), SPOOL_HDR_SIZE + (2 * 32) + 8) == sizeof(u32payload_len));
+  close(fd);
+  check(_test_open(TEST_CAPACITY));
+  check(spool_used(&sSpool) == (2 * 32));
+  check(spool_drain(&sSpool) == 2);
+  _test_take_sent();
+  check((au32sent_nr[0] == 0) && (au32sent_nr[1] == 1));
+  check(_test_publish(7)); /* appended in place of the dropped ones */
+  check(spool_used(&sSpool) == (3 * 32));
+  spool_close(&sSpool);
+
+  /* a record of zeroes where the tail says there is one - a length of 0 is a wrap marker but there
+     are 192 bytes to the end of the ring and only 32 to the tail */
+  uint8_t au8zero[32] = { 0 };
+  fd = open(acpath, O_RDWR);
+  check(pwrite(fd, au8zero, sizeof(au8zero), SPOOL_HDR_SIZE + (2 * 32)) == sizeof(au8zero));
+  close(fd);
+  check(_test_open(TEST_CAPACITY));
+  check(spool_used(&sSpool) == (2 * 32));
+  spool_close(&sSpool);
+
+  /* a length reaching past the end of the ring */
+  uint32_t u32len = TEST_CAPACITY;
+  fd = open(acpath, O_RDWR);
+  check(pwrite(fd, &u32len, sizeof(u32len), SPOOL_HDR_SIZE + 32) == sizeof(u32len));
+  close(fd);
+  check(_test_open(TEST_CAPACITY));
+  check(spool_used(&sSpool) == 32);
+  spool_close(&sSpool);
+}
+
+static void test_capacity(void)
+{
+  unlink(acpath);
+  check(!_test_open(0));
+  check(!_test_open(SPOOL_CAPACITY_MAX + 8));
+  check(!_test_open(1ULL << 40));
+  check(access(acpath, F_OK) != 0); /* nothing created */
+  check(_test_open(TEST_CAPACITY - 5)); /* rounded up */
+  check(sSpool.psHdr->u64capacity == TEST_CAPACITY);
+  spool_close(&sSpool);
+}
+
+
+int main(void)
+{
+#if (CLIENT_LOG == 1)
+  client_log_hook = 0;
+#endif
+
+  snprintf(acpath, sizeof(acpath), "/tmp/spool_test.%d", (int)getpid());
+  test_replay();
+  test_wrap();
+  test_damaged();
+  test_capacity();
+  unlink(acpath);
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stdint.h>
+#include "client.h"
+#include "session.h"
+
+#define SPOOL_MAGIC        0x4C4F4F50  /* "POOL" */
+#define SPOOL_VERSION      1
+#define SPOOL_HDR_SIZE     4096        /* file header, the ring starts on the next page */
+#define SPOOL_REC_HDR      12          /* record header in front of topic and payload */
+#define SPOOL_CAPACITY_MAX 0xFFFFFFF8ULL /* record lengths are 32 bits */
+
+
+/* File header - head is the ack checkpoint, everything before it has been acknowledged by the broker */
+typedef struct
+{
+  uint32_t  u32magic;
+  uint32_t  u32version;
+  uint64_t  u64capacity;    /* ring bytes following the header */
+  uint64_t  u64head;        /* oldest record not yet acknowledged */
+  uint64_t  u64tail;        /* where the next record is appended */
+} spool_hdr_t;
+
+/*
+   Store-and-forward queue for outbound QoS 1/2 messages in a memory-mapped ring file.
+   Records are appended, sent through a session_t straight from the mapping (no copies) and
+   marked acknowledged in place. The head is advanced past acknowledged records and kept in
+   the file header, so after a restart only unacknowledged messages are sent again.
+
+   Positions are byte offsets that only grow, the place in the ring is position % capacity.
+*/
+typedef struct
+{
+  int          fd;
+  uint8_t*     pu8map;
+  uint64_t     u64map_sz;
+  spool_hdr_t* psHdr;
+  uint8_t*     pu8ring;
+  uint64_t     u64send;     /* next record to hand to the session, not persisted */
+  session_t*   psSess;
+} spool_t;
+
+
+/* Opens or creates the spool file. An existing file keeps its own capacity, records from a torn or damaged
+   tail are dropped. Returns 1 on success, 0 if the capacity is 0 or above SPOOL_CAPACITY_MAX. */
+int  spool_open(spool_t* psSpool, const char* path, uint64_t u64capacity, session_t* psSess);
+void spool_close(spool_t* psSpool);
+/* Append a message and send it if the connection is up. Returns 0 if the spool is full. */
+int  spool_publish(spool_t* psSpool, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t u8qos, uint8_t* pu8payload, uint32_t u32data_len);
+/* Hand queued messages to the session while it has room in its window - call after each poll and after reconnecting.
+   Returns the number of messages sent. */
+uint32_t spool_drain(spool_t* psSpool);
+/* Call from the session's message_complete callback. Returns 0 if pvctx is not a spooled message. */
+int  spool_complete(spool_t* psSpool, void* pvctx);
+/* Write the mapping to disk - the kernel does it on its own, this is for power-loss safety */
+int  spool_sync(spool_t* psSpool);
+/* Bytes in the ring not yet acknowledged */
+uint64_t spool_used(spool_t* psSpool);
+
+#endif /* _SPOOL_H_ */
@@ -0,0 +1,505 @@
+#include "subscribe.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+/* Helper functions: */
+
+static void _dummy_complete(subscribe_t* s) { (void) s; }
+
+static uint16_t _alloc_id(subscribe_t* psSub)
+{
+  uint16_t u16id;
+  uint32_t i;
+  for (;;)
+  {
+    u16id = psSub->u16next_id;
+    psSub->u16next_id = ((u16id == 0xFFFF) ? SUBSCRIBE_ID_FIRST : (u16id + 1));
+    for (i = 0; i < psSub->u32npending; ++i)
+    {
+      if (psSub->asPending[i].u16msg_id == u16id)
+      {
+        break;
+      }
+    }
+    if (i == psSub->u32npending)
+    {
+      return u16id;
+    }
+  }
+}
+
+static uint32_t _max_packet(subscribe_t* psSub)
+{
+  uint32_t u32max = psSub->u32bufsz;
+  if (    (psSub->psMqtt5 != 0)
+       && (psSub->psMqtt5->u32peer_max_packet_size != 0)
+       && (psSub->psMqtt5->u32peer_max_packet_size < u32max))
+  {
+    u32max = psSub->psMqtt5->u32peer_max_packet_size;
+  }
+  return u32max;
+}
+
+static void _set_result(subscribe_t* psSub, uint32_t u32idx, uint8_t u8code)
+{
+  if (psSub->au8result[u32idx] == SUBSCRIBE_PENDING)
+  {
+    if (u8code < SUBSCRIBE_FAILURE)
+    {
+      psSub->u32granted += 1;
+    }
+    else
+    {
+      psSub->u32failed += 1;
+    }
+  }
+  psSub->au8result[u32idx] = u8code;
+}
+
+/* Fill the pipeline: pack the next filters into packets until the window is full or all are sent */
+static int _send_more(subscribe_t* psSub)
+{
+  uint32_t u32max = _max_packet(psSub);
+  while (    (psSub->u32npending < psSub->u32window)
+          && (psSub->u32next < psSub->u32nfilters))
+  {
+    uint32_t u32first = psSub->u32next;
+    uint32_t u32left = psSub->u32nfilters - u32first;
+    uint32_t u32npacked = 0;
+    uint16_t u16msg_id = _alloc_id(psSub);
+    int nbytes;
+
+    if (psSub->u8unsubscribe)
+    {
+      nbytes = ((psSub->psMqtt5 != 0)
+                ? mqtt5_encode_unsubscribe_packed(psSub->pu8buf, u32max, &psSub->apu8filter[u32first], &psSub->au16filter_len[u32first], u32left, u16msg_id, &u32npacked)
+                : mqtt_encode_unsubscribe_packed(psSub->pu8buf, u32max, &psSub->apu8filter[u32first], &psSub->au16filter_len[u32first], u32left, u16msg_id, &u32npacked));
+    }
+    else
+    {
+      nbytes = ((psSub->psMqtt5 != 0)
+                ? mqtt5_encode_subscribe_packed(psSub->pu8buf, u32max, &psSub->apu8filter[u32first], &psSub->au16filter_len[u32first], &psSub->au8qos[u32first], u32left, u16msg_id, &u32npacked)
+                : mqtt_encode_subscribe_packed(psSub->pu8buf, u32max, &psSub->apu8filter[u32first], &psSub->au16filter_len[u32first], &psSub->au8qos[u32first], u32left, u16msg_id, &u32npacked));
+    }
+
+    if (nbytes <= 0)
+    {
+      /* this filter alone doesn't fit in a packet - fail it and go on with the next */
+      client_log(CLIENT_LOG_ERROR, "CLNT%d: topic filter %u too long for the max packet size.\n", psSub->psClnt->sockfd, u32first);
+      _set_result(psSub, u32first, SUBSCRIBE_FAILURE);
+      psSub->u32next += 1;
+      continue;
+    }
+    if (client_send(psSub->psClnt, (char*)psSub->pu8buf, nbytes) <= 0)
+    {
+      return 0;
+    }
+
+    subscribe_pkt_t* psPkt = &psSub->asPending[psSub->u32npending++];
+    psPkt->u16msg_id = u16msg_id;
+    psPkt->u32first = u32first;
+    psPkt->u32count = u32npacked;
+    psSub->u32next += u32npacked;
+  }
+
+  if (subscribe_done(psSub))
+  {
+    psSub->subscribe_complete(psSub);
+  }
+  return 1;
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+void subscribe_init(subscribe_t* psSub, client_t* psClnt, uint8_t** apu8filter, uint16_t* au16filter_len, uint8_t* au8qos, uint8_t* au8result, uint32_t u32nfilters, uint8_t* pu8buf, uint32_t u32bufsz)
+{
+  require(psSub != 0);
+  require(psClnt != 0);
+  require(apu8filter != 0);
+  require(au16filter_len != 0);
+  require(au8result != 0);
+  require(pu8buf != 0);
+
+  memset(psSub, 0, sizeof(subscribe_t));
+  psSub->psClnt = psClnt;
+  psSub->apu8filter = apu8filter;
+  psSub->au16filter_len = au16filter_len;
+  psSub->au8qos = au8qos;
+  psSub->au8result = au8result;
+  psSub->u32nfilters = u32nfilters;
+  psSub->pu8buf = pu8buf;
+  psSub->u32bufsz = u32bufsz;
+  psSub->u32window = SUBSCRIBE_PIPELINE_MAX;
+  psSub->u16next_id = SUBSCRIBE_ID_FIRST;
+  psSub->u32next = u32nfilters; /* nothing to send before subscribe_start() */
+  psSub->subscribe_complete = (void*)_dummy_complete;
+}
+
+void subscribe_set_callback(subscribe_t* psSub, void* funcptr)
+{
+  require(psSub != 0);
+  require(funcptr != 0);
+
+  psSub->subscribe_complete = funcptr;
+}
+
+void subscribe_set_mqtt5(subscribe_t* psSub, mqtt5_conn_t* psConn)
+{
+  require(psSub != 0);
+
+  psSub->psMqtt5 = psConn;
+}
+
+int subscribe_start(subscribe_t* psSub, int unsubscribe)
+{
+  require(psSub != 0);
+  require(unsubscribe || (psSub->au8qos != 0));
+
+  memset(psSub->au8result, SUBSCRIBE_PENDING, psSub->u32nfilters);
+  psSub->u8unsubscribe = (unsubscribe != 0);
+  psSub->u32next = 0;
+  psSub->u32npending = 0;
+  psSub->u32granted = 0;
+  psSub->u32failed = 0;
+  return _send_more(psSub);
+}
+
+int subscribe_handle_packet(subscribe_t* psSub, uint8_t* pu8pkt, uint32_t u32nbytes)
+{
+  require(psSub != 0);
+  require(pu8pkt != 0);
+
+  mqtt_view_t sView;
+  mqtt_suback_view_t sAck;
+  uint8_t u8type = (psSub->u8unsubscribe ? CTRL_UNSUBACK : CTRL_SUBACK);
+
+  if (    (psSub->u32npending == 0)
+       || (mqtt_decode_view(pu8pkt, u32nbytes, &sView) <= 0)
+       || (sView.u8type != u8type))
+  {
+    return 0;
+  }
+
+  if (psSub->psMqtt5 != 0)
+  {
+    if (!mqtt5_view_suback(&sView, &sAck))
+    {
+      return 0;
+    }
+  }
+  else if (u8type == CTRL_SUBACK)
+  {
+    if (!mqtt_view_suback(&sView, &sAck))
+    {
+      return 0;
+    }
+  }
+  else
+  {
+    /* MQTT 3.1.1 UNSUBACK has no return codes: every filter succeeded */
+    if (!mqtt_view_ack(&sView, &sAck.u16msg_id))
+    {
+      return 0;
+    }
+    sAck.pu8codes = 0;
+    sAck.u32ncodes = 0;
+  }
+
+  uint32_t i;
+  for (i = 0; i < psSub->u32npending; ++i)
+  {
+    subscribe_pkt_t* psPkt = &psSub->asPending[i];
+    if (psPkt->u16msg_id == sAck.u16msg_id)
+    {
+      uint32_t j;
+      for (j = 0; j < psPkt->u32count; ++j)
+      {
+        uint8_t u8code;
+        if (j < sAck.u32ncodes)
+        {
+          u8code = sAck.pu8codes[j];
+        }
+        else
+        {
+          /* a broker answering with too few codes fails the rest */
+          u8code = ((sAck.pu8codes == 0) ? 0 : SUBSCRIBE_FAILURE);
+        }
+        _set_result(psSub, psPkt->u32first + j, u8code);
+      }
+      /* order of the pending list does not matter: move the last one into the hole */
+      *psPkt = psSub->asPending[--psSub->u32npending];
+      return (_send_more(psSub) ? 1 : -1);
+    }
+  }
+  return 0;
+}
+
+int subscribe_resume(subscribe_t* psSub)
+{
+  require(psSub != 0);
+
+  if (subscribe_done(psSub))
+  {
+    return 1; /* nothing left to send, and subscribe_complete has been called */
+  }
+
+  /* rewind to the oldest unanswered packet - filters answered since are sent again, which is harmless */
+  uint32_t i;
+  for (i = 0; i < psSub->u32npending; ++i)
+  {
+    if (psSub->asPending[i].u32first < psSub->u32next)
+    {
+      psSub->u32next = psSub->asPending[i].u32first;
+    }
+  }
+  psSub->u32npending = 0;
+  return _send_more(psSub);
+}
+
+int subscribe_done(subscribe_t* psSub)
+{
+  require(psSub != 0);
+
+  return (    (psSub->u32next == psSub->u32nfilters)
+           && (psSub->u32npending == 0));
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 -c subscribe.c && gcc subscribe.o client.c mqtt.c wheel.c ring.c -o subscribe_test && ./subscribe_test */
+#include <stdio.h>
+#include <errno.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+#define NFILTERS  40
+
+/* Loopback transport: what the client sends collects in au8sent, unless writes are refused */
+static uint8_t  au8sent[4096];
+static uint32_t u32sent;
+static int      refuse;
+
+static ssize_t _test_writev(void* pvClnt, int fd, struct iovec* asIov, int niov, int flags)
+{
+  (void)pvClnt; (void)fd; (void)flags;
+  if (refuse)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  ssize_t nbytes = 0;
+  int i;
+  for (i = 0; i < niov; ++i)
+  {
+    require((u32sent + asIov[i].iov_len) <= sizeof(au8sent));
+    memcpy(&au8sent[u32sent], asIov[i].iov_base, asIov[i].iov_len);
+    u32sent += asIov[i].iov_len;
+    nbytes += asIov[i].iov_len;
+  }
+  return nbytes;
+}
+
+static const client_transport_t sTestTransport = { "test", 0, 0, 0, 0, 0, _test_writev, 0, 0 };
+
+static uint32_t u32ncomplete;
+
+static void _test_complete(subscribe_t* psSub)
+{
+  (void)psSub;
+  u32ncomplete += 1;
+}
+
+static char     acnames[NFILTERS][8];
+static uint8_t* apu8filter[NFILTERS];
+static uint16_t au16len[NFILTERS];
+static uint8_t  au8qos[NFILTERS];
+static uint8_t  au8result[NFILTERS];
+static uint8_t  au8buf[48];      /* a few filters per packet */
+
+/* A run over NFILTERS filters "f/<i>", QoS i % 3, on a connected non-blocking client */
+static void _test_run(subscribe_t* psSub, client_t* psClnt, uint32_t u32window)
+{
+  static char acrxbuf[256];
+  uint32_t i;
+  for (i = 0; i < NFILTERS; ++i)
+  {
+    sprintf(acnames[i], "f/%u", i);
+    apu8filter[i] = (uint8_t*)acnames[i];
+    au16len[i] = strlen(acnames[i]);
+    au8qos[i] = i % 3;
+  }
+  client_init(psClnt, "127.0.0.1", 1883, acrxbuf, sizeof(acrxbuf));
+  client_set_transport(psClnt, &sTestTransport, 0);
+  psClnt->state = CONNECTED;
+  psClnt->nonblocking = 1;
+  subscribe_init(psSub, psClnt, apu8filter, au16len, au8qos, au8result, NFILTERS, au8buf, sizeof(au8buf));
+  subscribe_set_callback(psSub, _test_complete);
+  psSub->u32window = u32window;
+  u32sent = 0;
+  refuse = 0;
+  u32ncomplete = 0;
+}
+
+/* Play the broker: SUBACK every SUBSCRIBE sent so far, granting the requested QoS except for "f/7".
+   Returns the number of packets answered, *pfailed is set if subscribe_handle_packet() said -1. */
+static uint32_t _test_answer(subscribe_t* psSub, int* pfailed)
+{
+  uint8_t au8pkts[sizeof(au8sent)];
+  uint32_t u32len = u32sent;
+  uint32_t u32ofs = 0;
+  uint32_t n = 0;
+  memcpy(au8pkts, au8sent, u32len);
+  u32sent = 0;
+  while (u32ofs < u32len)
+  {
+    mqtt_view_t sView;
+    uint16_t u16msg_id;
+    uint32_t u32fofs = 0;
+    uint8_t* pu8filter;
+    uint16_t u16filter_len;
+    uint8_t u8qos;
+    uint8_t au8codes[NFILTERS];
+    uint32_t u32ncodes = 0;
+    uint8_t au8ack[64];
+
+    int len = mqtt_decode_view(&au8pkts[u32ofs], u32len - u32ofs, &sView);
+    require(len > 0);
+    require(sView.u8type == CTRL_SUBSCRIBE);
+    require(mqtt_view_ack(&sView, &u16msg_id));
+    while (mqtt_view_filter(&sView, &u32fofs, &pu8filter, &u16filter_len, &u8qos))
+    {
+      au8codes[u32ncodes++] = (((u16filter_len == 3) && (memcmp(pu8filter, "f/7", 3) == 0)) ? SUBSCRIBE_FAILURE : u8qos);
+    }
+    int nack = mqtt_encode_suback_msg(au8ack, u16msg_id, au8codes, u32ncodes);
+    int rc = subscribe_handle_packet(psSub, au8ack, nack);
+    check(rc != 0);
+    if (rc < 0)
+    {
+      *pfailed = 1;
+    }
+    n += 1;
+    u32ofs += len;
+  }
+  return n;
+}
+
+static void test_pipeline(void)
+{
+  subscribe_t sSub;
+  client_t sClnt;
+  int failed = 0;
+  uint32_t u32rounds = 0;
+  uint32_t i;
+  _test_run(&sSub, &sClnt, 2);
+
+  check(subscribe_start(&sSub, 0));
+  check(sSub.u32npending == 2);
+  while (    (_test_answer(&sSub, &failed) != 0)
+          && (u32rounds < 100))
+  {
+    check(sSub.u32npending <= 2);
+    u32rounds += 1;
+  }
+  check(!failed);
+  check(u32rounds > 3);
+  check(subscribe_done(&sSub));
+  check(u32ncomplete == 1);
+  check(sSub.u32granted == (NFILTERS - 1));
+  check(sSub.u32failed == 1);
+  int allgranted = 1;
+  for (i = 0; i < NFILTERS; ++i)
+  {
+    allgranted &= (au8result[i] == ((i == 7) ? SUBSCRIBE_FAILURE : (i % 3)));
+  }
+  check(allgranted);
+
+  /* resuming a finished run neither sends nor completes it again */
+  check(subscribe_resume(&sSub));
+  check(u32sent == 0);
+  check(u32ncomplete == 1);
+
+  /* an ack nobody waits for isn't ours */
+  uint8_t au8ack[8];
+  uint8_t u8code = 0;
+  check(subscribe_handle_packet(&sSub, au8ack, mqtt_encode_suback_msg(au8ack, SUBSCRIBE_ID_FIRST, &u8code, 1)) == 0);
+}
+
+/* A failed send stops the run until subscribe_resume(), which picks up where it stopped */
+static void test_send_failure(void)
+{
+  subscribe_t sSub;
+  client_t sClnt;
+  int failed = 0;
+  _test_run(&sSub, &sClnt, 1);
+
+  refuse = 1;
+  check(!subscribe_start(&sSub, 0));
+  check(sSub.u32npending == 0);
+  refuse = 0;
+  check(subscribe_resume(&sSub));
+  check(sSub.u32npending == 1);
+
+  /* the ack goes through, the next packet doesn't */
+  refuse = 1;
+  check(_test_answer(&sSub, &failed) == 1);
+  check(failed);
+  check(sSub.u32npending == 0);
+  check(subscribe_resume(&sSub) == 0);
+  check(!subscribe_done(&sSub));
+  check(u32ncomplete == 0);
+
+  /* after a reconnect the unanswered packet goes out again with a new id, its old ack is ignored */
+  refuse = 0;
+  check(subscribe_resume(&sSub));
+  uint8_t au8first[sizeof(au8sent)];
+  uint32_t u32first = u32sent;
+  memcpy(au8first, au8sent, u32first);
+  check(subscribe_resume(&sSub));
+  check(u32sent == (2 * u32first));
+  mqtt_view_t sView;
+  uint16_t u16old;
+  uint8_t au8ack[8];
+  uint8_t u8code = 0;
+  check(mqtt_decode_view(au8first, u32first, &sView) > 0);
+  check(mqtt_view_ack(&sView, &u16old));
+  check(subscribe_handle_packet(&sSub, au8ack, mqtt_encode_suback_msg(au8ack, u16old, &u8code, 1)) == 0);
+  u32sent -= u32first;
+  memmove(au8sent, &au8sent[u32first], u32sent);
+
+  while (_test_answer(&sSub, &failed) != 0)
+  {
+  }
+  check(subscribe_done(&sSub));
+  check(u32ncomplete == 1);
+  check(sSub.u32granted == (NFILTERS - 1));
+  check(subscribe_resume(&sSub));
+  check(u32ncomplete == 1);
+}
+
+
+int main(void)
+{
+#if (CLIENT_LOG == 1)
+  client_log_hook = 0;
+#endif
+
+  test_pipeline();
+  test_send_failure();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
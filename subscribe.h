@@ -0,0 +1,75 @@
+#ifndef _SUBSCRIBE_H_
+#define _SUBSCRIBE_H_
+
+#include <stdint.h>
+#include "client.h"
+#include "mqtt.h"
+#include "session.h"
+
+#define SUBSCRIBE_PIPELINE_MAX  16       /* SUBSCRIBE / UNSUBSCRIBE packets sent ahead of their acks */
+#define SUBSCRIBE_ID_FIRST      (SESSION_ID_LAST + 1) /* packet ids used, up to 0xFFFF */
+
+/* au8result[] values besides a granted QoS [0:2] (or 0 for a successful unsubscribe) */
+#define SUBSCRIBE_FAILURE       0x80     /* 3.1.1 failure - MQTT 5 reports its own reason codes >= 0x80 */
+#define SUBSCRIBE_PENDING       0xFF     /* not answered yet */
+
+
+/* One (UN)SUBSCRIBE packet on its way */
+typedef struct
+{
+  uint16_t u16msg_id;
+  uint32_t u32first;       /* filters [u32first, u32first + u32count) */
+  uint32_t u32count;
+} subscribe_pkt_t;
+
+/*
+   Bulk subscribe / unsubscribe on top of a client_t: the filters are packed into
+   as few packets as the maximum packet size allows, and up to u32window packets
+   are sent without waiting for their SUBACK / UNSUBACK. The result for each filter
+   lands in au8result[]. Filter arrays and the packet buffer belong to the caller
+   and must stay valid until the callback reports the run complete.
+*/
+typedef struct
+{
+  client_t*      psClnt;
+  mqtt5_conn_t*  psMqtt5;        /* MQTT 5 connection state, 0 for MQTT 3.1.1 */
+  uint8_t**      apu8filter;
+  uint16_t*      au16filter_len;
+  uint8_t*       au8qos;         /* requested QoS (MQTT 5: subscription options) */
+  uint8_t*       au8result;
+  uint32_t       u32nfilters;
+  uint8_t*       pu8buf;         /* each packet is built here - its size caps the packet size */
+  uint32_t       u32bufsz;
+
+  uint8_t        u8unsubscribe;
+  uint32_t       u32next;        /* first filter not sent yet */
+  uint32_t       u32window;
+  subscribe_pkt_t asPending[SUBSCRIBE_PIPELINE_MAX];
+  uint32_t       u32npending;
+  uint16_t       u16next_id;
+  uint32_t       u32granted;     /* filters answered with success */
+  uint32_t       u32failed;      /* ... with a failure, or too long to fit in a packet */
+
+  /* Called once every filter has been answered */
+  void (*subscribe_complete)(void* psSub);
+} subscribe_t;
+
+
+void subscribe_init(subscribe_t* psSub, client_t* psClnt, uint8_t** apu8filter, uint16_t* au16filter_len, uint8_t* au8qos, uint8_t* au8result, uint32_t u32nfilters, uint8_t* pu8buf, uint32_t u32bufsz);
+void subscribe_set_callback(subscribe_t* psSub, void* funcptr);
+/* Encode and decode as MQTT 5. Packets are kept within the broker's maximum packet size as well. */
+void subscribe_set_mqtt5(subscribe_t* psSub, mqtt5_conn_t* psConn);
+/* Start sending: all filters are subscribed (unsubscribe == 0) or unsubscribed, au8result[] is reset to
+   SUBSCRIBE_PENDING. Call once the broker has accepted the connection. Returns 0 if sending failed:
+   the run waits for subscribe_resume(). */
+int  subscribe_start(subscribe_t* psSub, int unsubscribe);
+/* Feed an inbound packet. Returns 1 if it was the SUBACK / UNSUBACK of one of our packets, -1 if it
+   was but sending the next packet failed: the run waits for subscribe_resume(). */
+int  subscribe_handle_packet(subscribe_t* psSub, uint8_t* pu8pkt, uint32_t u32nbytes);
+/* After reconnecting, or once the client can send again after a failure: the packets in flight may be
+   lost, send them again and go on. Does nothing for a run that is done. Returns 0 if sending failed. */
+int  subscribe_resume(subscribe_t* psSub);
+/* 1 once every filter has been answered */
+int  subscribe_done(subscribe_t* psSub);
+
+#endif /* _SUBSCRIBE_H_ */
@@ -0,0 +1,633 @@
+#include "topictrie.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* Assertion macro */
+#define require(predicate)         assert((predicate))
+
+
+/* A topic split into levels: level i is pu8str[au16ofs[i] .. au16ofs[i] + au16len[i]] */
+typedef struct
+{
+  uint8_t* pu8str;
+  uint16_t au16ofs[TRIE_MAX_LEVELS];
+  uint16_t au16len[TRIE_MAX_LEVELS];
+  uint32_t u32nlevels;
+} levels_t;
+
+
+/* Helper functions: */
+static int _split(uint8_t* pu8str, uint16_t u16len, levels_t* psLvl)
+{
+  uint32_t n = 0;
+  uint16_t u16start = 0;
+  uint16_t i;
+
+  psLvl->pu8str = pu8str;
+  for (i = 0; i <= u16len; ++i)
+  {
+    if (    (i == u16len)
+         || (pu8str[i] == '/'))
+    {
+      if (n == TRIE_MAX_LEVELS)
+      {
+        return 0; /* too deep */
+      }
+      psLvl->au16ofs[n] = u16start;
+      psLvl->au16len[n] = i - u16start;
+      n += 1;
+      u16start = i + 1;
+    }
+  }
+  psLvl->u32nlevels = n;
+  return 1;
+}
+
+static int _is_level(levels_t* psLvl, uint32_t u32idx, char c)
+{
+  return (    (psLvl->au16len[u32idx] == 1)
+           && (psLvl->pu8str[psLvl->au16ofs[u32idx]] == c));
+}
+
+/* '#' may only appear as the last level of a filter */
+static int _valid_filter(levels_t* psLvl)
+{
+  uint32_t i;
+  for (i = 0; (i + 1) < psLvl->u32nlevels; ++i)
+  {
+    if (_is_level(psLvl, i, '#'))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Hash bucket of a named child: FNV-1a over the name, seeded with the parent */
+static uint32_t _bucket(trie_t* psTrie, uint16_t u16parent, uint8_t* pu8name, uint16_t u16name_len)
+{
+  uint32_t u32hash = 2166136261u ^ u16parent;
+  uint16_t i;
+  for (i = 0; i < u16name_len; ++i)
+  {
+    u32hash = (u32hash ^ pu8name[i]) * 16777619u;
+  }
+  return (u32hash % psTrie->u32nnodes_max);
+}
+
+/* Arena header in front of each name: the owning node (TRIE_NIL once freed) and the name length */
+#define NAME_HDR_SIZE  4
+
+static void _put_hdr(trie_t* psTrie, uint32_t u32name_ofs, uint16_t u16owner, uint16_t u16name_len)
+{
+  uint16_t au16hdr[2];
+  au16hdr[0] = u16owner;
+  au16hdr[1] = u16name_len;
+  memcpy(&psTrie->pcnames[u32name_ofs - NAME_HDR_SIZE], au16hdr, NAME_HDR_SIZE);
+}
+
+/* Squeeze the names of freed nodes out of the arena, moving the others down */
+static void _compact(trie_t* psTrie)
+{
+  uint32_t u32src = 0;
+  uint32_t u32dst = 0;
+  while (u32src < psTrie->u32names_len)
+  {
+    uint16_t au16hdr[2];
+    memcpy(au16hdr, &psTrie->pcnames[u32src], NAME_HDR_SIZE);
+    uint32_t u32size = NAME_HDR_SIZE + au16hdr[1];
+    if (au16hdr[0] != TRIE_NIL)
+    {
+      memmove(&psTrie->pcnames[u32dst], &psTrie->pcnames[u32src], u32size);
+      psTrie->asNodes[au16hdr[0]].u32name_ofs = u32dst + NAME_HDR_SIZE;
+      u32dst += u32size;
+    }
+    u32src += u32size;
+  }
+  psTrie->u32names_len = u32dst;
+  psTrie->u32names_dead = 0;
+}
+
+static uint16_t _alloc_node(trie_t* psTrie, uint16_t u16parent, uint8_t* pu8name, uint16_t u16name_len)
+{
+  uint32_t u32need = ((u16name_len != 0) ? (NAME_HDR_SIZE + u16name_len) : 0);
+  if (    ((psTrie->u32names_len + u32need) > psTrie->u32names_max)
+       && (psTrie->u32names_dead != 0))
+  {
+    _compact(psTrie);
+  }
+  if (    (    (psTrie->u32free == TRIE_NIL)
+            && (    (psTrie->u32nnodes >= psTrie->u32nnodes_max)
+                 || (psTrie->u32nnodes >= TRIE_NIL)))
+       || ((psTrie->u32names_len + u32need) > psTrie->u32names_max))
+  {
+    return TRIE_NIL;
+  }
+
+  uint16_t u16idx;
+  if (psTrie->u32free != TRIE_NIL)
+  {
+    u16idx = psTrie->u32free;
+    psTrie->u32free = psTrie->asNodes[u16idx].u16hnext;
+  }
+  else
+  {
+    u16idx = psTrie->u32nnodes++;
+  }
+  trie_node_t* psNode = &psTrie->asNodes[u16idx];
+  psNode->u16parent = u16parent;
+  psNode->u16hnext = TRIE_NIL;
+  psNode->u16wild_plus = TRIE_NIL;
+  psNode->u16wild_hash = TRIE_NIL;
+  psNode->u32name_ofs = psTrie->u32names_len + NAME_HDR_SIZE;
+  psNode->u16name_len = u16name_len;
+  psNode->u16nchildren = 0;
+  psNode->pfHandler = 0;
+  psNode->pvctx = 0;
+  if (u16name_len != 0)
+  {
+    _put_hdr(psTrie, psNode->u32name_ofs, u16idx, u16name_len);
+    memcpy(&psTrie->pcnames[psNode->u32name_ofs], pu8name, u16name_len);
+    psTrie->u32names_len += u32need;
+  }
+  return u16idx;
+}
+
+/* Free u16node, then its ancestors, as long as no handler and no child needs them */
+static void _prune(trie_t* psTrie, uint16_t u16node)
+{
+  while (    (u16node != 0)
+          && (psTrie->asNodes[u16node].pfHandler == 0)
+          && (psTrie->asNodes[u16node].u16nchildren == 0))
+  {
+    trie_node_t* psNode = &psTrie->asNodes[u16node];
+    uint16_t u16parent = psNode->u16parent;
+    trie_node_t* psParent = &psTrie->asNodes[u16parent];
+
+    if (psParent->u16wild_plus == u16node)
+    {
+      psParent->u16wild_plus = TRIE_NIL;
+    }
+    else if (psParent->u16wild_hash == u16node)
+    {
+      psParent->u16wild_hash = TRIE_NIL;
+    }
+    else
+    {
+      uint32_t u32bucket = _bucket(psTrie, u16parent, (uint8_t*)&psTrie->pcnames[psNode->u32name_ofs], psNode->u16name_len);
+      uint16_t* pu16link = &psTrie->asNodes[u32bucket].u16bucket;
+      while (*pu16link != u16node)
+      {
+        pu16link = &psTrie->asNodes[*pu16link].u16hnext;
+      }
+      *pu16link = psNode->u16hnext;
+    }
+    psParent->u16nchildren -= 1;
+
+    if (psNode->u16name_len != 0)
+    {
+      _put_hdr(psTrie, psNode->u32name_ofs, TRIE_NIL, psNode->u16name_len);
+      psTrie->u32names_dead += NAME_HDR_SIZE + psNode->u16name_len;
+    }
+    psNode->u16hnext = psTrie->u32free;
+    psTrie->u32free = u16node;
+    u16node = u16parent;
+  }
+}
+
+/* Exact-name child lookup. There are no more buckets than nodes, so chains stay short however wide a level gets */
+static uint16_t _find_child(trie_t* psTrie, uint16_t u16parent, uint8_t* pu8name, uint16_t u16name_len)
+{
+  uint16_t u16idx = psTrie->asNodes[_bucket(psTrie, u16parent, pu8name, u16name_len)].u16bucket;
+  while (u16idx != TRIE_NIL)
+  {
+    trie_node_t* psNode = &psTrie->asNodes[u16idx];
+    if (    (psNode->u16parent == u16parent)
+         && (psNode->u16name_len == u16name_len)
+         && (memcmp(&psTrie->pcnames[psNode->u32name_ofs], pu8name, u16name_len) == 0))
+    {
+      break;
+    }
+    u16idx = psNode->u16hnext;
+  }
+  return u16idx;
+}
+
+/* Walk (and with create set, build) the path of a filter. Returns the final node or TRIE_NIL */
+static uint16_t _walk_filter(trie_t* psTrie, levels_t* psLvl, int create)
+{
+  uint16_t u16node = 0;
+  uint32_t i;
+  for (i = 0; i < psLvl->u32nlevels; ++i)
+  {
+    uint8_t* pu8name = &psLvl->pu8str[psLvl->au16ofs[i]];
+    uint16_t u16name_len = psLvl->au16len[i];
+    uint16_t* pu16link = 0;  /* 0 = named child, linked into its hash bucket */
+    uint16_t u16next;
+
+    if (_is_level(psLvl, i, '#'))
+    {
+      pu16link = &psTrie->asNodes[u16node].u16wild_hash;
+      u16next = *pu16link;
+    }
+    else if (_is_level(psLvl, i, '+'))
+    {
+      pu16link = &psTrie->asNodes[u16node].u16wild_plus;
+      u16next = *pu16link;
+    }
+    else
+    {
+      u16next = _find_child(psTrie, u16node, pu8name, u16name_len);
+    }
+
+    if (    (u16next == TRIE_NIL)
+         && (create))
+    {
+      u16next = _alloc_node(psTrie, u16node, pu8name, u16name_len);
+      if (u16next == TRIE_NIL)
+      {
+        _prune(psTrie, u16node); /* out of memory: drop what this walk built so far */
+      }
+      else
+      {
+        if (pu16link != 0)
+        {
+          *pu16link = u16next; /* wildcard links only ever hold one node */
+        }
+        else
+        {
+          trie_node_t* psBucket = &psTrie->asNodes[_bucket(psTrie, u16node, pu8name, u16name_len)];
+          psTrie->asNodes[u16next].u16hnext = psBucket->u16bucket;
+          psBucket->u16bucket = u16next;
+        }
+        psTrie->asNodes[u16node].u16nchildren += 1;
+      }
+    }
+    u16node = u16next;
+    if (u16node == TRIE_NIL)
+    {
+      break;
+    }
+  }
+  return u16node;
+}
+
+static int _call(trie_node_t* psNode, levels_t* psLvl, uint16_t u16topic_len, uint8_t* pu8payload, uint32_t u32payload_len)
+{
+  if (psNode->pfHandler != 0)
+  {
+    psNode->pfHandler(psNode->pvctx, psLvl->pu8str, u16topic_len, pu8payload, u32payload_len);
+    return 1;
+  }
+  return 0;
+}
+
+/* Depth-first match of topic levels [u32idx..] below u16node. Recursion depth is bounded by TRIE_MAX_LEVELS */
+static int _match(trie_t* psTrie, uint16_t u16node, levels_t* psLvl, uint32_t u32idx, uint16_t u16topic_len, uint8_t* pu8payload, uint32_t u32payload_len)
+{
+  int ncalls = 0;
+  trie_node_t* psNode = &psTrie->asNodes[u16node];
+
+  /* MQTT 3.1.1 section 4.7.2: wildcards at the first level don't match topics starting with '$' */
+  int allow_wild = !(    (u32idx == 0)
+                      && (psLvl->au16len[0] > 0)
+                      && (psLvl->pu8str[0] == '$'));
+
+  /* "a/#" matches "a" as well as everything below it */
+  if (    (allow_wild)
+       && (psNode->u16wild_hash != TRIE_NIL))
+  {
+    ncalls += _call(&psTrie->asNodes[psNode->u16wild_hash], psLvl, u16topic_len, pu8payload, u32payload_len);
+  }
+
+  if (u32idx == psLvl->u32nlevels)
+  {
+    ncalls += _call(psNode, psLvl, u16topic_len, pu8payload, u32payload_len);
+  }
+  else
+  {
+    uint16_t u16child = _find_child(psTrie, u16node, &psLvl->pu8str[psLvl->au16ofs[u32idx]], psLvl->au16len[u32idx]);
+    if (u16child != TRIE_NIL)
+    {
+      ncalls += _match(psTrie, u16child, psLvl, u32idx + 1, u16topic_len, pu8payload, u32payload_len);
+    }
+    if (    (allow_wild)
+         && (psNode->u16wild_plus != TRIE_NIL))
+    {
+      ncalls += _match(psTrie, psNode->u16wild_plus, psLvl, u32idx + 1, u16topic_len, pu8payload, u32payload_len);
+    }
+  }
+  return ncalls;
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+void trie_init(trie_t* psTrie, trie_node_t* asNodes, uint32_t u32nnodes, char* pcnames, uint32_t u32names_size)
+{
+  require(psTrie != 0);
+  require(asNodes != 0);
+  require(u32nnodes > 0);
+
+  uint32_t i;
+  psTrie->asNodes = asNodes;
+  psTrie->u32nnodes_max = u32nnodes;
+  psTrie->u32nnodes = 0;
+  psTrie->u32free = TRIE_NIL;
+  psTrie->pcnames = pcnames;
+  psTrie->u32names_max = ((pcnames != 0) ? u32names_size : 0);
+  psTrie->u32names_len = 0;
+  psTrie->u32names_dead = 0;
+  for (i = 0; i < u32nnodes; ++i)
+  {
+    asNodes[i].u16bucket = TRIE_NIL; /* buckets are spread over all nodes, allocated or not */
+  }
+  _alloc_node(psTrie, TRIE_NIL, 0, 0); /* root */
+}
+
+int trie_subscribe(trie_t* psTrie, uint8_t* pu8filter, uint16_t u16filter_len, trie_handler_t pfHandler, void* pvctx)
+{
+  require(psTrie != 0);
+  require(pu8filter != 0);
+  require(pfHandler != 0);
+
+  int success = 0;
+  levels_t sLvl;
+  if (    (u16filter_len > 0)
+       && (_split(pu8filter, u16filter_len, &sLvl))
+       && (_valid_filter(&sLvl)))
+  {
+    uint16_t u16node = _walk_filter(psTrie, &sLvl, 1);
+    if (u16node != TRIE_NIL)
+    {
+      psTrie->asNodes[u16node].pfHandler = pfHandler;
+      psTrie->asNodes[u16node].pvctx = pvctx;
+      success = 1;
+    }
+  }
+  return success;
+}
+
+int trie_unsubscribe(trie_t* psTrie, uint8_t* pu8filter, uint16_t u16filter_len)
+{
+  require(psTrie != 0);
+  require(pu8filter != 0);
+
+  int success = 0;
+  levels_t sLvl;
+  if (    (u16filter_len > 0)
+       && (_split(pu8filter, u16filter_len, &sLvl)))
+  {
+    uint16_t u16node = _walk_filter(psTrie, &sLvl, 0);
+    if (    (u16node != TRIE_NIL)
+         && (psTrie->asNodes[u16node].pfHandler != 0))
+    {
+      psTrie->asNodes[u16node].pfHandler = 0;
+      psTrie->asNodes[u16node].pvctx = 0;
+      _prune(psTrie, u16node);
+      success = 1;
+    }
+  }
+  return success;
+}
+
+void* trie_lookup(trie_t* psTrie, uint8_t* pu8filter, uint16_t u16filter_len)
+{
+  require(psTrie != 0);
+  require(pu8filter != 0);
+
+  void* pvctx = 0;
+  levels_t sLvl;
+  if (    (u16filter_len > 0)
+       && (_split(pu8filter, u16filter_len, &sLvl)))
+  {
+    uint16_t u16node = _walk_filter(psTrie, &sLvl, 0);
+    if (    (u16node != TRIE_NIL)
+         && (psTrie->asNodes[u16node].pfHandler != 0))
+    {
+      pvctx = psTrie->asNodes[u16node].pvctx;
+    }
+  }
+  return pvctx;
+}
+
+int trie_unbind(trie_t* psTrie, void* pvctx)
+{
+  require(psTrie != 0);
+
+  int nunbound = 0;
+  uint32_t i;
+  for (i = 0; i < psTrie->u32nnodes; ++i)
+  {
+    trie_node_t* psNode = &psTrie->asNodes[i];
+    if (    (psNode->pfHandler != 0)
+         && (psNode->pvctx == pvctx))
+    {
+      psNode->pfHandler = 0;
+      psNode->pvctx = 0;
+      _prune(psTrie, (uint16_t)i);
+      nunbound += 1;
+    }
+  }
+  return nunbound;
+}
+
+int trie_dispatch(trie_t* psTrie, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t* pu8payload, uint32_t u32payload_len)
+{
+  require(psTrie != 0);
+  require(pu8topic != 0);
+
+  int ncalls = 0;
+  levels_t sLvl;
+  if (_split(pu8topic, u16topic_len, &sLvl))
+  {
+    ncalls = _match(psTrie, 0, &sLvl, 0, u16topic_len, pu8payload, u32payload_len);
+  }
+  return ncalls;
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 topictrie.c -o trie_test && ./trie_test - exits with 1 if a check fails */
+#include <stdio.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+static uint32_t u32matched;   /* bit i set: filter i was called */
+
+static void _handler(void* pvctx, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t* pu8payload, uint32_t u32payload_len)
+{
+  (void)pu8topic; (void)u16topic_len; (void)pu8payload; (void)u32payload_len;
+  u32matched |= (uint32_t)(uintptr_t)pvctx;
+}
+
+static int _sub(trie_t* psTrie, const char* filter, uint32_t u32bit)
+{
+  return trie_subscribe(psTrie, (uint8_t*)filter, strlen(filter), _handler, (void*)(uintptr_t)u32bit);
+}
+
+static uint32_t _match_mask(trie_t* psTrie, const char* topic)
+{
+  u32matched = 0;
+  trie_dispatch(psTrie, (uint8_t*)topic, strlen(topic), 0, 0);
+  return u32matched;
+}
+
+static void test_wildcards(void)
+{
+  static trie_node_t asNodes[64];
+  static char acnames[256];
+  trie_t sTrie;
+  trie_init(&sTrie, asNodes, 64, acnames, sizeof(acnames));
+
+  check(_sub(&sTrie, "a/b",    0x001));
+  check(_sub(&sTrie, "a/+",    0x002));
+  check(_sub(&sTrie, "a/#",    0x004));
+  check(_sub(&sTrie, "#",      0x008));
+  check(_sub(&sTrie, "+/b",    0x010));
+  check(_sub(&sTrie, "+",      0x020));
+  check(_sub(&sTrie, "$SYS/#", 0x040));
+  check(_sub(&sTrie, "+/+/c",  0x080));
+  check(_sub(&sTrie, "a/b/#",  0x100));
+  check(_sub(&sTrie, "/",      0x200));
+
+  /* '#' only as the last level, and no empty filters */
+  check(!_sub(&sTrie, "a/#/b", 0x400));
+  check(!_sub(&sTrie, "#/a",   0x400));
+  check(!trie_subscribe(&sTrie, (uint8_t*)"a", 0, _handler, 0));
+
+  check(_match_mask(&sTrie, "a/b")    == (0x001 | 0x002 | 0x004 | 0x008 | 0x010 | 0x100));
+  check(_match_mask(&sTrie, "a")      == (0x004 | 0x008 | 0x020));            /* "a/#" includes "a" itself */
+  check(_match_mask(&sTrie, "a/b/c")  == (0x004 | 0x008 | 0x080 | 0x100));
+  check(_match_mask(&sTrie, "a/")     == (0x002 | 0x004 | 0x008));            /* '+' matches an empty level */
+  check(_match_mask(&sTrie, "/")      == (0x008 | 0x200));
+  check(_match_mask(&sTrie, "x/b")    == (0x008 | 0x010));
+
+  /* MQTT 3.1.1 section 4.7.2: leading wildcards don't match topics starting with '$' */
+  check(_match_mask(&sTrie, "$SYS/x") == 0x040);
+  check(_match_mask(&sTrie, "$SYS")   == 0x040);
+  check(_match_mask(&sTrie, "$x/b")   == 0);
+  check(_match_mask(&sTrie, "a/$x")   == (0x002 | 0x004 | 0x008));            /* only at the first level */
+
+  /* exact lookup, unsubscribe and unbind */
+  check(trie_lookup(&sTrie, (uint8_t*)"a/+", 3) == (void*)0x002);
+  check(trie_lookup(&sTrie, (uint8_t*)"a/c", 3) == 0);
+  check(trie_unsubscribe(&sTrie, (uint8_t*)"#", 1));
+  check(!trie_unsubscribe(&sTrie, (uint8_t*)"#", 1));
+  check(_match_mask(&sTrie, "x/b") == 0x010);
+  check(_sub(&sTrie, "q/+", 0x010));
+  check(trie_unbind(&sTrie, (void*)0x010) == 2);
+  check(_match_mask(&sTrie, "x/b") == 0);
+}
+
+/* Named children are hashed on (parent, name): many siblings, and equal names under different parents */
+static void test_index(void)
+{
+  static trie_node_t asNodes[4000];
+  static char acnames[32 * 1024];
+  trie_t sTrie;
+  char acbuf[32];
+  uint32_t i;
+  trie_init(&sTrie, asNodes, 4000, acnames, sizeof(acnames));
+
+  for (i = 0; i < 1000; ++i)
+  {
+    sprintf(acbuf, "dev/%u", i);
+    check(_sub(&sTrie, acbuf, 1));
+    sprintf(acbuf, "%u/dev", i);
+    check(_sub(&sTrie, acbuf, 2));
+  }
+  for (i = 0; i < 1000; ++i)
+  {
+    sprintf(acbuf, "dev/%u", i);
+    check(_match_mask(&sTrie, acbuf) == 1);
+    sprintf(acbuf, "%u/dev", i);
+    check(_match_mask(&sTrie, acbuf) == 2);
+    sprintf(acbuf, "dev/%u/x", i);
+    check(_match_mask(&sTrie, acbuf) == 0);
+  }
+
+  /* out of nodes: subscribing fails, everything already there still matches */
+  uint32_t u32added = 0;
+  for (i = 0; i < 2000; ++i)
+  {
+    sprintf(acbuf, "x/%u", i);
+    u32added += _sub(&sTrie, acbuf, 4);
+  }
+  check(u32added == (4000 - 3003)); /* root, "dev" + 1000, 2 * 1000 for "<i>/dev", and "x" */
+  check(sTrie.u32nnodes == 4000);
+  for (i = 0; i < 1000; ++i)
+  {
+    sprintf(acbuf, "dev/%u", i);
+    check(_match_mask(&sTrie, acbuf) == 1);
+  }
+  check(_match_mask(&sTrie, "x/0") == 4);
+}
+
+/* Unsubscribing frees nodes and names: distinct filters forever in a small trie */
+static void test_free(void)
+{
+  static trie_node_t asNodes[16];
+  static char acnames[128];
+  trie_t sTrie;
+  char acbuf[32];
+  uint32_t i;
+  trie_init(&sTrie, asNodes, 16, acnames, sizeof(acnames));
+
+  check(_sub(&sTrie, "keep/+/x", 1));
+  for (i = 0; i < 1000; ++i)
+  {
+    sprintf(acbuf, "probe/%u/+", 100000 + (i * 7919));
+    check(_sub(&sTrie, acbuf, 2));
+    check(_match_mask(&sTrie, "keep/a/x") == 1);
+    sprintf(acbuf, "probe/%u/a", 100000 + (i * 7919));
+    check(_match_mask(&sTrie, acbuf) == 2);
+    sprintf(acbuf, "probe/%u/+", 100000 + (i * 7919));
+    check(trie_unsubscribe(&sTrie, (uint8_t*)acbuf, strlen(acbuf)));
+    check(_match_mask(&sTrie, acbuf) == 0);
+  }
+  check(sTrie.u32nnodes <= 8);
+  check(_match_mask(&sTrie, "keep/b/x") == 1);
+
+  /* unbind frees too, up to the first node still in use */
+  check(_sub(&sTrie, "keep/+/y/z", 4));
+  check(_sub(&sTrie, "a/b/c/d", 4));
+  check(trie_unbind(&sTrie, (void*)4) == 2);
+  check(_match_mask(&sTrie, "keep/b/x") == 1);
+  for (i = 0; i < 100; ++i)
+  {
+    sprintf(acbuf, "%u/%u/%u", i, i + 1, i + 2);
+    check(_sub(&sTrie, acbuf, 8));
+    check(_match_mask(&sTrie, acbuf) == 8);
+    check(trie_unbind(&sTrie, (void*)8) == 1);
+  }
+
+  /* a subscribe that runs out of nodes half way leaves nothing behind */
+  check(!_sub(&sTrie, "1/2/3/4/5/6/7/8/9/10/11/12/13/14/15/16", 8));
+  check(_sub(&sTrie, "1/2/3/4/5/6/7/8/9/10/11/12", 8));
+  check(_match_mask(&sTrie, "1/2/3/4/5/6/7/8/9/10/11/12") == 8);
+  check(_match_mask(&sTrie, "keep/b/x") == 1);
+}
+
+
+int main(void)
+{
+  test_wildcards();
+  test_index();
+  test_free();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
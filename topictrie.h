@@ -0,0 +1,64 @@
+#ifndef _TOPICTRIE_H_
+#define _TOPICTRIE_H_
+
+#include <stdint.h>
+
+#define TRIE_MAX_LEVELS  32      /* max number of '/'-separated levels in a topic or filter */
+#define TRIE_NIL         0xFFFF  /* "no node" */
+
+
+/* Handler bound to a subscription filter */
+typedef void (*trie_handler_t)(void* pvctx, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t* pu8payload, uint32_t u32payload_len);
+
+/*
+   One topic level. Named children are found through a hash on (parent, name)
+   chained through the node array itself: bucket i's chain starts at
+   asNodes[i].u16bucket. Level names are stored back to back in the trie's string arena.
+   A node left without handler and children is freed, and so is its name.
+*/
+typedef struct
+{
+  uint16_t       u16parent;     /* TRIE_NIL for the root */
+  uint16_t       u16bucket;     /* first node of hash bucket <this index>, or TRIE_NIL */
+  uint16_t       u16hnext;      /* next node in the same hash bucket, or TRIE_NIL */
+  uint16_t       u16wild_plus;  /* child for '+', or TRIE_NIL */
+  uint16_t       u16wild_hash;  /* child for '#', or TRIE_NIL */
+  uint32_t       u32name_ofs;   /* level name in string arena */
+  uint16_t       u16name_len;
+  uint16_t       u16nchildren;  /* named and wildcard children */
+  trie_handler_t pfHandler;     /* set if a filter ends at this node */
+  void*          pvctx;
+} trie_node_t;
+
+/*
+   Subscription registry. All memory is supplied by the caller:
+   a node array and a byte arena for the level names. Node 0 is the root.
+   Each name in the arena carries a 4 byte header, so the names of freed
+   nodes can be squeezed out when the arena runs full.
+*/
+typedef struct
+{
+  trie_node_t* asNodes;
+  uint32_t     u32nnodes_max;
+  uint32_t     u32nnodes;       /* nodes ever taken from asNodes, free ones included */
+  uint32_t     u32free;         /* first free node, chained through u16hnext, or TRIE_NIL */
+  char*        pcnames;
+  uint32_t     u32names_max;
+  uint32_t     u32names_len;
+  uint32_t     u32names_dead;   /* arena bytes of freed names */
+} trie_t;
+
+
+void trie_init(trie_t* psTrie, trie_node_t* asNodes, uint32_t u32nnodes, char* pcnames, uint32_t u32names_size);
+/* Bind pfHandler to a filter (may contain '+' and a trailing '#'). Returns 1 on success, 0 if out of memory or bad filter */
+int  trie_subscribe(trie_t* psTrie, uint8_t* pu8filter, uint16_t u16filter_len, trie_handler_t pfHandler, void* pvctx);
+/* Unbind the handler from a filter and free the nodes only it used. Returns 1 if the filter was found */
+int  trie_unsubscribe(trie_t* psTrie, uint8_t* pu8filter, uint16_t u16filter_len);
+/* The pvctx bound to exactly this filter, or 0 if there is none */
+void* trie_lookup(trie_t* psTrie, uint8_t* pu8filter, uint16_t u16filter_len);
+/* Unbind (and free, like trie_unsubscribe()) every filter bound with pvctx, for callers that don't keep the filter text. Scans all nodes, returns how many */
+int  trie_unbind(trie_t* psTrie, void* pvctx);
+/* Call the handler of every filter matching the topic. Returns number of handlers called */
+int  trie_dispatch(trie_t* psTrie, uint8_t* pu8topic, uint16_t u16topic_len, uint8_t* pu8payload, uint32_t u32payload_len);
+
+#endif /* _TOPICTRIE_H_ */
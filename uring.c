@@ -0,0 +1,533 @@
+#include "uring.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+
+
+/* Request types, kept in the low byte of user_data and as bits in client_t.ioflags */
+enum
+{
+  OP_RECV   = 0x01,
+  OP_SEND   = 0x02,
+  OP_POLL   = 0x04, /* connect completion */
+  OP_CANCEL = 0x08,
+};
+
+
+/* Helper functions: */
+
+/* user_data = generation of the connection | slot | request type */
+static uint64_t _user_data(client_t* psClnt, uint32_t u32slot, uint32_t u32op)
+{
+  return ((uint64_t)psClnt->iogen << 32) | (u32slot << 8) | u32op;
+}
+
+static int _enter(uring_t* psUring, uint32_t u32wait, uint64_t u64timeout_ns)
+{
+  __atomic_store_n(psUring->pu32sq_tail, psUring->u32sq_tail, __ATOMIC_RELEASE);
+  uint32_t u32submit = psUring->u32sq_tail - __atomic_load_n(psUring->pu32sq_head, __ATOMIC_ACQUIRE);
+  if (    (u32submit == 0)
+       && (u32wait == 0))
+  {
+    return 0;
+  }
+
+  struct __kernel_timespec sTs;
+  struct io_uring_getevents_arg sArg;
+  uint32_t u32flags = IORING_ENTER_EXT_ARG | ((u32wait != 0) ? IORING_ENTER_GETEVENTS : 0);
+  sTs.tv_sec = u64timeout_ns / 1000000000;
+  sTs.tv_nsec = u64timeout_ns % 1000000000;
+  memset(&sArg, 0, sizeof(sArg));
+  sArg.ts = (uint64_t)(uintptr_t)&sTs;
+
+  int rc = (int)syscall(__NR_io_uring_enter, psUring->fd, u32submit, u32wait, u32flags, &sArg, sizeof(sArg));
+  psUring->u64enters += 1;
+  if (    (rc < 0)
+       && (errno != ETIME)   /* wait timed out */
+       && (errno != EINTR)
+       && (errno != EBUSY)   /* completion queue full, reaping makes room */
+       && (errno != EAGAIN))
+  {
+    client_log(CLIENT_LOG_ERROR, "io_uring_enter: %s\n", strerror(errno));
+  }
+  return rc;
+}
+
+static struct io_uring_sqe* _get_sqe(uring_t* psUring)
+{
+  if ((psUring->u32sq_tail - __atomic_load_n(psUring->pu32sq_head, __ATOMIC_ACQUIRE)) >= psUring->u32sq_entries)
+  {
+    /* queue full: hand what we have to the kernel */
+    _enter(psUring, 0, 0);
+    if ((psUring->u32sq_tail - __atomic_load_n(psUring->pu32sq_head, __ATOMIC_ACQUIRE)) >= psUring->u32sq_entries)
+    {
+      return 0;
+    }
+  }
+
+  uint32_t u32idx = psUring->u32sq_tail & psUring->u32sq_mask;
+  struct io_uring_sqe* psSqe = &psUring->asSqe[u32idx];
+  memset(psSqe, 0, sizeof(struct io_uring_sqe));
+  psUring->pu32sq_array[u32idx] = u32idx;
+  psUring->u32sq_tail += 1;
+  return psSqe;
+}
+
+/* Give a receive buffer back to the kernel */
+static void _recycle(uring_t* psUring, uint16_t u16bid)
+{
+  struct io_uring_buf* psBuf = &psUring->psBufRing->bufs[psUring->u16buf_tail & (URING_RX_BUFS - 1)];
+  psBuf->addr = (uint64_t)(uintptr_t)&psUring->pu8bufs[(uint32_t)u16bid * URING_RX_BUFSZ];
+  psBuf->len = URING_RX_BUFSZ;
+  psBuf->bid = u16bid;
+  psUring->u16buf_tail += 1;
+  __atomic_store_n(&psUring->psBufRing->tail, psUring->u16buf_tail, __ATOMIC_RELEASE);
+}
+
+static void _teardown(uring_t* psUring)
+{
+  if (psUring->pu8bufs != 0)
+  {
+    munmap(psUring->pu8bufs, URING_RX_BUFS * URING_RX_BUFSZ);
+    psUring->pu8bufs = 0;
+  }
+  if (psUring->psBufRing != 0)
+  {
+    munmap(psUring->psBufRing, URING_RX_BUFS * sizeof(struct io_uring_buf));
+    psUring->psBufRing = 0;
+  }
+  if (psUring->asSqe != 0)
+  {
+    munmap(psUring->asSqe, psUring->u32sqes_sz);
+    psUring->asSqe = 0;
+  }
+  if (psUring->pvring != 0)
+  {
+    munmap(psUring->pvring, psUring->u32ring_sz);
+    psUring->pvring = 0;
+  }
+  if (psUring->fd >= 0)
+  {
+    close(psUring->fd);
+    psUring->fd = -1;
+  }
+}
+
+/* Create the ring and register the receive buffers. Returns 0 if the kernel can't do what we need. */
+static int _setup(uring_t* psUring)
+{
+  struct io_uring_params sParams;
+  memset(&sParams, 0, sizeof(sParams));
+  psUring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &sParams);
+  if (psUring->fd < 0)
+  {
+    client_log(CLIENT_LOG_INFO, "io_uring_setup: %s\n", strerror(errno));
+    return 0;
+  }
+  if ((sParams.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) != (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG))
+  {
+    client_log(CLIENT_LOG_INFO, "io_uring: kernel lacks required features (0x%x).\n", sParams.features);
+    _teardown(psUring);
+    return 0;
+  }
+
+  /* SQ and CQ rings share one mapping */
+  uint32_t u32sq_sz = sParams.sq_off.array + (sParams.sq_entries * sizeof(uint32_t));
+  uint32_t u32cq_sz = sParams.cq_off.cqes + (sParams.cq_entries * sizeof(struct io_uring_cqe));
+  psUring->u32ring_sz = ((u32sq_sz > u32cq_sz) ? u32sq_sz : u32cq_sz);
+  psUring->u32sqes_sz = sParams.sq_entries * sizeof(struct io_uring_sqe);
+  void* pvring = mmap(0, psUring->u32ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, psUring->fd, IORING_OFF_SQ_RING);
+  void* pvsqes = mmap(0, psUring->u32sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, psUring->fd, IORING_OFF_SQES);
+  psUring->pvring = ((pvring != MAP_FAILED) ? pvring : 0);
+  psUring->asSqe = ((pvsqes != MAP_FAILED) ? pvsqes : 0);
+  if (    (psUring->pvring == 0)
+       || (psUring->asSqe == 0))
+  {
+    client_log(CLIENT_LOG_ERROR, "io_uring mmap: %s\n", strerror(errno));
+    _teardown(psUring);
+    return 0;
+  }
+
+  uint8_t* pu8ring = psUring->pvring;
+  psUring->pu32sq_head  = (uint32_t*)(pu8ring + sParams.sq_off.head);
+  psUring->pu32sq_tail  = (uint32_t*)(pu8ring + sParams.sq_off.tail);
+  psUring->pu32sq_array = (uint32_t*)(pu8ring + sParams.sq_off.array);
+  psUring->u32sq_mask   = *(uint32_t*)(pu8ring + sParams.sq_off.ring_mask);
+  psUring->u32sq_entries = *(uint32_t*)(pu8ring + sParams.sq_off.ring_entries);
+  psUring->u32sq_tail   = *psUring->pu32sq_tail;
+  psUring->pu32cq_head  = (uint32_t*)(pu8ring + sParams.cq_off.head);
+  psUring->pu32cq_tail  = (uint32_t*)(pu8ring + sParams.cq_off.tail);
+  psUring->u32cq_mask   = *(uint32_t*)(pu8ring + sParams.cq_off.ring_mask);
+  psUring->asCqe        = (struct io_uring_cqe*)(pu8ring + sParams.cq_off.cqes);
+
+  /* provided buffer ring (5.19+): the kernel picks a buffer when data arrives, not when the receive is queued */
+  void* pvbufring = mmap(0, URING_RX_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void* pvbufs = mmap(0, URING_RX_BUFS * URING_RX_BUFSZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  psUring->psBufRing = ((pvbufring != MAP_FAILED) ? pvbufring : 0);
+  psUring->pu8bufs = ((pvbufs != MAP_FAILED) ? pvbufs : 0);
+  if (    (psUring->psBufRing == 0)
+       || (psUring->pu8bufs == 0))
+  {
+    client_log(CLIENT_LOG_ERROR, "io_uring buffers: %s\n", strerror(errno));
+    _teardown(psUring);
+    return 0;
+  }
+
+  struct io_uring_buf_reg sReg;
+  memset(&sReg, 0, sizeof(sReg));
+  sReg.ring_addr = (uint64_t)(uintptr_t)psUring->psBufRing;
+  sReg.ring_entries = URING_RX_BUFS;
+  sReg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, psUring->fd, IORING_REGISTER_PBUF_RING, &sReg, 1) < 0)
+  {
+    client_log(CLIENT_LOG_INFO, "io_uring: cannot register receive buffers: %s\n", strerror(errno));
+    _teardown(psUring);
+    return 0;
+  }
+
+  psUring->u16buf_tail = 0;
+  uint32_t i;
+  for (i = 0; i < URING_RX_BUFS; ++i)
+  {
+    _recycle(psUring, i);
+  }
+
+  return 1;
+}
+
+/* Queue the requests the client's state calls for: connect completion, receive and the tx queue */
+static void _arm(uring_t* psUring, uint32_t u32slot, client_t* psClnt)
+{
+  struct io_uring_sqe* psSqe;
+
+  if (psClnt->state == CONNECTING)
+  {
+    if (    (!(psClnt->ioflags & OP_POLL))
+         && ((psSqe = _get_sqe(psUring)) != 0))
+    {
+      psSqe->opcode = IORING_OP_POLL_ADD;
+      psSqe->fd = psClnt->sockfd;
+      psSqe->poll32_events = POLLOUT;
+      psSqe->user_data = _user_data(psClnt, u32slot, OP_POLL);
+      psClnt->ioflags |= OP_POLL;
+    }
+  }
+  else if (psClnt->state == CONNECTED)
+  {
+    if (    (!(psClnt->ioflags & OP_RECV))
+         && ((psSqe = _get_sqe(psUring)) != 0))
+    {
+      psSqe->opcode = IORING_OP_RECV;
+      psSqe->fd = psClnt->sockfd;
+      psSqe->flags = IOSQE_BUFFER_SELECT;
+      psSqe->buf_group = URING_BGID;
+      psSqe->ioprio = (psUring->multishot ? IORING_RECV_MULTISHOT : 0);
+      psSqe->len = (psUring->multishot ? 0 : URING_RX_BUFSZ);
+      psSqe->user_data = _user_data(psClnt, u32slot, OP_RECV);
+      psClnt->ioflags |= OP_RECV;
+    }
+    if (    (psClnt->tx_async)
+         && (psClnt->txbuflen != 0)
+         && (!(psClnt->ioflags & OP_SEND))
+         && ((psSqe = _get_sqe(psUring)) != 0))
+    {
+      psSqe->opcode = IORING_OP_SEND;
+      psSqe->fd = psClnt->sockfd;
+      psSqe->addr = (uint64_t)(uintptr_t)psClnt->txbuf;
+      psSqe->len = psClnt->txbuflen;
+      psSqe->msg_flags = MSG_NOSIGNAL;
+      psSqe->user_data = _user_data(psClnt, u32slot, OP_SEND);
+      psClnt->txinflight = psClnt->txbuflen;
+      psClnt->ioflags |= OP_SEND;
+    }
+  }
+}
+
+static void _cancel(uring_t* psUring, uint32_t u32slot, client_t* psClnt, uint32_t u32op)
+{
+  struct io_uring_sqe* psSqe;
+  if (    (psClnt->ioflags & u32op)
+       && ((psSqe = _get_sqe(psUring)) != 0))
+  {
+    psSqe->opcode = IORING_OP_ASYNC_CANCEL;
+    psSqe->addr = _user_data(psClnt, u32slot, u32op);
+    psSqe->user_data = OP_CANCEL;
+  }
+}
+
+/* One completion. Requests of a closed or removed connection complete with a stale generation and are dropped. */
+static void _dispatch(uring_t* psUring, struct io_uring_cqe* psCqe)
+{
+  uint32_t u32op = psCqe->user_data & 0xFF;
+  uint32_t u32slot = (psCqe->user_data >> 8) & 0xFFFFFF;
+  uint32_t u32gen = psCqe->user_data >> 32;
+  client_t* psClnt = ((u32slot < psUring->u32nslots) ? psUring->apsClnt[u32slot] : 0);
+  int live = (    (psClnt != 0)
+               && (psClnt->iogen == u32gen));
+
+  switch (u32op)
+  {
+    case OP_RECV:
+    {
+      uint8_t* pu8data = 0;
+      uint16_t u16bid = psCqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (psCqe->flags & IORING_CQE_F_BUFFER)
+      {
+        pu8data = &psUring->pu8bufs[(uint32_t)u16bid * URING_RX_BUFSZ];
+      }
+      if (live)
+      {
+        if (!(psCqe->flags & IORING_CQE_F_MORE))
+        {
+          psClnt->ioflags &= ~OP_RECV; /* re-armed on the next poll */
+        }
+        if (    (psCqe->res > 0)
+             && (pu8data != 0))
+        {
+          client_feed(psClnt, (char*)pu8data, psCqe->res);
+        }
+        else if (psCqe->res == 0)
+        {
+          client_log(CLIENT_LOG_ERROR, "CLNT%d: recv: connection closed\n", psClnt->sockfd);
+          client_disconnect(psClnt);
+        }
+        else if (psCqe->res == -ENOBUFS)
+        {
+          /* all receive buffers in use, they are recycled before the next poll */
+        }
+        else if (    (psCqe->res == -EINVAL)
+                  && (psUring->multishot))
+        {
+          client_log(CLIENT_LOG_INFO, "io_uring: no multishot receive, falling back to single-shot.\n");
+          psUring->multishot = 0;
+        }
+        else if (psCqe->res < 0)
+        {
+          client_log(CLIENT_LOG_ERROR, "CLNT%d: recv: %s\n", psClnt->sockfd, strerror(-psCqe->res));
+          client_disconnect(psClnt);
+        }
+      }
+      if (pu8data != 0)
+      {
+        _recycle(psUring, u16bid);
+      }
+    } break;
+
+    case OP_SEND:
+    {
+      if (live)
+      {
+        psClnt->ioflags &= ~OP_SEND;
+        if (psCqe->res >= 0)
+        {
+          client_sent(psClnt, psCqe->res); /* a short send leaves the rest queued for the next poll */
+        }
+        else
+        {
+          client_log(CLIENT_LOG_ERROR, "CLNT%d: send: %s\n", psClnt->sockfd, strerror(-psCqe->res));
+          client_disconnect(psClnt);
+        }
+      }
+    } break;
+
+    case OP_POLL:
+    {
+      if (live)
+      {
+        psClnt->ioflags &= ~OP_POLL;
+        if (psClnt->state == CONNECTING)
+        {
+          client_finish_connect(psClnt);
+        }
+      }
+    } break;
+  }
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+int uring_init(uring_t* psUring, client_t** apsSlots, uint32_t u32nslots)
+{
+  require(psUring != 0);
+  require(apsSlots != 0);
+  require(u32nslots <= 0xFFFFFF);
+
+  memset(psUring, 0, sizeof(uring_t));
+  psUring->apsClnt = apsSlots;
+  psUring->u32nslots = u32nslots;
+  psUring->multishot = 1;
+  memset(apsSlots, 0, u32nslots * sizeof(client_t*));
+
+  if (!_setup(psUring))
+  {
+    client_log(CLIENT_LOG_INFO, "io_uring unavailable, using epoll.\n");
+    psUring->fd = -1;
+    return reactor_init(&psUring->sReactor, apsSlots, u32nslots);
+  }
+
+  /* only the timing settings and the timer wheel of the reactor are used */
+  psUring->sReactor.epfd = -1;
+  psUring->sReactor.wakefd = -1;
+  psUring->sReactor.connect_timeout_us = REACTOR_CONNECT_TIMEOUT_US;
+  wheel_init(&psUring->sReactor.sWheel, client_time_us());
+  return 1;
+}
+
+void uring_close(uring_t* psUring)
+{
+  require(psUring != 0);
+
+  if (psUring->fd < 0)
+  {
+    reactor_close(&psUring->sReactor);
+    return;
+  }
+
+  uint32_t i;
+  for (i = 0; i < psUring->u32nslots; ++i)
+  {
+    if (psUring->apsClnt[i] != 0)
+    {
+      uring_remove(psUring, psUring->apsClnt[i]);
+    }
+  }
+  /* closing the ring cancels whatever is still in flight */
+  _teardown(psUring);
+}
+
+int uring_add(uring_t* psUring, client_t* psClnt)
+{
+  require(psUring != 0);
+  require(psClnt != 0);
+
+  if (psUring->fd < 0)
+  {
+    return reactor_add(&psUring->sReactor, psClnt);
+  }
+  if (!(psClnt->psTransport->flags & CLIENT_TRANSPORT_SOCKET))
+  {
+    /* the SQEs recv() / send() on the descriptor itself */
+    client_log(CLIENT_LOG_ERROR, "uring: %s transport needs a reactor.\n", psClnt->psTransport->name);
+    return 0;
+  }
+
+  int success = 0;
+  uint32_t i;
+  for (i = 0; i < psUring->u32nslots; ++i)
+  {
+    if (psUring->apsClnt[i] == 0)
+    {
+      client_set_nonblocking(psClnt, 1);
+      /* a fresh generation, so completions for an earlier occupant of the slot can't match */
+      psUring->u32gen += 0x10000;
+      psClnt->iogen = psUring->u32gen;
+      psClnt->ioflags = 0;
+      psClnt->txinflight = 0;
+      psClnt->tx_async = (psClnt->txbuf != 0);
+      psUring->apsClnt[i] = psClnt;
+      psUring->u32nclients += 1;
+      reactor_attach_timers(&psUring->sReactor, psClnt);
+      success = 1;
+      break;
+    }
+  }
+  return success;
+}
+
+int uring_remove(uring_t* psUring, client_t* psClnt)
+{
+  require(psUring != 0);
+  require(psClnt != 0);
+
+  if (psUring->fd < 0)
+  {
+    return reactor_remove(&psUring->sReactor, psClnt);
+  }
+
+  int success = 0;
+  uint32_t i;
+  for (i = 0; i < psUring->u32nslots; ++i)
+  {
+    if (psUring->apsClnt[i] == psClnt)
+    {
+      _cancel(psUring, i, psClnt, OP_RECV);
+      _cancel(psUring, i, psClnt, OP_POLL);
+      psClnt->iogen += 1;
+      psClnt->ioflags = 0;
+      psClnt->txinflight = 0;
+      psClnt->tx_async = 0;
+      reactor_detach_timers(&psUring->sReactor, psClnt);
+      psUring->apsClnt[i] = 0;
+      psUring->u32nclients -= 1;
+      success = 1;
+      break;
+    }
+  }
+  return success;
+}
+
+int uring_poll(uring_t* psUring, uint32_t timeout_us)
+{
+  require(psUring != 0);
+
+  if (psUring->fd < 0)
+  {
+    return reactor_poll(&psUring->sReactor, timeout_us);
+  }
+
+  uint64_t u64now = client_time_us();
+  uint64_t u64next = u64now + timeout_us;
+  uint64_t u64timers;
+  uint32_t i;
+
+  wheel_advance(&psUring->sReactor.sWheel, u64now);
+  u64timers = wheel_next_deadline(&psUring->sReactor.sWheel);
+  u64next = ((u64timers < u64next) ? u64timers : u64next);
+
+  /* queue receives, sends and connect polls - a few flag checks per client */
+  for (i = 0; i < psUring->u32nslots; ++i)
+  {
+    client_t* psClnt = psUring->apsClnt[i];
+    if (psClnt != 0)
+    {
+      /* no eventfd here: a publish queue left non-empty means don't sleep */
+      if (    (client_drain_queue(psClnt) == CLIENT_QUEUE_BATCH)
+           && (client_queue_level(psClnt) != 0))
+      {
+        u64next = u64now;
+      }
+      _arm(psUring, i, psClnt);
+    }
+  }
+
+  /* one system call submits everything queued above and waits for the first completion */
+  u64now = client_time_us();
+  uint64_t u64wait_ns = ((u64next > u64now) ? ((u64next - u64now) * 1000) : 0);
+  _enter(psUring, (u64wait_ns != 0), u64wait_ns);
+
+  int ncompletions = 0;
+  uint32_t u32head = *psUring->pu32cq_head;
+  while (u32head != __atomic_load_n(psUring->pu32cq_tail, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe sCqe = psUring->asCqe[u32head & psUring->u32cq_mask];
+    u32head += 1;
+    __atomic_store_n(psUring->pu32cq_head, u32head, __ATOMIC_RELEASE);
+    _dispatch(psUring, &sCqe);
+    ncompletions += 1;
+  }
+  psUring->u64completions += ncompletions;
+
+  return ncompletions;
+}
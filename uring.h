@@ -0,0 +1,75 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include "client.h"
+#include "reactor.h"
+
+#define URING_ENTRIES      256     /* submission queue entries */
+#define URING_RX_BUFS      256     /* receive buffers shared by all connections, must be a power of 2 */
+#define URING_RX_BUFSZ     4096    /* size of one receive buffer */
+#define URING_BGID         0       /* buffer group id of the receive buffers */
+
+
+/*
+   Drives many client_t's from one thread with io_uring, as a drop-in for reactor_t:
+   - sends, receives and connect completions for all clients go to the kernel in one io_uring_enter() per poll
+   - receives land in a ring of kernel-registered (provided) buffers, with one multishot receive per connection
+     where the kernel supports it, single-shot receives otherwise
+   - complete packets are delivered straight from the receive buffers, only partial packets are copied to rxbuf
+   - clients with a txbuf (client_set_batching) send their whole queue once per poll, others send synchronously
+   When io_uring or provided buffers are unavailable, everything runs on an embedded epoll reactor instead.
+
+   The slot table holds stable slots (0 = free), the slot index is part of each request's user_data.
+*/
+typedef struct
+{
+  int        fd;                 /* io_uring fd, -1 when running on the epoll fallback */
+  reactor_t  sReactor;           /* fallback, and timers and timing settings in either mode */
+  client_t** apsClnt;            /* slot table, u32nslots long */
+  uint32_t   u32nslots;
+  uint32_t   u32nclients;
+  uint32_t   u32gen;             /* seeds client_t.iogen on uring_add() */
+  int        multishot;          /* multishot receive works on this kernel */
+
+  /* submission queue */
+  uint32_t*  pu32sq_head;
+  uint32_t*  pu32sq_tail;
+  uint32_t*  pu32sq_array;
+  uint32_t   u32sq_mask;
+  uint32_t   u32sq_entries;
+  uint32_t   u32sq_tail;         /* local tail, published before io_uring_enter() */
+  struct io_uring_sqe* asSqe;
+
+  /* completion queue */
+  uint32_t*  pu32cq_head;
+  uint32_t*  pu32cq_tail;
+  uint32_t   u32cq_mask;
+  struct io_uring_cqe* asCqe;
+
+  /* provided receive buffers */
+  struct io_uring_buf_ring* psBufRing;
+  uint8_t*   pu8bufs;
+  uint16_t   u16buf_tail;
+
+  void*      pvring;
+  uint32_t   u32ring_sz;
+  uint32_t   u32sqes_sz;
+
+  uint64_t   u64enters;          /* io_uring_enter() calls */
+  uint64_t   u64completions;
+} uring_t;
+
+
+/* Returns 1 on success - check psUring->fd to see if io_uring or the epoll fallback is in use */
+int  uring_init(uring_t* psUring, client_t** apsSlots, uint32_t u32nslots);
+void uring_close(uring_t* psUring);
+/* Puts the client in non-blocking mode, it connects on the next uring_poll(). Fails for a transport that isn't
+   CLIENT_TRANSPORT_SOCKET unless the epoll fallback is in use. */
+int  uring_add(uring_t* psUring, client_t* psClnt);
+int  uring_remove(uring_t* psUring, client_t* psClnt);
+/* Run timers, submit queued I/O, wait up to timeout_us for completions and dispatch them. Returns number of completions. */
+int  uring_poll(uring_t* psUring, uint32_t timeout_us);
+
+#endif /* _URING_H_ */
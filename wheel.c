@@ -0,0 +1,432 @@
+#include "wheel.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define require(predicate)         assert((predicate))
+#define WHEEL_MASK                 (WHEEL_SLOTS - 1)
+
+
+/* Helper functions: */
+
+static void _list_init(wheel_link_t* psHead)
+{
+  psHead->psNext = psHead;
+  psHead->psPrev = psHead;
+}
+
+static int _list_empty(wheel_link_t* psHead)
+{
+  return (psHead->psNext == psHead);
+}
+
+static void _list_append(wheel_link_t* psHead, wheel_link_t* psLink)
+{
+  psLink->psNext = psHead;
+  psLink->psPrev = psHead->psPrev;
+  psHead->psPrev->psNext = psLink;
+  psHead->psPrev = psLink;
+}
+
+/* Move everything from psFrom to the (empty) list psTo */
+static void _list_take(wheel_link_t* psTo, wheel_link_t* psFrom)
+{
+  _list_init(psTo);
+  if (!_list_empty(psFrom))
+  {
+    psTo->psNext = psFrom->psNext;
+    psTo->psPrev = psFrom->psPrev;
+    psTo->psNext->psPrev = psTo;
+    psTo->psPrev->psNext = psTo;
+    _list_init(psFrom);
+  }
+}
+
+static void _unlink(wheel_t* psWheel, wheel_timer_t* psTimer)
+{
+  psTimer->sLink.psPrev->psNext = psTimer->sLink.psNext;
+  psTimer->sLink.psNext->psPrev = psTimer->sLink.psPrev;
+  psTimer->sLink.psNext = 0;
+  psTimer->sLink.psPrev = 0;
+  psWheel->au32count[psTimer->u8level] -= 1;
+}
+
+/* Level by distance from the current tick, slot by the deadline's bits at that level */
+static void _insert(wheel_t* psWheel, wheel_timer_t* psTimer)
+{
+  uint64_t u64due = psTimer->u64deadline_us / WHEEL_TICK_US;
+  if (u64due < psWheel->u64tick)
+  {
+    u64due = psWheel->u64tick;
+  }
+
+  uint64_t u64delta = u64due - psWheel->u64tick;
+  uint32_t u32level = 0;
+  while (    (u32level < (WHEEL_LEVELS - 1))
+          && (u64delta >= (1ULL << (WHEEL_BITS * (u32level + 1)))))
+  {
+    u32level += 1;
+  }
+  if (u64delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+  {
+    /* too far out: park it at the end of the wheel, it is placed again when that slot cascades */
+    u64due = psWheel->u64tick + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  }
+
+  uint32_t u32slot = (u64due >> (WHEEL_BITS * u32level)) & WHEEL_MASK;
+  psTimer->u8level = u32level;
+  _list_append(&psWheel->asSlot[u32level][u32slot], &psTimer->sLink);
+  psWheel->au32count[u32level] += 1;
+}
+
+/* Entering a tick whose level-0 index is 0: move the next slot of each higher level down */
+static void _cascade(wheel_t* psWheel)
+{
+  uint32_t u32level;
+  for (u32level = 1; u32level < WHEEL_LEVELS; ++u32level)
+  {
+    uint32_t u32slot = (psWheel->u64tick >> (WHEEL_BITS * u32level)) & WHEEL_MASK;
+    wheel_link_t sList;
+    _list_take(&sList, &psWheel->asSlot[u32level][u32slot]);
+    while (!_list_empty(&sList))
+    {
+      wheel_timer_t* psTimer = (wheel_timer_t*)sList.psNext;
+      psTimer->sLink.psPrev->psNext = psTimer->sLink.psNext;
+      psTimer->sLink.psNext->psPrev = psTimer->sLink.psPrev;
+      psWheel->au32count[u32level] -= 1;
+      _insert(psWheel, psTimer);
+    }
+    if (u32slot != 0)
+    {
+      break;
+    }
+  }
+}
+
+/* Run the current level-0 slot: expire what is due, keep the rest (deadline later within this tick) */
+static uint32_t _run_slot(wheel_t* psWheel, uint64_t u64now)
+{
+  uint32_t u32fired = 0;
+  wheel_link_t sList;
+  _list_take(&sList, &psWheel->asSlot[0][psWheel->u64tick & WHEEL_MASK]);
+
+  /* the callbacks may cancel timers still on sList - always take the first one */
+  while (!_list_empty(&sList))
+  {
+    wheel_timer_t* psTimer = (wheel_timer_t*)sList.psNext;
+    _unlink(psWheel, psTimer);
+    if (psTimer->u64deadline_us <= u64now)
+    {
+      psTimer->expire(psTimer, u64now);
+      u32fired += 1;
+    }
+    else
+    {
+      _insert(psWheel, psTimer);
+    }
+  }
+  return u32fired;
+}
+
+
+
+/*
+   Implementation of exported interface begins here
+*/
+
+void wheel_init(wheel_t* psWheel, uint64_t u64now)
+{
+  require(psWheel != 0);
+
+  uint32_t i, j;
+  for (i = 0; i < WHEEL_LEVELS; ++i)
+  {
+    for (j = 0; j < WHEEL_SLOTS; ++j)
+    {
+      _list_init(&psWheel->asSlot[i][j]);
+    }
+    psWheel->au32count[i] = 0;
+  }
+  psWheel->u64tick = u64now / WHEEL_TICK_US;
+}
+
+void wheel_timer_init(wheel_timer_t* psTimer, void* expire, void* pvctx)
+{
+  require(psTimer != 0);
+  require(expire != 0);
+
+  memset(psTimer, 0, sizeof(wheel_timer_t));
+  psTimer->expire = expire;
+  psTimer->pvctx = pvctx;
+}
+
+void wheel_add(wheel_t* psWheel, wheel_timer_t* psTimer, uint64_t u64deadline_us)
+{
+  require(psWheel != 0);
+  require(psTimer != 0);
+
+  if (wheel_pending(psTimer))
+  {
+    _unlink(psWheel, psTimer);
+  }
+  psTimer->u64deadline_us = u64deadline_us;
+  _insert(psWheel, psTimer);
+}
+
+void wheel_cancel(wheel_t* psWheel, wheel_timer_t* psTimer)
+{
+  require(psWheel != 0);
+  require(psTimer != 0);
+
+  if (wheel_pending(psTimer))
+  {
+    _unlink(psWheel, psTimer);
+  }
+}
+
+int wheel_pending(wheel_timer_t* psTimer)
+{
+  require(psTimer != 0);
+
+  return (psTimer->sLink.psNext != 0);
+}
+
+uint32_t wheel_advance(wheel_t* psWheel, uint64_t u64now)
+{
+  require(psWheel != 0);
+
+  uint64_t u64target = u64now / WHEEL_TICK_US;
+  uint32_t u32fired = 0;
+
+  for (;;)
+  {
+    u32fired += _run_slot(psWheel, u64now);
+    if (psWheel->u64tick >= u64target)
+    {
+      break;
+    }
+
+    /* skip ahead over an empty level 0, stopping at the next cascade */
+    uint64_t u64next = psWheel->u64tick + 1;
+    if (psWheel->au32count[0] == 0)
+    {
+      u64next = (psWheel->u64tick | WHEEL_MASK) + 1;
+      if (u64next > u64target)
+      {
+        u64next = u64target;
+      }
+    }
+    psWheel->u64tick = u64next;
+    if ((u64next & WHEEL_MASK) == 0)
+    {
+      _cascade(psWheel);
+    }
+  }
+  return u32fired;
+}
+
+uint64_t wheel_next_deadline(wheel_t* psWheel)
+{
+  require(psWheel != 0);
+
+  uint64_t u64next = UINT64_MAX;
+  uint32_t i;
+
+  /* level 0 is exact: the first non-empty slot from the current tick on holds the earliest deadline */
+  if (psWheel->au32count[0] != 0)
+  {
+    for (i = 0; i < WHEEL_SLOTS; ++i)
+    {
+      wheel_link_t* psHead = &psWheel->asSlot[0][(psWheel->u64tick + i) & WHEEL_MASK];
+      if (!_list_empty(psHead))
+      {
+        wheel_link_t* psLink;
+        for (psLink = psHead->psNext; psLink != psHead; psLink = psLink->psNext)
+        {
+          uint64_t u64deadline = ((wheel_timer_t*)psLink)->u64deadline_us;
+          u64next = ((u64deadline < u64next) ? u64deadline : u64next);
+        }
+        break;
+      }
+    }
+  }
+
+  /* higher levels: wake up when their first non-empty slot cascades, which is no later than its deadlines */
+  uint32_t u32level;
+  for (u32level = 1; u32level < WHEEL_LEVELS; ++u32level)
+  {
+    if (psWheel->au32count[u32level] == 0)
+    {
+      continue;
+    }
+    uint32_t u32shift = WHEEL_BITS * u32level;
+    uint64_t u64base = psWheel->u64tick >> u32shift;
+    for (i = 1; i <= WHEEL_SLOTS; ++i)
+    {
+      if (!_list_empty(&psWheel->asSlot[u32level][(u64base + i) & WHEEL_MASK]))
+      {
+        uint64_t u64cascade_us = ((u64base + i) << u32shift) * WHEEL_TICK_US;
+        u64next = ((u64cascade_us < u64next) ? u64cascade_us : u64next);
+        break;
+      }
+    }
+  }
+
+  return u64next;
+}
+
+
+
+
+#if defined(TEST) && (TEST == 1)
+
+/* gcc -DTEST=1 wheel.c -o wheel_test && ./wheel_test - exits with 1 if a check fails */
+#include <stdio.h>
+
+static int nfailed = 0;
+
+#define check(predicate) \
+  do { if (!(predicate)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #predicate); nfailed += 1; } } while (0)
+
+#define NTIMERS 2000
+
+static wheel_timer_t asTimer[NTIMERS];
+static uint64_t      au64fired[NTIMERS];   /* now at expiry, 0 = not fired */
+static uint32_t      au32nfired[NTIMERS];
+
+static void _expire(wheel_timer_t* psTimer, uint64_t u64now)
+{
+  uint32_t idx = (uint32_t)(psTimer - asTimer);
+  au64fired[idx] = u64now;
+  au32nfired[idx] += 1;
+}
+
+static void _reset(wheel_t* psWheel, uint64_t u64now)
+{
+  uint32_t i;
+  wheel_init(psWheel, u64now);
+  for (i = 0; i < NTIMERS; ++i)
+  {
+    wheel_timer_init(&asTimer[i], _expire, 0);
+    au64fired[i] = 0;
+    au32nfired[i] = 0;
+  }
+}
+
+static uint32_t u32seed = 12345;
+static uint32_t _rand(void)
+{
+  u32seed = (u32seed * 1103515245) + 12345;
+  return (u32seed >> 8);
+}
+
+static void test_edges(void)
+{
+  static wheel_t sWheel;
+  _reset(&sWheel, 1000000);
+  check(wheel_next_deadline(&sWheel) == UINT64_MAX);
+
+  /* due within the same ms: fires on the tick, not before its deadline */
+  wheel_add(&sWheel, &asTimer[0], 1000500);
+  check(wheel_next_deadline(&sWheel) == 1000500);
+  check(wheel_advance(&sWheel, 1000499) == 0);
+  check(wheel_advance(&sWheel, 1000500) == 1);
+  check(!wheel_pending(&asTimer[0]));
+
+  /* one per level: level 0 is exact, higher levels report when they cascade - never after the deadline */
+  uint64_t au64deadline[] = { 1000000 + 40000, 1000000 + 3000000, 1000000 + 200000000, 1000000 + 3600000000ULL };
+  uint32_t i;
+  for (i = 0; i < 4; ++i)
+  {
+    _reset(&sWheel, 1000000);
+    wheel_add(&sWheel, &asTimer[i], au64deadline[i]);
+    check(asTimer[i].u8level == i);
+    uint64_t u64next = wheel_next_deadline(&sWheel);
+    check((u64next > 1000000) && (u64next <= au64deadline[i]));
+    check(wheel_advance(&sWheel, au64deadline[i] - 1) == 0);
+    check(wheel_advance(&sWheel, au64deadline[i]) == 1);
+    check(au64fired[i] == au64deadline[i]);
+  }
+
+  /* past the last level (4.7 h) the timer is parked and placed again as the wheel turns */
+  _reset(&sWheel, 0);
+  uint64_t u64far = 5ULL * 3600 * 1000000;
+  wheel_add(&sWheel, &asTimer[0], u64far);
+  check(wheel_advance(&sWheel, u64far - 1000) == 0);
+  check(wheel_pending(&asTimer[0]));
+  check(wheel_advance(&sWheel, u64far) == 1);
+
+  /* moving and cancelling */
+  _reset(&sWheel, 0);
+  wheel_add(&sWheel, &asTimer[0], 100000);
+  wheel_add(&sWheel, &asTimer[0], 5000);
+  wheel_add(&sWheel, &asTimer[1], 7000);
+  wheel_cancel(&sWheel, &asTimer[1]);
+  check(wheel_next_deadline(&sWheel) == 5000);
+  check(wheel_advance(&sWheel, 200000) == 1);
+  check((au32nfired[0] == 1) && (au32nfired[1] == 0));
+  check(wheel_next_deadline(&sWheel) == UINT64_MAX);
+}
+
+/* Random deadlines across all levels, driven the way the reactor does: sleep until wheel_next_deadline() */
+static void test_random(void)
+{
+  static wheel_t sWheel;
+  uint64_t u64now = 123456789;
+  uint64_t au64deadline[NTIMERS];
+  uint32_t i;
+
+  _reset(&sWheel, u64now);
+  for (i = 0; i < NTIMERS; ++i)
+  {
+    /* spread over 1 ms .. 20 min, with a bias towards the near future */
+    uint64_t u64range = 1000ULL << (_rand() % 21);
+    au64deadline[i] = u64now + 1 + (_rand() % u64range);
+    wheel_add(&sWheel, &asTimer[i], au64deadline[i]);
+  }
+
+  uint32_t u32total = 0;
+  while (u32total < NTIMERS)
+  {
+    uint64_t u64next = wheel_next_deadline(&sWheel);
+    uint64_t u64earliest = UINT64_MAX;
+    for (i = 0; i < NTIMERS; ++i)
+    {
+      if (    (au32nfired[i] == 0)
+           && (au64deadline[i] < u64earliest))
+      {
+        u64earliest = au64deadline[i];
+      }
+    }
+    check((u64next > u64now) && (u64next <= u64earliest));
+    if (    (u64next <= u64now)
+         || (u64next > u64earliest))
+    {
+      break;
+    }
+
+    /* sometimes oversleep, like a busy event loop */
+    u64now = u64next + (((_rand() % 4) == 0) ? (_rand() % 5000) : 0);
+    u32total += wheel_advance(&sWheel, u64now);
+    for (i = 0; i < NTIMERS; ++i)
+    {
+      /* everything due has fired, nothing early */
+      check((au64deadline[i] <= u64now) == (au32nfired[i] == 1));
+      check(au32nfired[i] <= 1);
+    }
+  }
+  check(u32total == NTIMERS);
+  check(wheel_next_deadline(&sWheel) == UINT64_MAX);
+}
+
+
+int main(void)
+{
+  test_edges();
+  test_random();
+
+  printf("%s\n", ((nfailed == 0) ? "all checks passed" : "FAILED"));
+  return (nfailed != 0);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stdint.h>
+
+#define WHEEL_TICK_US      1000    /* slot width - deadlines themselves are kept to the usec */
+#define WHEEL_BITS         6
+#define WHEEL_SLOTS        (1 << WHEEL_BITS)
+#define WHEEL_LEVELS       4       /* 64 ms, 4 s, 4.4 min and 4.7 h ahead - later deadlines wait in the last level */
+
+
+typedef struct wheel_link_s
+{
+  struct wheel_link_s* psNext;
+  struct wheel_link_s* psPrev;
+} wheel_link_t;
+
+/* A timer is embedded in its owner and never allocated by the wheel */
+typedef struct wheel_timer_s
+{
+  wheel_link_t sLink;            /* psNext == 0: not scheduled */
+  uint64_t     u64deadline_us;   /* monotonic, see client_time_us() */
+  uint8_t      u8level;
+  void       (*expire)(struct wheel_timer_s* psTimer, uint64_t u64now);
+  void*        pvctx;
+} wheel_timer_t;
+
+/*
+   Hierarchical timing wheel: adding, moving and cancelling a timer is O(1),
+   timers only cost time when they expire or move down a level.
+*/
+typedef struct
+{
+  wheel_link_t asSlot[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint32_t     au32count[WHEEL_LEVELS];
+  uint64_t     u64tick;          /* slots before this tick have been run */
+} wheel_t;
+
+
+void wheel_init(wheel_t* psWheel, uint64_t u64now);
+void wheel_timer_init(wheel_timer_t* psTimer, void* expire, void* pvctx);
+/* Schedule, or move if already scheduled. A deadline in the past expires on the next wheel_advance(). */
+void wheel_add(wheel_t* psWheel, wheel_timer_t* psTimer, uint64_t u64deadline_us);
+void wheel_cancel(wheel_t* psWheel, wheel_timer_t* psTimer);
+int  wheel_pending(wheel_timer_t* psTimer);
+/* Run every timer due at u64now, returns how many. Expiry callbacks may add and cancel timers. */
+uint32_t wheel_advance(wheel_t* psWheel, uint64_t u64now);
+/* When to call wheel_advance() next - never later than the earliest deadline, UINT64_MAX if nothing is scheduled */
+uint64_t wheel_next_deadline(wheel_t* psWheel);
+
+#endif /* _WHEEL_H_ */